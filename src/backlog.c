@@ -0,0 +1,352 @@
+#include "backlog.h"
+#include "factory.h"
+#include "stat.h"
+
+#define BACKLOG_TRACKS 2
+
+typedef struct _GstRTSPClientBacklog GstRTSPClientBacklog;
+
+struct _GstRTSPClientBacklog
+{
+  GWeakRef client;
+  GstRTSPWatch *watch;
+  guint track;
+  gboolean skipping;
+  gint64 behind_since;
+  guint64 skipped_at;
+  guint64 dropped;
+  guint skips;
+  guint bytes;
+  guint ms;
+};
+
+struct _GstRTSPBacklog
+{
+  GMutex lock;
+  GstRTSPMedia *media;
+  guint64 frames[BACKLOG_TRACKS];
+  guint skipping;
+};
+
+static guint backlog_max_bytes = 0;
+static guint backlog_max_ms = 0;
+static guint backlog_timeout = 0;
+
+void
+backlog_init (guint max_bytes, guint max_ms, guint timeout)
+{
+  backlog_max_bytes = max_bytes;
+  backlog_max_ms = max_ms;
+  backlog_timeout = timeout;
+
+  g_print ("rtmp2rtsp: limit client backlog to %u bytes, %u ms for %u seconds\n",
+      max_bytes, max_ms, timeout);
+}
+
+GstRTSPBacklog *
+backlog_new (GstRTSPMedia *media)
+{
+  GstRTSPBacklog *backlog;
+
+  backlog = g_new0 (GstRTSPBacklog, 1);
+  g_mutex_init (&backlog->lock);
+  backlog->media = media;
+
+  return backlog;
+}
+
+void
+backlog_free (GstRTSPBacklog *backlog)
+{
+  g_mutex_clear (&backlog->lock);
+  g_free (backlog);
+}
+
+static void
+client_backlog_free (GstRTSPClientBacklog *client_backlog)
+{
+  g_weak_ref_clear (&client_backlog->client);
+  if (client_backlog->watch)
+    g_source_unref ((GSource *) client_backlog->watch);
+  g_free (client_backlog);
+}
+
+static GList *
+backlog_get_transports (GstRTSPBacklog *backlog, guint track)
+{
+  GstRTSPStream *stream = relay_media_get_stream (backlog->media, track);
+
+  if (!stream)
+    return NULL;
+
+  return gst_rtsp_stream_transport_filter (stream, NULL, NULL);
+}
+
+static void
+backlog_resume (GstRTSPBacklog *backlog, GstRTSPClientBacklog *client_backlog)
+{
+  client_backlog->skipping = FALSE;
+  client_backlog->behind_since = 0;
+  client_backlog->dropped += backlog->frames[client_backlog->track] - client_backlog->skipped_at;
+}
+
+static void
+backlog_set_active (GstRTSPBacklog *backlog, GList *list, gboolean active)
+{
+  GstRTSPMediaStat *stat = g_object_get_data (G_OBJECT (backlog->media), "stat");
+  GList *item;
+
+  for (item = list; item; item = g_list_next (item))
+  {
+    GstRTSPTransportStat *transport_stat = g_object_get_data (G_OBJECT (item->data), "stat");
+
+    gst_rtsp_stream_transport_set_active (item->data, active);
+
+    /* a skipped client is not sent what it skips */
+    if (stat && transport_stat && active)
+      transport_stat_start (transport_stat, stat);
+    else if (stat && transport_stat)
+      transport_stat_stop (transport_stat, stat);
+  }
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+}
+
+static GstPadProbeReturn
+backlog_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPBacklog *backlog)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GList *list, *item, *resume = NULL;
+  guint track;
+
+  track = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "backlog-track"));
+
+  g_mutex_lock (&backlog->lock);
+
+  backlog->frames[track]++;
+
+  if (backlog->skipping == 0)
+  {
+    g_mutex_unlock (&backlog->lock);
+    return GST_PAD_PROBE_OK;
+  }
+
+  /* video can only be picked up again at a keyframe, audio at any frame */
+  if (track == 0 && GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+  {
+    g_mutex_unlock (&backlog->lock);
+    return GST_PAD_PROBE_OK;
+  }
+
+  list = backlog_get_transports (backlog, track);
+
+  for (item = list; item; item = g_list_next (item))
+  {
+    GstRTSPClientBacklog *client_backlog = g_object_get_data (G_OBJECT (item->data), "backlog");
+
+    /* resume once the watch drained to a quarter of the limits */
+    if (client_backlog && client_backlog->skipping
+        && client_backlog->bytes <= backlog_max_bytes / 4
+        && client_backlog->ms <= backlog_max_ms / 4)
+    {
+      backlog_resume (backlog, client_backlog);
+      resume = g_list_prepend (resume, g_object_ref (item->data));
+    }
+  }
+
+  g_mutex_unlock (&backlog->lock);
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+
+  backlog_set_active (backlog, resume, TRUE);
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+backlog_attach (GstRTSPBacklog *backlog, GstElement *bin)
+{
+  guint i;
+
+  for (i = 0; i < BACKLOG_TRACKS; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "src");
+    if (pad)
+    {
+      g_object_set_data (G_OBJECT (pad), "backlog-track", GUINT_TO_POINTER (i));
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+          (GstPadProbeCallback) backlog_probe, backlog, NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+}
+
+void
+backlog_play (GstRTSPBacklog *backlog, GstRTSPClient *client, GstRTSPSessionMedia *sessmedia)
+{
+  GstRTSPWatch *watch = g_object_get_data (G_OBJECT (client), "watch");
+  guint i;
+
+  /* udp clients are paced by the network, only interleaved ones queue up */
+  for (i = 0; i < BACKLOG_TRACKS; i++)
+  {
+    GstRTSPStreamTransport *trans;
+    const GstRTSPTransport *transport;
+    GstRTSPClientBacklog *client_backlog;
+
+    trans = relay_session_media_get_transport (sessmedia, i);
+    if (!trans || g_object_get_data (G_OBJECT (trans), "backlog"))
+      continue;
+
+    transport = gst_rtsp_stream_transport_get_transport (trans);
+    if (transport->lower_transport != GST_RTSP_LOWER_TRANS_TCP)
+      continue;
+
+    client_backlog = g_new0 (GstRTSPClientBacklog, 1);
+    g_weak_ref_init (&client_backlog->client, client);
+    client_backlog->watch = watch ? (GstRTSPWatch *) g_source_ref ((GSource *) watch) : NULL;
+    client_backlog->track = i;
+
+    g_object_set_data_full (G_OBJECT (trans), "backlog", client_backlog, (GDestroyNotify) client_backlog_free);
+  }
+}
+
+static guint
+backlog_get_queued (GstRTSPWatch *watch)
+{
+  gsize bytes = 0;
+  guint messages = 0;
+
+  /* the interleaved data waits in the watch, the kernel buffer only
+   * ever holds its head */
+  if (!watch)
+    return 0;
+
+  gst_rtsp_watch_get_send_backlog (watch, &bytes, &messages);
+
+  return bytes;
+}
+
+void
+backlog_check (GstRTSPBacklog *backlog, guint bps)
+{
+  GList *list, *item, *close = NULL, *pause = NULL;
+  gint64 now;
+  guint track;
+
+  if (backlog_max_bytes == 0 || backlog_max_ms == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&backlog->lock);
+
+  /* recounted every time, torn down clients take their state with them */
+  backlog->skipping = 0;
+
+  for (track = 0; track < BACKLOG_TRACKS; track++)
+  {
+    list = backlog_get_transports (backlog, track);
+
+    for (item = list; item; item = g_list_next (item))
+    {
+      GstRTSPClientBacklog *client_backlog = g_object_get_data (G_OBJECT (item->data), "backlog");
+
+      if (!client_backlog)
+        continue;
+
+      client_backlog->bytes = backlog_get_queued (client_backlog->watch);
+      client_backlog->ms = bps ? (guint64) client_backlog->bytes * 8 * 1000 / bps : 0;
+
+      if (client_backlog->skipping)
+      {
+        backlog->skipping++;
+
+        /* a client that cannot drain even with nothing sent is gone */
+        if (now - client_backlog->behind_since > (gint64) backlog_timeout * G_USEC_PER_SEC)
+        {
+          GstRTSPClient *client = g_weak_ref_get (&client_backlog->client);
+
+          if (client && !g_list_find (close, client))
+            close = g_list_prepend (close, client);
+          else if (client)
+            g_object_unref (client);
+        }
+        continue;
+      }
+
+      if (client_backlog->bytes <= backlog_max_bytes && client_backlog->ms <= backlog_max_ms)
+        continue;
+
+      /* stop feeding only this client, the next keyframe brings it back */
+      client_backlog->skipping = TRUE;
+      client_backlog->behind_since = now;
+      client_backlog->skipped_at = backlog->frames[track];
+      client_backlog->skips++;
+      backlog->skipping++;
+
+      pause = g_list_prepend (pause, g_object_ref (item->data));
+    }
+
+    g_list_free_full (list, (GDestroyNotify) g_object_unref);
+  }
+
+  g_mutex_unlock (&backlog->lock);
+
+  backlog_set_active (backlog, pause, FALSE);
+
+  for (item = close; item; item = g_list_next (item))
+  {
+    g_print ("rtmp2rtsp: close client stuck behind for %u seconds\n", backlog_timeout);
+    gst_rtsp_client_close (item->data);
+  }
+
+  g_list_free_full (close, (GDestroyNotify) g_object_unref);
+}
+
+void
+json_builder_backlog_value (JsonBuilder *builder, GstRTSPBacklog *backlog, GstRTSPStreamTransport *trans)
+{
+  GstRTSPClientBacklog *client_backlog = g_object_get_data (G_OBJECT (trans), "backlog");
+  guint64 dropped;
+
+  if (!client_backlog)
+    return;
+
+  g_mutex_lock (&backlog->lock);
+
+  dropped = client_backlog->dropped;
+  if (client_backlog->skipping)
+    dropped += backlog->frames[client_backlog->track] - client_backlog->skipped_at;
+
+  json_builder_set_member_name (builder, "backlog");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "bytes");
+  json_builder_add_int_value (builder, client_backlog->bytes);
+  json_builder_set_member_name (builder, "ms");
+  json_builder_add_int_value (builder, client_backlog->ms);
+  json_builder_set_member_name (builder, "skipping");
+  json_builder_add_boolean_value (builder, client_backlog->skipping);
+  json_builder_set_member_name (builder, "skips");
+  json_builder_add_int_value (builder, client_backlog->skips);
+  json_builder_set_member_name (builder, "dropped_frames");
+  json_builder_add_int_value (builder, dropped);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&backlog->lock);
+}
@@ -0,0 +1,26 @@
+#ifndef __BACKLOG_H__
+#define __BACKLOG_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <json-glib/json-glib.h>
+
+typedef struct _GstRTSPBacklog GstRTSPBacklog;
+
+void backlog_init (guint max_bytes, guint max_ms, guint timeout);
+
+GstRTSPBacklog *backlog_new (GstRTSPMedia *media);
+void backlog_free (GstRTSPBacklog *backlog);
+
+void backlog_attach (GstRTSPBacklog *backlog, GstElement *bin);
+
+void backlog_play (GstRTSPBacklog *backlog, GstRTSPClient *client, GstRTSPSessionMedia *sessmedia);
+
+void backlog_check (GstRTSPBacklog *backlog, guint bps);
+
+void json_builder_backlog_value (JsonBuilder *builder, GstRTSPBacklog *backlog, GstRTSPStreamTransport *trans);
+
+#endif
@@ -0,0 +1,258 @@
+#include <gst/rtp/gstrtpbuffer.h>
+
+#include "batch.h"
+
+#define BATCH_MAX_PACKETS 64
+
+typedef struct _GstRTSPBatch GstRTSPBatch;
+
+struct _GstRTSPBatch
+{
+  GstPad *pad;
+  GstBufferList *pending;
+  gboolean batched;
+  guint32 timestamp;
+};
+
+static gboolean batch_enabled = FALSE;
+
+static guint64 batch_packets = 0;
+static guint64 batch_pushes_in = 0;
+static guint64 batch_pushes_out = 0;
+
+void
+batch_init ()
+{
+  batch_enabled = TRUE;
+
+  g_print ("rtmp2rtsp: run batched rtp egress with up to %u packets per push\n", BATCH_MAX_PACKETS);
+}
+
+static void
+batch_free (GstRTSPBatch *batch)
+{
+  if (batch->pending)
+    gst_buffer_list_unref (batch->pending);
+  g_free (batch);
+}
+
+static gboolean
+batch_parse (GstBuffer *buffer, guint32 *timestamp)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  gboolean marker;
+
+  if (!gst_rtp_buffer_map (buffer, GST_MAP_READ, &rtp))
+    return TRUE;
+
+  marker = gst_rtp_buffer_get_marker (&rtp);
+  *timestamp = gst_rtp_buffer_get_timestamp (&rtp);
+  gst_rtp_buffer_unmap (&rtp);
+
+  return marker;
+}
+
+static GstFlowReturn
+batch_flush (GstRTSPBatch *batch)
+{
+  GstBufferList *list;
+  GstFlowReturn ret;
+
+  if (!batch->pending)
+    return GST_FLOW_OK;
+
+  list = batch->pending;
+  batch->pending = NULL;
+
+  __atomic_add_fetch (&batch_pushes_out, 1, __ATOMIC_RELAXED);
+
+  /* the list takes one push downstream, multiudpsink sends it with one
+   * sendmmsg per socket and interleaved clients get it as one writev */
+  ret = gst_pad_push_list (batch->pad, list);
+
+  return ret;
+}
+
+static gboolean
+batch_append_buffer (GstBuffer **buffer, guint idx, gpointer user_data)
+{
+  GstRTSPBatch *batch = user_data;
+
+  gst_buffer_list_add (batch->pending, gst_buffer_ref (*buffer));
+
+  return TRUE;
+}
+
+static GstPadProbeReturn
+batch_event_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPBatch *batch)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+  {
+    if (batch->pending)
+      gst_buffer_list_unref (batch->pending);
+    batch->pending = NULL;
+  }
+  else if (GST_EVENT_IS_SERIALIZED (event))
+  {
+    batch_flush (batch);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+batch_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPBatch *batch)
+{
+  GstBuffer *first, *last;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint32 timestamp;
+  guint packets;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    packets = gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+  else
+    packets = 1;
+
+  __atomic_add_fetch (&batch_packets, packets, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&batch_pushes_in, 1, __ATOMIC_RELAXED);
+
+  if (!batch_enabled || !batch->batched || packets == 0)
+  {
+    __atomic_add_fetch (&batch_pushes_out, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+  }
+
+  /* a frame whose last packet lost its marker still ends where the next
+   * one starts */
+  first = info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST ?
+      gst_buffer_list_get (GST_PAD_PROBE_INFO_BUFFER_LIST (info), 0) : GST_PAD_PROBE_INFO_BUFFER (info);
+  timestamp = batch->timestamp;
+  batch_parse (first, &timestamp);
+  if (batch->pending && timestamp != batch->timestamp)
+    ret = batch_flush (batch);
+
+  if (!batch->pending)
+    batch->pending = gst_buffer_list_new_sized (BATCH_MAX_PACKETS);
+
+  /* the probe owns the data it handles */
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info), batch_append_buffer, batch);
+    gst_buffer_list_unref (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+  }
+  else
+  {
+    gst_buffer_list_add (batch->pending, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+  GST_PAD_PROBE_INFO_DATA (info) = NULL;
+
+  /* payloaders set the marker on the last packet of a frame */
+  packets = gst_buffer_list_length (batch->pending);
+  last = gst_buffer_list_get (batch->pending, packets - 1);
+  if ((batch_parse (last, &batch->timestamp) || packets >= BATCH_MAX_PACKETS) && ret == GST_FLOW_OK)
+    ret = batch_flush (batch);
+
+  GST_PAD_PROBE_INFO_FLOW_RETURN (info) = ret;
+
+  return GST_PAD_PROBE_HANDLED;
+}
+
+static void
+batch_probe_pay (GstElement *bin, const gchar *name, gboolean batched)
+{
+  GstRTSPBatch *batch;
+  GstElement *element;
+  GstPad *pad, *internal;
+
+  element = gst_bin_get_by_name (GST_BIN (bin), name);
+  if (!element)
+    return;
+
+  pad = gst_element_get_static_pad (element, "src");
+
+  /* packets are collected on the inside of the stage and pushed out of
+   * its ghost pad, so every tap on the ghost pad sees each packet once */
+  internal = pad && GST_IS_GHOST_PAD (pad) ?
+      GST_PAD (gst_proxy_pad_get_internal (GST_PROXY_PAD (pad))) : NULL;
+
+  if (internal)
+  {
+    batch = g_new0 (GstRTSPBatch, 1);
+    batch->pad = pad;
+    batch->batched = batched;
+    g_object_set_data_full (G_OBJECT (internal), "batch", batch, (GDestroyNotify) batch_free);
+
+    gst_pad_add_probe (internal, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+        (GstPadProbeCallback) batch_probe, batch, NULL);
+    if (batch_enabled && batched)
+      gst_pad_add_probe (internal, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+          (GstPadProbeCallback) batch_event_probe, batch, NULL);
+
+    gst_object_unref (internal);
+  }
+
+  if (pad)
+    gst_object_unref (pad);
+
+  gst_object_unref (element);
+}
+
+void
+batch_attach (GstElement *bin)
+{
+  /* audio payloaders put one frame in a packet and only mark the start
+   * of a talkspurt, there is nothing to batch and waiting for a marker
+   * would hold them back */
+  batch_probe_pay (bin, "rtppay0", TRUE);
+  batch_probe_pay (bin, "rtppay1", FALSE);
+}
+
+static gdouble
+batch_ratio (guint64 packets, guint64 pushes)
+{
+  return pushes ? (gdouble) packets / pushes : 0.0;
+}
+
+void
+batch_metrics_append (GString *body)
+{
+  guint64 packets, pushes_in, pushes_out;
+
+  packets = __atomic_load_n (&batch_packets, __ATOMIC_RELAXED);
+  pushes_in = __atomic_load_n (&batch_pushes_in, __ATOMIC_RELAXED);
+  pushes_out = __atomic_load_n (&batch_pushes_out, __ATOMIC_RELAXED);
+
+  g_string_append (body, "# TYPE rtmp2rtsp_egress_packets_total counter\n");
+  g_string_append_printf (body, "rtmp2rtsp_egress_packets_total %" G_GUINT64_FORMAT "\n", packets);
+  g_string_append (body, "# TYPE rtmp2rtsp_egress_pushes_total counter\n");
+  g_string_append_printf (body,
+      "rtmp2rtsp_egress_pushes_total{stage=\"payloader\"} %" G_GUINT64_FORMAT "\n", pushes_in);
+  g_string_append_printf (body,
+      "rtmp2rtsp_egress_pushes_total{stage=\"sink\"} %" G_GUINT64_FORMAT "\n", pushes_out);
+}
+
+void
+json_builder_batch_value (JsonBuilder *builder)
+{
+  guint64 packets, pushes_in, pushes_out;
+
+  packets = __atomic_load_n (&batch_packets, __ATOMIC_RELAXED);
+  pushes_in = __atomic_load_n (&batch_pushes_in, __ATOMIC_RELAXED);
+  pushes_out = __atomic_load_n (&batch_pushes_out, __ATOMIC_RELAXED);
+
+  json_builder_set_member_name (builder, "batch");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "enabled");
+  json_builder_add_boolean_value (builder, batch_enabled);
+  json_builder_set_member_name (builder, "packets");
+  json_builder_add_int_value (builder, packets);
+  json_builder_set_member_name (builder, "packets_per_push_before");
+  json_builder_add_double_value (builder, batch_ratio (packets, pushes_in));
+  json_builder_set_member_name (builder, "packets_per_push_after");
+  json_builder_add_double_value (builder, batch_ratio (packets, pushes_out));
+
+  json_builder_end_object (builder);
+}
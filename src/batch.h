@@ -0,0 +1,18 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+void batch_init ();
+
+void batch_attach (GstElement *bin);
+
+void batch_metrics_append (GString *body);
+
+void json_builder_batch_value (JsonBuilder *builder);
+
+#endif
@@ -0,0 +1,149 @@
+#include "edge.h"
+
+/* seconds between the ntp and the unix epoch */
+#define EDGE_NTP_OFFSET G_GUINT64_CONSTANT (2208988800)
+
+/* the published hop only moves in steps so the stream list is not
+ * rebuilt for every packet */
+#define EDGE_REPORT_STEP_MS 10
+
+typedef struct _GstRTSPEdgeTrack GstRTSPEdgeTrack;
+
+struct _GstRTSPEdgeTrack
+{
+  GstRTSPEdge *edge;
+  gboolean valid;
+  gint64 hop;
+  gint64 reported;
+};
+
+struct _GstRTSPEdge
+{
+  GMutex lock;
+  gint *version;
+  gchar *origin;
+  GstCaps *ntp_caps;
+  GstRTSPEdgeTrack tracks[EDGE_TRACKS];
+};
+
+GstRTSPEdge *
+edge_new (const gchar *origin, gint *version)
+{
+  GstRTSPEdge *edge;
+  guint i;
+
+  edge = g_new0 (GstRTSPEdge, 1);
+  g_mutex_init (&edge->lock);
+  edge->version = version;
+  edge->origin = g_strdup (origin);
+  edge->ntp_caps = gst_caps_new_empty_simple ("timestamp/x-ntp");
+
+  for (i = 0; i < EDGE_TRACKS; i++)
+    edge->tracks[i].edge = edge;
+
+  return edge;
+}
+
+void
+edge_free (GstRTSPEdge *edge)
+{
+  gst_caps_unref (edge->ntp_caps);
+  g_free (edge->origin);
+  g_mutex_clear (&edge->lock);
+  g_free (edge);
+}
+
+static GstPadProbeReturn
+edge_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPEdgeTrack *track)
+{
+  GstRTSPEdge *edge = track->edge;
+  GstReferenceTimestampMeta *meta;
+  gboolean changed = FALSE;
+  gint64 hop;
+
+  meta = gst_buffer_get_reference_timestamp_meta (GST_PAD_PROBE_INFO_BUFFER (info), edge->ntp_caps);
+  if (!meta)
+    return GST_PAD_PROBE_OK;
+
+  /* the origin maps rtp time to its wall clock in the sender reports, so
+   * this is the hop as long as both hosts keep their clocks in sync */
+  hop = g_get_real_time () * GST_USECOND - (gint64) (meta->timestamp - EDGE_NTP_OFFSET * GST_SECOND);
+
+  g_mutex_lock (&edge->lock);
+  track->hop = track->valid ? (track->hop * 7 + hop) / 8 : hop;
+  if (!track->valid || ABS (track->hop - track->reported) >= EDGE_REPORT_STEP_MS * GST_MSECOND)
+  {
+    track->valid = TRUE;
+    track->reported = track->hop;
+    changed = TRUE;
+  }
+  g_mutex_unlock (&edge->lock);
+
+  if (changed)
+    g_atomic_int_inc (edge->version);
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+edge_attach (GstRTSPEdge *edge, GstElement *bin)
+{
+  guint i;
+
+  /* right behind the jitter buffer, before anything depayloads */
+  for (i = 0; i < EDGE_TRACKS; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("queue%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+    {
+      name = g_strdup_printf ("parse%u", i);
+      element = gst_bin_get_by_name (GST_BIN (bin), name);
+      g_free (name);
+    }
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "sink");
+    if (pad)
+    {
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+          (GstPadProbeCallback) edge_probe, &edge->tracks[i], NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+}
+
+void
+json_builder_edge_value (JsonBuilder *builder, GstRTSPEdge *edge)
+{
+  guint i;
+
+  json_builder_set_member_name (builder, "edge");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "origin");
+  json_builder_add_string_value (builder, edge->origin);
+
+  g_mutex_lock (&edge->lock);
+  for (i = 0; i < EDGE_TRACKS; i++)
+  {
+    if (!edge->tracks[i].valid)
+      continue;
+
+    json_builder_set_member_name (builder, i ? "audio_hop_ms" : "video_hop_ms");
+    json_builder_add_int_value (builder, edge->tracks[i].reported / GST_MSECOND);
+  }
+  g_mutex_unlock (&edge->lock);
+
+  json_builder_end_object (builder);
+}
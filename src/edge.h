@@ -0,0 +1,21 @@
+#ifndef __EDGE_H__
+#define __EDGE_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+#define EDGE_TRACKS 2
+
+typedef struct _GstRTSPEdge GstRTSPEdge;
+
+GstRTSPEdge *edge_new (const gchar *origin, gint *version);
+void edge_free (GstRTSPEdge *edge);
+
+void edge_attach (GstRTSPEdge *edge, GstElement *bin);
+
+void json_builder_edge_value (JsonBuilder *builder, GstRTSPEdge *edge);
+
+#endif
@@ -0,0 +1,137 @@
+#include "rtsp.h"
+#include "events.h"
+
+typedef struct _GstRTSPEvent GstRTSPEvent;
+
+struct _GstRTSPEvent
+{
+  guint64 seq;
+  gint64 time;
+  gchar *event;
+  gchar *path;
+};
+
+static GMutex events_lock;
+static GstRTSPEvent *events = NULL;
+static guint events_capacity = 0;
+static guint64 events_seq = 0;
+static EventsNotify events_notify = NULL;
+static gpointer events_notify_data = NULL;
+
+void
+events_init (guint capacity)
+{
+  g_mutex_lock (&events_lock);
+  events = g_new0 (GstRTSPEvent, capacity);
+  events_capacity = capacity;
+  g_mutex_unlock (&events_lock);
+}
+
+void
+events_set_notify (EventsNotify notify, gpointer data)
+{
+  g_mutex_lock (&events_lock);
+  events_notify = notify;
+  events_notify_data = data;
+  g_mutex_unlock (&events_lock);
+}
+
+void
+events_push (const gchar *event, const gchar *path)
+{
+  GstRTSPEvent *slot;
+  EventsNotify notify;
+  gpointer notify_data;
+
+  g_mutex_lock (&events_lock);
+
+  if (!events)
+  {
+    g_mutex_unlock (&events_lock);
+    return;
+  }
+
+  /* the oldest event is overwritten, readers behind it get a gap marker */
+  slot = &events[events_seq % events_capacity];
+  g_free (slot->event);
+  g_free (slot->path);
+  slot->seq = events_seq++;
+  slot->time = g_get_real_time ();
+  slot->event = g_strdup (event);
+  slot->path = g_strdup (path ? path : "");
+
+  notify = events_notify;
+  notify_data = events_notify_data;
+
+  g_mutex_unlock (&events_lock);
+
+  if (notify)
+    notify (notify_data);
+}
+
+gchar *
+events_to_body (guint64 cursor, gboolean *empty)
+{
+  JsonBuilder *builder;
+  guint64 first, seq;
+  gboolean gap = FALSE;
+  gchar *body;
+
+  builder = json_builder_new ();
+
+  g_mutex_lock (&events_lock);
+
+  first = events_seq > events_capacity ? events_seq - events_capacity : 0;
+
+  if (cursor < first)
+  {
+    gap = TRUE;
+    cursor = first;
+  }
+
+  if (cursor > events_seq)
+    cursor = events_seq;
+
+  *empty = !gap && cursor == events_seq;
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "data");
+  json_builder_begin_array (builder);
+
+  for (seq = cursor; seq < events_seq; seq++)
+  {
+    GstRTSPEvent *event = &events[seq % events_capacity];
+
+    json_builder_begin_object (builder);
+    json_builder_set_member_name (builder, "type");
+    json_builder_add_string_value (builder, "events");
+    json_builder_set_member_name (builder, "seq");
+    json_builder_add_int_value (builder, event->seq);
+    json_builder_set_member_name (builder, "event");
+    json_builder_add_string_value (builder, event->event);
+    json_builder_set_member_name (builder, "path");
+    json_builder_add_string_value (builder, event->path);
+    json_builder_set_member_name (builder, "time");
+    json_builder_add_int_value (builder, event->time / 1000);
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_array (builder);
+
+  json_builder_set_member_name (builder, "meta");
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "next");
+  json_builder_add_int_value (builder, events_seq);
+  json_builder_set_member_name (builder, "gap");
+  json_builder_add_boolean_value (builder, gap);
+  json_builder_end_object (builder);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&events_lock);
+
+  body = json_builder_to_body (builder);
+  g_object_unref (builder);
+
+  return body;
+}
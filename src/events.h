@@ -0,0 +1,16 @@
+#ifndef __EVENTS_H__
+#define __EVENTS_H__
+
+#include <glib.h>
+
+typedef void (*EventsNotify) (gpointer data);
+
+void events_init (guint capacity);
+
+void events_set_notify (EventsNotify notify, gpointer data);
+
+void events_push (const gchar *event, const gchar *path);
+
+gchar * events_to_body (guint64 cursor, gboolean *empty);
+
+#endif
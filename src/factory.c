@@ -0,0 +1,1538 @@
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+
+#include "factory.h"
+#include "upstream.h"
+#include "timeshift.h"
+#include "rendition.h"
+
+#define RELAY_TRACKS 2
+#define RELAY_EDGE_LATENCY_MS 100
+
+typedef enum
+{
+  RELAY_RTMPSRC,
+  RELAY_APPSRC,
+  RELAY_FLVDEMUX,
+  RELAY_QUEUE,
+  RELAY_H264PARSE,
+  RELAY_RTPH264PAY,
+  RELAY_AACPARSE,
+  RELAY_RTPMP4APAY,
+  RELAY_H265PARSE,
+  RELAY_RTPH265PAY,
+  RELAY_MPEGAUDIOPARSE,
+  RELAY_RTPMPAPAY,
+  RELAY_OPUSPARSE,
+  RELAY_RTPOPUSPAY,
+  RELAY_IDENTITY,
+  RELAY_RTPPCMAPAY,
+  RELAY_RTPPCMUPAY,
+  RELAY_RTSPSRC,
+  RELAY_RTPH264DEPAY,
+  RELAY_RTPH265DEPAY,
+  RELAY_RTPMP4ADEPAY,
+  RELAY_RTPMPADEPAY,
+  RELAY_RTPOPUSDEPAY,
+  RELAY_RTPPCMADEPAY,
+  RELAY_RTPPCMUDEPAY,
+  RELAY_NUM
+} GstRTSPRelayElement;
+
+static const gchar *relay_element_names[RELAY_NUM] =
+{
+  "rtmpsrc",
+  "appsrc",
+  "flvdemux",
+  "queue",
+  "h264parse",
+  "rtph264pay",
+  "aacparse",
+  "rtpmp4apay",
+  "h265parse",
+  "rtph265pay",
+  "mpegaudioparse",
+  "rtpmpapay",
+  "opusparse",
+  "rtpopuspay",
+  "identity",
+  "rtppcmapay",
+  "rtppcmupay",
+  "rtspsrc",
+  "rtph264depay",
+  "rtph265depay",
+  "rtpmp4adepay",
+  "rtpmpadepay",
+  "rtpopusdepay",
+  "rtppcmadepay",
+  "rtppcmudepay"
+};
+
+typedef struct _GstRTSPRelayCodec GstRTSPRelayCodec;
+
+struct _GstRTSPRelayCodec
+{
+  guint track;
+  const gchar *caps;
+  gint mpegversion;
+  const gchar *encoding;
+  const gchar *name;
+  GstRTSPRelayElement depay;
+  GstRTSPRelayElement parse;
+  GstRTSPRelayElement pay;
+  guint pt;
+};
+
+/* everything is passed through as it comes from the demuxer, g.711 has
+ * nothing to parse, an edge matches the encoding its origin payloaded */
+static const GstRTSPRelayCodec relay_codecs[] =
+{
+  { 0, "video/x-h264", 0, "H264", "h264", RELAY_RTPH264DEPAY, RELAY_H264PARSE, RELAY_RTPH264PAY, 96 },
+  { 0, "video/x-h265", 0, "H265", "h265", RELAY_RTPH265DEPAY, RELAY_H265PARSE, RELAY_RTPH265PAY, 96 },
+  { 1, "audio/mpeg", 4, "MP4A-LATM", "aac", RELAY_RTPMP4ADEPAY, RELAY_AACPARSE, RELAY_RTPMP4APAY, 97 },
+  { 1, "audio/mpeg", 2, NULL, "aac", RELAY_RTPMP4ADEPAY, RELAY_AACPARSE, RELAY_RTPMP4APAY, 97 },
+  { 1, "audio/mpeg", 1, "MPA", "mp3", RELAY_RTPMPADEPAY, RELAY_MPEGAUDIOPARSE, RELAY_RTPMPAPAY, 14 },
+  { 1, "audio/x-opus", 0, "OPUS", "opus", RELAY_RTPOPUSDEPAY, RELAY_OPUSPARSE, RELAY_RTPOPUSPAY, 97 },
+  { 1, "audio/x-alaw", 0, "PCMA", "pcma", RELAY_RTPPCMADEPAY, RELAY_IDENTITY, RELAY_RTPPCMAPAY, 8 },
+  { 1, "audio/x-mulaw", 0, "PCMU", "pcmu", RELAY_RTPPCMUDEPAY, RELAY_IDENTITY, RELAY_RTPPCMUPAY, 0 }
+};
+
+typedef struct _GstRTSPRelayFactory GstRTSPRelayFactory;
+typedef struct _GstRTSPRelayFactoryClass GstRTSPRelayFactoryClass;
+
+struct _GstRTSPRelayFactory
+{
+  GstRTSPMediaFactory parent;
+  gchar *location;
+  guint timeout;
+  gboolean queues;
+  guint leaky_ms;
+  gchar *backup;
+  guint reconnect_timeout;
+  gboolean slate;
+  guint track_window;
+  gboolean edge;
+  gboolean forward;
+  gchar *timeshift;
+  gchar *rendition;
+};
+
+struct _GstRTSPRelayFactoryClass
+{
+  GstRTSPMediaFactoryClass parent_class;
+  GstElementFactory *elements[RELAY_NUM];
+  GstCaps *flv_caps;
+};
+
+typedef struct _GstRTSPRelayPool GstRTSPRelayPool;
+
+struct _GstRTSPRelayPool
+{
+  GMutex lock;
+  guint size;
+  GstRTSPMediaFactory *template;
+  GQueue pipelines;
+  GHashTable *factories;
+  GQueue recent;
+  gboolean refilling;
+  guint64 hits;
+  guint64 misses;
+  guint64 factory_hits;
+  gint64 saved;
+};
+
+static GstRTSPRelayPool relay_pool;
+
+typedef struct _GstRTSPRelayTracks GstRTSPRelayTracks;
+
+struct _GstRTSPRelayTracks
+{
+  GMutex lock;
+  GstRTSPRelayFactoryClass *klass;
+  GstElement *dynpay;
+  guint window;
+  gboolean forward;
+  gboolean expected[RELAY_TRACKS];
+  gboolean exposed[RELAY_TRACKS];
+  gboolean announced;
+  gboolean done;
+  guint timeout_id;
+};
+
+#define GST_TYPE_RTSP_RELAY_FACTORY (gst_rtsp_relay_factory_get_type ())
+#define GST_RTSP_RELAY_FACTORY(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_RTSP_RELAY_FACTORY, GstRTSPRelayFactory))
+#define GST_RTSP_RELAY_FACTORY_GET_CLASS(obj) \
+    (G_TYPE_INSTANCE_GET_CLASS ((obj), GST_TYPE_RTSP_RELAY_FACTORY, GstRTSPRelayFactoryClass))
+
+GType gst_rtsp_relay_factory_get_type (void);
+
+G_DEFINE_TYPE (GstRTSPRelayFactory, gst_rtsp_relay_factory, GST_TYPE_RTSP_MEDIA_FACTORY);
+
+static GstElement *
+relay_element_new (GstRTSPRelayFactoryClass *klass, GstRTSPRelayElement type, GstElement *bin, const gchar *name)
+{
+  GstElement *element;
+
+  if (!klass->elements[type])
+  {
+    g_print ("rtmp2rtsp: missing element %s\n", relay_element_names[type]);
+    return NULL;
+  }
+
+  element = gst_element_factory_create (klass->elements[type], name);
+  if (element)
+    gst_bin_add (GST_BIN (bin), element);
+
+  return element;
+}
+
+static GstElement *
+relay_branch_head (GstElement *bin, guint track)
+{
+  GstElement *element;
+
+  /* the branch starts at the queue when there is one */
+  element = gst_bin_get_by_name (GST_BIN (bin), track ? "queue1" : "queue0");
+  if (!element)
+    element = gst_bin_get_by_name (GST_BIN (bin), track ? "parse1" : "parse0");
+
+  return element;
+}
+
+static void
+relay_branch_link (GstElement *bin, GstPad *pad, guint track)
+{
+  GstRTSPRelayTracks *tracks;
+  GstElement *element;
+  GstPad *sinkpad;
+
+  tracks = g_object_get_data (G_OBJECT (bin), "tracks");
+  if (tracks)
+  {
+    g_mutex_lock (&tracks->lock);
+    tracks->expected[track] = TRUE;
+    g_mutex_unlock (&tracks->lock);
+  }
+
+  element = relay_branch_head (bin, track);
+  if (!element)
+    return;
+
+  sinkpad = gst_element_get_static_pad (element, "sink");
+  if (sinkpad && !gst_pad_is_linked (sinkpad))
+    gst_pad_link (pad, sinkpad);
+
+  if (sinkpad)
+    gst_object_unref (sinkpad);
+  gst_object_unref (element);
+}
+
+static void
+relay_demux_pad_added (GstElement *demux, GstPad *pad, GstElement *bin)
+{
+  gchar *pad_name;
+
+  pad_name = gst_pad_get_name (pad);
+  if (g_strcmp0 (pad_name, "video") == 0)
+    relay_branch_link (bin, pad, 0);
+  else if (g_strcmp0 (pad_name, "audio") == 0)
+    relay_branch_link (bin, pad, 1);
+  g_free (pad_name);
+}
+
+static void
+relay_edge_pad_added (GstElement *src, GstPad *pad, GstElement *bin)
+{
+  GstCaps *caps;
+  const gchar *media;
+
+  caps = gst_pad_get_current_caps (pad);
+  if (!caps)
+    caps = gst_pad_query_caps (pad, NULL);
+
+  /* the origin announces one stream per track, the sdp tells which */
+  media = gst_caps_is_empty (caps) ? NULL : gst_structure_get_string (gst_caps_get_structure (caps, 0), "media");
+  if (g_strcmp0 (media, "video") == 0)
+    relay_branch_link (bin, pad, 0);
+  else if (g_strcmp0 (media, "audio") == 0)
+    relay_branch_link (bin, pad, 1);
+
+  gst_caps_unref (caps);
+}
+
+static GstElement *
+relay_stage_new (GstElement *bin, const gchar *format, guint track)
+{
+  GstElement *stage;
+  gchar *name;
+
+  /* the codec is only known once data flows, the stage keeps the name
+   * and pads everyone probes while its content is picked later */
+  name = g_strdup_printf (format, track);
+  stage = gst_bin_new (name);
+  g_free (name);
+
+  gst_element_add_pad (stage, gst_ghost_pad_new_no_target ("sink", GST_PAD_SINK));
+  gst_element_add_pad (stage, gst_ghost_pad_new_no_target ("src", GST_PAD_SRC));
+  gst_bin_add (GST_BIN (bin), stage);
+
+  return stage;
+}
+
+static gboolean
+relay_stage_set (GstElement *stage, GstElement *first, GstElement *last)
+{
+  GstPad *ghost, *pad;
+
+  if (first != last && !gst_element_link (first, last))
+    return FALSE;
+
+  ghost = gst_element_get_static_pad (stage, "sink");
+  pad = gst_element_get_static_pad (first, "sink");
+  gst_ghost_pad_set_target (GST_GHOST_PAD (ghost), pad);
+  gst_object_unref (pad);
+  gst_object_unref (ghost);
+
+  ghost = gst_element_get_static_pad (stage, "src");
+  pad = gst_element_get_static_pad (last, "src");
+  gst_ghost_pad_set_target (GST_GHOST_PAD (ghost), pad);
+  gst_object_unref (pad);
+  gst_object_unref (ghost);
+
+  gst_element_sync_state_with_parent (last);
+  if (first != last)
+    gst_element_sync_state_with_parent (first);
+
+  return TRUE;
+}
+
+static gboolean
+relay_factory_add_branch (GstRTSPRelayFactory *relay, GstRTSPRelayFactoryClass *klass, GstElement *bin, guint track)
+{
+  GstElement *queue = NULL, *parse, *pay;
+  gchar *name;
+
+  if (relay->queues)
+  {
+    name = g_strdup_printf ("queue%u", track);
+    queue = relay_element_new (klass, RELAY_QUEUE, bin, name);
+    g_free (name);
+
+    if (!queue)
+      return FALSE;
+
+    if (relay->leaky_ms > 0)
+    {
+      gst_util_set_object_arg (G_OBJECT (queue), "leaky", "downstream");
+      g_object_set (queue,
+          "max-size-buffers", 0,
+          "max-size-bytes", 0,
+          "max-size-time", (guint64) relay->leaky_ms * GST_MSECOND,
+          NULL);
+    }
+  }
+
+  parse = relay_stage_new (bin, "parse%u", track);
+
+  /* not pay%u, the media would pick it up as a static stream */
+  pay = relay_stage_new (bin, "rtppay%u", track);
+
+  if (queue && !gst_element_link (queue, parse))
+    return FALSE;
+
+  return gst_element_link (parse, pay);
+}
+
+static const GstRTSPRelayCodec *
+relay_codec_find (guint track, const GstStructure *structure)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (relay_codecs); i++)
+  {
+    const GstRTSPRelayCodec *codec = &relay_codecs[i];
+    const gchar *encoding;
+    gint mpegversion;
+
+    if (codec->track != track)
+      continue;
+
+    if (gst_structure_has_name (structure, "application/x-rtp"))
+    {
+      encoding = gst_structure_get_string (structure, "encoding-name");
+      if (codec->encoding && encoding && g_ascii_strcasecmp (encoding, codec->encoding) == 0)
+        return codec;
+      continue;
+    }
+
+    if (!gst_structure_has_name (structure, codec->caps))
+      continue;
+
+    if (codec->mpegversion &&
+        (!gst_structure_get_int (structure, "mpegversion", &mpegversion) || mpegversion != codec->mpegversion))
+      continue;
+
+    return codec;
+  }
+
+  return NULL;
+}
+
+typedef struct _GstRTSPRelayForward GstRTSPRelayForward;
+
+struct _GstRTSPRelayForward
+{
+  guint track;
+  gboolean h265;
+  gboolean keyed;
+  guint32 key_timestamp;
+};
+
+static gboolean
+relay_forward_is_key_nal (GstRTSPRelayForward *forward, guint type)
+{
+  /* an access unit that can be decoded on its own starts with parameter
+   * sets or an idr, irap in h.265 */
+  if (forward->h265)
+    return (type >= 16 && type <= 21) || type == 32 || type == 33;
+
+  return type == 5 || type == 7;
+}
+
+static gboolean
+relay_forward_is_key (GstRTSPRelayForward *forward, const guint8 *data, guint size)
+{
+  guint header, type, offset, len;
+
+  header = forward->h265 ? 2 : 1;
+  if (size < header + 1)
+    return FALSE;
+
+  type = forward->h265 ? (data[0] >> 1) & 0x3f : data[0] & 0x1f;
+
+  /* fragments count only from their first packet */
+  if (type == (forward->h265 ? 49 : 28))
+    return (data[header] & 0x80) &&
+        relay_forward_is_key_nal (forward, forward->h265 ? data[header] & 0x3f : data[header] & 0x1f);
+
+  if (type != (forward->h265 ? 48 : 24))
+    return relay_forward_is_key_nal (forward, type);
+
+  /* aggregates carry 16 bit sizes in front of every nal */
+  for (offset = header; offset + 2 + header <= size; offset += 2 + len)
+  {
+    len = GST_READ_UINT16_BE (data + offset);
+    type = forward->h265 ? (data[offset + 2] >> 1) & 0x3f : data[offset + 2] & 0x1f;
+
+    if (relay_forward_is_key_nal (forward, type))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static GstBuffer *
+relay_forward_flag (GstRTSPRelayForward *forward, GstBuffer *buffer)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  gboolean key = TRUE, marker = TRUE;
+  guint32 timestamp;
+
+  if (!gst_rtp_buffer_map (buffer, GST_MAP_READ, &rtp))
+    return buffer;
+
+  timestamp = gst_rtp_buffer_get_timestamp (&rtp);
+
+  /* every audio packet stands on its own, a video frame is keyed once by
+   * the first packet of its access unit and ends on the marker */
+  if (forward->track == 0)
+  {
+    key = relay_forward_is_key (forward, gst_rtp_buffer_get_payload (&rtp), gst_rtp_buffer_get_payload_len (&rtp))
+        && (!forward->keyed || timestamp != forward->key_timestamp);
+    marker = gst_rtp_buffer_get_marker (&rtp);
+  }
+
+  gst_rtp_buffer_unmap (&rtp);
+
+  if (key)
+  {
+    forward->keyed = TRUE;
+    forward->key_timestamp = timestamp;
+  }
+
+  buffer = gst_buffer_make_writable (buffer);
+
+  if (key)
+    GST_BUFFER_FLAG_UNSET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  else
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  if (marker)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_MARKER);
+  else
+    GST_BUFFER_FLAG_UNSET (buffer, GST_BUFFER_FLAG_MARKER);
+
+  return buffer;
+}
+
+static GstPadProbeReturn
+relay_forward_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPRelayForward *forward)
+{
+  /* the taps on parse%u look for keyframes, forwarded packets come
+   * without the flags a parser would set */
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list;
+    guint i;
+
+    list = gst_buffer_list_make_writable (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+
+    for (i = 0; i < gst_buffer_list_length (list); i++)
+    {
+      GstBuffer *buffer;
+
+      buffer = gst_buffer_ref (gst_buffer_list_get (list, i));
+      gst_buffer_list_remove (list, i, 1);
+      gst_buffer_list_insert (list, i, relay_forward_flag (forward, buffer));
+    }
+
+    GST_PAD_PROBE_INFO_DATA (info) = list;
+  }
+  else
+  {
+    GST_PAD_PROBE_INFO_DATA (info) = relay_forward_flag (forward, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+relay_forward_attach (GstElement *element, guint track, const GstRTSPRelayCodec *codec)
+{
+  GstRTSPRelayForward *forward;
+  GstPad *pad;
+
+  forward = g_new0 (GstRTSPRelayForward, 1);
+  forward->track = track;
+  forward->h265 = g_strcmp0 (codec->encoding, "H265") == 0;
+
+  pad = gst_element_get_static_pad (element, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) relay_forward_probe, forward, g_free);
+  gst_object_unref (pad);
+}
+
+static gboolean
+relay_tracks_build (GstRTSPRelayTracks *tracks, guint track, GstCaps *caps)
+{
+  const GstRTSPRelayCodec *codec;
+  GstElement *parse_stage, *pay_stage, *depay = NULL, *parse = NULL, *pay = NULL;
+  gboolean rtp, res = FALSE;
+  gchar *name;
+
+  codec = relay_codec_find (track, gst_caps_get_structure (caps, 0));
+  if (!codec)
+  {
+    name = gst_caps_to_string (caps);
+    g_print ("rtmp2rtsp: unsupported %s codec %s\n", track ? "audio" : "video", name);
+    g_free (name);
+    return FALSE;
+  }
+
+  name = g_strdup_printf ("parse%u", track);
+  parse_stage = gst_bin_get_by_name (GST_BIN (tracks->dynpay), name);
+  g_free (name);
+
+  name = g_strdup_printf ("rtppay%u", track);
+  pay_stage = gst_bin_get_by_name (GST_BIN (tracks->dynpay), name);
+  g_free (name);
+
+  rtp = gst_structure_has_name (gst_caps_get_structure (caps, 0), "application/x-rtp");
+
+  /* an edge either forwards the packets of its origin untouched or
+   * depayloads them to get keyframes and caps like any other source */
+  if (parse_stage && pay_stage && rtp && tracks->forward)
+  {
+    parse = relay_element_new (tracks->klass, RELAY_IDENTITY, parse_stage, NULL);
+    pay = relay_element_new (tracks->klass, RELAY_IDENTITY, pay_stage, NULL);
+
+    res = parse && pay && relay_stage_set (parse_stage, parse, parse) && relay_stage_set (pay_stage, pay, pay);
+
+    if (res)
+      relay_forward_attach (parse, track, codec);
+  }
+  else if (parse_stage && pay_stage)
+  {
+    depay = rtp ? relay_element_new (tracks->klass, codec->depay, parse_stage, NULL) : NULL;
+    parse = relay_element_new (tracks->klass, codec->parse, parse_stage, NULL);
+    pay = relay_element_new (tracks->klass, codec->pay, pay_stage, NULL);
+
+    if (parse && pay && (depay || !rtp))
+    {
+      g_object_set (pay, "pt", codec->pt, NULL);
+      res = relay_stage_set (parse_stage, depay ? depay : parse, parse) && relay_stage_set (pay_stage, pay, pay);
+    }
+  }
+
+  if (res)
+    g_print ("rtmp2rtsp: relay %s track as %s%s\n", track ? "audio" : "video", codec->name,
+        rtp && tracks->forward ? " rtp" : "");
+
+  if (parse_stage)
+    gst_object_unref (parse_stage);
+  if (pay_stage)
+    gst_object_unref (pay_stage);
+
+  return res;
+}
+
+static void
+relay_tracks_remove (GstElement *dynpay, guint track)
+{
+  const gchar *names[] = { "queue%u", "parse%u", "rtppay%u" };
+  guint i;
+
+  /* a track that never showed up keeps no queue thread or payloader */
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+  {
+    GstElement *element;
+    gchar *name;
+
+    name = g_strdup_printf (names[i], track);
+    element = gst_bin_get_by_name (GST_BIN (dynpay), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    gst_bin_remove (GST_BIN (dynpay), element);
+    gst_element_set_state (element, GST_STATE_NULL);
+    gst_object_unref (element);
+  }
+}
+
+static void
+relay_tracks_finish (GstRTSPRelayTracks *tracks)
+{
+  gboolean absent[RELAY_TRACKS];
+  guint i;
+
+  g_mutex_lock (&tracks->lock);
+  if (tracks->done)
+  {
+    g_mutex_unlock (&tracks->lock);
+    return;
+  }
+  tracks->done = TRUE;
+  if (tracks->timeout_id)
+  {
+    g_source_remove (tracks->timeout_id);
+    tracks->timeout_id = 0;
+  }
+  for (i = 0; i < RELAY_TRACKS; i++)
+    absent[i] = !tracks->exposed[i];
+  g_mutex_unlock (&tracks->lock);
+
+  for (i = 0; i < RELAY_TRACKS; i++)
+  {
+    if (absent[i])
+    {
+      g_print ("rtmp2rtsp: no %s track, relay without it\n", i ? "audio" : "video");
+      relay_tracks_remove (tracks->dynpay, i);
+    }
+  }
+
+  gst_element_no_more_pads (tracks->dynpay);
+}
+
+static gboolean
+relay_tracks_complete (GstRTSPRelayTracks *tracks)
+{
+  gboolean complete = TRUE;
+  guint i;
+
+  for (i = 0; i < RELAY_TRACKS; i++)
+  {
+    if (!tracks->exposed[i] && (!tracks->announced || tracks->expected[i]))
+      complete = FALSE;
+  }
+
+  return complete;
+}
+
+static gboolean
+relay_tracks_timeout (GstElement *dynpay)
+{
+  GstRTSPRelayTracks *tracks = g_object_get_data (G_OBJECT (dynpay), "tracks");
+
+  g_mutex_lock (&tracks->lock);
+  tracks->timeout_id = 0;
+  g_mutex_unlock (&tracks->lock);
+
+  relay_tracks_finish (tracks);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+relay_tracks_expose (GstRTSPRelayTracks *tracks, guint track, GstCaps *caps)
+{
+  GstElement *pay;
+  GstPad *pad, *ghost;
+  gboolean complete;
+  gchar *name;
+
+  g_mutex_lock (&tracks->lock);
+  if (tracks->done || tracks->exposed[track] || !relay_tracks_build (tracks, track, caps))
+  {
+    g_mutex_unlock (&tracks->lock);
+    return;
+  }
+
+  name = g_strdup_printf ("rtppay%u", track);
+  pay = gst_bin_get_by_name (GST_BIN (tracks->dynpay), name);
+  g_free (name);
+
+  /* the media makes a stream out of every pad of the dynamic payloader,
+   * the pad keeps the track name so streams can be mapped back */
+  pad = gst_element_get_static_pad (pay, "src");
+  name = g_strdup_printf ("pay%u", track);
+  ghost = gst_ghost_pad_new (name, pad);
+  g_free (name);
+  gst_object_unref (pad);
+  gst_object_unref (pay);
+
+  gst_pad_set_active (ghost, TRUE);
+  gst_element_add_pad (tracks->dynpay, ghost);
+  tracks->exposed[track] = TRUE;
+
+  /* the other track gets a window to show up, no one waits for it
+   * longer than that */
+  complete = relay_tracks_complete (tracks);
+  if (!complete && !tracks->timeout_id)
+    tracks->timeout_id = g_timeout_add_full (G_PRIORITY_DEFAULT, tracks->window,
+        (GSourceFunc) relay_tracks_timeout, gst_object_ref (tracks->dynpay), gst_object_unref);
+  g_mutex_unlock (&tracks->lock);
+
+  if (complete)
+    relay_tracks_finish (tracks);
+}
+
+static GstPadProbeReturn
+relay_tracks_caps_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPRelayTracks *tracks)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstCaps *caps;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_caps (event, &caps);
+  relay_tracks_expose (tracks, GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "track")), caps);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+relay_demux_no_more_pads (GstElement *demux, GstElement *dynpay)
+{
+  GstRTSPRelayTracks *tracks = g_object_get_data (G_OBJECT (dynpay), "tracks");
+  gboolean complete;
+
+  if (!tracks)
+    return;
+
+  /* the header already said which tracks there are */
+  g_mutex_lock (&tracks->lock);
+  tracks->announced = TRUE;
+  complete = relay_tracks_complete (tracks);
+  g_mutex_unlock (&tracks->lock);
+
+  if (complete)
+    relay_tracks_finish (tracks);
+}
+
+static void
+relay_tracks_free (GstRTSPRelayTracks *tracks)
+{
+  g_mutex_clear (&tracks->lock);
+  g_free (tracks);
+}
+
+static void
+relay_tracks_attach (GstElement *dynpay, GstRTSPRelayFactoryClass *klass, guint window, gboolean forward)
+{
+  GstRTSPRelayTracks *tracks;
+  guint i;
+
+  tracks = g_new0 (GstRTSPRelayTracks, 1);
+  g_mutex_init (&tracks->lock);
+  tracks->klass = klass;
+  tracks->dynpay = dynpay;
+  tracks->window = window;
+  tracks->forward = forward;
+
+  g_object_set_data_full (G_OBJECT (dynpay), "tracks", tracks, (GDestroyNotify) relay_tracks_free);
+
+  for (i = 0; i < RELAY_TRACKS; i++)
+  {
+    GstElement *head;
+    GstPad *pad;
+
+    head = relay_branch_head (dynpay, i);
+    if (!head)
+      continue;
+
+    pad = gst_element_get_static_pad (head, "sink");
+
+    g_object_set_data (G_OBJECT (pad), "track", GUINT_TO_POINTER (i));
+    tracks->expected[i] = gst_pad_is_linked (pad);
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+        (GstPadProbeCallback) relay_tracks_caps_probe, tracks, NULL);
+
+    gst_object_unref (pad);
+    gst_object_unref (head);
+  }
+}
+
+static GstElement *relay_factory_build (GstRTSPMediaFactory *factory, const GstRTSPUrl *url);
+
+static gboolean
+relay_factory_fill_upstream (GstRTSPRelayFactory *relay, GstRTSPRelayFactoryClass *klass, GstElement *dynpay)
+{
+  GstElement *upstream, *head;
+  guint i;
+
+  /* the source and demuxer live in their own bin that swaps them on
+   * failure, the branches below never see the upstream go away */
+  upstream = upstream_new (relay->location, relay->backup,
+      relay->timeout, relay->reconnect_timeout, relay->slate);
+  if (!upstream)
+    return FALSE;
+
+  gst_bin_add (GST_BIN (dynpay), upstream);
+  g_signal_connect (upstream, "no-more-pads", (GCallback) relay_demux_no_more_pads, dynpay);
+
+  if (!relay_factory_add_branch (relay, klass, dynpay, 0))
+    return FALSE;
+  if (!relay_factory_add_branch (relay, klass, dynpay, 1))
+    return FALSE;
+
+  for (i = 0; i < 2; i++)
+  {
+    gboolean linked;
+
+    head = relay_branch_head (dynpay, i);
+    linked = gst_element_link_pads (upstream, i ? "audio" : "video", head, "sink");
+    gst_object_unref (head);
+
+    if (!linked)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+relay_factory_fill_edge (GstRTSPRelayFactory *relay, GstRTSPRelayFactoryClass *klass, GstElement *dynpay)
+{
+  GstElement *src;
+
+  src = relay_element_new (klass, RELAY_RTSPSRC, dynpay, "src");
+  if (!src)
+    return FALSE;
+
+  /* rtspt:// in the location forces interleaved, rtsp:// tries udp first */
+  g_object_set (src,
+      "location", relay->location,
+      "latency", relay->leaky_ms > 0 ? 0 : RELAY_EDGE_LATENCY_MS,
+      "tcp-timeout", (guint64) relay->timeout * G_USEC_PER_SEC,
+      NULL);
+
+  /* the origin stamps its sender reports with the wall clock, which is
+   * what the hop latency is measured against */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (src), "add-reference-timestamp-meta"))
+    g_object_set (src, "add-reference-timestamp-meta", TRUE, NULL);
+
+  if (!relay_factory_add_branch (relay, klass, dynpay, 0))
+    return FALSE;
+  if (!relay_factory_add_branch (relay, klass, dynpay, 1))
+    return FALSE;
+
+  g_signal_connect (src, "pad-added", (GCallback) relay_edge_pad_added, dynpay);
+  g_signal_connect (src, "no-more-pads", (GCallback) relay_demux_no_more_pads, dynpay);
+
+  return TRUE;
+}
+
+static gboolean
+relay_factory_fill_timeshift (GstRTSPRelayFactory *relay, GstRTSPRelayFactoryClass *klass, GstElement *dynpay)
+{
+  GstRTSPTimeshift *store;
+  GstRTSPTimeshiftPlayback *playback = NULL;
+  guint i;
+
+  /* a playback reads the ring of the live path, it never goes upstream */
+  store = timeshift_lookup (relay->timeshift);
+  if (store)
+  {
+    playback = timeshift_playback_new (store);
+    timeshift_release (store);
+  }
+
+  if (!playback)
+  {
+    g_print ("rtmp2rtsp: %s: nothing to timeshift\n", relay->timeshift);
+    return FALSE;
+  }
+
+  g_object_set_data_full (G_OBJECT (dynpay), "timeshift", playback, (GDestroyNotify) timeshift_playback_free);
+
+  for (i = 0; i < RELAY_TRACKS; i++)
+  {
+    GstElement *src;
+    GstPad *pad;
+    gchar *name;
+
+    if (!timeshift_playback_has_track (playback, i))
+      continue;
+
+    name = g_strdup_printf ("timeshift%u", i);
+    src = relay_element_new (klass, RELAY_APPSRC, dynpay, name);
+    g_free (name);
+
+    if (!src || !relay_factory_add_branch (relay, klass, dynpay, i))
+      return FALSE;
+
+    timeshift_source_attach (playback, src, i);
+
+    pad = gst_element_get_static_pad (src, "src");
+    relay_branch_link (dynpay, pad, i);
+    gst_object_unref (pad);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+relay_factory_fill_rendition (GstRTSPRelayFactory *relay, GstRTSPRelayFactoryClass *klass, GstElement *dynpay)
+{
+  GstRTSPRendition *rendition;
+  guint i;
+
+  /* a rendition is fed from the live media of its source, the tracks
+   * show up once that media has them */
+  rendition = rendition_new (relay->rendition, dynpay);
+  if (!rendition)
+  {
+    g_print ("rtmp2rtsp: %s: unknown rendition\n", relay->rendition);
+    return FALSE;
+  }
+
+  for (i = 0; i < RELAY_TRACKS; i++)
+  {
+    GstElement *src, *last;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("rendition%u", i);
+    src = relay_element_new (klass, RELAY_APPSRC, dynpay, name);
+    g_free (name);
+
+    if (!src || !relay_factory_add_branch (relay, klass, dynpay, i))
+      return FALSE;
+
+    if (!rendition_fill (rendition, dynpay, i, src, &last))
+      return FALSE;
+
+    pad = gst_element_get_static_pad (last, "src");
+    relay_branch_link (dynpay, pad, i);
+    gst_object_unref (pad);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+relay_pool_matches (GstRTSPRelayFactory *relay)
+{
+  GstRTSPRelayFactory *template = GST_RTSP_RELAY_FACTORY (relay_pool.template);
+
+  return (relay->location == NULL) == (template->location == NULL)
+      && (relay->backup == NULL) == (template->backup == NULL)
+      && relay->timeout == template->timeout
+      && relay->queues == template->queues
+      && relay->leaky_ms == template->leaky_ms
+      && relay->reconnect_timeout == template->reconnect_timeout
+      && relay->slate == template->slate
+      && relay->track_window == template->track_window
+      && relay->edge == template->edge
+      && relay->forward == template->forward
+      && (relay->timeshift == NULL) == (template->timeshift == NULL)
+      && (relay->rendition == NULL) == (template->rendition == NULL);
+}
+
+static gboolean
+relay_pool_refill (gpointer user_data)
+{
+  GstElement *element;
+  gint64 start;
+
+  g_mutex_lock (&relay_pool.lock);
+  if (relay_pool.pipelines.length >= relay_pool.size)
+  {
+    relay_pool.refilling = FALSE;
+    g_mutex_unlock (&relay_pool.lock);
+    return G_SOURCE_REMOVE;
+  }
+  g_mutex_unlock (&relay_pool.lock);
+
+  /* one pipeline per main loop iteration, requests keep being served */
+  start = g_get_monotonic_time ();
+  element = relay_factory_build (relay_pool.template, NULL);
+  if (!element)
+  {
+    g_mutex_lock (&relay_pool.lock);
+    relay_pool.refilling = FALSE;
+    g_mutex_unlock (&relay_pool.lock);
+    return G_SOURCE_REMOVE;
+  }
+
+  g_object_set_data (G_OBJECT (element), "build-time", GINT_TO_POINTER (g_get_monotonic_time () - start));
+
+  g_mutex_lock (&relay_pool.lock);
+  g_queue_push_tail (&relay_pool.pipelines, gst_object_ref_sink (element));
+  g_mutex_unlock (&relay_pool.lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+relay_pool_schedule ()
+{
+  g_mutex_lock (&relay_pool.lock);
+  if (!relay_pool.refilling && relay_pool.pipelines.length < relay_pool.size)
+  {
+    relay_pool.refilling = TRUE;
+    g_idle_add (relay_pool_refill, NULL);
+  }
+  g_mutex_unlock (&relay_pool.lock);
+}
+
+static GstElement *
+relay_pool_take (GstRTSPRelayFactory *relay)
+{
+  GstElement *element = NULL, *src;
+
+  if (relay_pool.size == 0 || !relay_pool_matches (relay))
+    return NULL;
+
+  g_mutex_lock (&relay_pool.lock);
+  element = g_queue_pop_head (&relay_pool.pipelines);
+  if (element)
+  {
+    relay_pool.hits++;
+    relay_pool.saved += GPOINTER_TO_INT (g_object_get_data (G_OBJECT (element), "build-time"));
+  }
+  else
+  {
+    relay_pool.misses++;
+  }
+  g_mutex_unlock (&relay_pool.lock);
+
+  relay_pool_schedule ();
+
+  if (!element)
+    return NULL;
+
+  /* the media sinks the element it is handed, as it does after a parse */
+  g_object_force_floating (G_OBJECT (element));
+
+  /* warm pipelines are generic, only the upstream differs per path */
+  if ((src = gst_bin_get_by_name (GST_BIN (element), "upstream")))
+  {
+    upstream_set_location (src, relay->location, relay->backup);
+    gst_object_unref (src);
+  }
+  else if (relay->location)
+  {
+    src = gst_bin_get_by_name (GST_BIN (element), "src");
+    g_object_set (src, "location", relay->location, NULL);
+    gst_object_unref (src);
+  }
+
+  return element;
+}
+
+static GstElement *
+gst_rtsp_relay_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
+{
+  GstElement *element;
+
+  element = relay_pool_take (GST_RTSP_RELAY_FACTORY (factory));
+  if (element)
+    return element;
+
+  return relay_factory_build (factory, url);
+}
+
+static gboolean
+relay_factory_fill (GstRTSPRelayFactory *relay, GstRTSPRelayFactoryClass *klass, GstElement *dynpay)
+{
+  GstElement *src, *demux;
+
+  if (relay->location)
+  {
+    src = relay_element_new (klass, RELAY_RTMPSRC, dynpay, "src");
+    if (src)
+      g_object_set (src, "location", relay->location, "timeout", relay->timeout, NULL);
+  }
+  else
+  {
+    src = relay_element_new (klass, RELAY_APPSRC, dynpay, "src");
+    if (src)
+    {
+      gst_util_set_object_arg (G_OBJECT (src), "format", "bytes");
+      g_object_set (src, "is-live", TRUE, "block", FALSE, "caps", klass->flv_caps, NULL);
+    }
+  }
+
+  demux = relay_element_new (klass, RELAY_FLVDEMUX, dynpay, "demux");
+
+  if (!src || !demux || !gst_element_link (src, demux))
+    return FALSE;
+
+  if (!relay_factory_add_branch (relay, klass, dynpay, 0))
+    return FALSE;
+  if (!relay_factory_add_branch (relay, klass, dynpay, 1))
+    return FALSE;
+
+  g_signal_connect (demux, "pad-added", (GCallback) relay_demux_pad_added, dynpay);
+  g_signal_connect (demux, "no-more-pads", (GCallback) relay_demux_no_more_pads, dynpay);
+
+  return TRUE;
+}
+
+static GstElement *
+relay_factory_build (GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
+{
+  GstRTSPRelayFactory *relay = GST_RTSP_RELAY_FACTORY (factory);
+  GstRTSPRelayFactoryClass *klass = GST_RTSP_RELAY_FACTORY_GET_CLASS (factory);
+  GstElement *bin, *dynpay;
+  gboolean res;
+
+  /* a dynamic payloader lets the media create streams only for the tracks
+   * that show up instead of waiting on a pad that never comes */
+  bin = gst_bin_new (NULL);
+  dynpay = gst_bin_new ("dynpay0");
+  gst_bin_add (GST_BIN (bin), dynpay);
+
+  if (relay->timeshift)
+    res = relay_factory_fill_timeshift (relay, klass, dynpay);
+  else if (relay->rendition)
+    res = relay_factory_fill_rendition (relay, klass, dynpay);
+  else if (relay->location && relay->edge)
+    res = relay_factory_fill_edge (relay, klass, dynpay);
+  else if (relay->location && relay->reconnect_timeout > 0)
+    res = relay_factory_fill_upstream (relay, klass, dynpay);
+  else
+    res = relay_factory_fill (relay, klass, dynpay);
+
+  if (!res)
+  {
+    g_print ("rtmp2rtsp: %s: failed to build pipeline\n", url ? url->abspath : "");
+    gst_object_unref (bin);
+    return NULL;
+  }
+
+  relay_tracks_attach (dynpay, klass, relay->track_window, relay->forward);
+
+  /* the ring already knows its tracks */
+  if (relay->timeshift)
+    relay_demux_no_more_pads (NULL, dynpay);
+
+  return bin;
+}
+
+static gchar *
+gst_rtsp_relay_factory_gen_key (GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
+{
+  /* there is a factory per path, and a shard is reached both on the public
+   * port and on its own, both have to share the one media */
+  return g_strdup (url->abspath);
+}
+
+static void
+gst_rtsp_relay_factory_finalize (GObject *object)
+{
+  GstRTSPRelayFactory *relay = GST_RTSP_RELAY_FACTORY (object);
+
+  g_free (relay->location);
+  g_free (relay->backup);
+  g_free (relay->timeshift);
+  g_free (relay->rendition);
+
+  G_OBJECT_CLASS (gst_rtsp_relay_factory_parent_class)->finalize (object);
+}
+
+static void
+gst_rtsp_relay_factory_class_init (GstRTSPRelayFactoryClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GstRTSPMediaFactoryClass *factory_class = GST_RTSP_MEDIA_FACTORY_CLASS (klass);
+  guint i;
+
+  object_class->finalize = gst_rtsp_relay_factory_finalize;
+  factory_class->create_element = gst_rtsp_relay_factory_create_element;
+  factory_class->gen_key = gst_rtsp_relay_factory_gen_key;
+
+  /* resolved once for the process instead of on every parse */
+  for (i = 0; i < RELAY_NUM; i++)
+    klass->elements[i] = gst_element_factory_find (relay_element_names[i]);
+
+  klass->flv_caps = gst_caps_new_empty_simple ("video/x-flv");
+}
+
+static void
+gst_rtsp_relay_factory_init (GstRTSPRelayFactory *relay)
+{
+  relay->track_window = RELAY_TRACK_WINDOW_MS;
+}
+
+GstRTSPMediaFactory *
+relay_factory_new (const gchar *location, guint timeout, gboolean queues, guint leaky_ms)
+{
+  GstRTSPRelayFactory *relay;
+
+  relay = g_object_new (GST_TYPE_RTSP_RELAY_FACTORY, NULL);
+  relay->location = g_strdup (location);
+  relay->timeout = timeout;
+  relay->queues = queues;
+  relay->leaky_ms = leaky_ms;
+
+  return GST_RTSP_MEDIA_FACTORY (relay);
+}
+
+void
+relay_factory_set_failover (GstRTSPMediaFactory *factory, const gchar *backup, guint reconnect_timeout, gboolean slate)
+{
+  GstRTSPRelayFactory *relay = GST_RTSP_RELAY_FACTORY (factory);
+
+  g_free (relay->backup);
+  relay->backup = g_strdup (backup);
+  relay->reconnect_timeout = reconnect_timeout;
+  relay->slate = slate;
+}
+
+void
+relay_factory_set_edge (GstRTSPMediaFactory *factory, gboolean forward)
+{
+  GstRTSPRelayFactory *relay = GST_RTSP_RELAY_FACTORY (factory);
+
+  relay->edge = TRUE;
+  relay->forward = forward;
+}
+
+void
+relay_factory_set_timeshift (GstRTSPMediaFactory *factory, const gchar *path)
+{
+  GstRTSPRelayFactory *relay = GST_RTSP_RELAY_FACTORY (factory);
+
+  g_free (relay->timeshift);
+  relay->timeshift = g_strdup (path);
+}
+
+void
+relay_factory_set_rendition (GstRTSPMediaFactory *factory, const gchar *path)
+{
+  GstRTSPRelayFactory *relay = GST_RTSP_RELAY_FACTORY (factory);
+
+  g_free (relay->rendition);
+  relay->rendition = g_strdup (path);
+}
+
+void
+relay_factory_set_track_window (GstRTSPMediaFactory *factory, guint track_window)
+{
+  GST_RTSP_RELAY_FACTORY (factory)->track_window = track_window;
+}
+
+const gchar *
+relay_codec_get_name (guint track, const GstStructure *structure)
+{
+  const GstRTSPRelayCodec *codec = relay_codec_find (track, structure);
+
+  return codec ? codec->name : NULL;
+}
+
+guint
+relay_stream_get_track (GstRTSPStream *stream)
+{
+  GstPad *srcpad, *target;
+  guint track;
+
+  track = gst_rtsp_stream_get_index (stream);
+
+  /* streams are numbered in the order the tracks showed up, the pad the
+   * stream was made from still tells which track it is */
+  srcpad = gst_rtsp_stream_get_srcpad (stream);
+  if (!srcpad)
+    return track;
+
+  target = GST_IS_GHOST_PAD (srcpad) ? gst_ghost_pad_get_target (GST_GHOST_PAD (srcpad)) : NULL;
+  if (target)
+  {
+    gchar *name = gst_pad_get_name (target);
+
+    if (g_str_has_prefix (name, "pay"))
+      track = g_ascii_strtoull (name + 3, NULL, 10);
+
+    g_free (name);
+    gst_object_unref (target);
+  }
+
+  gst_object_unref (srcpad);
+
+  return track;
+}
+
+GstRTSPStream *
+relay_media_get_stream (GstRTSPMedia *media, guint track)
+{
+  guint i;
+
+  for (i = 0; i < gst_rtsp_media_n_streams (media); i++)
+  {
+    GstRTSPStream *stream = gst_rtsp_media_get_stream (media, i);
+
+    if (relay_stream_get_track (stream) == track)
+      return stream;
+  }
+
+  return NULL;
+}
+
+GstRTSPStreamTransport *
+relay_session_media_get_transport (GstRTSPSessionMedia *sessmedia, guint track)
+{
+  GstRTSPStream *stream;
+
+  stream = relay_media_get_stream (gst_rtsp_session_media_get_media (sessmedia), track);
+  if (!stream)
+    return NULL;
+
+  return gst_rtsp_session_media_get_transport (sessmedia, gst_rtsp_stream_get_index (stream));
+}
+
+void
+relay_factory_pool_init (guint size, GstRTSPMediaFactory *template)
+{
+  g_mutex_init (&relay_pool.lock);
+  g_queue_init (&relay_pool.pipelines);
+  g_queue_init (&relay_pool.recent);
+  relay_pool.size = size;
+  relay_pool.factories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+  relay_pool.template = g_object_ref (template);
+
+  relay_pool_schedule ();
+
+  g_print ("rtmp2rtsp: run warm pool of %u pipelines\n", size);
+}
+
+GstRTSPMediaFactory *
+relay_factory_acquire (const gchar *path)
+{
+  GstRTSPMediaFactory *factory = NULL;
+  gpointer key;
+
+  if (relay_pool.size == 0)
+    return NULL;
+
+  g_mutex_lock (&relay_pool.lock);
+  if (g_hash_table_steal_extended (relay_pool.factories, path, &key, (gpointer *) &factory))
+  {
+    g_queue_remove (&relay_pool.recent, key);
+    g_free (key);
+    relay_pool.factory_hits++;
+  }
+  g_mutex_unlock (&relay_pool.lock);
+
+  return factory;
+}
+
+void
+relay_factory_release (GstRTSPMediaFactory *factory, const gchar *path)
+{
+  gpointer key;
+
+  if (relay_pool.size == 0)
+    return;
+
+  g_mutex_lock (&relay_pool.lock);
+
+  /* the path released longest ago makes room for the latest one */
+  if (g_hash_table_lookup_extended (relay_pool.factories, path, &key, NULL))
+  {
+    g_queue_remove (&relay_pool.recent, key);
+    g_hash_table_remove (relay_pool.factories, path);
+  }
+  else if (g_hash_table_size (relay_pool.factories) >= relay_pool.size)
+  {
+    key = g_queue_pop_head (&relay_pool.recent);
+    g_hash_table_remove (relay_pool.factories, key);
+  }
+
+  key = g_strdup (path);
+  g_hash_table_insert (relay_pool.factories, key, g_object_ref (factory));
+  g_queue_push_tail (&relay_pool.recent, key);
+
+  g_mutex_unlock (&relay_pool.lock);
+}
+
+void
+json_builder_relay_pool_value (JsonBuilder *builder)
+{
+  if (relay_pool.size == 0)
+    return;
+
+  g_mutex_lock (&relay_pool.lock);
+
+  json_builder_set_member_name (builder, "warm_pool");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "size");
+  json_builder_add_int_value (builder, relay_pool.size);
+  json_builder_set_member_name (builder, "idle_pipelines");
+  json_builder_add_int_value (builder, relay_pool.pipelines.length);
+  json_builder_set_member_name (builder, "idle_factories");
+  json_builder_add_int_value (builder, g_hash_table_size (relay_pool.factories));
+  json_builder_set_member_name (builder, "hits");
+  json_builder_add_int_value (builder, relay_pool.hits);
+  json_builder_set_member_name (builder, "misses");
+  json_builder_add_int_value (builder, relay_pool.misses);
+  json_builder_set_member_name (builder, "hit_rate");
+  json_builder_add_double_value (builder,
+      relay_pool.hits + relay_pool.misses ? (gdouble) relay_pool.hits / (relay_pool.hits + relay_pool.misses) : 0.0);
+  json_builder_set_member_name (builder, "factory_hits");
+  json_builder_add_int_value (builder, relay_pool.factory_hits);
+  json_builder_set_member_name (builder, "time_saved_ms");
+  json_builder_add_int_value (builder, relay_pool.saved / 1000);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&relay_pool.lock);
+}
+
+static GstBuffer *
+relay_benchmark_sample ()
+{
+  GstElement *pipeline, *sink;
+  GstBuffer *sample = NULL;
+  GstSample *item;
+
+  /* a second of h.264 in flv stands in for a publisher, the relay
+   * prepares on it like on any rtmp stream */
+  pipeline = gst_parse_launch (
+      "videotestsrc num-buffers=30 is-live=false "
+      "! video/x-raw,width=640,height=360,framerate=30/1 "
+      "! x264enc tune=zerolatency key-int-max=30 "
+      "! h264parse ! flvmux streamable=true "
+      "! appsink name=sink sync=false", NULL);
+  if (!pipeline)
+    return NULL;
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  while ((item = gst_app_sink_pull_sample (GST_APP_SINK (sink))))
+  {
+    GstBuffer *buffer = gst_buffer_ref (gst_sample_get_buffer (item));
+
+    sample = sample ? gst_buffer_append (sample, buffer) : buffer;
+    gst_sample_unref (item);
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  return sample;
+}
+
+void
+relay_factory_benchmark (guint count)
+{
+  GstRTSPMediaFactory *factory;
+  GstRTSPThreadPool *pool;
+  GstBuffer *sample;
+  gint64 start, construct_time = 0, prepare_time = 0;
+  guint i, prepared = 0;
+
+  sample = relay_benchmark_sample ();
+  if (!sample)
+  {
+    g_print ("rtmp2rtsp: benchmark needs videotestsrc, x264enc and flvmux\n");
+    return;
+  }
+
+  factory = relay_factory_new (NULL, 30, TRUE, 0);
+  pool = gst_rtsp_thread_pool_new ();
+
+  /* every stream goes the way a describe takes it, from the media of the
+   * factory to its payloaders having caps, which is when prepare returns
+   * for a live source */
+  for (i = 0; i < count; i++)
+  {
+    GstRTSPThread *thread;
+    GstRTSPMedia *media;
+    GstRTSPUrl *url = NULL;
+    GstElement *element, *src;
+    gchar *location;
+    gint64 constructed;
+
+    location = g_strdup_printf ("rtsp://127.0.0.1:8554/live/bench%u", i);
+    gst_rtsp_url_parse (location, &url);
+    g_free (location);
+
+    start = g_get_monotonic_time ();
+    media = gst_rtsp_media_factory_construct (factory, url);
+    constructed = g_get_monotonic_time ();
+    gst_rtsp_url_free (url);
+
+    if (!media)
+      continue;
+
+    element = gst_rtsp_media_get_element (media);
+    src = gst_bin_get_by_name (GST_BIN (element), "src");
+    if (src)
+    {
+      gst_app_src_push_buffer (GST_APP_SRC (src), gst_buffer_ref (sample));
+      gst_object_unref (src);
+    }
+    gst_object_unref (element);
+
+    thread = gst_rtsp_thread_pool_get_thread (pool, GST_RTSP_THREAD_TYPE_MEDIA, NULL);
+    if (thread && gst_rtsp_media_prepare (media, thread))
+    {
+      construct_time += constructed - start;
+      prepare_time += g_get_monotonic_time () - constructed;
+      prepared++;
+
+      gst_rtsp_media_unprepare (media);
+    }
+
+    g_object_unref (media);
+  }
+
+  g_print ("rtmp2rtsp: benchmark %u streams, %u prepared\n", count, prepared);
+  g_print ("rtmp2rtsp: construct media %.1f us per stream\n", (gdouble) construct_time / MAX (prepared, 1));
+  g_print ("rtmp2rtsp: prepare to payloader caps %.1f ms per stream\n",
+      (gdouble) prepare_time / MAX (prepared, 1) / 1000);
+
+  gst_buffer_unref (sample);
+  g_object_unref (pool);
+  g_object_unref (factory);
+}
@@ -0,0 +1,41 @@
+#ifndef __FACTORY_H__
+#define __FACTORY_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <json-glib/json-glib.h>
+
+#define RELAY_TRACK_WINDOW_MS 500
+
+GstRTSPMediaFactory *relay_factory_new (const gchar *location, guint timeout, gboolean queues, guint leaky_ms);
+
+void relay_factory_set_failover (GstRTSPMediaFactory *factory, const gchar *backup,
+    guint reconnect_timeout, gboolean slate);
+
+void relay_factory_set_edge (GstRTSPMediaFactory *factory, gboolean forward);
+
+void relay_factory_set_timeshift (GstRTSPMediaFactory *factory, const gchar *path);
+
+void relay_factory_set_rendition (GstRTSPMediaFactory *factory, const gchar *path);
+
+void relay_factory_set_track_window (GstRTSPMediaFactory *factory, guint track_window);
+
+const gchar *relay_codec_get_name (guint track, const GstStructure *structure);
+
+guint relay_stream_get_track (GstRTSPStream *stream);
+GstRTSPStream *relay_media_get_stream (GstRTSPMedia *media, guint track);
+GstRTSPStreamTransport *relay_session_media_get_transport (GstRTSPSessionMedia *sessmedia, guint track);
+
+void relay_factory_pool_init (guint size, GstRTSPMediaFactory *template);
+
+GstRTSPMediaFactory *relay_factory_acquire (const gchar *path);
+void relay_factory_release (GstRTSPMediaFactory *factory, const gchar *path);
+
+void json_builder_relay_pool_value (JsonBuilder *builder);
+
+void relay_factory_benchmark (guint count);
+
+#endif
@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/rtp/gstrtpbuffer.h>
+
+#include "gopcache.h"
+#include "metrics.h"
+#include "factory.h"
+
+#define GOP_CACHE_STREAMS 2
+#define GOP_CACHE_MAX_PACKETS 8192
+#define GOP_CACHE_MAX_CLIENTS 16
+
+typedef struct _GstRTSPGopClient GstRTSPGopClient;
+
+struct _GstRTSPGopClient
+{
+  gchar *address;
+  gint64 connected;
+  gint64 ttff;
+};
+
+typedef struct _GstRTSPGopBurst GstRTSPGopBurst;
+
+struct _GstRTSPGopBurst
+{
+  GPtrArray *packets[GOP_CACHE_STREAMS];
+};
+
+struct _GstRTSPGopCache
+{
+  GMutex lock;
+  gboolean burst;
+  gboolean keyframe;
+  gboolean valid;
+  GPtrArray *packets[GOP_CACHE_STREAMS];
+  GList *waiting;
+  GstRTSPGopClient clients[GOP_CACHE_MAX_CLIENTS];
+  guint clients_pos;
+};
+
+GstRTSPGopCache *
+gop_cache_new (gboolean burst)
+{
+  GstRTSPGopCache *cache;
+  guint i;
+
+  cache = g_new0 (GstRTSPGopCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->burst = burst;
+
+  for (i = 0; i < GOP_CACHE_STREAMS; i++)
+    cache->packets[i] = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+
+  return cache;
+}
+
+static void
+gop_client_free (GstRTSPGopClient *client)
+{
+  g_free (client->address);
+  g_free (client);
+}
+
+void
+gop_cache_free (GstRTSPGopCache *cache)
+{
+  guint i;
+
+  for (i = 0; i < GOP_CACHE_STREAMS; i++)
+    g_ptr_array_unref (cache->packets[i]);
+
+  for (i = 0; i < GOP_CACHE_MAX_CLIENTS; i++)
+    g_free (cache->clients[i].address);
+
+  g_list_free_full (cache->waiting, (GDestroyNotify) gop_client_free);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+static void
+gop_cache_record (GstRTSPGopCache *cache, GstRTSPGopClient *client, gint64 now)
+{
+  GstRTSPGopClient *slot;
+
+  slot = &cache->clients[cache->clients_pos];
+  cache->clients_pos = (cache->clients_pos + 1) % GOP_CACHE_MAX_CLIENTS;
+
+  g_free (slot->address);
+  slot->address = g_strdup (client->address);
+  slot->connected = client->connected;
+  slot->ttff = now - client->connected;
+
+  metrics_observe (METRICS_CLIENT_TTFF, slot->ttff);
+}
+
+static void
+gop_cache_reset (GstRTSPGopCache *cache)
+{
+  GList *item;
+  gint64 now;
+  guint i;
+
+  for (i = 0; i < GOP_CACHE_STREAMS; i++)
+    g_ptr_array_set_size (cache->packets[i], 0);
+
+  now = g_get_monotonic_time ();
+
+  for (item = cache->waiting; item; item = g_list_next (item))
+    gop_cache_record (cache, item->data, now);
+
+  g_list_free_full (cache->waiting, (GDestroyNotify) gop_client_free);
+  cache->waiting = NULL;
+
+  cache->valid = cache->burst;
+}
+
+static gboolean
+gop_cache_append_buffer (GstBuffer **buffer, guint idx, gpointer user_data)
+{
+  GPtrArray *packets = user_data;
+
+  g_ptr_array_add (packets, gst_buffer_ref (*buffer));
+
+  return TRUE;
+}
+
+static GstPadProbeReturn
+gop_cache_parse_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPGopCache *cache)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+  {
+    g_mutex_lock (&cache->lock);
+    cache->keyframe = TRUE;
+    g_mutex_unlock (&cache->lock);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+gop_cache_pay_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPGopCache *cache)
+{
+  GPtrArray *packets;
+  guint idx;
+
+  idx = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "gop-cache-stream"));
+
+  g_mutex_lock (&cache->lock);
+
+  /* the parser and the video payloader share a streaming thread, so the
+   * packets following a keyframe on parse0 are the ones of that keyframe */
+  if (idx == 0 && cache->keyframe)
+  {
+    cache->keyframe = FALSE;
+    gop_cache_reset (cache);
+  }
+
+  packets = cache->packets[idx];
+
+  if (cache->valid)
+  {
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+      gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info), gop_cache_append_buffer, packets);
+    else
+      g_ptr_array_add (packets, gst_buffer_ref (GST_PAD_PROBE_INFO_BUFFER (info)));
+
+    if (packets->len > GOP_CACHE_MAX_PACKETS)
+    {
+      g_ptr_array_set_size (cache->packets[0], 0);
+      g_ptr_array_set_size (cache->packets[1], 0);
+      cache->valid = FALSE;
+    }
+  }
+
+  g_mutex_unlock (&cache->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+gop_cache_probe (GstRTSPGopCache *cache, GstElement *bin,
+    const gchar *name, GstPadProbeType type, GstPadProbeCallback callback, guint idx)
+{
+  GstElement *element;
+  GstPad *pad;
+
+  element = gst_bin_get_by_name (GST_BIN (bin), name);
+  if (!element)
+    return;
+
+  pad = gst_element_get_static_pad (element, "src");
+  if (pad)
+  {
+    g_object_set_data (G_OBJECT (pad), "gop-cache-stream", GUINT_TO_POINTER (idx));
+    gst_pad_add_probe (pad, type, callback, cache, NULL);
+    gst_object_unref (pad);
+  }
+
+  gst_object_unref (element);
+}
+
+void
+gop_cache_attach (GstRTSPGopCache *cache, GstElement *bin)
+{
+  gop_cache_probe (cache, bin, "parse0",
+      GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) gop_cache_parse_probe, 0);
+  gop_cache_probe (cache, bin, "rtppay0",
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) gop_cache_pay_probe, 0);
+  gop_cache_probe (cache, bin, "rtppay1",
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) gop_cache_pay_probe, 1);
+}
+
+static void
+gop_burst_free (GstRTSPGopBurst *burst)
+{
+  guint i;
+
+  for (i = 0; i < GOP_CACHE_STREAMS; i++)
+  {
+    if (burst->packets[i])
+      g_ptr_array_unref (burst->packets[i]);
+  }
+
+  g_free (burst);
+}
+
+static gboolean
+gop_packet_get_info (GstBuffer *buffer, guint16 *seq, guint32 *rtptime)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+  if (!gst_rtp_buffer_map (buffer, GST_MAP_READ, &rtp))
+    return FALSE;
+
+  *seq = gst_rtp_buffer_get_seq (&rtp);
+  *rtptime = gst_rtp_buffer_get_timestamp (&rtp);
+  gst_rtp_buffer_unmap (&rtp);
+
+  return TRUE;
+}
+
+static gint
+gop_rtpinfo_find (gchar **entries, GstRTSPStream *stream)
+{
+  gchar *control, *suffix;
+  gint i, found = -1;
+
+  control = gst_rtsp_stream_get_control (stream);
+  if (!control)
+    return -1;
+
+  suffix = g_strdup_printf ("/%s", control);
+
+  /* url=<url>;seq=<seq>;rtptime=<rtptime> */
+  for (i = 0; entries[i] && found < 0; i++)
+  {
+    gchar **fields = g_strsplit (entries[i], ";", 2);
+
+    if (g_str_has_prefix (fields[0], "url=") && g_str_has_suffix (fields[0], suffix))
+      found = i;
+
+    g_strfreev (fields);
+  }
+
+  g_free (suffix);
+  g_free (control);
+
+  return found;
+}
+
+void
+gop_cache_rtpinfo (GstRTSPGopCache *cache, GstRTSPSessionMedia *sessmedia, GstRTSPMessage *response)
+{
+  GstRTSPGopBurst *burst;
+  gchar *rtpinfo = NULL, **entries;
+  guint i, j;
+
+  gst_rtsp_message_get_header (response, GST_RTSP_HDR_RTP_INFO, &rtpinfo, 0);
+  entries = g_strsplit (rtpinfo ? rtpinfo : "", ",", -1);
+  for (i = 0; entries[i]; i++)
+    g_strstrip (entries[i]);
+
+  burst = g_new0 (GstRTSPGopBurst, 1);
+
+  /* the burst is taken while the play response is on its way out, the
+   * cached packets run up to the first live one and rtp-info starts the
+   * stream at the first of them, so the client sees one run of seqnums */
+  for (i = 0; i < GOP_CACHE_STREAMS; i++)
+  {
+    GstRTSPStreamTransport *trans;
+    const GstRTSPTransport *transport;
+    const gchar *field;
+    guint16 seq, live = 0;
+    guint32 rtptime;
+    gint entry;
+
+    trans = relay_session_media_get_transport (sessmedia, i);
+    if (!trans)
+      continue;
+
+    /* only interleaved transports can be fed per client, udp clients
+     * share the multiudpsink of the stream and wait for the next
+     * keyframe */
+    transport = gst_rtsp_stream_transport_get_transport (trans);
+    if (transport->lower_transport != GST_RTSP_LOWER_TRANS_TCP)
+      continue;
+
+    entry = gop_rtpinfo_find (entries, gst_rtsp_stream_transport_get_stream (trans));
+    field = entry >= 0 ? strstr (entries[entry], ";seq=") : NULL;
+    if (field)
+      live = atoi (field + strlen (";seq="));
+
+    burst->packets[i] = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+
+    /* what is live by the time of the response goes out live */
+    g_mutex_lock (&cache->lock);
+    for (j = 0; cache->valid && j < cache->packets[i]->len; j++)
+    {
+      GstBuffer *packet = g_ptr_array_index (cache->packets[i], j);
+
+      if (field && (!gop_packet_get_info (packet, &seq, &rtptime) || (gint16) (seq - live) >= 0))
+        continue;
+
+      g_ptr_array_add (burst->packets[i], gst_buffer_ref (packet));
+    }
+    g_mutex_unlock (&cache->lock);
+
+    if (entry >= 0 && burst->packets[i]->len > 0 &&
+        gop_packet_get_info (g_ptr_array_index (burst->packets[i], 0), &seq, &rtptime))
+    {
+      gchar **fields = g_strsplit (entries[entry], ";", 2);
+
+      g_free (entries[entry]);
+      entries[entry] = g_strdup_printf ("%s;seq=%u;rtptime=%u", fields[0], seq, rtptime);
+      g_strfreev (fields);
+    }
+  }
+
+  if (rtpinfo)
+  {
+    rtpinfo = g_strjoinv (", ", entries);
+    gst_rtsp_message_remove_header (response, GST_RTSP_HDR_RTP_INFO, -1);
+    gst_rtsp_message_take_header (response, GST_RTSP_HDR_RTP_INFO, rtpinfo);
+  }
+
+  g_strfreev (entries);
+
+  g_object_set_data_full (G_OBJECT (sessmedia), "gop-burst", burst, (GDestroyNotify) gop_burst_free);
+}
+
+void
+gop_cache_play (GstRTSPGopCache *cache, GstRTSPClient *client, GstRTSPSessionMedia *sessmedia)
+{
+  GstRTSPConnection *connection;
+  GstRTSPGopClient *gop_client;
+  GstRTSPGopBurst *burst;
+  gboolean burst_sent = FALSE;
+  gint64 *connected;
+  guint i, j;
+
+  connection = gst_rtsp_client_get_connection (client);
+  connected = g_object_get_data (G_OBJECT (client), "connected");
+
+  gop_client = g_new0 (GstRTSPGopClient, 1);
+  gop_client->address = g_strdup (connection ? gst_rtsp_connection_get_ip (connection) : "");
+  gop_client->connected = connected ? *connected : g_get_monotonic_time ();
+
+  /* the burst was taken along with the rtp-info of the response */
+  burst = g_object_steal_data (G_OBJECT (sessmedia), "gop-burst");
+
+  for (i = 0; burst && i < GOP_CACHE_STREAMS; i++)
+  {
+    GstRTSPStreamTransport *trans;
+
+    trans = relay_session_media_get_transport (sessmedia, i);
+    if (!trans || !burst->packets[i])
+      continue;
+
+    for (j = 0; j < burst->packets[i]->len; j++)
+      gst_rtsp_stream_transport_send_rtp (trans, g_ptr_array_index (burst->packets[i], j));
+
+    if (i == 0 && burst->packets[i]->len > 0)
+      burst_sent = TRUE;
+  }
+
+  if (burst)
+    gop_burst_free (burst);
+
+  g_mutex_lock (&cache->lock);
+  if (burst_sent)
+  {
+    gop_cache_record (cache, gop_client, g_get_monotonic_time ());
+    gop_client_free (gop_client);
+  }
+  else
+  {
+    cache->waiting = g_list_prepend (cache->waiting, gop_client);
+  }
+  g_mutex_unlock (&cache->lock);
+}
+
+void
+json_builder_gop_cache_value (JsonBuilder *builder, GstRTSPGopCache *cache)
+{
+  guint i;
+
+  g_mutex_lock (&cache->lock);
+
+  json_builder_set_member_name (builder, "gop_cache");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "video_packets");
+  json_builder_add_int_value (builder, cache->valid ? cache->packets[0]->len : 0);
+  json_builder_set_member_name (builder, "audio_packets");
+  json_builder_add_int_value (builder, cache->valid ? cache->packets[1]->len : 0);
+
+  json_builder_set_member_name (builder, "clients");
+  json_builder_begin_array (builder);
+
+  for (i = 0; i < GOP_CACHE_MAX_CLIENTS; i++)
+  {
+    GstRTSPGopClient *client = &cache->clients[i];
+
+    if (!client->address)
+      continue;
+
+    json_builder_begin_object (builder);
+    json_builder_set_member_name (builder, "address");
+    json_builder_add_string_value (builder, client->address);
+    json_builder_set_member_name (builder, "ttff_ms");
+    json_builder_add_int_value (builder, client->ttff / 1000);
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_array (builder);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,23 @@
+#ifndef __GOPCACHE_H__
+#define __GOPCACHE_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <json-glib/json-glib.h>
+
+typedef struct _GstRTSPGopCache GstRTSPGopCache;
+
+GstRTSPGopCache *gop_cache_new (gboolean burst);
+void gop_cache_free (GstRTSPGopCache *cache);
+
+void gop_cache_attach (GstRTSPGopCache *cache, GstElement *bin);
+
+void gop_cache_rtpinfo (GstRTSPGopCache *cache, GstRTSPSessionMedia *sessmedia, GstRTSPMessage *response);
+void gop_cache_play (GstRTSPGopCache *cache, GstRTSPClient *client, GstRTSPSessionMedia *sessmedia);
+
+void json_builder_gop_cache_value (JsonBuilder *builder, GstRTSPGopCache *cache);
+
+#endif
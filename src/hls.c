@@ -0,0 +1,1121 @@
+#include <string.h>
+
+#include "hls.h"
+
+/* closed segments kept in memory, the playlist lists the newest of them
+ * and the older ones stay for clients still downloading */
+#define HLS_SEGMENTS 8
+#define HLS_PLAYLIST_SEGMENTS 6
+#define HLS_PART_SEGMENTS 3
+
+#define HLS_SEGMENT_BYTES (256 * 1024)
+
+#define HLS_TS_PACKET 188
+#define HLS_TS_PAYLOAD 184
+#define HLS_PID_PAT 0x0000
+#define HLS_PID_PMT 0x1000
+#define HLS_PID_VIDEO 0x0100
+#define HLS_PID_AUDIO 0x0101
+
+/* pes timestamps start a few seconds in so b-frames never go negative */
+#define HLS_TS_OFFSET (10 * 90000)
+#define HLS_TS_MASK ((G_GUINT64_CONSTANT (1) << 33) - 1)
+
+/* the pcr runs behind the dts so a frame is in the decoder before it is
+ * due */
+#define HLS_PCR_DELAY (90000 / 10)
+
+typedef struct _GstRTSPHlsPart GstRTSPHlsPart;
+
+struct _GstRTSPHlsPart
+{
+  gsize offset;
+  gsize size;
+  GstClockTime duration;
+  gboolean independent;
+};
+
+typedef struct _GstRTSPHlsSegment GstRTSPHlsSegment;
+
+struct _GstRTSPHlsSegment
+{
+  guint64 sequence;
+  GstClockTime start;
+  GstClockTime duration;
+  gboolean discontinuity;
+  GByteArray *data;
+  GBytes *bytes;
+  GArray *parts;
+};
+
+struct _GstRTSPHls
+{
+  gint ref_count;
+  GMutex lock;
+  gchar *path;
+
+  gboolean video;
+  gboolean audio;
+  guint nal_length;
+  GByteArray *parameter_sets;
+  gboolean adts;
+  guint8 aac_profile;
+  guint8 aac_rate;
+  guint8 aac_channels;
+
+  guint8 cc_pat;
+  guint8 cc_pmt;
+  guint8 cc_video;
+  guint8 cc_audio;
+
+  GQueue segments;
+  GstRTSPHlsSegment *current;
+  guint64 sequence;
+  guint discontinuity_sequence;
+  gboolean discontinuity;
+  GstClockTime max_duration;
+
+  GstClockTime part_start;
+  gsize part_offset;
+  gboolean part_independent;
+
+  GstClockTime last_time;
+  GstClockTime interval;
+};
+
+typedef struct _GstRTSPHlsRegistry GstRTSPHlsRegistry;
+
+struct _GstRTSPHlsRegistry
+{
+  GMutex lock;
+  gboolean enabled;
+  GstClockTime segment;
+  GstClockTime part;
+  GHashTable *streams;
+  HlsNotify notify;
+  gpointer notify_data;
+};
+
+static GstRTSPHlsRegistry hls_registry;
+
+typedef struct _GstRTSPHlsFrame GstRTSPHlsFrame;
+
+struct _GstRTSPHlsFrame
+{
+  GstRTSPHls *hls;
+  GByteArray *pes;
+  gboolean parameters;
+};
+
+typedef void (*HlsNalFunc) (const guint8 *nal, gsize size, GstRTSPHlsFrame *frame);
+
+static const guint8 hls_start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+static const guint8 hls_aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+
+void
+hls_init (guint segment_ms, guint part_ms)
+{
+  g_mutex_init (&hls_registry.lock);
+  hls_registry.enabled = TRUE;
+  hls_registry.segment = segment_ms * GST_MSECOND;
+  hls_registry.part = part_ms < segment_ms ? part_ms * GST_MSECOND : 0;
+  hls_registry.streams = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+gboolean
+hls_enabled ()
+{
+  return hls_registry.enabled;
+}
+
+void
+hls_set_notify (HlsNotify notify, gpointer data)
+{
+  g_mutex_lock (&hls_registry.lock);
+  hls_registry.notify = notify;
+  hls_registry.notify_data = data;
+  g_mutex_unlock (&hls_registry.lock);
+}
+
+static void
+hls_notify (GstRTSPHls *hls)
+{
+  HlsNotify notify;
+  gpointer notify_data;
+
+  g_mutex_lock (&hls_registry.lock);
+  notify = hls_registry.notify;
+  notify_data = hls_registry.notify_data;
+  g_mutex_unlock (&hls_registry.lock);
+
+  if (notify)
+    notify (hls->path, notify_data);
+}
+
+static void
+hls_segment_free (GstRTSPHlsSegment *segment)
+{
+  if (segment->data)
+    g_byte_array_unref (segment->data);
+  if (segment->bytes)
+    g_bytes_unref (segment->bytes);
+  g_array_unref (segment->parts);
+  g_free (segment);
+}
+
+static GstRTSPHls *
+hls_new (const gchar *path)
+{
+  GstRTSPHls *hls;
+
+  hls = g_new0 (GstRTSPHls, 1);
+  hls->ref_count = 1;
+  g_mutex_init (&hls->lock);
+  hls->path = g_strdup (path);
+  hls->parameter_sets = g_byte_array_new ();
+  g_queue_init (&hls->segments);
+  hls->last_time = GST_CLOCK_TIME_NONE;
+
+  /* a restarted stream must not reuse segment names caches still hold */
+  hls->sequence = g_get_real_time () / G_USEC_PER_SEC;
+
+  return hls;
+}
+
+static void
+hls_free (GstRTSPHls *hls)
+{
+  g_queue_clear_full (&hls->segments, (GDestroyNotify) hls_segment_free);
+  if (hls->current)
+    hls_segment_free (hls->current);
+  g_byte_array_unref (hls->parameter_sets);
+  g_mutex_clear (&hls->lock);
+  g_free (hls->path);
+  g_free (hls);
+}
+
+GstRTSPHls *
+hls_acquire (const gchar *path)
+{
+  GstRTSPHls *hls;
+
+  g_mutex_lock (&hls_registry.lock);
+
+  hls = g_hash_table_lookup (hls_registry.streams, path);
+  if (hls)
+  {
+    hls->ref_count++;
+  }
+  else
+  {
+    hls = hls_new (path);
+    g_hash_table_insert (hls_registry.streams, hls->path, hls);
+  }
+
+  g_mutex_unlock (&hls_registry.lock);
+
+  return hls;
+}
+
+GstRTSPHls *
+hls_lookup (const gchar *path)
+{
+  GstRTSPHls *hls;
+
+  if (!hls_registry.enabled)
+    return NULL;
+
+  g_mutex_lock (&hls_registry.lock);
+  hls = g_hash_table_lookup (hls_registry.streams, path);
+  if (hls)
+    hls->ref_count++;
+  g_mutex_unlock (&hls_registry.lock);
+
+  return hls;
+}
+
+void
+hls_release (GstRTSPHls *hls)
+{
+  gboolean last;
+
+  g_mutex_lock (&hls_registry.lock);
+  last = --hls->ref_count == 0;
+  if (last)
+    g_hash_table_remove (hls_registry.streams, hls->path);
+  g_mutex_unlock (&hls_registry.lock);
+
+  if (last)
+    hls_free (hls);
+}
+
+static guint32
+hls_crc32 (const guint8 *data, gsize size)
+{
+  guint32 crc = 0xffffffff;
+  gsize i;
+  guint j;
+
+  for (i = 0; i < size; i++)
+  {
+    crc ^= (guint32) data[i] << 24;
+    for (j = 0; j < 8; j++)
+      crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+  }
+
+  return crc;
+}
+
+static void
+hls_ts_section (GByteArray *out, guint16 pid, guint8 *cc, const guint8 *section, gsize size)
+{
+  guint8 packet[HLS_TS_PACKET];
+  guint32 crc;
+
+  memset (packet, 0xff, sizeof (packet));
+  packet[0] = 0x47;
+  packet[1] = 0x40 | ((pid >> 8) & 0x1f);
+  packet[2] = pid & 0xff;
+  packet[3] = 0x10 | (*cc & 0x0f);
+  packet[4] = 0;
+  *cc = (*cc + 1) & 0x0f;
+
+  crc = hls_crc32 (section, size);
+  memcpy (packet + 5, section, size);
+  packet[5 + size] = crc >> 24;
+  packet[6 + size] = crc >> 16;
+  packet[7 + size] = crc >> 8;
+  packet[8 + size] = crc;
+
+  g_byte_array_append (out, packet, sizeof (packet));
+}
+
+static void
+hls_ts_tables (GstRTSPHls *hls, GByteArray *out)
+{
+  const guint8 pat[] = {
+    0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0x00, 0x01, 0xe0 | (HLS_PID_PMT >> 8), HLS_PID_PMT & 0xff
+  };
+  guint8 pmt[32];
+  guint16 pcr_pid = hls->video ? HLS_PID_VIDEO : HLS_PID_AUDIO;
+  gsize size = 0;
+
+  pmt[size++] = 0x02;
+  pmt[size++] = 0xb0;
+  pmt[size++] = 0x00;
+  pmt[size++] = 0x00;
+  pmt[size++] = 0x01;
+  pmt[size++] = 0xc1;
+  pmt[size++] = 0x00;
+  pmt[size++] = 0x00;
+  pmt[size++] = 0xe0 | (pcr_pid >> 8);
+  pmt[size++] = pcr_pid & 0xff;
+  pmt[size++] = 0xf0;
+  pmt[size++] = 0x00;
+
+  if (hls->video)
+  {
+    pmt[size++] = 0x1b;
+    pmt[size++] = 0xe0 | (HLS_PID_VIDEO >> 8);
+    pmt[size++] = HLS_PID_VIDEO & 0xff;
+    pmt[size++] = 0xf0;
+    pmt[size++] = 0x00;
+  }
+
+  if (hls->audio)
+  {
+    pmt[size++] = 0x0f;
+    pmt[size++] = 0xe0 | (HLS_PID_AUDIO >> 8);
+    pmt[size++] = HLS_PID_AUDIO & 0xff;
+    pmt[size++] = 0xf0;
+    pmt[size++] = 0x00;
+  }
+
+  pmt[2] = size - 3 + 4;
+
+  hls_ts_section (out, HLS_PID_PAT, &hls->cc_pat, pat, sizeof (pat));
+  hls_ts_section (out, HLS_PID_PMT, &hls->cc_pmt, pmt, size);
+}
+
+static void
+hls_ts_packetize (GByteArray *out, guint16 pid, guint8 *cc, gint64 pcr, gboolean random_access,
+    const guint8 *data, gsize size)
+{
+  gsize position = 0;
+
+  while (position < size)
+  {
+    guint8 packet[HLS_TS_PACKET];
+    gboolean first = position == 0;
+    gsize field = 0, payload, i = 4;
+    guint8 flags = 0;
+
+    if (first && pcr >= 0)
+    {
+      flags |= 0x10;
+      field = 8;
+    }
+    if (first && random_access)
+    {
+      flags |= 0x40;
+      field = MAX (field, 2);
+    }
+
+    /* the last packet of a pes is padded with adaptation field stuffing */
+    payload = MIN (size - position, HLS_TS_PAYLOAD - field);
+    field = HLS_TS_PAYLOAD - payload;
+
+    packet[0] = 0x47;
+    packet[1] = (first ? 0x40 : 0x00) | ((pid >> 8) & 0x1f);
+    packet[2] = pid & 0xff;
+    packet[3] = (field ? 0x30 : 0x10) | (*cc & 0x0f);
+    *cc = (*cc + 1) & 0x0f;
+
+    if (field)
+    {
+      packet[i++] = field - 1;
+
+      if (field > 1)
+      {
+        packet[i++] = flags;
+
+        if (flags & 0x10)
+        {
+          guint64 base = pcr / 300;
+          guint extension = pcr % 300;
+
+          packet[i++] = base >> 25;
+          packet[i++] = base >> 17;
+          packet[i++] = base >> 9;
+          packet[i++] = base >> 1;
+          packet[i++] = ((base & 1) << 7) | 0x7e | (extension >> 8);
+          packet[i++] = extension;
+        }
+
+        memset (packet + i, 0xff, 4 + field - i);
+        i = 4 + field;
+      }
+    }
+
+    memcpy (packet + i, data + position, payload);
+    position += payload;
+
+    g_byte_array_append (out, packet, sizeof (packet));
+  }
+}
+
+static guint64
+hls_ts_time (GstClockTime time)
+{
+  return (gst_util_uint64_scale (time, 90000, GST_SECOND) + HLS_TS_OFFSET) & HLS_TS_MASK;
+}
+
+static gint64
+hls_ts_pcr (guint64 dts)
+{
+  return (gint64) ((dts - HLS_PCR_DELAY) & HLS_TS_MASK) * 300;
+}
+
+static void
+hls_pes_time (guint8 *p, guint8 prefix, guint64 time)
+{
+  p[0] = (prefix << 4) | (((time >> 30) & 0x07) << 1) | 1;
+  p[1] = time >> 22;
+  p[2] = (((time >> 15) & 0x7f) << 1) | 1;
+  p[3] = time >> 7;
+  p[4] = ((time & 0x7f) << 1) | 1;
+}
+
+static void
+hls_pes_header (GByteArray *pes, guint8 stream_id, gsize payload, guint64 pts, guint64 dts)
+{
+  gboolean has_dts = dts != pts;
+  guint8 header[19];
+  gsize length;
+
+  length = 3 + (has_dts ? 10 : 5) + payload;
+
+  /* video pes are unbounded, audio ones are small enough to say */
+  if (stream_id == 0xe0 || length > 0xffff)
+    length = 0;
+
+  header[0] = 0x00;
+  header[1] = 0x00;
+  header[2] = 0x01;
+  header[3] = stream_id;
+  header[4] = length >> 8;
+  header[5] = length & 0xff;
+  header[6] = 0x80;
+  header[7] = has_dts ? 0xc0 : 0x80;
+  header[8] = has_dts ? 10 : 5;
+
+  hls_pes_time (header + 9, has_dts ? 0x03 : 0x02, pts);
+  if (has_dts)
+    hls_pes_time (header + 14, 0x01, dts);
+
+  g_byte_array_append (pes, header, 9 + header[8]);
+}
+
+static gsize
+hls_find_start_code (const guint8 *data, gsize size, gsize from)
+{
+  gsize i;
+
+  for (i = from; i + 3 <= size; i++)
+  {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+      return i;
+  }
+
+  return size;
+}
+
+static void
+hls_h264_foreach (GstRTSPHls *hls, const guint8 *data, gsize size, HlsNalFunc func, GstRTSPHlsFrame *frame)
+{
+  gsize position = 0, next;
+
+  /* avc has length prefixes, byte-stream start codes */
+  if (hls->nal_length > 0)
+  {
+    while (position + hls->nal_length <= size)
+    {
+      gsize length = 0;
+      guint i;
+
+      for (i = 0; i < hls->nal_length; i++)
+        length = (length << 8) | data[position + i];
+      position += hls->nal_length;
+
+      if (length > size - position)
+        break;
+
+      func (data + position, length, frame);
+      position += length;
+    }
+
+    return;
+  }
+
+  next = hls_find_start_code (data, size, 0);
+
+  while (next < size)
+  {
+    gsize start = next + 3, end;
+
+    next = hls_find_start_code (data, size, start);
+    end = next;
+
+    /* the zero of a four byte start code is not part of the nal */
+    while (next < size && end > start && data[end - 1] == 0)
+      end--;
+
+    func (data + start, end - start, frame);
+  }
+}
+
+static void
+hls_h264_scan (const guint8 *nal, gsize size, GstRTSPHlsFrame *frame)
+{
+  guint type = size > 0 ? nal[0] & 0x1f : 0;
+
+  if (type != 7 && type != 8)
+    return;
+
+  /* parameter sets sent in-band replace the ones from the caps */
+  if (!frame->parameters)
+  {
+    g_byte_array_set_size (frame->hls->parameter_sets, 0);
+    frame->parameters = TRUE;
+  }
+
+  g_byte_array_append (frame->hls->parameter_sets, hls_start_code, sizeof (hls_start_code));
+  g_byte_array_append (frame->hls->parameter_sets, nal, size);
+}
+
+static void
+hls_h264_write (const guint8 *nal, gsize size, GstRTSPHlsFrame *frame)
+{
+  if (size == 0 || (nal[0] & 0x1f) == 9)
+    return;
+
+  g_byte_array_append (frame->pes, hls_start_code, sizeof (hls_start_code));
+  g_byte_array_append (frame->pes, nal, size);
+}
+
+static void
+hls_write_video (GstRTSPHls *hls, GByteArray *out, GstBuffer *buffer, const guint8 *data, gsize size, gboolean keyframe)
+{
+  GstRTSPHlsFrame frame = { hls, NULL, FALSE };
+  GstClockTime pts, dts;
+
+  dts = GST_BUFFER_DTS_OR_PTS (buffer);
+  pts = GST_BUFFER_PTS_IS_VALID (buffer) ? GST_BUFFER_PTS (buffer) : dts;
+
+  frame.pes = g_byte_array_sized_new (size + 64);
+
+  hls_h264_foreach (hls, data, size, hls_h264_scan, &frame);
+
+  hls_pes_header (frame.pes, 0xe0, 0, hls_ts_time (pts), hls_ts_time (dts));
+
+  /* every access unit is delimited, every keyframe can be decoded from
+   * where a segment or part starts */
+  g_byte_array_append (frame.pes, hls_aud, sizeof (hls_aud));
+  if (keyframe && !frame.parameters)
+    g_byte_array_append (frame.pes, hls->parameter_sets->data, hls->parameter_sets->len);
+
+  hls_h264_foreach (hls, data, size, hls_h264_write, &frame);
+
+  hls_ts_packetize (out, HLS_PID_VIDEO, &hls->cc_video, hls_ts_pcr (hls_ts_time (dts)), keyframe,
+      frame.pes->data, frame.pes->len);
+
+  g_byte_array_unref (frame.pes);
+}
+
+static void
+hls_write_audio (GstRTSPHls *hls, GByteArray *out, GstBuffer *buffer, const guint8 *data, gsize size)
+{
+  GByteArray *pes;
+  guint64 pts;
+
+  pts = hls_ts_time (GST_BUFFER_DTS_OR_PTS (buffer));
+
+  pes = g_byte_array_sized_new (size + 32);
+
+  hls_pes_header (pes, 0xc0, size + (hls->adts ? 0 : 7), pts, pts);
+
+  if (!hls->adts)
+  {
+    gsize length = size + 7;
+    guint8 header[7];
+
+    header[0] = 0xff;
+    header[1] = 0xf1;
+    header[2] = ((hls->aac_profile - 1) << 6) | (hls->aac_rate << 2) | (hls->aac_channels >> 2);
+    header[3] = ((hls->aac_channels & 0x03) << 6) | (length >> 11);
+    header[4] = length >> 3;
+    header[5] = ((length & 0x07) << 5) | 0x1f;
+    header[6] = 0xfc;
+
+    g_byte_array_append (pes, header, sizeof (header));
+  }
+
+  g_byte_array_append (pes, data, size);
+
+  /* without video the audio carries the clock */
+  hls_ts_packetize (out, HLS_PID_AUDIO, &hls->cc_audio, hls->video ? -1 : hls_ts_pcr (pts), FALSE,
+      pes->data, pes->len);
+
+  g_byte_array_unref (pes);
+}
+
+static void
+hls_set_caps (GstRTSPHls *hls, guint track, GstCaps *caps)
+{
+  const GstStructure *structure = gst_caps_get_structure (caps, 0);
+  const GValue *value;
+  GstBuffer *codec_data = NULL;
+  GstMapInfo map;
+  gint mpegversion = 0;
+
+  value = gst_structure_get_value (structure, "codec_data");
+  if (value && G_VALUE_HOLDS (value, GST_TYPE_BUFFER))
+    codec_data = gst_value_get_buffer (value);
+
+  g_mutex_lock (&hls->lock);
+
+  if (track == 0)
+  {
+    hls->video = gst_structure_has_name (structure, "video/x-h264");
+    hls->nal_length = 0;
+
+    /* the avc header has the length size and the parameter sets */
+    if (hls->video && codec_data && gst_buffer_map (codec_data, &map, GST_MAP_READ))
+    {
+      gsize position = 6;
+      guint count, i, j;
+
+      if (map.size > 6)
+      {
+        hls->nal_length = (map.data[4] & 0x03) + 1;
+        g_byte_array_set_size (hls->parameter_sets, 0);
+
+        for (j = 0; j < 2 && position < map.size; j++)
+        {
+          count = j == 0 ? map.data[5] & 0x1f : map.data[position++];
+
+          for (i = 0; i < count && position + 2 <= map.size; i++)
+          {
+            gsize length = (map.data[position] << 8) | map.data[position + 1];
+
+            position += 2;
+            if (position + length > map.size)
+              break;
+
+            g_byte_array_append (hls->parameter_sets, hls_start_code, sizeof (hls_start_code));
+            g_byte_array_append (hls->parameter_sets, map.data + position, length);
+            position += length;
+          }
+        }
+      }
+
+      gst_buffer_unmap (codec_data, &map);
+    }
+
+    if (!hls->video)
+      g_print ("rtmp2rtsp: %s: hls only carries h.264 video\n", hls->path);
+  }
+  else
+  {
+    hls->audio = gst_structure_has_name (structure, "audio/mpeg") &&
+        gst_structure_get_int (structure, "mpegversion", &mpegversion) && mpegversion != 1;
+    hls->adts = g_strcmp0 (gst_structure_get_string (structure, "stream-format"), "adts") == 0;
+
+    /* raw aac gets its adts headers from the audio specific config */
+    if (hls->audio && !hls->adts)
+    {
+      hls->audio = codec_data && gst_buffer_map (codec_data, &map, GST_MAP_READ);
+      if (hls->audio)
+      {
+        hls->audio = map.size >= 2;
+        if (hls->audio)
+        {
+          hls->aac_profile = MAX (map.data[0] >> 3, 1);
+          hls->aac_rate = ((map.data[0] & 0x07) << 1) | (map.data[1] >> 7);
+          hls->aac_channels = (map.data[1] >> 3) & 0x0f;
+        }
+        gst_buffer_unmap (codec_data, &map);
+      }
+    }
+
+    if (!hls->audio)
+      g_print ("rtmp2rtsp: %s: hls only carries aac audio\n", hls->path);
+  }
+
+  g_mutex_unlock (&hls->lock);
+}
+
+static void
+hls_close_part (GstRTSPHls *hls, GstClockTime time)
+{
+  GstRTSPHlsSegment *segment = hls->current;
+  GstRTSPHlsPart part;
+
+  part.offset = hls->part_offset;
+  part.size = segment->data->len - hls->part_offset;
+  part.duration = time > hls->part_start ? time - hls->part_start : 0;
+  part.independent = hls->part_independent;
+  g_array_append_val (segment->parts, part);
+
+  hls->part_offset = segment->data->len;
+  hls->part_start = time;
+}
+
+static void
+hls_close_segment (GstRTSPHls *hls, GstClockTime time)
+{
+  GstRTSPHlsSegment *segment = hls->current;
+
+  if (hls_registry.part && segment->data->len > hls->part_offset)
+    hls_close_part (hls, time);
+
+  segment->duration = time > segment->start ? time - segment->start : 0;
+  segment->bytes = g_byte_array_free_to_bytes (segment->data);
+  segment->data = NULL;
+
+  hls->max_duration = MAX (hls->max_duration, segment->duration);
+  hls->current = NULL;
+
+  g_queue_push_tail (&hls->segments, segment);
+
+  while (hls->segments.length > HLS_SEGMENTS)
+  {
+    segment = g_queue_pop_head (&hls->segments);
+    if (segment->discontinuity)
+      hls->discontinuity_sequence++;
+    hls_segment_free (segment);
+  }
+}
+
+static void
+hls_open_segment (GstRTSPHls *hls, GstClockTime time)
+{
+  GstRTSPHlsSegment *segment;
+
+  segment = g_new0 (GstRTSPHlsSegment, 1);
+  segment->sequence = hls->sequence++;
+  segment->start = time;
+  segment->discontinuity = hls->discontinuity;
+  segment->data = g_byte_array_sized_new (HLS_SEGMENT_BYTES);
+  segment->parts = g_array_new (FALSE, FALSE, sizeof (GstRTSPHlsPart));
+
+  hls->discontinuity = FALSE;
+  hls->current = segment;
+  hls->part_start = time;
+  hls->part_offset = 0;
+  hls->part_independent = TRUE;
+
+  hls_ts_tables (hls, segment->data);
+}
+
+static void
+hls_push (GstRTSPHls *hls, guint track, GstBuffer *buffer, const guint8 *data, gsize size)
+{
+  GstClockTime time = GST_BUFFER_DTS_OR_PTS (buffer);
+  gboolean keyframe, drives, closed = FALSE, started = FALSE;
+
+  if (!GST_CLOCK_TIME_IS_VALID (time))
+    return;
+
+  g_mutex_lock (&hls->lock);
+
+  if (track == 0 ? !hls->video : !hls->audio)
+  {
+    g_mutex_unlock (&hls->lock);
+    return;
+  }
+
+  /* video cuts segments and parts at its frames, audio only without it */
+  keyframe = track != 0 || !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  drives = track == 0 || !hls->video;
+
+  if (drives)
+  {
+    if (GST_CLOCK_TIME_IS_VALID (hls->last_time) && time < hls->last_time && hls->current)
+    {
+      hls_close_segment (hls, hls->last_time);
+      hls->discontinuity = TRUE;
+      closed = TRUE;
+    }
+    else if (GST_CLOCK_TIME_IS_VALID (hls->last_time) && time > hls->last_time)
+    {
+      hls->interval = time - hls->last_time;
+    }
+
+    hls->last_time = time;
+
+    if (hls->current && keyframe && time >= hls->current->start + hls_registry.segment)
+    {
+      hls_close_segment (hls, time);
+      closed = TRUE;
+    }
+    else if (hls->current && hls_registry.part && hls->current->data->len > hls->part_offset &&
+        time + hls->interval > hls->part_start + hls_registry.part)
+    {
+      /* cut before the frame that would take the part past its target */
+      hls_close_part (hls, time);
+      closed = TRUE;
+      started = TRUE;
+    }
+  }
+
+  if (!hls->current && drives && keyframe)
+  {
+    hls_open_segment (hls, time);
+  }
+  else if (started)
+  {
+    hls->part_independent = drives && keyframe;
+    if (hls->part_independent)
+      hls_ts_tables (hls, hls->current->data);
+  }
+
+  if (hls->current)
+  {
+    if (track == 0)
+      hls_write_video (hls, hls->current->data, buffer, data, size, keyframe);
+    else
+      hls_write_audio (hls, hls->current->data, buffer, data, size);
+  }
+
+  g_mutex_unlock (&hls->lock);
+
+  if (closed)
+    hls_notify (hls);
+}
+
+static GstPadProbeReturn
+hls_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPHls *hls)
+{
+  guint track = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "hls-track"));
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+  {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstMapInfo map;
+
+    if (gst_buffer_map (buffer, &map, GST_MAP_READ))
+    {
+      hls_push (hls, track, buffer, map.data, map.size);
+      gst_buffer_unmap (buffer, &map);
+    }
+  }
+  else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+  {
+    GstCaps *caps;
+
+    gst_event_parse_caps (GST_PAD_PROBE_INFO_EVENT (info), &caps);
+    hls_set_caps (hls, track, caps);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+hls_attach (GstRTSPHls *hls, GstElement *bin)
+{
+  guint i;
+
+  /* a new pipeline for the path restarts the timestamps */
+  g_mutex_lock (&hls->lock);
+  if (hls->current)
+    hls_close_segment (hls, hls->last_time);
+  hls->discontinuity = hls->segments.length > 0;
+  hls->video = FALSE;
+  hls->audio = FALSE;
+  hls->last_time = GST_CLOCK_TIME_NONE;
+  hls->interval = 0;
+  g_mutex_unlock (&hls->lock);
+
+  /* the parsed frames are segmented as they go to the payloaders, there
+   * is no second demuxer or pull */
+  for (i = 0; i < 2; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "src");
+    if (pad)
+    {
+      g_object_set_data (G_OBJECT (pad), "hls-track", GUINT_TO_POINTER (i));
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+          (GstPadProbeCallback) hls_probe, hls, NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+}
+
+gboolean
+hls_is_ready (GstRTSPHls *hls, gint64 sequence, gint64 part)
+{
+  GstRTSPHlsSegment *last;
+  gboolean ready;
+
+  g_mutex_lock (&hls->lock);
+
+  last = g_queue_peek_tail (&hls->segments);
+
+  if (sequence < 0)
+    ready = last || (hls->current && hls->current->parts->len > 0);
+  else if (last && (gint64) last->sequence >= sequence)
+    ready = TRUE;
+  else if (hls->current && (gint64) hls->current->sequence == sequence)
+    ready = part >= 0 && part < hls->current->parts->len;
+  else
+    ready = hls->current && (gint64) hls->current->sequence > sequence;
+
+  g_mutex_unlock (&hls->lock);
+
+  return ready;
+}
+
+gint64
+hls_get_last_sequence (GstRTSPHls *hls)
+{
+  GstRTSPHlsSegment *last;
+  gint64 sequence = -1;
+
+  /* the segment still being cut is in the playlist once it has a part */
+  g_mutex_lock (&hls->lock);
+
+  last = g_queue_peek_tail (&hls->segments);
+
+  if (hls->current && hls->current->parts->len > 0)
+    sequence = hls->current->sequence;
+  else if (last)
+    sequence = last->sequence;
+
+  g_mutex_unlock (&hls->lock);
+
+  return sequence;
+}
+
+static void
+hls_append_seconds (GString *playlist, GstClockTime time)
+{
+  guint64 ms = time / GST_MSECOND;
+
+  /* no printf of doubles, the locale may want a comma */
+  g_string_append_printf (playlist, "%" G_GUINT64_FORMAT ".%03u", ms / 1000, (guint) (ms % 1000));
+}
+
+static void
+hls_append_parts (GString *playlist, GstRTSPHlsSegment *segment)
+{
+  guint i;
+
+  for (i = 0; i < segment->parts->len; i++)
+  {
+    GstRTSPHlsPart *part = &g_array_index (segment->parts, GstRTSPHlsPart, i);
+
+    g_string_append (playlist, "#EXT-X-PART:DURATION=");
+    hls_append_seconds (playlist, part->duration);
+    g_string_append_printf (playlist, ",URI=\"%" G_GUINT64_FORMAT ".%u.ts\"%s\n",
+        segment->sequence, i, part->independent ? ",INDEPENDENT=YES" : "");
+  }
+}
+
+static guint
+hls_target (GstRTSPHls *hls)
+{
+  GstClockTime target = MAX (hls->max_duration, hls_registry.segment);
+
+  return (target + GST_SECOND - 1) / GST_SECOND;
+}
+
+gchar *
+hls_get_playlist (GstRTSPHls *hls)
+{
+  GString *playlist;
+  GList *item;
+  guint index = 0, skip;
+  guint64 sequence;
+
+  playlist = g_string_new ("#EXTM3U\n#EXT-X-VERSION:6\n");
+
+  g_mutex_lock (&hls->lock);
+
+  skip = hls->segments.length > HLS_PLAYLIST_SEGMENTS ? hls->segments.length - HLS_PLAYLIST_SEGMENTS : 0;
+  item = g_queue_peek_nth_link (&hls->segments, skip);
+  sequence = item ? ((GstRTSPHlsSegment *) item->data)->sequence : hls->current ? hls->current->sequence : hls->sequence;
+
+  g_string_append_printf (playlist, "#EXT-X-TARGETDURATION:%u\n", hls_target (hls));
+  g_string_append_printf (playlist, "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT "\n", sequence);
+  if (hls->discontinuity_sequence > 0)
+    g_string_append_printf (playlist, "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n", hls->discontinuity_sequence);
+
+  if (hls_registry.part)
+  {
+    g_string_append (playlist, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=");
+    hls_append_seconds (playlist, 3 * hls_registry.part);
+    g_string_append (playlist, "\n#EXT-X-PART-INF:PART-TARGET=");
+    hls_append_seconds (playlist, hls_registry.part);
+    g_string_append (playlist, "\n");
+  }
+
+  if (hls->video)
+    g_string_append (playlist, "#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+  for (; item; item = g_list_next (item), index++)
+  {
+    GstRTSPHlsSegment *segment = item->data;
+
+    if (segment->discontinuity)
+      g_string_append (playlist, "#EXT-X-DISCONTINUITY\n");
+
+    /* parts are only listed close to the live edge */
+    if (hls_registry.part && index + HLS_PART_SEGMENTS >= hls->segments.length - skip)
+      hls_append_parts (playlist, segment);
+
+    g_string_append (playlist, "#EXTINF:");
+    hls_append_seconds (playlist, segment->duration);
+    g_string_append_printf (playlist, ",\n%" G_GUINT64_FORMAT ".ts\n", segment->sequence);
+  }
+
+  if (hls_registry.part && hls->current)
+  {
+    if (hls->current->discontinuity)
+      g_string_append (playlist, "#EXT-X-DISCONTINUITY\n");
+    hls_append_parts (playlist, hls->current);
+  }
+
+  g_mutex_unlock (&hls->lock);
+
+  return g_string_free (playlist, FALSE);
+}
+
+GBytes *
+hls_get_segment (GstRTSPHls *hls, guint64 sequence, gint part)
+{
+  GstRTSPHlsSegment *segment = NULL;
+  GstRTSPHlsPart *range;
+  GBytes *bytes = NULL;
+  GList *item;
+
+  g_mutex_lock (&hls->lock);
+
+  for (item = hls->segments.head; item && !segment; item = g_list_next (item))
+  {
+    if (((GstRTSPHlsSegment *) item->data)->sequence == sequence)
+      segment = item->data;
+  }
+
+  if (!segment && hls->current && hls->current->sequence == sequence)
+    segment = hls->current;
+
+  if (segment && part < 0)
+  {
+    /* a segment is only served whole once it is closed */
+    if (segment->bytes)
+      bytes = g_bytes_ref (segment->bytes);
+  }
+  else if (segment && part < (gint) segment->parts->len)
+  {
+    range = &g_array_index (segment->parts, GstRTSPHlsPart, part);
+
+    /* closed segments share their memory, the open one is still growing */
+    if (segment->bytes)
+      bytes = g_bytes_new_from_bytes (segment->bytes, range->offset, range->size);
+    else
+      bytes = g_bytes_new (segment->data->data + range->offset, range->size);
+  }
+
+  g_mutex_unlock (&hls->lock);
+
+  return bytes;
+}
+
+guint
+hls_get_target_duration (GstRTSPHls *hls)
+{
+  guint target;
+
+  g_mutex_lock (&hls->lock);
+  target = hls_target (hls);
+  g_mutex_unlock (&hls->lock);
+
+  return target;
+}
+
+void
+json_builder_hls_value (JsonBuilder *builder, GstRTSPHls *hls)
+{
+  gchar *playlist;
+
+  playlist = g_strdup_printf ("/hls%s/index.m3u8", hls->path);
+
+  json_builder_set_member_name (builder, "hls");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "playlist");
+  json_builder_add_string_value (builder, playlist);
+  json_builder_set_member_name (builder, "segment_ms");
+  json_builder_add_int_value (builder, hls_registry.segment / GST_MSECOND);
+  json_builder_set_member_name (builder, "part_ms");
+  json_builder_add_int_value (builder, hls_registry.part / GST_MSECOND);
+
+  json_builder_end_object (builder);
+
+  g_free (playlist);
+}
@@ -0,0 +1,37 @@
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+#define HLS_SEGMENT_MS 2000
+#define HLS_PART_MS 500
+#define HLS_START_TIMEOUT_S 10
+
+typedef struct _GstRTSPHls GstRTSPHls;
+
+typedef void (*HlsNotify) (const gchar *path, gpointer data);
+
+void hls_init (guint segment_ms, guint part_ms);
+gboolean hls_enabled ();
+
+void hls_set_notify (HlsNotify notify, gpointer data);
+
+GstRTSPHls *hls_acquire (const gchar *path);
+GstRTSPHls *hls_lookup (const gchar *path);
+void hls_release (GstRTSPHls *hls);
+
+void hls_attach (GstRTSPHls *hls, GstElement *bin);
+
+gboolean hls_is_ready (GstRTSPHls *hls, gint64 sequence, gint64 part);
+gint64 hls_get_last_sequence (GstRTSPHls *hls);
+gchar *hls_get_playlist (GstRTSPHls *hls);
+GBytes *hls_get_segment (GstRTSPHls *hls, guint64 sequence, gint part);
+guint hls_get_target_duration (GstRTSPHls *hls);
+
+void json_builder_hls_value (JsonBuilder *builder, GstRTSPHls *hls);
+
+#endif
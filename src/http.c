@@ -3,6 +3,15 @@
 
 #include "rtsp.h"
 #include "http.h"
+#include "taskpool.h"
+#include "metrics.h"
+#include "events.h"
+#include "batch.h"
+#include "slab.h"
+#include "shard.h"
+#include "hls.h"
+#include "whep.h"
+#include "thumbnail.h"
 
 #include <libsoup/soup.h>
 
@@ -11,19 +20,130 @@ typedef struct _SoupOpaque SoupOpaque;
 struct _SoupOpaque
 {
   GstRTSPMediaTable *media_table;
+  GstRTSPServer *rtsp_server;
   gchar *host;
   gchar *port;
+  GMainContext *context;
+  GMainLoop *loop;
+  GList *waiters;
+  GList *hls_waiters;
+  gint hls_waiting;
+  GList *whep_waiters;
+  GList *snapshot_waiters;
+  SoupSession *session;
+};
+
+typedef struct _SoupWaiter SoupWaiter;
+
+struct _SoupWaiter
+{
+  SoupServer *server;
+  SoupMessage *msg;
+  guint64 cursor;
+  GSource *timeout;
+};
+
+typedef struct _SoupHlsWaiter SoupHlsWaiter;
+
+struct _SoupHlsWaiter
+{
+  SoupServer *server;
+  SoupMessage *msg;
+  gchar *path;
+  gint64 sequence;
+  gint64 part;
+  GSource *timeout;
+};
+
+typedef struct _SoupWhepWaiter SoupWhepWaiter;
+
+struct _SoupWhepWaiter
+{
+  SoupServer *server;
+  SoupMessage *msg;
+  gchar *path;
+  gchar *id;
+  GSource *timeout;
+};
+
+typedef struct _SoupWhepWake SoupWhepWake;
+
+struct _SoupWhepWake
+{
+  SoupServer *server;
+  gchar *id;
+};
+
+typedef struct _SoupSnapshotWaiter SoupSnapshotWaiter;
+
+struct _SoupSnapshotWaiter
+{
+  SoupServer *server;
+  SoupMessage *msg;
+  GstRTSPThumbnail *thumbnail;
+  GSource *timeout;
+};
+
+typedef struct _SoupSnapshotWake SoupSnapshotWake;
+
+struct _SoupSnapshotWake
+{
+  SoupServer *server;
+  gchar *path;
+};
+
+typedef struct _SoupShardsRequest SoupShardsRequest;
+
+typedef void (*SoupShardsFunc) (SoupShardsRequest *request, SoupMessage *forward);
+
+struct _SoupShardsRequest
+{
+  SoupServer *server;
+  SoupMessage *msg;
+  SoupMessage **replies;
+  guint count;
+  guint pending;
+  SoupShardsFunc func;
+  gpointer data;
+  GDestroyNotify notify;
+};
+
+typedef struct _SoupShardForward SoupShardForward;
+
+struct _SoupShardForward
+{
+  SoupServer *server;
+  SoupMessage *msg;
+};
+
+typedef struct _SoupShardsStreams SoupShardsStreams;
+
+struct _SoupShardsStreams
+{
+  guint offset;
+  guint limit;
+};
+
+typedef struct _SoupHlsWake SoupHlsWake;
+
+struct _SoupHlsWake
+{
+  SoupServer *server;
+  gchar *path;
 };
 
 static SoupOpaque *
-soup_opaque_new (GstRTSPMediaTable *media_table, const gchar* host, const gchar *port)
+soup_opaque_new (GstRTSPMediaTable *media_table, GstRTSPServer *rtsp_server, const gchar* host, const gchar *port)
 {
   SoupOpaque *opaque;
 
   opaque = g_new0 (SoupOpaque, 1);
   opaque->media_table = media_table;
+  opaque->rtsp_server = rtsp_server;
   opaque->host = g_strdup (host);
   opaque->port = g_strdup (port);
+  opaque->context = g_main_context_new ();
+  opaque->loop = g_main_loop_new (opaque->context, FALSE);
 
   return opaque;
 }
@@ -33,37 +153,120 @@ soup_opaque_free (SoupOpaque *opaque)
 {
   g_free (opaque->host);
   g_free (opaque->port);
+  if (opaque->session)
+    g_object_unref (opaque->session);
+  g_main_loop_unref (opaque->loop);
+  g_main_context_unref (opaque->context);
   g_free (opaque);
 }
 
 static void http_handle (
     SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
     SoupClientContext *context, gpointer data);
+static void http_handle_metrics (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_events (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
 static void http_handle_streams (
     SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
     SoupClientContext *context, gpointer data);
 static void http_handle_streams_get (
     SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
     SoupClientContext *context, gpointer data);
+static void http_handle_streams_post (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_publish (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_stats (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_stats_get (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_workers (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_workers_get (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_hls (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_whep (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+static void http_handle_snapshot (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data);
+
+static gpointer http_thread (SoupOpaque *opaque);
+static void http_events_notify (SoupServer *server);
+static void http_hls_notify (const gchar *path, SoupServer *server);
+static void http_whep_notify (const gchar *id, SoupServer *server);
+static void http_snapshot_notify (const gchar *path, SoupServer *server);
 
 void
-http_init (GstRTSPMediaTable *media_table, const gchar *host, const gchar *port)
+http_init (GstRTSPMediaTable *media_table, GstRTSPServer *rtsp_server, const gchar *host, const gchar *port)
 {
   SoupOpaque *opaque;
+
+  opaque = soup_opaque_new (media_table, rtsp_server, host, port);
+
+  g_thread_unref (g_thread_new ("http", (GThreadFunc) http_thread, opaque));
+}
+
+static gpointer
+http_thread (SoupOpaque *opaque)
+{
   SoupServer *server;
   GError *error = NULL;
 
-  opaque = soup_opaque_new (media_table, host, port);
+  /* the server picks up the thread-default context on listen, so the api
+   * is served here and never competes with rtsp signalling */
+  g_main_context_push_thread_default (opaque->context);
 
   server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "simple-httpd ", NULL);
 
   g_object_set_data_full (G_OBJECT (server), "opaque", opaque, (GDestroyNotify) soup_opaque_free);
 
-  soup_server_listen_all (server, atoi(port), 0, &error);
+  soup_server_listen_all (server, atoi(opaque->port), 0, &error);
 
   soup_server_add_handler (server, NULL, http_handle, NULL, NULL);
 
-  g_print ("rtmp2rtsp: run http at %s:%s\n", host, port);
+  /* the supervisor only answers from what its shards report */
+  if (shard_is_supervisor ())
+    opaque->session = soup_session_new_with_options (SOUP_SESSION_TIMEOUT, 2, NULL);
+
+  events_set_notify ((EventsNotify) http_events_notify, server);
+
+  if (hls_enabled ())
+    hls_set_notify ((HlsNotify) http_hls_notify, server);
+
+  if (whep_enabled ())
+    whep_set_notify ((WhepNotify) http_whep_notify, server);
+
+  if (thumbnail_enabled ())
+    thumbnail_set_notify ((ThumbnailNotify) http_snapshot_notify, server);
+
+  g_print ("rtmp2rtsp: run http at %s:%s\n", opaque->host, opaque->port);
+
+  g_main_loop_run (opaque->loop);
+
+  g_main_context_pop_thread_default (opaque->context);
+
+  g_object_unref (server);
+
+  return NULL;
+}
+
+static void
+http_request_finished (SoupMessage *msg, gint64 *start)
+{
+  metrics_observe (METRICS_HTTP_REQUEST, g_get_monotonic_time () - *start);
 }
 
 static void
@@ -71,11 +274,196 @@ http_handle (
     SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
     SoupClientContext *context, gpointer data)
 {
-  if (g_strcmp0 (path, "/api/v1/streams") == 0) {
+  gint64 *start;
+
+  start = g_new (gint64, 1);
+  *start = g_get_monotonic_time ();
+
+  if (g_strcmp0 (path, "/metrics") == 0) {
+    http_handle_metrics (server, msg, path, query, context, data);
+  } else if (g_strcmp0 (path, "/api/v1/events") == 0) {
+    http_handle_events (server, msg, path, query, context, data);
+  } else if (g_strcmp0 (path, "/api/v1/streams") == 0) {
     http_handle_streams (server, msg, path, query, context, data);
+  } else if (g_str_has_prefix (path, "/api/v1/streams/")) {
+    http_handle_snapshot (server, msg, path, query, context, data);
+  } else if (g_strcmp0 (path, "/api/v1/publish") == 0) {
+    http_handle_publish (server, msg, path, query, context, data);
+  } else if (g_strcmp0 (path, "/api/v1/stats") == 0) {
+    http_handle_stats (server, msg, path, query, context, data);
+  } else if (g_strcmp0 (path, "/api/v1/workers") == 0) {
+    http_handle_workers (server, msg, path, query, context, data);
+  } else if (g_str_has_prefix (path, "/hls/")) {
+    http_handle_hls (server, msg, path, query, context, data);
+  } else if (g_str_has_prefix (path, "/whep/")) {
+    http_handle_whep (server, msg, path, query, context, data);
   } else {
     soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
   }
+
+  /* paused handlers answer later, the request is timed until its response
+   * is out; a parked event poll only measures its own timeout */
+  if (g_strcmp0 (path, "/api/v1/events") == 0 && msg->status_code == SOUP_STATUS_NONE)
+    g_free (start);
+  else
+    g_signal_connect_data (msg, "finished", (GCallback) http_request_finished, start, (GClosureNotify) g_free, 0);
+}
+
+static void
+http_waiter_free (SoupWaiter *waiter)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (waiter->server), "opaque");
+
+  opaque->waiters = g_list_remove (opaque->waiters, waiter);
+
+  g_source_destroy (waiter->timeout);
+  g_source_unref (waiter->timeout);
+  g_free (waiter);
+}
+
+static void
+http_waiter_respond (SoupWaiter *waiter, gchar *body)
+{
+  SoupServer *server = waiter->server;
+  SoupMessage *msg = waiter->msg;
+
+  g_signal_handlers_disconnect_by_data (msg, waiter);
+  http_waiter_free (waiter);
+
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_server_unpause_message (server, msg);
+}
+
+static gboolean
+http_waiter_timeout (SoupWaiter *waiter)
+{
+  gboolean empty;
+
+  http_waiter_respond (waiter, events_to_body (waiter->cursor, &empty));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_waiter_finished (SoupMessage *msg, SoupWaiter *waiter)
+{
+  http_waiter_free (waiter);
+}
+
+static gboolean
+http_events_wake (SoupServer *server)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GList *waiters, *item;
+  gboolean empty;
+  gchar *body;
+
+  waiters = g_list_copy (opaque->waiters);
+
+  for (item = waiters; item; item = g_list_next (item))
+  {
+    SoupWaiter *waiter = item->data;
+
+    body = events_to_body (waiter->cursor, &empty);
+
+    if (empty)
+      g_free (body);
+    else
+      http_waiter_respond (waiter, body);
+  }
+
+  g_list_free (waiters);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_events_notify (SoupServer *server)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+
+  /* events are pushed from rtsp and streaming threads, waiters live in
+   * the http context */
+  g_main_context_invoke (opaque->context, (GSourceFunc) http_events_wake, server);
+}
+
+static void
+http_handle_events (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupWaiter *waiter;
+  guint64 cursor = 0;
+  guint timeout = 30;
+  gboolean empty;
+  gchar *body;
+
+  if (g_strcmp0 (msg->method, "GET") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  if (query)
+  {
+    if (g_hash_table_lookup (query, "cursor"))
+      cursor = g_ascii_strtoull (g_hash_table_lookup (query, "cursor"), NULL, 10);
+    if (g_hash_table_lookup (query, "timeout"))
+      timeout = atoi (g_hash_table_lookup (query, "timeout"));
+  }
+
+  body = events_to_body (cursor, &empty);
+
+  if (!empty || timeout == 0)
+  {
+    soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+    return;
+  }
+
+  g_free (body);
+
+  waiter = g_new0 (SoupWaiter, 1);
+  waiter->server = server;
+  waiter->msg = msg;
+  waiter->cursor = cursor;
+  waiter->timeout = g_timeout_source_new_seconds (MIN (timeout, 300));
+  g_source_set_callback (waiter->timeout, (GSourceFunc) http_waiter_timeout, waiter, NULL);
+  g_source_attach (waiter->timeout, opaque->context);
+
+  opaque->waiters = g_list_prepend (opaque->waiters, waiter);
+
+  g_signal_connect (msg, "finished", (GCallback) http_waiter_finished, waiter);
+
+  soup_server_pause_message (server, msg);
+}
+
+static void
+http_handle_metrics (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GString *body;
+  gsize length;
+
+  if (g_strcmp0 (msg->method, "GET") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  body = g_string_new (NULL);
+  metrics_append (body);
+  rtsp_metrics_append (body, opaque->media_table);
+  batch_metrics_append (body);
+  slab_metrics_append (body);
+  length = body->len;
+
+  soup_message_set_response (msg, "text/plain; version=0.0.4", SOUP_MEMORY_TAKE,
+      g_string_free (body, FALSE), length);
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
 }
 
 static void
@@ -85,26 +473,1284 @@ http_handle_streams (
 {
   if (g_strcmp0 (msg->method, "GET") == 0) {
     http_handle_streams_get (server, msg, path, query, context, data);
+  } else if (g_strcmp0 (msg->method, "POST") == 0) {
+    http_handle_streams_post (server, msg, path, query, context, data);
   } else {
     soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
   }
 }
 
 static void
-http_handle_streams_get (
-    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
-    SoupClientContext *context, gpointer data)
+http_shard_forward_finished (SoupMessage *msg, SoupShardForward *forward)
+{
+  /* the client went away, the reply of the shard is dropped */
+  forward->msg = NULL;
+}
+
+static void
+http_shard_forward_reply (SoupSession *session, SoupMessage *reply, SoupShardForward *forward)
+{
+  SoupMessage *msg = forward->msg;
+
+  if (msg)
+  {
+    g_signal_handlers_disconnect_by_data (msg, forward);
+    soup_message_set_status (msg,
+        SOUP_STATUS_IS_TRANSPORT_ERROR (reply->status_code) ? SOUP_STATUS_BAD_GATEWAY : reply->status_code);
+    soup_server_unpause_message (forward->server, msg);
+  }
+
+  g_free (forward);
+}
+
+static gboolean
+http_shard_forward (SoupServer *server, SoupMessage *msg, const gchar *stream_path, const gchar *path, gboolean wait)
 {
   SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
-  JsonBuilder *builder;
-  gchar *body;
+  SoupShardForward *forward;
+  SoupMessage *request;
+  gchar *port, *uri;
 
-  builder = json_builder_new ();
-  json_builder_stream_list (builder, opaque->media_table);
-  body = json_builder_to_body (builder);
-  g_object_unref (builder);
+  port = shard_get_http_port (shard_lookup (stream_path));
+  uri = g_strdup_printf ("http://%s:%s%s", opaque->host, port, path);
+  request = soup_message_new (msg->method, uri);
+  g_free (uri);
+  g_free (port);
 
-  soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+  if (!request)
+    return FALSE;
 
-  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_message_set_request (request,
+      soup_message_headers_get_content_type (msg->request_headers, NULL),
+      SOUP_MEMORY_COPY, msg->request_body->data, msg->request_body->length);
+
+  /* the supervisor keeps serving while the shard answers, a client that
+   * waits for the status is parked until then */
+  if (!wait)
+  {
+    soup_session_queue_message (opaque->session, request, NULL, NULL);
+    return TRUE;
+  }
+
+  forward = g_new0 (SoupShardForward, 1);
+  forward->server = server;
+  forward->msg = msg;
+
+  g_signal_connect (msg, "finished", (GCallback) http_shard_forward_finished, forward);
+  soup_server_pause_message (server, msg);
+
+  soup_session_queue_message (opaque->session, request, (SoupSessionCallback) http_shard_forward_reply, forward);
+
+  return TRUE;
+}
+
+static void
+http_shard_redirect (SoupMessage *msg, const gchar *stream_path, guint status)
+{
+  SoupURI *uri = soup_uri_copy (soup_message_get_uri (msg));
+  gchar *port, *location;
+
+  port = shard_get_http_port (shard_lookup (stream_path));
+  soup_uri_set_port (uri, atoi (port));
+  location = soup_uri_to_string (uri, FALSE);
+  soup_message_set_redirect (msg, status, location);
+  g_free (location);
+  g_free (port);
+  soup_uri_free (uri);
+}
+
+static void
+http_shards_request_free (SoupShardsRequest *request)
+{
+  guint i;
+
+  for (i = 0; i < request->count; i++)
+    if (request->replies[i])
+      g_object_unref (request->replies[i]);
+
+  if (request->notify)
+    request->notify (request->data);
+
+  g_free (request->replies);
+  g_free (request);
+}
+
+static void
+http_shards_finished (SoupMessage *msg, SoupShardsRequest *request)
+{
+  /* the client went away, the replies still in flight are dropped */
+  request->msg = NULL;
+}
+
+static void
+http_shards_respond (SoupShardsRequest *request, guint status)
+{
+  SoupMessage *msg = request->msg;
+
+  g_signal_handlers_disconnect_by_data (msg, request);
+  request->msg = NULL;
+
+  soup_message_set_status (msg, status);
+  soup_server_unpause_message (request->server, msg);
+}
+
+static void
+http_shards_reply (SoupSession *session, SoupMessage *forward, SoupShardsRequest *request)
+{
+  guint i = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (forward), "shard"));
+
+  if (!SOUP_STATUS_IS_TRANSPORT_ERROR (forward->status_code))
+    request->replies[i] = g_object_ref (forward);
+
+  request->pending--;
+
+  /* func may answer on any reply, once all are in it answers anyway */
+  if (request->msg && request->replies[i])
+    request->func (request, forward);
+
+  if (request->msg && request->pending == 0)
+    request->func (request, NULL);
+
+  if (request->pending == 0)
+    http_shards_request_free (request);
+}
+
+static void
+http_shards_queue (
+    SoupServer *server, SoupMessage *msg, const gchar *method, const gchar *path,
+    SoupShardsFunc func, gpointer data, GDestroyNotify notify)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupShardsRequest *request;
+  const gchar *if_none_match;
+  guint i;
+
+  request = g_new0 (SoupShardsRequest, 1);
+  request->server = server;
+  request->msg = msg;
+  request->count = shard_count ();
+  request->replies = g_new0 (SoupMessage *, request->count);
+  request->func = func;
+  request->data = data;
+  request->notify = notify;
+
+  if_none_match = soup_message_headers_get_one (msg->request_headers, "If-None-Match");
+
+  /* the shards are asked in parallel, the http thread keeps serving while
+   * the client message is parked */
+  g_signal_connect (msg, "finished", (GCallback) http_shards_finished, request);
+  soup_server_pause_message (server, msg);
+
+  for (i = 0; i < request->count; i++)
+  {
+    SoupMessage *forward;
+    gchar *port, *uri;
+
+    port = shard_get_http_port (i);
+    uri = g_strdup_printf ("http://%s:%s%s", opaque->host, port, path);
+    forward = soup_message_new (method, uri);
+    g_free (uri);
+    g_free (port);
+
+    if (!forward)
+      continue;
+
+    if (if_none_match)
+      soup_message_headers_replace (forward->request_headers, "If-None-Match", if_none_match);
+
+    g_object_set_data (G_OBJECT (forward), "shard", GUINT_TO_POINTER (i));
+
+    request->pending++;
+    soup_session_queue_message (opaque->session, forward, (SoupSessionCallback) http_shards_reply, request);
+  }
+
+  if (request->pending > 0)
+    return;
+
+  func (request, NULL);
+  http_shards_request_free (request);
+}
+
+static gchar *
+http_shards_streams_body (SoupShardsRequest *request, guint offset, guint limit)
+{
+  GString *body;
+  guint i, j, total = 0, count = 0, up = 0;
+  gint version = 0;
+
+  body = g_string_new ("{\"data\":[");
+
+  /* every stream lives on exactly one shard, so the union is the list */
+  for (i = 0; i < request->count; i++)
+  {
+    SoupMessage *msg = request->replies[i];
+    JsonParser *parser;
+    JsonObject *object;
+    JsonArray *array;
+
+    if (!msg || !SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+      continue;
+
+    parser = json_parser_new ();
+
+    if (json_parser_load_from_data (parser, msg->response_body->data, msg->response_body->length, NULL) &&
+        JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser)))
+    {
+      object = json_node_get_object (json_parser_get_root (parser));
+      array = json_object_has_member (object, "data") ? json_object_get_array_member (object, "data") : NULL;
+
+      if (json_object_has_member (object, "meta"))
+        version += json_object_get_int_member (json_object_get_object_member (object, "meta"), "version");
+
+      for (j = 0; array && j < json_array_get_length (array); j++)
+      {
+        gchar *item;
+
+        if (total++ < offset)
+          continue;
+
+        if (limit > 0 && count >= limit)
+          continue;
+
+        if (count++ > 0)
+          g_string_append_c (body, ',');
+
+        item = json_to_string (json_array_get_element (array, j), FALSE);
+        g_string_append (body, item);
+        g_free (item);
+      }
+
+      up++;
+    }
+
+    g_object_unref (parser);
+  }
+
+  g_string_append_printf (body,
+      "],\"meta\":{\"total\":%u,\"offset\":%u,\"limit\":%u,\"version\":%d,\"shards\":%u,\"shards_up\":%u}}",
+      total, offset, limit, version, request->count, up);
+
+  return g_string_free (body, FALSE);
+}
+
+static void
+http_shards_streams_reply (SoupShardsRequest *request, SoupMessage *forward)
+{
+  SoupShardsStreams *streams = request->data;
+  gchar *body;
+
+  /* the union needs every shard, answer once all are in */
+  if (forward)
+    return;
+
+  body = http_shards_streams_body (request, streams->offset, streams->limit);
+  soup_message_headers_replace (request->msg->response_headers, "Cache-Control", "no-cache");
+  soup_message_set_response (request->msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+  http_shards_respond (request, SOUP_STATUS_OK);
+}
+
+static gboolean
+http_query_get_uint (GHashTable *query, const gchar *name, guint *value)
+{
+  const gchar *string = g_hash_table_lookup (query, name);
+  gchar *end;
+  guint64 parsed;
+
+  if (!string)
+    return TRUE;
+
+  /* strtoull takes a sign and wraps it around, only digits are a count */
+  if (!g_ascii_isdigit (*string))
+    return FALSE;
+
+  parsed = g_ascii_strtoull (string, &end, 10);
+  if (*end != '\0' || parsed > G_MAXUINT)
+    return FALSE;
+
+  *value = parsed;
+
+  return TRUE;
+}
+
+static void
+http_handle_streams_get (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  const gchar *prefix = NULL, *if_none_match;
+  guint offset = 0, limit = 0;
+  gint version;
+  gchar *body, *etag;
+
+  if (query)
+  {
+    prefix = g_hash_table_lookup (query, "prefix");
+
+    if (!http_query_get_uint (query, "offset", &offset) || !http_query_get_uint (query, "limit", &limit))
+    {
+      soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+      return;
+    }
+  }
+
+  if (opaque->session)
+  {
+    SoupShardsStreams *streams;
+    gchar *encoded, *uri;
+
+    streams = g_new0 (SoupShardsStreams, 1);
+    streams->offset = offset;
+    streams->limit = limit;
+
+    encoded = prefix ? soup_form_encode ("prefix", prefix, NULL) : NULL;
+    uri = g_strdup_printf ("/api/v1/streams%s%s", encoded ? "?" : "", encoded ? encoded : "");
+    http_shards_queue (server, msg, "GET", uri, http_shards_streams_reply, streams, g_free);
+    g_free (uri);
+    g_free (encoded);
+    return;
+  }
+
+  if_none_match = soup_message_headers_get_one (msg->request_headers, "If-None-Match");
+
+  version = rtsp_media_table_get_version (opaque->media_table);
+  etag = g_strdup_printf ("\"%d-%u-%u-%u\"", version, offset, limit, prefix ? g_str_hash (prefix) : 0);
+
+  if (g_strcmp0 (if_none_match, etag) == 0)
+  {
+    soup_message_headers_replace (msg->response_headers, "ETag", etag);
+    soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+    g_free (etag);
+    return;
+  }
+
+  g_free (etag);
+
+  body = rtsp_media_table_to_body (opaque->media_table, prefix, offset, limit, &version);
+  etag = g_strdup_printf ("\"%d-%u-%u-%u\"", version, offset, limit, prefix ? g_str_hash (prefix) : 0);
+
+  soup_message_headers_replace (msg->response_headers, "ETag", etag);
+  soup_message_headers_replace (msg->response_headers, "Cache-Control", "no-cache");
+
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+
+  g_free (etag);
+}
+
+static void
+http_handle_streams_post (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  JsonParser *parser;
+  JsonObject *object;
+  const gchar *stream_path = NULL;
+
+  parser = json_parser_new ();
+
+  if (json_parser_load_from_data (parser, msg->request_body->data, msg->request_body->length, NULL) &&
+      JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser)))
+  {
+    object = json_node_get_object (json_parser_get_root (parser));
+    if (json_object_has_member (object, "path"))
+      stream_path = json_object_get_string_member (object, "path");
+  }
+
+  if (opaque->session && stream_path)
+  {
+    if (!http_shard_forward (server, msg, stream_path, path, TRUE))
+      soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+  }
+  else if (opaque->rtsp_server && rtsp_prepull (opaque->rtsp_server, stream_path))
+    soup_message_set_status (msg, SOUP_STATUS_ACCEPTED);
+  else
+    soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+
+  g_object_unref (parser);
+}
+
+static void
+http_handle_publish (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GHashTable *form;
+  gchar *stream_path;
+
+  if (g_strcmp0 (msg->method, "POST") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  /* nginx-rtmp on_publish posts app and name as a form, any 2xx lets the
+   * publisher in, so a failed prepull must not reject it */
+  form = soup_form_decode (msg->request_body->data);
+
+  if (g_hash_table_lookup (form, "app") && g_hash_table_lookup (form, "name") && opaque->rtsp_server)
+  {
+    stream_path = g_strdup_printf ("/%s/%s",
+        (gchar *) g_hash_table_lookup (form, "app"),
+        (gchar *) g_hash_table_lookup (form, "name"));
+    rtsp_prepull (opaque->rtsp_server, stream_path);
+    g_free (stream_path);
+  }
+  else if (g_hash_table_lookup (form, "app") && g_hash_table_lookup (form, "name") && opaque->session)
+  {
+    stream_path = g_strdup_printf ("/%s/%s",
+        (gchar *) g_hash_table_lookup (form, "app"),
+        (gchar *) g_hash_table_lookup (form, "name"));
+    http_shard_forward (server, msg, stream_path, path, FALSE);
+    g_free (stream_path);
+  }
+
+  g_hash_table_destroy (form);
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+http_handle_stats (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  if (g_strcmp0 (msg->method, "GET") == 0) {
+    http_handle_stats_get (server, msg, path, query, context, data);
+  } else {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+  }
+}
+
+static void
+http_handle_stats_get (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  JsonBuilder *builder;
+  gchar *body;
+
+  builder = json_builder_new ();
+  json_builder_stats (builder, opaque->media_table);
+  body = json_builder_to_body (builder);
+  g_object_unref (builder);
+
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+http_handle_workers (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  if (g_strcmp0 (msg->method, "GET") == 0) {
+    http_handle_workers_get (server, msg, path, query, context, data);
+  } else {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+  }
+}
+
+static void
+http_handle_workers_get (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  JsonBuilder *builder;
+  gchar *body;
+
+  builder = json_builder_new ();
+  if (shard_is_supervisor ())
+    json_builder_shards (builder);
+  else
+    json_builder_task_pool (builder);
+  body = json_builder_to_body (builder);
+  g_object_unref (builder);
+
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+http_hls_respond_playlist (SoupMessage *msg, GstRTSPHls *hls, gboolean blocking)
+{
+  gchar *body, *cache_control;
+
+  body = hls_get_playlist (hls);
+
+  /* a blocking reload names the segment it waits for, its answer never
+   * changes, a plain reload goes stale within a part */
+  if (blocking)
+    cache_control = g_strdup_printf ("public, max-age=%u", hls_get_target_duration (hls) * 6);
+  else
+    cache_control = g_strdup ("max-age=1");
+
+  soup_message_headers_replace (msg->response_headers, "Cache-Control", cache_control);
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Origin", "*");
+  soup_message_set_response (msg, "application/vnd.apple.mpegurl", SOUP_MEMORY_TAKE, body, strlen (body));
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+
+  g_free (cache_control);
+}
+
+static void
+http_hls_waiter_free (SoupHlsWaiter *waiter)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (waiter->server), "opaque");
+
+  opaque->hls_waiters = g_list_remove (opaque->hls_waiters, waiter);
+  g_atomic_int_dec_and_test (&opaque->hls_waiting);
+
+  g_source_destroy (waiter->timeout);
+  g_source_unref (waiter->timeout);
+  g_free (waiter->path);
+  g_free (waiter);
+}
+
+static void
+http_hls_waiter_respond (SoupHlsWaiter *waiter, GstRTSPHls *hls, gboolean blocking)
+{
+  SoupServer *server = waiter->server;
+  SoupMessage *msg = waiter->msg;
+
+  g_signal_handlers_disconnect_by_data (msg, waiter);
+  http_hls_waiter_free (waiter);
+
+  if (hls)
+    http_hls_respond_playlist (msg, hls, blocking);
+  else
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+
+  soup_server_unpause_message (server, msg);
+}
+
+static gboolean
+http_hls_waiter_timeout (SoupHlsWaiter *waiter)
+{
+  GstRTSPHls *hls;
+
+  /* the playlist as it is rather than an error, the player asks again,
+   * it does not have what was asked for so it must not be cached as if */
+  hls = hls_lookup (waiter->path);
+  http_hls_waiter_respond (waiter, hls, FALSE);
+  if (hls)
+    hls_release (hls);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_hls_waiter_finished (SoupMessage *msg, SoupHlsWaiter *waiter)
+{
+  http_hls_waiter_free (waiter);
+}
+
+static void
+http_hls_wake_free (SoupHlsWake *wake)
+{
+  g_free (wake->path);
+  g_free (wake);
+}
+
+static gboolean
+http_hls_wake (SoupHlsWake *wake)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (wake->server), "opaque");
+  GList *waiters, *item;
+  GstRTSPHls *hls;
+
+  hls = hls_lookup (wake->path);
+  if (!hls)
+    return G_SOURCE_REMOVE;
+
+  waiters = g_list_copy (opaque->hls_waiters);
+
+  for (item = waiters; item; item = g_list_next (item))
+  {
+    SoupHlsWaiter *waiter = item->data;
+
+    if (g_strcmp0 (waiter->path, wake->path) == 0 && hls_is_ready (hls, waiter->sequence, waiter->part))
+      http_hls_waiter_respond (waiter, hls, waiter->sequence >= 0);
+  }
+
+  g_list_free (waiters);
+  hls_release (hls);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_hls_notify (const gchar *path, SoupServer *server)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupHlsWake *wake;
+
+  /* parts close on every stream all the time, only wake the http thread
+   * when someone is waiting */
+  if (g_atomic_int_get (&opaque->hls_waiting) == 0)
+    return;
+
+  wake = g_new0 (SoupHlsWake, 1);
+  wake->server = server;
+  wake->path = g_strdup (path);
+
+  g_main_context_invoke_full (opaque->context, G_PRIORITY_DEFAULT,
+      (GSourceFunc) http_hls_wake, wake, (GDestroyNotify) http_hls_wake_free);
+}
+
+static void
+http_handle_hls_playlist (SoupServer *server, SoupMessage *msg, GHashTable *query, const gchar *stream_path)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupHlsWaiter *waiter;
+  GstRTSPHls *hls;
+  gint64 sequence = -1, part = -1, last;
+  guint timeout;
+
+  if (query)
+  {
+    if (g_hash_table_lookup (query, "_HLS_msn"))
+      sequence = g_ascii_strtoll (g_hash_table_lookup (query, "_HLS_msn"), NULL, 10);
+    if (g_hash_table_lookup (query, "_HLS_part"))
+      part = g_ascii_strtoll (g_hash_table_lookup (query, "_HLS_part"), NULL, 10);
+  }
+
+  hls = hls_lookup (stream_path);
+
+  /* more than two segments ahead is not going to show up in time */
+  last = hls ? hls_get_last_sequence (hls) : -1;
+  if (sequence >= 0 && last >= 0 && sequence > last + 2)
+  {
+    soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+    hls_release (hls);
+    return;
+  }
+
+  if (hls && hls_is_ready (hls, sequence, part))
+  {
+    http_hls_respond_playlist (msg, hls, sequence >= 0);
+    hls_release (hls);
+    return;
+  }
+
+  /* the first viewer starts the pull, the rtsp clients share it */
+  if (!hls && opaque->rtsp_server && !rtsp_prepull (opaque->rtsp_server, stream_path))
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  timeout = hls ? hls_get_target_duration (hls) * 3 : HLS_START_TIMEOUT_S;
+  if (hls)
+    hls_release (hls);
+
+  waiter = g_new0 (SoupHlsWaiter, 1);
+  waiter->server = server;
+  waiter->msg = msg;
+  waiter->path = g_strdup (stream_path);
+  waiter->sequence = sequence;
+  waiter->part = part;
+  waiter->timeout = g_timeout_source_new_seconds (timeout);
+  g_source_set_callback (waiter->timeout, (GSourceFunc) http_hls_waiter_timeout, waiter, NULL);
+  g_source_attach (waiter->timeout, opaque->context);
+
+  opaque->hls_waiters = g_list_prepend (opaque->hls_waiters, waiter);
+  g_atomic_int_inc (&opaque->hls_waiting);
+
+  g_signal_connect (msg, "finished", (GCallback) http_hls_waiter_finished, waiter);
+
+  soup_server_pause_message (server, msg);
+}
+
+static void
+http_handle_hls_segment (SoupServer *server, SoupMessage *msg, const gchar *stream_path, const gchar *name)
+{
+  GstRTSPHls *hls;
+  GBytes *bytes = NULL;
+  SoupBuffer *buffer;
+  guint64 sequence;
+  gint64 part = -1;
+  gchar *end, *cache_control;
+  guint target = 0;
+
+  /* <sequence>.ts or <sequence>.<part>.ts */
+  sequence = g_ascii_strtoull (name, &end, 10);
+  if (end != name && *end == '.' && g_ascii_isdigit (end[1]))
+    part = g_ascii_strtoll (end + 1, &end, 10);
+
+  hls = g_strcmp0 (end, ".ts") == 0 ? hls_lookup (stream_path) : NULL;
+  if (hls)
+  {
+    bytes = hls_get_segment (hls, sequence, part);
+    target = hls_get_target_duration (hls);
+    hls_release (hls);
+  }
+
+  if (!bytes)
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  /* segment names are never reused, so they are cached as long as the
+   * ring could still hand them out */
+  cache_control = g_strdup_printf ("public, max-age=%u, immutable", target * 10);
+  soup_message_headers_replace (msg->response_headers, "Cache-Control", cache_control);
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Origin", "*");
+  soup_message_headers_set_content_type (msg->response_headers, "video/mp2t", NULL);
+  g_free (cache_control);
+
+  /* the ring memory goes out as is, no copy per viewer */
+  buffer = soup_buffer_new_with_owner (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+      bytes, (GDestroyNotify) g_bytes_unref);
+  soup_message_body_append_buffer (msg->response_body, buffer);
+  soup_buffer_free (buffer);
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+http_handle_hls (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  const gchar *name;
+  gchar *stream_path;
+
+  if (g_strcmp0 (msg->method, "GET") != 0 && g_strcmp0 (msg->method, "HEAD") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  /* /hls/<stream path>/<file> */
+  name = strrchr (path, '/');
+  stream_path = g_strndup (path + strlen ("/hls"), name - path - strlen ("/hls"));
+  name++;
+
+  if (!stream_path[0])
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  }
+  else if (opaque->session)
+  {
+    /* the shard has the segments, the player follows it there */
+    http_shard_redirect (msg, stream_path, SOUP_STATUS_FOUND);
+  }
+  else if (!hls_enabled ())
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  }
+  else if (g_strcmp0 (name, "index.m3u8") == 0)
+  {
+    http_handle_hls_playlist (server, msg, query, stream_path);
+  }
+  else
+  {
+    http_handle_hls_segment (server, msg, stream_path, name);
+  }
+
+  g_free (stream_path);
+}
+
+static void
+http_whep_set_cors (SoupMessage *msg)
+{
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Origin", "*");
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Methods", "POST, DELETE, OPTIONS");
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Headers", "Content-Type");
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Expose-Headers", "Location");
+}
+
+static void
+http_whep_waiter_free (SoupWhepWaiter *waiter)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (waiter->server), "opaque");
+
+  opaque->whep_waiters = g_list_remove (opaque->whep_waiters, waiter);
+
+  g_source_destroy (waiter->timeout);
+  g_source_unref (waiter->timeout);
+  g_free (waiter->path);
+  g_free (waiter->id);
+  g_free (waiter);
+}
+
+static gboolean
+http_whep_waiter_respond (SoupWhepWaiter *waiter, gboolean timeout)
+{
+  SoupServer *server = waiter->server;
+  SoupMessage *msg = waiter->msg;
+  gchar *answer = NULL, *location;
+
+  if (!whep_session_get_answer (waiter->id, &answer) && !timeout)
+    return FALSE;
+
+  if (answer)
+  {
+    location = g_strdup_printf ("/whep%s/%s", waiter->path, waiter->id);
+    soup_message_headers_replace (msg->response_headers, "Location", location);
+    soup_message_set_response (msg, "application/sdp", SOUP_MEMORY_TAKE, answer, strlen (answer));
+    soup_message_set_status (msg, SOUP_STATUS_CREATED);
+    g_free (location);
+  }
+  else
+  {
+    /* the stream never got going or the offer did not negotiate */
+    whep_session_remove (waiter->id);
+    soup_message_set_status (msg, timeout ? SOUP_STATUS_SERVICE_UNAVAILABLE : SOUP_STATUS_NOT_ACCEPTABLE);
+  }
+
+  g_signal_handlers_disconnect_by_data (msg, waiter);
+  http_whep_waiter_free (waiter);
+
+  soup_server_unpause_message (server, msg);
+
+  return TRUE;
+}
+
+static gboolean
+http_whep_waiter_timeout (SoupWhepWaiter *waiter)
+{
+  http_whep_waiter_respond (waiter, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_whep_waiter_finished (SoupMessage *msg, SoupWhepWaiter *waiter)
+{
+  /* the peer gave up before the answer, nobody will ever connect */
+  whep_session_remove (waiter->id);
+  http_whep_waiter_free (waiter);
+}
+
+static void
+http_whep_wake_free (SoupWhepWake *wake)
+{
+  g_free (wake->id);
+  g_free (wake);
+}
+
+static gboolean
+http_whep_wake (SoupWhepWake *wake)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (wake->server), "opaque");
+  GList *item;
+
+  for (item = opaque->whep_waiters; item; item = g_list_next (item))
+  {
+    SoupWhepWaiter *waiter = item->data;
+
+    if (g_strcmp0 (waiter->id, wake->id) == 0)
+    {
+      http_whep_waiter_respond (waiter, FALSE);
+      break;
+    }
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_whep_notify (const gchar *id, SoupServer *server)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupWhepWake *wake;
+  GSource *source;
+
+  wake = g_new0 (SoupWhepWake, 1);
+  wake->server = server;
+  wake->id = g_strdup (id);
+
+  /* a session that fails while the offer is still being handled notifies
+   * from the http thread, so always wake up after its waiter exists */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, (GSourceFunc) http_whep_wake, wake, (GDestroyNotify) http_whep_wake_free);
+  g_source_attach (source, opaque->context);
+  g_source_unref (source);
+}
+
+static void
+http_handle_whep_offer (SoupServer *server, SoupMessage *msg, const gchar *stream_path)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupWhepWaiter *waiter;
+  GstSDPMessage *offer;
+  GstRTSPWhep *whep;
+  gchar *text, *id;
+
+  if (g_strcmp0 (soup_message_headers_get_content_type (msg->request_headers, NULL), "application/sdp") != 0)
+  {
+    soup_message_set_status (msg, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE);
+    return;
+  }
+
+  text = g_strndup (msg->request_body->data, msg->request_body->length);
+  gst_sdp_message_new_from_text (text, &offer);
+  g_free (text);
+
+  if (!offer || gst_sdp_message_medias_len (offer) == 0)
+  {
+    if (offer)
+      gst_sdp_message_free (offer);
+    soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+    return;
+  }
+
+  /* the first viewer starts the pull, the peers and rtsp clients share
+   * it, a whep kept by peers of a media that went away pulls again */
+  whep = whep_lookup (stream_path);
+  if ((!whep || !whep_is_live (whep)) && opaque->rtsp_server && !rtsp_prepull (opaque->rtsp_server, stream_path))
+  {
+    if (whep)
+      whep_release (whep);
+    gst_sdp_message_free (offer);
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  if (!whep)
+    whep = whep_acquire (stream_path);
+
+  id = whep_session_new (whep, offer);
+  whep_release (whep);
+
+  if (!id)
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_ACCEPTABLE);
+    return;
+  }
+
+  waiter = g_new0 (SoupWhepWaiter, 1);
+  waiter->server = server;
+  waiter->msg = msg;
+  waiter->path = g_strdup (stream_path);
+  waiter->id = id;
+  waiter->timeout = g_timeout_source_new_seconds (WHEP_START_TIMEOUT_S);
+  g_source_set_callback (waiter->timeout, (GSourceFunc) http_whep_waiter_timeout, waiter, NULL);
+  g_source_attach (waiter->timeout, opaque->context);
+
+  opaque->whep_waiters = g_list_prepend (opaque->whep_waiters, waiter);
+
+  g_signal_connect (msg, "finished", (GCallback) http_whep_waiter_finished, waiter);
+
+  soup_server_pause_message (server, msg);
+}
+
+static void
+http_handle_whep (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  const gchar *id = NULL;
+  gchar *stream_path;
+
+  http_whep_set_cors (msg);
+
+  if (g_strcmp0 (msg->method, "OPTIONS") == 0) {
+    soup_message_set_status (msg, SOUP_STATUS_NO_CONTENT);
+    return;
+  } else if (g_strcmp0 (msg->method, "POST") != 0 && g_strcmp0 (msg->method, "DELETE") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  /* /whep/<stream path> takes the offer, /whep/<stream path>/<session>
+   * is the resource the answer points at */
+  if (g_strcmp0 (msg->method, "DELETE") == 0)
+  {
+    id = strrchr (path, '/');
+    stream_path = g_strndup (path + strlen ("/whep"), id - path - strlen ("/whep"));
+    id++;
+  }
+  else
+  {
+    stream_path = g_strdup (path + strlen ("/whep"));
+  }
+
+  if (!stream_path[0])
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  }
+  else if (opaque->session)
+  {
+    /* the offer has to reach the shard with its body */
+    http_shard_redirect (msg, stream_path, SOUP_STATUS_TEMPORARY_REDIRECT);
+  }
+  else if (!whep_enabled ())
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  }
+  else if (id)
+  {
+    soup_message_set_status (msg, whep_session_remove (id) ? SOUP_STATUS_OK : SOUP_STATUS_NOT_FOUND);
+  }
+  else
+  {
+    http_handle_whep_offer (server, msg, stream_path);
+  }
+
+  g_free (stream_path);
+}
+
+static void
+http_snapshot_respond (SoupMessage *msg, GBytes *jpeg, guint64 sequence)
+{
+  SoupBuffer *buffer;
+  gchar *etag, *cache_control;
+
+  /* the etag is the keyframe, a thumbnail that did not move is a 304
+   * without touching the cache or a decoder */
+  etag = g_strdup_printf ("\"%" G_GUINT64_FORMAT "\"", sequence);
+  cache_control = g_strdup_printf ("max-age=%u", MAX (thumbnail_get_ttl () / 1000, 1));
+  soup_message_headers_replace (msg->response_headers, "ETag", etag);
+  soup_message_headers_replace (msg->response_headers, "Cache-Control", cache_control);
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Origin", "*");
+  g_free (cache_control);
+
+  if (g_strcmp0 (soup_message_headers_get_one (msg->request_headers, "If-None-Match"), etag) == 0)
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+    g_free (etag);
+    return;
+  }
+
+  g_free (etag);
+
+  soup_message_headers_set_content_type (msg->response_headers, "image/jpeg", NULL);
+
+  buffer = soup_buffer_new_with_owner (g_bytes_get_data (jpeg, NULL), g_bytes_get_size (jpeg),
+      g_bytes_ref (jpeg), (GDestroyNotify) g_bytes_unref);
+  soup_message_body_append_buffer (msg->response_body, buffer);
+  soup_buffer_free (buffer);
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+http_snapshot_unavailable (SoupMessage *msg)
+{
+  /* no keyframe yet or it did not decode, the next one may */
+  soup_message_headers_replace (msg->response_headers, "Retry-After", "1");
+  soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Origin", "*");
+  soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+}
+
+static void
+http_snapshot_waiter_free (SoupSnapshotWaiter *waiter)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (waiter->server), "opaque");
+
+  opaque->snapshot_waiters = g_list_remove (opaque->snapshot_waiters, waiter);
+
+  g_source_destroy (waiter->timeout);
+  g_source_unref (waiter->timeout);
+  thumbnail_release (waiter->thumbnail);
+  g_free (waiter);
+}
+
+static gboolean
+http_snapshot_waiter_respond (SoupSnapshotWaiter *waiter, gboolean timeout)
+{
+  SoupServer *server = waiter->server;
+  SoupMessage *msg = waiter->msg;
+  guint64 sequence;
+  gboolean pending;
+  GBytes *jpeg;
+
+  jpeg = thumbnail_get_jpeg (waiter->thumbnail, &sequence, &pending);
+  if (!jpeg && pending && !timeout)
+    return FALSE;
+
+  if (jpeg)
+  {
+    http_snapshot_respond (msg, jpeg, sequence);
+    g_bytes_unref (jpeg);
+  }
+  else
+  {
+    http_snapshot_unavailable (msg);
+  }
+
+  g_signal_handlers_disconnect_by_data (msg, waiter);
+  http_snapshot_waiter_free (waiter);
+
+  soup_server_unpause_message (server, msg);
+
+  return TRUE;
+}
+
+static gboolean
+http_snapshot_waiter_timeout (SoupSnapshotWaiter *waiter)
+{
+  http_snapshot_waiter_respond (waiter, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_snapshot_waiter_finished (SoupMessage *msg, SoupSnapshotWaiter *waiter)
+{
+  http_snapshot_waiter_free (waiter);
+}
+
+static void
+http_snapshot_wake_free (SoupSnapshotWake *wake)
+{
+  g_free (wake->path);
+  g_free (wake);
+}
+
+static gboolean
+http_snapshot_wake (SoupSnapshotWake *wake)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (wake->server), "opaque");
+  GList *waiters, *item;
+
+  waiters = g_list_copy (opaque->snapshot_waiters);
+
+  for (item = waiters; item; item = g_list_next (item))
+  {
+    SoupSnapshotWaiter *waiter = item->data;
+
+    if (g_strcmp0 (thumbnail_get_path (waiter->thumbnail), wake->path) == 0)
+      http_snapshot_waiter_respond (waiter, FALSE);
+  }
+
+  g_list_free (waiters);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+http_snapshot_notify (const gchar *path, SoupServer *server)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupSnapshotWake *wake;
+
+  /* decodes finish on the decoder threads, waiters live in the http
+   * context */
+  wake = g_new0 (SoupSnapshotWake, 1);
+  wake->server = server;
+  wake->path = g_strdup (path);
+
+  g_main_context_invoke_full (opaque->context, G_PRIORITY_DEFAULT,
+      (GSourceFunc) http_snapshot_wake, wake, (GDestroyNotify) http_snapshot_wake_free);
+}
+
+static void
+http_shards_snapshot_reply (SoupShardsRequest *request, SoupMessage *forward)
+{
+  static const gchar *headers[] =
+      { "Content-Type", "Content-Length", "ETag", "Cache-Control", "Retry-After", "Access-Control-Allow-Origin" };
+  SoupMessage *msg = request->msg;
+  guint j;
+
+  /* ids carry no path to hash, the first shard that has the stream answers */
+  if (!forward)
+  {
+    http_shards_respond (request, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  if (forward->status_code == SOUP_STATUS_NOT_FOUND)
+    return;
+
+  for (j = 0; j < G_N_ELEMENTS (headers); j++)
+  {
+    const gchar *value = soup_message_headers_get_one (forward->response_headers, headers[j]);
+
+    if (value)
+      soup_message_headers_replace (msg->response_headers, headers[j], value);
+  }
+  soup_message_body_append (msg->response_body, SOUP_MEMORY_COPY,
+      forward->response_body->data, forward->response_body->length);
+  http_shards_respond (request, forward->status_code);
+}
+
+static void
+http_handle_snapshot (
+    SoupServer *server, SoupMessage *msg, const gchar *path, GHashTable *query,
+    SoupClientContext *context, gpointer data)
+{
+  SoupOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  SoupSnapshotWaiter *waiter;
+  GstRTSPThumbnail *thumbnail;
+  guint64 sequence;
+  gboolean pending;
+  GBytes *jpeg;
+  gchar *id;
+
+  if (g_strcmp0 (msg->method, "GET") != 0 && g_strcmp0 (msg->method, "HEAD") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  /* /api/v1/streams/<id>/snapshot.jpg */
+  if (!g_str_has_suffix (path, "/snapshot.jpg") ||
+      strlen (path) <= strlen ("/api/v1/streams/") + strlen ("/snapshot.jpg"))
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  if (opaque->session)
+  {
+    /* HEAD stays HEAD on the shard */
+    http_shards_queue (server, msg, msg->method, path, http_shards_snapshot_reply, NULL, NULL);
+    return;
+  }
+
+  id = g_strndup (path + strlen ("/api/v1/streams/"),
+      strlen (path) - strlen ("/api/v1/streams/") - strlen ("/snapshot.jpg"));
+  thumbnail = id[0] && !strchr (id, '/') ? thumbnail_lookup (id) : NULL;
+  g_free (id);
+
+  /* thumbnails are of live streams only, asking for one never starts a
+   * pull */
+  if (!thumbnail)
+  {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  jpeg = thumbnail_get_jpeg (thumbnail, &sequence, &pending);
+
+  if (jpeg || !pending)
+  {
+    if (jpeg)
+    {
+      http_snapshot_respond (msg, jpeg, sequence);
+      g_bytes_unref (jpeg);
+    }
+    else
+    {
+      http_snapshot_unavailable (msg);
+    }
+
+    thumbnail_release (thumbnail);
+    return;
+  }
+
+  /* every request for the stream waits on the one decode */
+  waiter = g_new0 (SoupSnapshotWaiter, 1);
+  waiter->server = server;
+  waiter->msg = msg;
+  waiter->thumbnail = thumbnail;
+  waiter->timeout = g_timeout_source_new_seconds (THUMBNAIL_TIMEOUT_S);
+  g_source_set_callback (waiter->timeout, (GSourceFunc) http_snapshot_waiter_timeout, waiter, NULL);
+  g_source_attach (waiter->timeout, opaque->context);
+
+  opaque->snapshot_waiters = g_list_prepend (opaque->snapshot_waiters, waiter);
+
+  g_signal_connect (msg, "finished", (GCallback) http_snapshot_waiter_finished, waiter);
+
+  soup_server_pause_message (server, msg);
 }
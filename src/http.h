@@ -3,6 +3,6 @@
 
 #include "rtsp.h"
 
-void http_init (GstRTSPMediaTable *media_table, const gchar* host, const gchar *port);
+void http_init (GstRTSPMediaTable *media_table, GstRTSPServer *rtsp_server, const gchar* host, const gchar *port);
 
 #endif
@@ -7,6 +7,16 @@
 
 #include "rtsp.h"
 #include "http.h"
+#include "taskpool.h"
+#include "events.h"
+#include "batch.h"
+#include "backlog.h"
+#include "slab.h"
+#include "factory.h"
+#include "shard.h"
+#include "timeshift.h"
+#include "hls.h"
+#include "thumbnail.h"
 
 static gchar *rtmp_host = "127.0.0.1";
 static gchar *rtmp_port = "1935";
@@ -16,17 +26,85 @@ static gchar *rtsp_port = "8554";
 static gint rtsp_timeout = 30;
 static gchar *http_host = "127.0.0.1";
 static gchar *http_port = "8080";
+static gint workers = 0;
+static gint task_pool = 0;
+static gint task_pool_threads = 0;
+static gboolean gop_cache = FALSE;
+static gint events = 1024;
+static gboolean batch = FALSE;
+static gboolean slab = FALSE;
+static gint benchmark = 0;
+static gint warm_pool = 0;
+static gchar *upstream = NULL;
+static gboolean upstream_forward = FALSE;
+static gint shards = 0;
+static gint shard_index = -1;
+static gint reconnect_timeout = 0;
+static gchar *backup_host = NULL;
+static gchar *backup_port = "1935";
+static gboolean slate = FALSE;
+static gint track_window = RELAY_TRACK_WINDOW_MS;
+static gchar *timeshift_dir = NULL;
+static gint timeshift_size = TIMESHIFT_SIZE_MB;
+static gchar *timeshift_prefix = "/";
+static gboolean hls = FALSE;
+static gint hls_segment_ms = HLS_SEGMENT_MS;
+static gint hls_part_ms = HLS_PART_MS;
+static gboolean whep = FALSE;
+static gboolean renditions = FALSE;
+static gint snapshot_ttl_ms = 0;
+static gchar *profile = "default";
+static gint backlog_bytes = 0;
+static gint backlog_ms = 0;
+static gint backlog_timeout = 10;
+static gboolean rtmp_listen = FALSE;
+static gchar *multicast_range = NULL;
+static gint multicast_ttl = 16;
 
 static GOptionEntry options[] =
 {
   { "rtmp-host", 0, 0, G_OPTION_ARG_STRING, &rtmp_host, "rtmp host", NULL },
   { "rtmp-port", 0, 0, G_OPTION_ARG_STRING, &rtmp_port, "rtmp port", NULL },
   { "rtmp-timeout", 0, 0, G_OPTION_ARG_INT, &rtmp_timeout, "rtmp timeout", NULL },
+  { "rtmp-listen", 0, 0, G_OPTION_ARG_NONE, &rtmp_listen, "accept rtmp publishers at rtmp host and port", NULL },
+  { "upstream", 0, 0, G_OPTION_ARG_STRING, &upstream, "pull from an origin instance instead of rtmp, e.g. rtsp://origin:8554", NULL },
+  { "upstream-forward", 0, 0, G_OPTION_ARG_NONE, &upstream_forward, "forward origin rtp without depayloading", NULL },
   { "rtsp-host", 0, 0, G_OPTION_ARG_STRING, &rtsp_host, "rtsp host", NULL },
   { "rtsp-port", 0, 0, G_OPTION_ARG_STRING, &rtsp_port, "rtsp port", NULL },
   { "rtsp-timeout", 0, 0, G_OPTION_ARG_INT, &rtsp_timeout, "rtsp timeout", NULL },
+  { "multicast-range", 0, 0, G_OPTION_ARG_STRING, &multicast_range, "multicast address range, e.g. 224.3.0.1-224.3.0.254", NULL },
+  { "multicast-ttl", 0, 0, G_OPTION_ARG_INT, &multicast_ttl, "multicast ttl", NULL },
   { "http-host", 0, 0, G_OPTION_ARG_STRING, &http_host, "http host", NULL },
   { "http-port", 0, 0, G_OPTION_ARG_STRING, &http_port, "http port", NULL },
+  { "workers", 0, 0, G_OPTION_ARG_INT, &workers, "rtsp worker threads", NULL },
+  { "task-pool", 0, 0, G_OPTION_ARG_INT, &task_pool, "streaming task pool cores", NULL },
+  { "task-pool-threads", 0, 0, G_OPTION_ARG_INT, &task_pool_threads, "max streaming task pool threads, 0 for 16 per core", NULL },
+  { "gop-cache", 0, 0, G_OPTION_ARG_NONE, &gop_cache, "cache last gop for new clients", NULL },
+  { "events", 0, 0, G_OPTION_ARG_INT, &events, "event feed capacity", NULL },
+  { "profile", 0, 0, G_OPTION_ARG_STRING, &profile, "pipeline profile, default or low-latency", NULL },
+  { "backlog-bytes", 0, 0, G_OPTION_ARG_INT, &backlog_bytes, "max unsent bytes per tcp client, 0 to disable", NULL },
+  { "backlog-ms", 0, 0, G_OPTION_ARG_INT, &backlog_ms, "max unsent milliseconds per tcp client, 0 to disable", NULL },
+  { "backlog-timeout", 0, 0, G_OPTION_ARG_INT, &backlog_timeout, "seconds a tcp client may stay behind", NULL },
+  { "batch", 0, 0, G_OPTION_ARG_NONE, &batch, "send rtp packets of a frame in one batch", NULL },
+  { "slab", 0, 0, G_OPTION_ARG_NONE, &slab, "allocate small buffers from pooled slabs", NULL },
+  { "reconnect-timeout", 0, 0, G_OPTION_ARG_INT, &reconnect_timeout, "seconds to reconnect upstream before ending the stream", NULL },
+  { "backup-host", 0, 0, G_OPTION_ARG_STRING, &backup_host, "backup rtmp host", NULL },
+  { "backup-port", 0, 0, G_OPTION_ARG_STRING, &backup_port, "backup rtmp port", NULL },
+  { "slate", 0, 0, G_OPTION_ARG_NONE, &slate, "send a black slate while upstream is down", NULL },
+  { "track-window", 0, 0, G_OPTION_ARG_INT, &track_window, "milliseconds to wait for the second track", NULL },
+  { "timeshift-dir", 0, 0, G_OPTION_ARG_STRING, &timeshift_dir, "keep a rewindable ring per stream in this directory, played at <path>/timeshift", NULL },
+  { "timeshift-size", 0, 0, G_OPTION_ARG_INT, &timeshift_size, "megabytes of timeshift ring per stream", NULL },
+  { "timeshift-prefix", 0, 0, G_OPTION_ARG_STRING, &timeshift_prefix, "only keep timeshift rings for paths starting with this", NULL },
+  { "hls", 0, 0, G_OPTION_ARG_NONE, &hls, "serve hls at /hls/<path>/index.m3u8 on the http port", NULL },
+  { "hls-segment-ms", 0, 0, G_OPTION_ARG_INT, &hls_segment_ms, "target hls segment milliseconds", NULL },
+  { "hls-part-ms", 0, 0, G_OPTION_ARG_INT, &hls_part_ms, "low-latency hls part milliseconds, 0 for plain hls", NULL },
+  { "whep", 0, 0, G_OPTION_ARG_NONE, &whep, "serve webrtc playback at /whep/<path> on the http port", NULL },
+  { "renditions", 0, 0, G_OPTION_ARG_NONE, &renditions, "transcode 240p, 360p, 480p or 720p on demand at <path>/rendition=360p or <path>?rendition=360p", NULL },
+  { "snapshot-ttl-ms", 0, 0, G_OPTION_ARG_INT, &snapshot_ttl_ms, "serve /api/v1/streams/<id>/snapshot.jpg, reused for this many milliseconds", NULL },
+  { "warm-pool", 0, 0, G_OPTION_ARG_INT, &warm_pool, "pre-built idle pipelines and factories", NULL },
+  { "shards", 0, 0, G_OPTION_ARG_INT, &shards, "worker processes to shard streams across", NULL },
+  { "shard-index", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_INT, &shard_index, "shard of this worker", NULL },
+  { "benchmark", 0, 0, G_OPTION_ARG_INT, &benchmark, "measure media prepare for n streams and exit", NULL },
   { NULL }
 };
 
@@ -72,8 +150,13 @@ int
 main (int argc, char *argv[])
 {
   GstRTSPMediaTable *media_table;
+  GstRTSPServer *rtsp_server;
   GOptionContext *context;
   GError *error = NULL;
+  gchar **args, *public_port = NULL;
+
+  /* workers are started with the same arguments as the supervisor */
+  args = g_strdupv (argv);
 
   context = g_option_context_new ("");
 
@@ -89,12 +172,112 @@ main (int argc, char *argv[])
 
   gst_init (NULL, NULL);
 
+  if (benchmark > 0)
+  {
+    relay_factory_benchmark (benchmark);
+    return 0;
+  }
+
+  if (upstream && rtmp_listen)
+  {
+    g_print ("rtmp2rtsp: an edge can not accept rtmp publishers\n");
+    return 1;
+  }
+
+  if (shards > 1 && rtmp_listen)
+  {
+    g_print ("rtmp2rtsp: shards can not accept rtmp publishers\n");
+    return 1;
+  }
+
+  if (shards > 1 && shard_index < 0)
+  {
+    shard_init (shards, -1, rtsp_host, rtsp_port, http_port);
+
+    loop = g_main_loop_new (NULL, FALSE);
+
+    media_table = rtsp_media_table_new ();
+
+    shard_spawn (args);
+    g_strfreev (args);
+
+    http_init (media_table, NULL, http_host, http_port);
+
+    g_print ("rtmp2rtsp: start supervisor of %d shards\n", shards);
+
+    g_main_loop_run (loop);
+
+    g_print ("rtmp2rtsp: stop\n");
+
+    shard_stop ();
+
+    rtsp_media_table_free (media_table);
+
+    return 0;
+  }
+
+  if (shards > 1 && shard_index >= 0)
+  {
+    shard_init (shards, shard_index, rtsp_host, rtsp_port, http_port);
+
+    /* the public port is shared, every shard has its own for redirects */
+    public_port = rtsp_port;
+    rtsp_port = shard_get_rtsp_port (shard_index);
+    http_port = shard_get_http_port (shard_index);
+  }
+
+  g_strfreev (args);
+
+  if (task_pool > 0)
+    task_pool_init (task_pool, MAX (task_pool_threads, 0));
+
+  if (events > 0)
+    events_init (events);
+
+  if (batch)
+    batch_init ();
+
+  if (slab)
+    slab_init ();
+
+  if (hls && hls_segment_ms > 0)
+    hls_init (hls_segment_ms, MAX (hls_part_ms, 0));
+
+  if (snapshot_ttl_ms > 0)
+    thumbnail_init (snapshot_ttl_ms);
+
+  if (backlog_bytes > 0 && backlog_ms > 0)
+    backlog_init (backlog_bytes, backlog_ms, backlog_timeout);
+
   loop = g_main_loop_new (NULL, FALSE);
 
   media_table = rtsp_media_table_new ();
 
-  rtsp_init (media_table, rtmp_host, rtmp_port, rtmp_timeout, rtsp_host, rtsp_port, rtsp_timeout);
-  http_init (media_table, http_host, http_port);
+  rtsp_server = rtsp_init (media_table, rtmp_host, rtmp_port, rtmp_timeout, rtsp_host, rtsp_port, rtsp_timeout,
+      workers, gop_cache, rtmp_listen);
+  if (rtsp_server && !rtsp_set_profile (rtsp_server, profile))
+    return 1;
+  if (rtsp_server && public_port && !shard_listen (rtsp_server, rtsp_host, public_port))
+    return 1;
+  if (rtsp_server && reconnect_timeout > 0)
+    rtsp_set_failover (rtsp_server, reconnect_timeout, backup_host, backup_port, slate);
+  if (rtsp_server && upstream)
+    rtsp_set_upstream (rtsp_server, upstream, upstream_forward);
+  if (rtsp_server)
+    rtsp_set_track_window (rtsp_server, track_window);
+  if (rtsp_server && timeshift_dir && timeshift_size > 0)
+    rtsp_set_timeshift (rtsp_server, timeshift_dir, timeshift_size, timeshift_prefix);
+  if (rtsp_server && whep)
+    rtsp_set_whep (rtsp_server);
+  if (rtsp_server && renditions)
+    rtsp_set_renditions (rtsp_server);
+  if (rtsp_server && warm_pool > 0)
+    rtsp_set_warm_pool (rtsp_server, warm_pool);
+  if (rtsp_server && multicast_range && !rtsp_set_multicast (rtsp_server, multicast_range, multicast_ttl))
+    return 1;
+  if (rtsp_server && !rtsp_attach (rtsp_server))
+    g_clear_object (&rtsp_server);
+  http_init (media_table, rtsp_server, http_host, http_port);
 
   g_print ("rtmp2rtsp: start\n");
 
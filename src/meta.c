@@ -0,0 +1,116 @@
+#include "meta.h"
+
+typedef struct _GstRTSPMediaMetaTrack GstRTSPMediaMetaTrack;
+
+struct _GstRTSPMediaMetaTrack
+{
+  GstRTSPMediaMeta *meta;
+  GstStructure *structure;
+};
+
+struct _GstRTSPMediaMeta
+{
+  GMutex lock;
+  gint *version;
+  GstRTSPMediaMetaTrack tracks[MEDIA_META_TRACKS];
+};
+
+GstRTSPMediaMeta *
+media_meta_new (gint *version)
+{
+  GstRTSPMediaMeta *meta;
+  guint i;
+
+  meta = g_new0 (GstRTSPMediaMeta, 1);
+  g_mutex_init (&meta->lock);
+  meta->version = version;
+
+  for (i = 0; i < MEDIA_META_TRACKS; i++)
+    meta->tracks[i].meta = meta;
+
+  return meta;
+}
+
+void
+media_meta_free (GstRTSPMediaMeta *meta)
+{
+  guint i;
+
+  for (i = 0; i < MEDIA_META_TRACKS; i++)
+  {
+    if (meta->tracks[i].structure)
+      gst_structure_free (meta->tracks[i].structure);
+  }
+
+  g_mutex_clear (&meta->lock);
+  g_free (meta);
+}
+
+static GstPadProbeReturn
+media_meta_caps_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPMediaMetaTrack *track)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstRTSPMediaMeta *meta = track->meta;
+  GstCaps *caps;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_caps (event, &caps);
+
+  if (gst_caps_is_empty (caps))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&meta->lock);
+  if (track->structure)
+    gst_structure_free (track->structure);
+  track->structure = gst_structure_copy (gst_caps_get_structure (caps, 0));
+  g_mutex_unlock (&meta->lock);
+
+  g_atomic_int_inc (meta->version);
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+media_meta_attach (GstRTSPMediaMeta *meta, GstElement *bin)
+{
+  guint i;
+
+  for (i = 0; i < MEDIA_META_TRACKS; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "src");
+    if (pad)
+    {
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+          (GstPadProbeCallback) media_meta_caps_probe, &meta->tracks[i], NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+}
+
+GstStructure *
+media_meta_get_structure (GstRTSPMediaMeta *meta, guint track)
+{
+  GstStructure *structure = NULL;
+
+  g_mutex_lock (&meta->lock);
+  if (meta->tracks[track].structure)
+    structure = gst_structure_copy (meta->tracks[track].structure);
+  g_mutex_unlock (&meta->lock);
+
+  return structure;
+}
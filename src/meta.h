@@ -0,0 +1,19 @@
+#ifndef __META_H__
+#define __META_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#define MEDIA_META_TRACKS 2
+
+typedef struct _GstRTSPMediaMeta GstRTSPMediaMeta;
+
+GstRTSPMediaMeta *media_meta_new (gint *version);
+void media_meta_free (GstRTSPMediaMeta *meta);
+
+void media_meta_attach (GstRTSPMediaMeta *meta, GstElement *bin);
+
+GstStructure *media_meta_get_structure (GstRTSPMediaMeta *meta, guint track);
+
+#endif
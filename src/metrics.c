@@ -0,0 +1,192 @@
+#include <string.h>
+
+#include "metrics.h"
+
+#define METRICS_BUCKETS 14
+#define LATENCY_PROBE_SLOTS 64
+
+typedef struct _GstRTSPHistogram GstRTSPHistogram;
+
+struct _GstRTSPHistogram
+{
+  const gchar *name;
+  const gchar *help;
+  guint64 buckets[METRICS_BUCKETS + 1];
+  guint64 count;
+  guint64 sum;
+};
+
+/* upper bounds in microseconds, the last bucket is +Inf */
+static const gint64 metrics_bounds[METRICS_BUCKETS] =
+{
+  100, 500, 1000, 5000, 10000, 25000, 50000, 100000,
+  250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+static GstRTSPHistogram metrics[METRICS_NUM] =
+{
+  { "rtmp2rtsp_rtmp_connect_seconds", "Time from media prepare to the first buffer from rtmpsrc" },
+  { "rtmp2rtsp_media_prepare_seconds", "Time from media preparing to media prepared" },
+  { "rtmp2rtsp_client_ttff_seconds", "Time from client connect to its first keyframe" },
+  { "rtmp2rtsp_buffer_latency_seconds", "Time a video buffer spends between flvdemux and pay0" },
+  { "rtmp2rtsp_http_request_seconds", "Time from an http request to its response, event long-polls excluded" },
+};
+
+void
+metrics_observe (GstRTSPMetric metric, gint64 usec)
+{
+  GstRTSPHistogram *histogram = &metrics[metric];
+  guint i;
+
+  if (usec < 0)
+    usec = 0;
+
+  for (i = 0; i < METRICS_BUCKETS; i++)
+  {
+    if (usec <= metrics_bounds[i])
+      break;
+  }
+
+  __atomic_add_fetch (&histogram->buckets[i], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&histogram->sum, usec, __ATOMIC_RELAXED);
+}
+
+void
+metrics_append (GString *body)
+{
+  guint metric, i;
+
+  for (metric = 0; metric < METRICS_NUM; metric++)
+  {
+    GstRTSPHistogram *histogram = &metrics[metric];
+    guint64 cumulative = 0;
+
+    g_string_append_printf (body, "# HELP %s %s\n", histogram->name, histogram->help);
+    g_string_append_printf (body, "# TYPE %s histogram\n", histogram->name);
+
+    for (i = 0; i < METRICS_BUCKETS; i++)
+    {
+      cumulative += __atomic_load_n (&histogram->buckets[i], __ATOMIC_RELAXED);
+      g_string_append_printf (body, "%s_bucket{le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+          histogram->name, (gdouble) metrics_bounds[i] / G_USEC_PER_SEC, cumulative);
+    }
+
+    cumulative += __atomic_load_n (&histogram->buckets[METRICS_BUCKETS], __ATOMIC_RELAXED);
+    g_string_append_printf (body, "%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+        histogram->name, cumulative);
+    g_string_append_printf (body, "%s_sum %g\n", histogram->name,
+        (gdouble) __atomic_load_n (&histogram->sum, __ATOMIC_RELAXED) / G_USEC_PER_SEC);
+    g_string_append_printf (body, "%s_count %" G_GUINT64_FORMAT "\n", histogram->name,
+        __atomic_load_n (&histogram->count, __ATOMIC_RELAXED));
+  }
+}
+
+gchar *
+metrics_escape_label (const gchar *value)
+{
+  GString *escaped;
+  const gchar *c;
+
+  /* label values are quoted, a path may carry anything a url does */
+  escaped = g_string_sized_new (strlen (value));
+
+  for (c = value; *c; c++)
+  {
+    if (*c == '\\')
+      g_string_append (escaped, "\\\\");
+    else if (*c == '"')
+      g_string_append (escaped, "\\\"");
+    else if (*c == '\n')
+      g_string_append (escaped, "\\n");
+    else
+      g_string_append_c (escaped, *c);
+  }
+
+  return g_string_free (escaped, FALSE);
+}
+
+typedef struct _GstRTSPLatencySlot GstRTSPLatencySlot;
+
+struct _GstRTSPLatencySlot
+{
+  GstClockTime pts;
+  gint64 time;
+};
+
+struct _GstRTSPLatencyProbe
+{
+  GstRTSPLatencySlot slots[LATENCY_PROBE_SLOTS];
+  guint pos;
+};
+
+GstRTSPLatencyProbe *
+latency_probe_new ()
+{
+  GstRTSPLatencyProbe *probe;
+  guint i;
+
+  probe = g_new0 (GstRTSPLatencyProbe, 1);
+
+  for (i = 0; i < LATENCY_PROBE_SLOTS; i++)
+    probe->slots[i].pts = GST_CLOCK_TIME_NONE;
+
+  return probe;
+}
+
+void
+latency_probe_free (GstRTSPLatencyProbe *probe)
+{
+  g_free (probe);
+}
+
+static GstPadProbeReturn
+latency_probe_entry (GstPad *pad, GstPadProbeInfo *info, GstRTSPLatencyProbe *probe)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstRTSPLatencySlot *slot;
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  /* single writer, the reader matches on pts so a torn slot is skipped */
+  slot = &probe->slots[probe->pos++ % LATENCY_PROBE_SLOTS];
+  __atomic_store_n (&slot->pts, GST_CLOCK_TIME_NONE, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot->time, g_get_monotonic_time (), __ATOMIC_RELAXED);
+  __atomic_store_n (&slot->pts, GST_BUFFER_PTS (buffer), __ATOMIC_RELEASE);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+latency_probe_exit (GstPad *pad, GstPadProbeInfo *info, GstRTSPLatencyProbe *probe)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  guint i;
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  for (i = 0; i < LATENCY_PROBE_SLOTS; i++)
+  {
+    GstRTSPLatencySlot *slot = &probe->slots[i];
+
+    if (__atomic_load_n (&slot->pts, __ATOMIC_ACQUIRE) == GST_BUFFER_PTS (buffer))
+    {
+      metrics_observe (METRICS_BUFFER_LATENCY,
+          g_get_monotonic_time () - __atomic_load_n (&slot->time, __ATOMIC_RELAXED));
+      break;
+    }
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+latency_probe_attach (GstRTSPLatencyProbe *probe, GstPad *entry, GstPad *exit)
+{
+  gst_pad_add_probe (entry, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) latency_probe_entry, probe, NULL);
+  gst_pad_add_probe (exit, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) latency_probe_exit, probe, NULL);
+}
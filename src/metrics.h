@@ -0,0 +1,31 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+typedef enum
+{
+  METRICS_RTMP_CONNECT,
+  METRICS_MEDIA_PREPARE,
+  METRICS_CLIENT_TTFF,
+  METRICS_BUFFER_LATENCY,
+  METRICS_HTTP_REQUEST,
+  METRICS_NUM
+} GstRTSPMetric;
+
+void metrics_observe (GstRTSPMetric metric, gint64 usec);
+
+void metrics_append (GString *body);
+
+gchar *metrics_escape_label (const gchar *value);
+
+typedef struct _GstRTSPLatencyProbe GstRTSPLatencyProbe;
+
+GstRTSPLatencyProbe *latency_probe_new ();
+void latency_probe_free (GstRTSPLatencyProbe *probe);
+
+void latency_probe_attach (GstRTSPLatencyProbe *probe, GstPad *entry, GstPad *exit);
+
+#endif
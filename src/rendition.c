@@ -0,0 +1,723 @@
+#include <string.h>
+#include <time.h>
+
+#include <gst/app/gstappsrc.h>
+
+#include "rendition.h"
+#include "metrics.h"
+
+/* an encoder that cannot keep up drops to the next keyframe instead of
+ * falling further behind */
+#define RENDITION_QUEUE_BYTES (2 * 1024 * 1024)
+#define RENDITION_PENDING 64
+#define RENDITION_KEYINT 60
+
+typedef struct _GstRTSPRenditionProfile GstRTSPRenditionProfile;
+
+struct _GstRTSPRenditionProfile
+{
+  const gchar *name;
+  gint width;
+  gint height;
+  guint bitrate;
+};
+
+static const GstRTSPRenditionProfile rendition_profiles[] =
+{
+  { "240p", 426, 240, 400 },
+  { "360p", 640, 360, 800 },
+  { "480p", 854, 480, 1200 },
+  { "720p", 1280, 720, 2500 }
+};
+
+struct _GstRTSPRenditionSource
+{
+  gint ref_count;
+  GMutex lock;
+  gchar *path;
+  gint attached;
+  GstCaps *caps[RENDITION_TRACKS];
+  GList *renditions;
+};
+
+typedef struct _GstRTSPRenditionFrame GstRTSPRenditionFrame;
+
+struct _GstRTSPRenditionFrame
+{
+  GstClockTime pts;
+  gint64 time;
+};
+
+struct _GstRTSPRendition
+{
+  gchar *path;
+  const GstRTSPRenditionProfile *profile;
+  GstRTSPRenditionSource *source;
+
+  GstElement *appsrc[RENDITION_TRACKS];
+  gboolean keyframe;
+  gboolean dropping;
+  gboolean synced;
+  gint64 offset;
+
+  GMutex lock;
+  GQueue pending;
+  gint64 cpu_last;
+  guint64 cpu_ns;
+  guint64 frames;
+  guint64 dropped;
+  gint64 latency_us;
+  gint64 latency_max_us;
+};
+
+typedef struct _GstRTSPRenditionRegistry GstRTSPRenditionRegistry;
+
+struct _GstRTSPRenditionRegistry
+{
+  GMutex lock;
+  gboolean enabled;
+  GHashTable *sources;
+};
+
+static GstRTSPRenditionRegistry rendition_registry;
+
+void
+rendition_init ()
+{
+  g_mutex_init (&rendition_registry.lock);
+  rendition_registry.enabled = TRUE;
+  rendition_registry.sources = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+gboolean
+rendition_enabled ()
+{
+  return rendition_registry.enabled;
+}
+
+static const GstRTSPRenditionProfile *
+rendition_profile_find (const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (rendition_profiles); i++)
+  {
+    if (g_strcmp0 (rendition_profiles[i].name, name) == 0)
+      return &rendition_profiles[i];
+  }
+
+  return NULL;
+}
+
+gchar *
+rendition_get_source (const gchar *path)
+{
+  const gchar *suffix;
+
+  if (!rendition_registry.enabled)
+    return NULL;
+
+  suffix = g_strrstr (path, RENDITION_SUFFIX);
+  if (!suffix || suffix == path || !rendition_profile_find (suffix + strlen (RENDITION_SUFFIX)))
+    return NULL;
+
+  return g_strndup (path, suffix - path);
+}
+
+gchar *
+rendition_get_path (const gchar *path, const gchar *query)
+{
+  gchar **params, *res = NULL;
+  guint i;
+
+  if (!rendition_registry.enabled || !query)
+    return NULL;
+
+  /* ?rendition=360p is the same as the /rendition=360p path, clients only
+   * ever see the path form afterwards */
+  params = g_strsplit (query, "&", -1);
+  for (i = 0; params[i] && !res; i++)
+  {
+    gchar *name, *control;
+
+    if (!g_str_has_prefix (params[i], RENDITION_QUERY))
+      continue;
+
+    /* a client that appends the stream control to the whole url puts it
+     * after the query */
+    name = g_strdup (params[i] + strlen (RENDITION_QUERY));
+    control = strchr (name, '/');
+    if (control)
+      *control = '\0';
+
+    if (rendition_profile_find (name))
+      res = g_strdup_printf ("%s%s%s%s", path, RENDITION_SUFFIX, name,
+          control ? params[i] + strlen (RENDITION_QUERY) + (control - name) : "");
+
+    g_free (name);
+  }
+  g_strfreev (params);
+
+  return res;
+}
+
+static GstRTSPRenditionSource *
+rendition_source_new (const gchar *path)
+{
+  GstRTSPRenditionSource *source;
+
+  source = g_new0 (GstRTSPRenditionSource, 1);
+  source->ref_count = 1;
+  g_mutex_init (&source->lock);
+  source->path = g_strdup (path);
+
+  return source;
+}
+
+static void
+rendition_source_free (GstRTSPRenditionSource *source)
+{
+  guint i;
+
+  for (i = 0; i < RENDITION_TRACKS; i++)
+    gst_caps_replace (&source->caps[i], NULL);
+  g_mutex_clear (&source->lock);
+  g_free (source->path);
+  g_free (source);
+}
+
+GstRTSPRenditionSource *
+rendition_source_acquire (const gchar *path)
+{
+  GstRTSPRenditionSource *source;
+
+  g_mutex_lock (&rendition_registry.lock);
+
+  source = g_hash_table_lookup (rendition_registry.sources, path);
+  if (source)
+  {
+    source->ref_count++;
+  }
+  else
+  {
+    source = rendition_source_new (path);
+    g_hash_table_insert (rendition_registry.sources, source->path, source);
+  }
+
+  g_mutex_unlock (&rendition_registry.lock);
+
+  return source;
+}
+
+void
+rendition_source_release (GstRTSPRenditionSource *source)
+{
+  gboolean last;
+
+  g_mutex_lock (&rendition_registry.lock);
+  last = --source->ref_count == 0;
+  if (last)
+    g_hash_table_remove (rendition_registry.sources, source->path);
+  g_mutex_unlock (&rendition_registry.lock);
+
+  if (last)
+    rendition_source_free (source);
+}
+
+static void
+rendition_push (GstRTSPRenditionSource *source, guint track, GstBuffer *buffer)
+{
+  gboolean delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  GstClockTime time;
+  GList *item;
+
+  time = GST_BUFFER_DTS_IS_VALID (buffer) ? GST_BUFFER_DTS (buffer) : GST_BUFFER_PTS (buffer);
+  if (!GST_CLOCK_TIME_IS_VALID (time))
+    return;
+
+  g_mutex_lock (&source->lock);
+
+  for (item = source->renditions; item; item = g_list_next (item))
+  {
+    GstRTSPRendition *rendition = item->data;
+    GstElement *appsrc = rendition->appsrc[track];
+    GstClock *clock;
+    GstBuffer *copy;
+
+    if (!appsrc)
+      continue;
+
+    /* what is queued is already too old to be worth encoding, it is
+     * flushed and the decoder restarts on the next keyframe */
+    if (gst_app_src_get_current_level_bytes (GST_APP_SRC (appsrc)) > RENDITION_QUEUE_BYTES)
+    {
+      gst_element_send_event (appsrc, gst_event_new_flush_start ());
+      gst_element_send_event (appsrc, gst_event_new_flush_stop (FALSE));
+      rendition->keyframe = rendition->appsrc[0] != NULL;
+      rendition->dropping = TRUE;
+    }
+
+    /* the decoder starts on a keyframe, audio waits for it so both
+     * tracks share one offset */
+    if (rendition->keyframe && source->caps[0] && (track != 0 || delta))
+    {
+      if (rendition->dropping)
+      {
+        g_mutex_lock (&rendition->lock);
+        rendition->dropped++;
+        g_mutex_unlock (&rendition->lock);
+      }
+      continue;
+    }
+
+    rendition->dropping = FALSE;
+
+    /* source time is moved onto the running time of the rendition
+     * pipeline, which started later */
+    if (!rendition->synced)
+    {
+      clock = gst_element_get_clock (appsrc);
+      if (!clock)
+        continue;
+
+      rendition->offset = (gint64) (gst_clock_get_time (clock) - gst_element_get_base_time (appsrc)) - (gint64) time;
+      rendition->synced = TRUE;
+      gst_object_unref (clock);
+    }
+
+    rendition->keyframe = FALSE;
+
+    copy = gst_buffer_copy (buffer);
+    if (GST_BUFFER_PTS_IS_VALID (copy))
+      GST_BUFFER_PTS (copy) = MAX ((gint64) GST_BUFFER_PTS (copy) + rendition->offset, 0);
+    if (GST_BUFFER_DTS_IS_VALID (copy))
+      GST_BUFFER_DTS (copy) = MAX ((gint64) GST_BUFFER_DTS (copy) + rendition->offset, 0);
+
+    gst_app_src_push_buffer (GST_APP_SRC (appsrc), copy);
+  }
+
+  g_mutex_unlock (&source->lock);
+}
+
+static void
+rendition_set_caps (GstRTSPRenditionSource *source, guint track, GstCaps *caps)
+{
+  GList *item;
+
+  g_mutex_lock (&source->lock);
+
+  gst_caps_replace (&source->caps[track], caps);
+
+  for (item = source->renditions; item; item = g_list_next (item))
+  {
+    GstRTSPRendition *rendition = item->data;
+
+    if (rendition->appsrc[track])
+      gst_app_src_set_caps (GST_APP_SRC (rendition->appsrc[track]), caps);
+  }
+
+  g_mutex_unlock (&source->lock);
+}
+
+static GstPadProbeReturn
+rendition_source_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPRenditionSource *source)
+{
+  guint track = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "rendition-track"));
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+  {
+    rendition_push (source, track, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+  else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+  {
+    GstCaps *caps;
+
+    gst_event_parse_caps (GST_PAD_PROBE_INFO_EVENT (info), &caps);
+    rendition_set_caps (source, track, caps);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+rendition_source_attach (GstRTSPRenditionSource *source, GstElement *bin)
+{
+  GList *item;
+  guint i;
+
+  /* a new pipeline for the path restarts the timestamps, running
+   * renditions resync on its first keyframe */
+  g_mutex_lock (&source->lock);
+  for (item = source->renditions; item; item = g_list_next (item))
+  {
+    GstRTSPRendition *rendition = item->data;
+
+    rendition->keyframe = rendition->appsrc[0] != NULL;
+    rendition->synced = FALSE;
+  }
+  g_mutex_unlock (&source->lock);
+
+  g_atomic_int_inc (&source->attached);
+
+  for (i = 0; i < RENDITION_TRACKS; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "src");
+    if (pad)
+    {
+      g_object_set_data (G_OBJECT (pad), "rendition-track", GUINT_TO_POINTER (i));
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+          (GstPadProbeCallback) rendition_source_probe, source, NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+}
+
+void
+rendition_source_detach (GstRTSPRenditionSource *source)
+{
+  g_atomic_int_add (&source->attached, -1);
+  rendition_source_release (source);
+}
+
+static void
+rendition_free (GstRTSPRendition *rendition)
+{
+  GstRTSPRenditionSource *source = rendition->source;
+  guint i;
+
+  g_mutex_lock (&source->lock);
+  source->renditions = g_list_remove (source->renditions, rendition);
+  g_mutex_unlock (&source->lock);
+
+  g_print ("rtmp2rtsp: %s: rendition stopped\n", rendition->path);
+
+  rendition_source_release (source);
+
+  for (i = 0; i < RENDITION_TRACKS; i++)
+  {
+    if (rendition->appsrc[i])
+      gst_object_unref (rendition->appsrc[i]);
+  }
+
+  g_queue_clear_full (&rendition->pending, g_free);
+  g_mutex_clear (&rendition->lock);
+  g_free (rendition->path);
+  g_free (rendition);
+}
+
+GstRTSPRendition *
+rendition_new (const gchar *path, GstElement *bin)
+{
+  GstRTSPRendition *rendition;
+  GstRTSPRenditionSource *source;
+  gchar *source_path;
+
+  source_path = rendition_get_source (path);
+  if (!source_path)
+    return NULL;
+
+  source = rendition_source_acquire (source_path);
+  g_free (source_path);
+
+  rendition = g_new0 (GstRTSPRendition, 1);
+  rendition->path = g_strdup (path);
+  rendition->profile = rendition_profile_find (g_strrstr (path, RENDITION_SUFFIX) + strlen (RENDITION_SUFFIX));
+  rendition->source = source;
+  rendition->cpu_last = -1;
+  g_mutex_init (&rendition->lock);
+  g_queue_init (&rendition->pending);
+
+  g_mutex_lock (&source->lock);
+  source->renditions = g_list_prepend (source->renditions, rendition);
+  g_mutex_unlock (&source->lock);
+
+  g_object_set_data_full (G_OBJECT (bin), "rendition", rendition, (GDestroyNotify) rendition_free);
+
+  return rendition;
+}
+
+GstRTSPRendition *
+rendition_get (GstElement *bin)
+{
+  GstRTSPRendition *rendition;
+  GstElement *dynpay;
+
+  dynpay = gst_bin_get_by_name (GST_BIN (bin), "dynpay0");
+  if (!dynpay)
+    return NULL;
+
+  rendition = g_object_get_data (G_OBJECT (dynpay), "rendition");
+  gst_object_unref (dynpay);
+
+  return rendition;
+}
+
+static gint64
+rendition_thread_cpu ()
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return -1;
+
+  return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static GstPadProbeReturn
+rendition_input_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPRendition *rendition)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstRTSPRenditionFrame *frame;
+  gint64 cpu;
+
+  /* decode, scale and encode all run in the appsrc thread, so its cpu
+   * time between two frames is what the last one cost */
+  cpu = rendition_thread_cpu ();
+
+  g_mutex_lock (&rendition->lock);
+
+  if (cpu >= 0 && rendition->cpu_last >= 0 && cpu > rendition->cpu_last)
+    rendition->cpu_ns += cpu - rendition->cpu_last;
+  rendition->cpu_last = cpu;
+
+  if (GST_BUFFER_PTS_IS_VALID (buffer))
+  {
+    frame = g_new (GstRTSPRenditionFrame, 1);
+    frame->pts = GST_BUFFER_PTS (buffer);
+    frame->time = g_get_monotonic_time ();
+    g_queue_push_tail (&rendition->pending, frame);
+
+    if (rendition->pending.length > RENDITION_PENDING)
+      g_free (g_queue_pop_head (&rendition->pending));
+  }
+
+  g_mutex_unlock (&rendition->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+rendition_output_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPRendition *rendition)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstRTSPRenditionFrame *frame;
+  gint64 latency;
+  GList *item;
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&rendition->lock);
+
+  rendition->frames++;
+
+  /* input comes in decode order, the encoder keeps the timestamps, so
+   * the frame is looked up and everything older is gone */
+  for (item = rendition->pending.head; item; item = g_list_next (item))
+  {
+    frame = item->data;
+    if (frame->pts == GST_BUFFER_PTS (buffer))
+      break;
+  }
+
+  if (item)
+  {
+    frame = item->data;
+    latency = g_get_monotonic_time () - frame->time;
+
+    rendition->latency_us = rendition->latency_us ? (rendition->latency_us * 7 + latency) / 8 : latency;
+    rendition->latency_max_us = MAX (rendition->latency_max_us, latency);
+
+    g_queue_delete_link (&rendition->pending, item);
+    g_free (frame);
+  }
+
+  g_mutex_unlock (&rendition->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+rendition_decodebin_pad_added (GstElement *decodebin, GstPad *pad, GstElement *convert)
+{
+  GstPad *sinkpad;
+
+  sinkpad = gst_element_get_static_pad (convert, "sink");
+  if (!gst_pad_is_linked (sinkpad))
+    gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+static void
+rendition_decodebin_element_added (GstBin *decodebin, GstBin *bin, GstElement *element)
+{
+  /* a decoder with threads of its own would hide its cost from the
+   * rendition */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (element), "max-threads"))
+    g_object_set (element, "max-threads", 1, NULL);
+}
+
+static GstElement *
+rendition_element_new (GstElement *bin, const gchar *name)
+{
+  GstElement *element;
+
+  element = gst_element_factory_make (name, NULL);
+  if (!element)
+  {
+    g_print ("rtmp2rtsp: missing element %s\n", name);
+    return NULL;
+  }
+
+  gst_bin_add (GST_BIN (bin), element);
+
+  return element;
+}
+
+static GstElement *
+rendition_fill_video (GstRTSPRendition *rendition, GstElement *bin, GstElement *appsrc)
+{
+  GstElement *decodebin, *convert, *scale, *filter, *encode;
+  GstCaps *caps;
+  GstPad *pad;
+
+  decodebin = rendition_element_new (bin, "decodebin");
+  convert = rendition_element_new (bin, "videoconvert");
+  scale = rendition_element_new (bin, "videoscale");
+  filter = rendition_element_new (bin, "capsfilter");
+  encode = rendition_element_new (bin, "x264enc");
+
+  if (!decodebin || !convert || !scale || !filter || !encode)
+    return NULL;
+
+  caps = gst_caps_new_simple ("video/x-raw",
+      "format", G_TYPE_STRING, "I420",
+      "width", G_TYPE_INT, rendition->profile->width,
+      "height", G_TYPE_INT, rendition->profile->height,
+      "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+      NULL);
+  g_object_set (filter, "caps", caps, NULL);
+  gst_caps_unref (caps);
+
+  /* one encoder thread keeps the cost measurable per rendition and the
+   * frame out without lookahead */
+  gst_util_set_object_arg (G_OBJECT (encode), "tune", "zerolatency");
+  gst_util_set_object_arg (G_OBJECT (encode), "speed-preset", "veryfast");
+  g_object_set (encode,
+      "bitrate", rendition->profile->bitrate,
+      "key-int-max", RENDITION_KEYINT,
+      "threads", 1,
+      NULL);
+
+  if (!gst_element_link (appsrc, decodebin) || !gst_element_link_many (convert, scale, filter, encode, NULL))
+    return NULL;
+
+  g_signal_connect (decodebin, "pad-added", (GCallback) rendition_decodebin_pad_added, convert);
+  g_signal_connect (decodebin, "deep-element-added", (GCallback) rendition_decodebin_element_added, NULL);
+
+  pad = gst_element_get_static_pad (appsrc, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback) rendition_input_probe, rendition, NULL);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (encode, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback) rendition_output_probe, rendition, NULL);
+  gst_object_unref (pad);
+
+  return encode;
+}
+
+gboolean
+rendition_fill (GstRTSPRendition *rendition, GstElement *bin, guint track, GstElement *appsrc, GstElement **last)
+{
+  GstRTSPRenditionSource *source = rendition->source;
+
+  gst_util_set_object_arg (G_OBJECT (appsrc), "format", "time");
+  g_object_set (appsrc, "is-live", TRUE, "block", FALSE, NULL);
+
+  /* audio goes through untouched, only the video is transcoded */
+  *last = track ? appsrc : rendition_fill_video (rendition, bin, appsrc);
+  if (!*last)
+    return FALSE;
+
+  g_mutex_lock (&source->lock);
+  if (source->caps[track])
+    gst_app_src_set_caps (GST_APP_SRC (appsrc), source->caps[track]);
+  rendition->appsrc[track] = gst_object_ref (appsrc);
+  if (track == 0)
+    rendition->keyframe = TRUE;
+  g_mutex_unlock (&source->lock);
+
+  return TRUE;
+}
+
+void
+json_builder_rendition_value (JsonBuilder *builder, GstRTSPRendition *rendition)
+{
+  g_mutex_lock (&rendition->lock);
+
+  json_builder_set_member_name (builder, "rendition");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "name");
+  json_builder_add_string_value (builder, rendition->profile->name);
+  json_builder_set_member_name (builder, "source");
+  json_builder_add_string_value (builder, rendition->source->path);
+  json_builder_set_member_name (builder, "width");
+  json_builder_add_int_value (builder, rendition->profile->width);
+  json_builder_set_member_name (builder, "height");
+  json_builder_add_int_value (builder, rendition->profile->height);
+  json_builder_set_member_name (builder, "bitrate");
+  json_builder_add_int_value (builder, rendition->profile->bitrate * 1000);
+  json_builder_set_member_name (builder, "frames");
+  json_builder_add_int_value (builder, rendition->frames);
+  json_builder_set_member_name (builder, "dropped");
+  json_builder_add_int_value (builder, rendition->dropped);
+  json_builder_set_member_name (builder, "cpu_ms");
+  json_builder_add_int_value (builder, rendition->cpu_ns / 1000000);
+  json_builder_set_member_name (builder, "encode_latency_ms");
+  json_builder_add_int_value (builder, rendition->latency_us / 1000);
+  json_builder_set_member_name (builder, "encode_latency_max_ms");
+  json_builder_add_int_value (builder, rendition->latency_max_us / 1000);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&rendition->lock);
+}
+
+void
+rendition_metrics_append (GString *body, GstRTSPRendition *rendition, const gchar *path)
+{
+  gchar *name = metrics_escape_label (rendition->profile->name);
+
+  g_mutex_lock (&rendition->lock);
+
+  g_string_append_printf (body,
+      "rtmp2rtsp_rendition_cpu_seconds_total{path=\"%s\",rendition=\"%s\"} %g\n",
+      path, name, (gdouble) rendition->cpu_ns / 1e9);
+  g_string_append_printf (body,
+      "rtmp2rtsp_rendition_frames_total{path=\"%s\",rendition=\"%s\"} %" G_GUINT64_FORMAT "\n",
+      path, name, rendition->frames);
+  g_string_append_printf (body,
+      "rtmp2rtsp_rendition_dropped_total{path=\"%s\",rendition=\"%s\"} %" G_GUINT64_FORMAT "\n",
+      path, name, rendition->dropped);
+  g_string_append_printf (body,
+      "rtmp2rtsp_rendition_encode_latency_seconds{path=\"%s\",rendition=\"%s\"} %g\n",
+      path, name, (gdouble) rendition->latency_us / 1e6);
+
+  g_mutex_unlock (&rendition->lock);
+
+  g_free (name);
+}
@@ -0,0 +1,36 @@
+#ifndef __RENDITION_H__
+#define __RENDITION_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+#define RENDITION_TRACKS 2
+#define RENDITION_SUFFIX "/rendition="
+#define RENDITION_QUERY "rendition="
+
+typedef struct _GstRTSPRenditionSource GstRTSPRenditionSource;
+typedef struct _GstRTSPRendition GstRTSPRendition;
+
+void rendition_init ();
+gboolean rendition_enabled ();
+
+gchar *rendition_get_source (const gchar *path);
+gchar *rendition_get_path (const gchar *path, const gchar *query);
+
+GstRTSPRenditionSource *rendition_source_acquire (const gchar *path);
+void rendition_source_release (GstRTSPRenditionSource *source);
+void rendition_source_attach (GstRTSPRenditionSource *source, GstElement *bin);
+void rendition_source_detach (GstRTSPRenditionSource *source);
+
+GstRTSPRendition *rendition_new (const gchar *path, GstElement *bin);
+gboolean rendition_fill (GstRTSPRendition *rendition, GstElement *bin, guint track, GstElement *appsrc,
+    GstElement **last);
+GstRTSPRendition *rendition_get (GstElement *bin);
+
+void json_builder_rendition_value (JsonBuilder *builder, GstRTSPRendition *rendition);
+void rendition_metrics_append (GString *body, GstRTSPRendition *rendition, const gchar *path);
+
+#endif
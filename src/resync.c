@@ -0,0 +1,100 @@
+#include "resync.h"
+
+struct _GstRTSPResync
+{
+  gboolean waiting;
+  guint64 overruns;
+  guint64 dropped;
+};
+
+GstRTSPResync *
+resync_new ()
+{
+  GstRTSPResync *resync;
+
+  resync = g_new0 (GstRTSPResync, 1);
+
+  return resync;
+}
+
+void
+resync_free (GstRTSPResync *resync)
+{
+  g_free (resync);
+}
+
+static void
+resync_overrun (GstElement *queue, GstRTSPResync *resync)
+{
+  /* a leaky queue is about to lose frames the decoder depends on */
+  __atomic_add_fetch (&resync->overruns, 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&resync->waiting, TRUE, __ATOMIC_RELAXED);
+}
+
+static GstPadProbeReturn
+resync_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPResync *resync)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  if (!__atomic_load_n (&resync->waiting, __ATOMIC_RELAXED))
+    return GST_PAD_PROBE_OK;
+
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+  {
+    __atomic_store_n (&resync->waiting, FALSE, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+  }
+
+  __atomic_add_fetch (&resync->dropped, 1, __ATOMIC_RELAXED);
+
+  return GST_PAD_PROBE_DROP;
+}
+
+void
+resync_attach (GstRTSPResync *resync, GstElement *bin)
+{
+  GstElement *queue;
+  GstPad *pad;
+  guint i;
+
+  for (i = 0; i < 2; i++)
+  {
+    gchar *name;
+
+    name = g_strdup_printf ("queue%u", i);
+    queue = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!queue)
+      continue;
+
+    g_signal_connect (queue, "overrun", (GCallback) resync_overrun, resync);
+
+    /* only video needs a keyframe to recover, audio frames stand alone */
+    if (i == 0)
+    {
+      pad = gst_element_get_static_pad (queue, "src");
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+          (GstPadProbeCallback) resync_probe, resync, NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (queue);
+  }
+}
+
+void
+json_builder_resync_value (JsonBuilder *builder, GstRTSPResync *resync)
+{
+  json_builder_set_member_name (builder, "resync");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "waiting");
+  json_builder_add_boolean_value (builder, __atomic_load_n (&resync->waiting, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "overruns");
+  json_builder_add_int_value (builder, __atomic_load_n (&resync->overruns, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "dropped_frames");
+  json_builder_add_int_value (builder, __atomic_load_n (&resync->dropped, __ATOMIC_RELAXED));
+
+  json_builder_end_object (builder);
+}
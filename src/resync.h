@@ -0,0 +1,19 @@
+#ifndef __RESYNC_H__
+#define __RESYNC_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+typedef struct _GstRTSPResync GstRTSPResync;
+
+GstRTSPResync *resync_new ();
+void resync_free (GstRTSPResync *resync);
+
+void resync_attach (GstRTSPResync *resync, GstElement *bin);
+
+void json_builder_resync_value (JsonBuilder *builder, GstRTSPResync *resync);
+
+#endif
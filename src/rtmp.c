@@ -0,0 +1,1166 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <gst/app/gstappsrc.h>
+
+#include "rtmp.h"
+#include "events.h"
+
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_CHUNK_SIZE 128
+#define RTMP_WINDOW_SIZE 2500000
+#define RTMP_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+#define RTMP_AMF_MAX_DEPTH 32
+
+/* a publisher faster than the pipeline drops to the next keyframe
+ * instead of growing the appsrc queue */
+#define RTMP_QUEUE_BYTES (4 * 1024 * 1024)
+
+#define RTMP_MSG_CHUNK_SIZE 1
+#define RTMP_MSG_ACK 3
+#define RTMP_MSG_WINDOW_ACK_SIZE 5
+#define RTMP_MSG_PEER_BANDWIDTH 6
+#define RTMP_MSG_AUDIO 8
+#define RTMP_MSG_VIDEO 9
+#define RTMP_MSG_AMF3_COMMAND 17
+#define RTMP_MSG_AMF0_COMMAND 20
+
+#define RTMP_VIDEO_EX_HEADER 0x80
+#define RTMP_VIDEO_KEYFRAME 1
+#define RTMP_VIDEO_AVC 7
+#define RTMP_VIDEO_HEVC 12
+#define RTMP_VIDEO_SEQUENCE_START 0
+#define RTMP_VIDEO_CODED_FRAMES 1
+#define RTMP_VIDEO_CODED_FRAMES_X 3
+
+#define AMF0_NUMBER 0x00
+#define AMF0_BOOLEAN 0x01
+#define AMF0_STRING 0x02
+#define AMF0_OBJECT 0x03
+#define AMF0_NULL 0x05
+#define AMF0_UNDEFINED 0x06
+#define AMF0_ECMA_ARRAY 0x08
+#define AMF0_OBJECT_END 0x09
+#define AMF0_STRICT_ARRAY 0x0a
+#define AMF0_DATE 0x0b
+#define AMF0_LONG_STRING 0x0c
+
+typedef struct _GstRTMPStream GstRTMPStream;
+
+struct _GstRTMPStream
+{
+  gchar *path;
+  GstElement *appsrc;
+  gboolean publishing;
+  gboolean header;
+  gboolean dropping;
+  GstBuffer *video_config;
+  GstBuffer *audio_config;
+};
+
+typedef struct _GstRTMPChunkStream GstRTMPChunkStream;
+
+struct _GstRTMPChunkStream
+{
+  guint32 timestamp;
+  guint32 delta;
+  guint32 length;
+  guint8 type;
+  guint32 stream_id;
+  gboolean extended;
+  GstBuffer *message;
+  GstMapInfo map;
+  guint32 received;
+};
+
+typedef struct _GstRTMPConnection GstRTMPConnection;
+
+struct _GstRTMPConnection
+{
+  GInputStream *input;
+  GOutputStream *output;
+  guint32 chunk_size;
+  guint32 window;
+  guint64 received;
+  guint64 acked;
+  GHashTable *chunk_streams;
+  gchar *app;
+  GstRTMPStream *stream;
+};
+
+typedef struct _GstAMFReader GstAMFReader;
+
+struct _GstAMFReader
+{
+  const guint8 *data;
+  gsize size;
+  gsize pos;
+  guint depth;
+  gboolean overflow;
+};
+
+static GMutex rtmp_lock;
+static GHashTable *rtmp_streams = NULL;
+
+static GstRTMPStream *
+rtmp_stream_get (const gchar *path)
+{
+  GstRTMPStream *stream;
+
+  stream = g_hash_table_lookup (rtmp_streams, path);
+  if (!stream)
+  {
+    stream = g_new0 (GstRTMPStream, 1);
+    stream->path = g_strdup (path);
+    g_hash_table_insert (rtmp_streams, stream->path, stream);
+  }
+
+  return stream;
+}
+
+static void
+rtmp_stream_release (GstRTMPStream *stream)
+{
+  if (stream->appsrc || stream->publishing)
+    return;
+
+  g_hash_table_remove (rtmp_streams, stream->path);
+
+  gst_buffer_replace (&stream->video_config, NULL);
+  gst_buffer_replace (&stream->audio_config, NULL);
+  g_free (stream->path);
+  g_free (stream);
+}
+
+void
+rtmp_server_attach (const gchar *path, GstElement *appsrc)
+{
+  GstRTMPStream *stream;
+
+  if (!rtmp_streams)
+    return;
+
+  g_mutex_lock (&rtmp_lock);
+  stream = rtmp_stream_get (path);
+  gst_object_replace ((GstObject **) &stream->appsrc, GST_OBJECT (appsrc));
+  stream->header = FALSE;
+  stream->dropping = FALSE;
+  g_mutex_unlock (&rtmp_lock);
+
+  gst_app_src_set_max_bytes (GST_APP_SRC (appsrc), RTMP_QUEUE_BYTES);
+}
+
+void
+rtmp_server_detach (const gchar *path, GstElement *appsrc)
+{
+  GstRTMPStream *stream;
+
+  if (!rtmp_streams)
+    return;
+
+  g_mutex_lock (&rtmp_lock);
+  stream = g_hash_table_lookup (rtmp_streams, path);
+  if (stream && stream->appsrc == appsrc)
+  {
+    gst_object_replace ((GstObject **) &stream->appsrc, NULL);
+    rtmp_stream_release (stream);
+  }
+  g_mutex_unlock (&rtmp_lock);
+}
+
+static GstBuffer *
+rtmp_flv_header ()
+{
+  static const guint8 header[13] =
+  {
+    'F', 'L', 'V', 0x01, 0x05, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00
+  };
+
+  GstBuffer *buffer;
+
+  buffer = gst_buffer_new_allocate (NULL, sizeof (header), NULL);
+  gst_buffer_fill (buffer, 0, header, sizeof (header));
+
+  return buffer;
+}
+
+static void
+rtmp_stream_push (GstRTMPStream *stream, GstBuffer *tag, gboolean config, gboolean keyframe)
+{
+  GstElement *appsrc;
+  GstBuffer *video_config = NULL, *audio_config = NULL;
+  gboolean header = FALSE;
+
+  g_mutex_lock (&rtmp_lock);
+  appsrc = stream->appsrc ? gst_object_ref (stream->appsrc) : NULL;
+
+  /* the appsrc does not block, past max-bytes frames are dropped up to
+   * the next keyframe so the demuxer never sees a broken gop */
+  if (appsrc && !config)
+  {
+    if (gst_app_src_get_current_level_bytes (GST_APP_SRC (appsrc)) >= RTMP_QUEUE_BYTES)
+    {
+      if (!stream->dropping)
+        g_print ("rtmp2rtsp: %s: publisher ahead of pipeline, dropping to next keyframe\n", stream->path);
+      stream->dropping = TRUE;
+    }
+    else if (stream->dropping && (keyframe || !stream->video_config))
+    {
+      stream->dropping = FALSE;
+    }
+
+    if (stream->dropping)
+    {
+      g_mutex_unlock (&rtmp_lock);
+      gst_object_unref (appsrc);
+      gst_buffer_unref (tag);
+      return;
+    }
+  }
+
+  if (appsrc && !stream->header)
+  {
+    header = TRUE;
+    stream->header = TRUE;
+    if (stream->video_config && stream->video_config != tag)
+      video_config = gst_buffer_ref (stream->video_config);
+    if (stream->audio_config && stream->audio_config != tag)
+      audio_config = gst_buffer_ref (stream->audio_config);
+  }
+  g_mutex_unlock (&rtmp_lock);
+
+  if (appsrc)
+  {
+    /* a media attached mid-stream needs the flv header and the codec
+     * configuration before any frame */
+    if (header)
+      gst_app_src_push_buffer (GST_APP_SRC (appsrc), rtmp_flv_header ());
+    if (video_config)
+      gst_app_src_push_buffer (GST_APP_SRC (appsrc), video_config);
+    if (audio_config)
+      gst_app_src_push_buffer (GST_APP_SRC (appsrc), audio_config);
+
+    gst_app_src_push_buffer (GST_APP_SRC (appsrc), tag);
+    gst_object_unref (appsrc);
+  }
+  else
+  {
+    gst_buffer_unref (tag);
+  }
+}
+
+static gboolean
+rtmp_read (GstRTMPConnection *conn, gpointer data, gsize size)
+{
+  gsize read = 0;
+
+  if (size == 0)
+    return TRUE;
+
+  if (!g_input_stream_read_all (conn->input, data, size, &read, NULL, NULL) || read != size)
+    return FALSE;
+
+  conn->received += size;
+
+  return TRUE;
+}
+
+static gboolean
+rtmp_write (GstRTMPConnection *conn, gconstpointer data, gsize size)
+{
+  return g_output_stream_write_all (conn->output, data, size, NULL, NULL, NULL);
+}
+
+static gboolean
+rtmp_send (GstRTMPConnection *conn, guint8 csid, guint8 type, guint32 stream_id,
+    const guint8 *data, gsize size)
+{
+  GByteArray *out;
+  guint8 header[12];
+  guint8 continuation;
+  gsize pos;
+  gboolean res;
+
+  header[0] = csid & 0x3f;
+  header[1] = header[2] = header[3] = 0;
+  header[4] = (size >> 16) & 0xff;
+  header[5] = (size >> 8) & 0xff;
+  header[6] = size & 0xff;
+  header[7] = type;
+  header[8] = stream_id & 0xff;
+  header[9] = (stream_id >> 8) & 0xff;
+  header[10] = (stream_id >> 16) & 0xff;
+  header[11] = (stream_id >> 24) & 0xff;
+
+  continuation = 0xc0 | (csid & 0x3f);
+
+  out = g_byte_array_sized_new (sizeof (header) + size + size / RTMP_CHUNK_SIZE);
+  g_byte_array_append (out, header, sizeof (header));
+
+  for (pos = 0; pos < size; pos += RTMP_CHUNK_SIZE)
+  {
+    if (pos > 0)
+      g_byte_array_append (out, &continuation, 1);
+    g_byte_array_append (out, data + pos, MIN (RTMP_CHUNK_SIZE, size - pos));
+  }
+
+  res = rtmp_write (conn, out->data, out->len);
+
+  g_byte_array_unref (out);
+
+  return res;
+}
+
+static gboolean
+rtmp_send_control (GstRTMPConnection *conn, guint8 type, guint32 value, gint extra)
+{
+  guint8 data[5];
+  gsize size = 4;
+
+  data[0] = (value >> 24) & 0xff;
+  data[1] = (value >> 16) & 0xff;
+  data[2] = (value >> 8) & 0xff;
+  data[3] = value & 0xff;
+
+  if (extra >= 0)
+    data[size++] = extra;
+
+  return rtmp_send (conn, 2, type, 0, data, size);
+}
+
+static void
+amf_write_number (GByteArray *out, gdouble value)
+{
+  guint64 bits;
+  guint8 data[9];
+  gint i;
+
+  memcpy (&bits, &value, sizeof (bits));
+
+  data[0] = AMF0_NUMBER;
+  for (i = 0; i < 8; i++)
+    data[1 + i] = (bits >> (56 - 8 * i)) & 0xff;
+
+  g_byte_array_append (out, data, sizeof (data));
+}
+
+static void
+amf_write_key (GByteArray *out, const gchar *key)
+{
+  guint8 len[2];
+
+  len[0] = (strlen (key) >> 8) & 0xff;
+  len[1] = strlen (key) & 0xff;
+
+  g_byte_array_append (out, len, 2);
+  g_byte_array_append (out, (const guint8 *) key, strlen (key));
+}
+
+static void
+amf_write_string (GByteArray *out, const gchar *value)
+{
+  guint8 type = AMF0_STRING;
+
+  g_byte_array_append (out, &type, 1);
+  amf_write_key (out, value);
+}
+
+static void
+amf_write_null (GByteArray *out)
+{
+  guint8 type = AMF0_NULL;
+
+  g_byte_array_append (out, &type, 1);
+}
+
+static void
+amf_write_object_begin (GByteArray *out)
+{
+  guint8 type = AMF0_OBJECT;
+
+  g_byte_array_append (out, &type, 1);
+}
+
+static void
+amf_write_object_end (GByteArray *out)
+{
+  static const guint8 end[3] = { 0x00, 0x00, AMF0_OBJECT_END };
+
+  g_byte_array_append (out, end, sizeof (end));
+}
+
+static gboolean
+amf_read_u8 (GstAMFReader *reader, guint8 *value)
+{
+  if (reader->pos + 1 > reader->size)
+    return FALSE;
+
+  *value = reader->data[reader->pos++];
+
+  return TRUE;
+}
+
+static gboolean
+amf_read_key (GstAMFReader *reader, gchar **key)
+{
+  guint16 len;
+
+  if (reader->pos + 2 > reader->size)
+    return FALSE;
+
+  len = (reader->data[reader->pos] << 8) | reader->data[reader->pos + 1];
+  reader->pos += 2;
+
+  if (reader->pos + len > reader->size)
+    return FALSE;
+
+  if (key)
+    *key = g_strndup ((const gchar *) reader->data + reader->pos, len);
+  reader->pos += len;
+
+  return TRUE;
+}
+
+static gboolean amf_skip_value (GstAMFReader *reader);
+
+static gboolean
+amf_skip_properties (GstAMFReader *reader)
+{
+  while (reader->pos + 3 <= reader->size)
+  {
+    if (reader->data[reader->pos] == 0 && reader->data[reader->pos + 1] == 0 &&
+        reader->data[reader->pos + 2] == AMF0_OBJECT_END)
+    {
+      reader->pos += 3;
+      return TRUE;
+    }
+
+    if (!amf_read_key (reader, NULL) || !amf_skip_value (reader))
+      return FALSE;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+amf_skip_type (GstAMFReader *reader)
+{
+  guint32 count;
+  guint8 type;
+
+  if (!amf_read_u8 (reader, &type))
+    return FALSE;
+
+  switch (type)
+  {
+  case AMF0_NUMBER:
+    reader->pos += 8;
+    break;
+  case AMF0_BOOLEAN:
+    reader->pos += 1;
+    break;
+  case AMF0_STRING:
+    return amf_read_key (reader, NULL);
+  case AMF0_OBJECT:
+    return amf_skip_properties (reader);
+  case AMF0_NULL:
+  case AMF0_UNDEFINED:
+    break;
+  case AMF0_ECMA_ARRAY:
+    reader->pos += 4;
+    return reader->pos <= reader->size && amf_skip_properties (reader);
+  case AMF0_STRICT_ARRAY:
+    if (reader->pos + 4 > reader->size)
+      return FALSE;
+    count = GST_READ_UINT32_BE (reader->data + reader->pos);
+    reader->pos += 4;
+    while (count-- > 0)
+    {
+      if (!amf_skip_value (reader))
+        return FALSE;
+    }
+    break;
+  case AMF0_DATE:
+    reader->pos += 10;
+    break;
+  case AMF0_LONG_STRING:
+    if (reader->pos + 4 > reader->size)
+      return FALSE;
+    reader->pos += 4 + GST_READ_UINT32_BE (reader->data + reader->pos);
+    break;
+  default:
+    return FALSE;
+  }
+
+  return reader->pos <= reader->size;
+}
+
+static gboolean
+amf_skip_value (GstAMFReader *reader)
+{
+  gboolean res;
+
+  /* objects nest through here, a publisher must not be able to run the
+   * stack out */
+  if (reader->depth >= RTMP_AMF_MAX_DEPTH)
+  {
+    reader->overflow = TRUE;
+    return FALSE;
+  }
+
+  reader->depth++;
+  res = amf_skip_type (reader);
+  reader->depth--;
+
+  return res;
+}
+
+static gboolean
+amf_read_string (GstAMFReader *reader, gchar **value)
+{
+  guint8 type;
+
+  if (!amf_read_u8 (reader, &type) || type != AMF0_STRING)
+    return FALSE;
+
+  return amf_read_key (reader, value);
+}
+
+static gboolean
+amf_read_number (GstAMFReader *reader, gdouble *value)
+{
+  guint64 bits;
+  guint8 type;
+
+  if (!amf_read_u8 (reader, &type) || type != AMF0_NUMBER || reader->pos + 8 > reader->size)
+    return FALSE;
+
+  bits = GST_READ_UINT64_BE (reader->data + reader->pos);
+  memcpy (value, &bits, sizeof (bits));
+  reader->pos += 8;
+
+  return TRUE;
+}
+
+static gchar *
+amf_read_object_string (GstAMFReader *reader, const gchar *name)
+{
+  gchar *key, *value = NULL;
+  guint8 type;
+
+  if (!amf_read_u8 (reader, &type) || type != AMF0_OBJECT)
+    return NULL;
+
+  while (reader->pos + 3 <= reader->size)
+  {
+    if (reader->data[reader->pos] == 0 && reader->data[reader->pos + 1] == 0 &&
+        reader->data[reader->pos + 2] == AMF0_OBJECT_END)
+    {
+      reader->pos += 3;
+      break;
+    }
+
+    if (!amf_read_key (reader, &key))
+      break;
+
+    if (!value && g_str_equal (key, name) &&
+        reader->pos < reader->size && reader->data[reader->pos] == AMF0_STRING)
+    {
+      amf_read_string (reader, &value);
+    }
+    else if (!amf_skip_value (reader))
+    {
+      g_free (key);
+      break;
+    }
+
+    g_free (key);
+  }
+
+  return value;
+}
+
+static gboolean
+rtmp_send_result (GstRTMPConnection *conn, gdouble txn, gboolean stream_id)
+{
+  GByteArray *out;
+  gboolean res;
+
+  out = g_byte_array_new ();
+  amf_write_string (out, "_result");
+  amf_write_number (out, txn);
+  amf_write_null (out);
+  if (stream_id)
+    amf_write_number (out, 1);
+  else
+    amf_write_null (out);
+
+  res = rtmp_send (conn, 3, RTMP_MSG_AMF0_COMMAND, 0, out->data, out->len);
+
+  g_byte_array_unref (out);
+
+  return res;
+}
+
+static gboolean
+rtmp_send_connect_result (GstRTMPConnection *conn, gdouble txn)
+{
+  GByteArray *out;
+  gboolean res;
+
+  out = g_byte_array_new ();
+  amf_write_string (out, "_result");
+  amf_write_number (out, txn);
+
+  amf_write_object_begin (out);
+  amf_write_key (out, "fmsVer");
+  amf_write_string (out, "FMS/3,0,1,123");
+  amf_write_key (out, "capabilities");
+  amf_write_number (out, 31);
+  amf_write_object_end (out);
+
+  amf_write_object_begin (out);
+  amf_write_key (out, "level");
+  amf_write_string (out, "status");
+  amf_write_key (out, "code");
+  amf_write_string (out, "NetConnection.Connect.Success");
+  amf_write_key (out, "description");
+  amf_write_string (out, "Connection succeeded.");
+  amf_write_key (out, "objectEncoding");
+  amf_write_number (out, 0);
+  amf_write_object_end (out);
+
+  res = rtmp_send (conn, 3, RTMP_MSG_AMF0_COMMAND, 0, out->data, out->len);
+
+  g_byte_array_unref (out);
+
+  return res;
+}
+
+static gboolean
+rtmp_send_status (GstRTMPConnection *conn, const gchar *level, const gchar *code)
+{
+  GByteArray *out;
+  gboolean res;
+
+  out = g_byte_array_new ();
+  amf_write_string (out, "onStatus");
+  amf_write_number (out, 0);
+  amf_write_null (out);
+
+  amf_write_object_begin (out);
+  amf_write_key (out, "level");
+  amf_write_string (out, level);
+  amf_write_key (out, "code");
+  amf_write_string (out, code);
+  amf_write_key (out, "description");
+  amf_write_string (out, code);
+  amf_write_object_end (out);
+
+  res = rtmp_send (conn, 5, RTMP_MSG_AMF0_COMMAND, 1, out->data, out->len);
+
+  g_byte_array_unref (out);
+
+  return res;
+}
+
+static gboolean
+rtmp_publish (GstRTMPConnection *conn, const gchar *name)
+{
+  GstRTMPStream *stream;
+  gchar *stream_name, *path;
+
+  if (conn->stream || !conn->app)
+    return FALSE;
+
+  stream_name = g_strdup (name);
+  if (strchr (stream_name, '?'))
+    *strchr (stream_name, '?') = '\0';
+
+  path = g_strdup_printf ("/%s/%s", conn->app, stream_name);
+  g_free (stream_name);
+
+  g_mutex_lock (&rtmp_lock);
+  stream = rtmp_stream_get (path);
+  if (!stream->publishing)
+  {
+    stream->publishing = TRUE;
+    stream->header = FALSE;
+    conn->stream = stream;
+  }
+  g_mutex_unlock (&rtmp_lock);
+
+  if (!conn->stream)
+  {
+    g_print ("rtmp2rtsp: %s: already publishing\n", path);
+    rtmp_send_status (conn, "error", "NetStream.Publish.BadName");
+    g_free (path);
+    return FALSE;
+  }
+
+  g_print ("rtmp2rtsp: %s: publish\n", path);
+
+  events_push ("published", path);
+
+  g_free (path);
+
+  return rtmp_send_status (conn, "status", "NetStream.Publish.Start");
+}
+
+static void
+rtmp_unpublish (GstRTMPConnection *conn)
+{
+  GstRTMPStream *stream = conn->stream;
+  GstElement *appsrc;
+
+  if (!stream)
+    return;
+
+  g_print ("rtmp2rtsp: %s: unpublish\n", stream->path);
+
+  events_push ("unpublished", stream->path);
+
+  g_mutex_lock (&rtmp_lock);
+  appsrc = stream->appsrc ? gst_object_ref (stream->appsrc) : NULL;
+  stream->publishing = FALSE;
+  gst_buffer_replace (&stream->video_config, NULL);
+  gst_buffer_replace (&stream->audio_config, NULL);
+  rtmp_stream_release (stream);
+  g_mutex_unlock (&rtmp_lock);
+
+  conn->stream = NULL;
+
+  if (appsrc)
+  {
+    gst_app_src_end_of_stream (GST_APP_SRC (appsrc));
+    gst_object_unref (appsrc);
+  }
+}
+
+static gboolean
+rtmp_handle_command (GstRTMPConnection *conn, const guint8 *data, gsize size)
+{
+  GstAMFReader reader = { data, size, 0 };
+  gchar *name = NULL, *value = NULL;
+  gdouble txn = 0;
+  gboolean res = TRUE;
+
+  if (!amf_read_string (&reader, &name))
+    return TRUE;
+
+  amf_read_number (&reader, &txn);
+
+  if (g_str_equal (name, "connect"))
+  {
+    g_free (conn->app);
+    conn->app = amf_read_object_string (&reader, "app");
+
+    if (reader.overflow)
+    {
+      g_print ("rtmp2rtsp: connect object nested too deep\n");
+      g_free (name);
+      return FALSE;
+    }
+
+    res = rtmp_send_control (conn, RTMP_MSG_WINDOW_ACK_SIZE, RTMP_WINDOW_SIZE, -1) &&
+        rtmp_send_control (conn, RTMP_MSG_PEER_BANDWIDTH, RTMP_WINDOW_SIZE, 2) &&
+        rtmp_send_connect_result (conn, txn);
+  }
+  else if (g_str_equal (name, "createStream"))
+  {
+    res = rtmp_send_result (conn, txn, TRUE);
+  }
+  else if (g_str_equal (name, "releaseStream") || g_str_equal (name, "FCPublish"))
+  {
+    res = rtmp_send_result (conn, txn, FALSE);
+  }
+  else if (g_str_equal (name, "publish"))
+  {
+    if (amf_skip_value (&reader) && amf_read_string (&reader, &value))
+      res = rtmp_publish (conn, value);
+    else
+      res = FALSE;
+  }
+  else if (g_str_equal (name, "FCUnpublish") || g_str_equal (name, "deleteStream"))
+  {
+    rtmp_unpublish (conn);
+  }
+
+  g_free (name);
+  g_free (value);
+
+  return res;
+}
+
+static GstBuffer *
+rtmp_flv_tag (GstRTMPChunkStream *cs, GstBuffer *payload)
+{
+  guint8 *header, *trailer;
+  guint32 size = cs->length;
+
+  header = g_malloc (11);
+  header[0] = cs->type;
+  header[1] = (size >> 16) & 0xff;
+  header[2] = (size >> 8) & 0xff;
+  header[3] = size & 0xff;
+  header[4] = (cs->timestamp >> 16) & 0xff;
+  header[5] = (cs->timestamp >> 8) & 0xff;
+  header[6] = cs->timestamp & 0xff;
+  header[7] = (cs->timestamp >> 24) & 0xff;
+  header[8] = header[9] = header[10] = 0;
+
+  trailer = g_malloc (4);
+  GST_WRITE_UINT32_BE (trailer, size + 11);
+
+  /* the payload was read from the socket straight into its own memory,
+   * the tag only wraps it */
+  gst_buffer_prepend_memory (payload, gst_memory_new_wrapped (0, header, 11, 0, 11, header, g_free));
+  gst_buffer_append_memory (payload, gst_memory_new_wrapped (0, trailer, 4, 0, 4, trailer, g_free));
+
+  return payload;
+}
+
+static void
+rtmp_parse_video (const guint8 *data, gsize size, gboolean *config, gboolean *keyframe)
+{
+  guint type;
+
+  /* enhanced rtmp keeps a 3 bit frame type next to the ex header bit and
+   * a packet type where legacy tags have the codec id, a fourcc such as
+   * hvc1 follows instead of the avc packet type */
+  if (data[0] & RTMP_VIDEO_EX_HEADER)
+  {
+    if (size < 5)
+      return;
+
+    type = data[0] & 0x0f;
+    *config = type == RTMP_VIDEO_SEQUENCE_START;
+    *keyframe = ((data[0] >> 4) & 0x07) == RTMP_VIDEO_KEYFRAME &&
+        (type == RTMP_VIDEO_CODED_FRAMES || type == RTMP_VIDEO_CODED_FRAMES_X);
+    return;
+  }
+
+  /* avc and legacy hevc sequence headers */
+  type = data[0] & 0x0f;
+  *config = (type == RTMP_VIDEO_AVC || type == RTMP_VIDEO_HEVC) && data[1] == 0;
+  *keyframe = (data[0] >> 4) == RTMP_VIDEO_KEYFRAME;
+}
+
+static gboolean
+rtmp_handle_message (GstRTMPConnection *conn, GstRTMPChunkStream *cs)
+{
+  GstBuffer *message = cs->message;
+  GstMapInfo map;
+  gboolean res = TRUE;
+  gboolean config = FALSE;
+  gboolean keyframe = FALSE;
+
+  cs->message = NULL;
+
+  switch (cs->type)
+  {
+  case RTMP_MSG_CHUNK_SIZE:
+  case RTMP_MSG_WINDOW_ACK_SIZE:
+    if (gst_buffer_map (message, &map, GST_MAP_READ))
+    {
+      if (map.size >= 4)
+      {
+        if (cs->type == RTMP_MSG_CHUNK_SIZE)
+          conn->chunk_size = MAX (GST_READ_UINT32_BE (map.data) & 0x7fffffff, 1);
+        else
+          conn->window = GST_READ_UINT32_BE (map.data);
+      }
+      gst_buffer_unmap (message, &map);
+    }
+    break;
+  case RTMP_MSG_AMF3_COMMAND:
+  case RTMP_MSG_AMF0_COMMAND:
+    if (gst_buffer_map (message, &map, GST_MAP_READ))
+    {
+      if (cs->type == RTMP_MSG_AMF3_COMMAND && map.size > 0)
+        res = rtmp_handle_command (conn, map.data + 1, map.size - 1);
+      else
+        res = rtmp_handle_command (conn, map.data, map.size);
+      gst_buffer_unmap (message, &map);
+    }
+    break;
+  case RTMP_MSG_AUDIO:
+  case RTMP_MSG_VIDEO:
+    if (!conn->stream || cs->length < 2)
+      break;
+
+    if (gst_buffer_map (message, &map, GST_MAP_READ))
+    {
+      /* aac sequence headers */
+      if (cs->type == RTMP_MSG_VIDEO)
+        rtmp_parse_video (map.data, map.size, &config, &keyframe);
+      else
+        config = (map.data[0] >> 4) == 10 && map.data[1] == 0;
+      gst_buffer_unmap (message, &map);
+    }
+
+    message = rtmp_flv_tag (cs, message);
+
+    if (config)
+    {
+      g_mutex_lock (&rtmp_lock);
+      if (cs->type == RTMP_MSG_VIDEO)
+        gst_buffer_replace (&conn->stream->video_config, message);
+      else
+        gst_buffer_replace (&conn->stream->audio_config, message);
+      g_mutex_unlock (&rtmp_lock);
+    }
+
+    rtmp_stream_push (conn->stream, message, config, keyframe);
+    return TRUE;
+  default:
+    break;
+  }
+
+  gst_buffer_unref (message);
+
+  return res;
+}
+
+static GstRTMPChunkStream *
+rtmp_chunk_stream_get (GstRTMPConnection *conn, guint32 csid)
+{
+  GstRTMPChunkStream *cs;
+
+  cs = g_hash_table_lookup (conn->chunk_streams, GUINT_TO_POINTER (csid));
+  if (!cs)
+  {
+    cs = g_new0 (GstRTMPChunkStream, 1);
+    g_hash_table_insert (conn->chunk_streams, GUINT_TO_POINTER (csid), cs);
+  }
+
+  return cs;
+}
+
+static void
+rtmp_chunk_stream_free (GstRTMPChunkStream *cs)
+{
+  if (cs->message)
+  {
+    gst_buffer_unmap (cs->message, &cs->map);
+    gst_buffer_unref (cs->message);
+  }
+
+  g_free (cs);
+}
+
+static gboolean
+rtmp_read_chunk (GstRTMPConnection *conn)
+{
+  GstRTMPChunkStream *cs;
+  guint8 basic, header[11], ext[4];
+  guint32 csid, timestamp = 0, chunk;
+  guint fmt;
+
+  if (!rtmp_read (conn, &basic, 1))
+    return FALSE;
+
+  fmt = basic >> 6;
+  csid = basic & 0x3f;
+
+  if (csid == 0)
+  {
+    if (!rtmp_read (conn, ext, 1))
+      return FALSE;
+    csid = 64 + ext[0];
+  }
+  else if (csid == 1)
+  {
+    if (!rtmp_read (conn, ext, 2))
+      return FALSE;
+    csid = 64 + ext[0] + ext[1] * 256;
+  }
+
+  cs = rtmp_chunk_stream_get (conn, csid);
+
+  if (fmt <= 2)
+  {
+    if (!rtmp_read (conn, header, fmt == 0 ? 11 : fmt == 1 ? 7 : 3))
+      return FALSE;
+
+    timestamp = GST_READ_UINT24_BE (header);
+    cs->extended = timestamp == 0xffffff;
+
+    if (fmt <= 1)
+    {
+      /* a new message header while one is being assembled starts over,
+       * the partial message was sized for the old length */
+      if (cs->message)
+      {
+        gst_buffer_unmap (cs->message, &cs->map);
+        gst_buffer_unref (cs->message);
+        cs->message = NULL;
+      }
+
+      cs->length = GST_READ_UINT24_BE (header + 3);
+      cs->type = header[6];
+    }
+
+    if (fmt == 0)
+      cs->stream_id = GST_READ_UINT32_LE (header + 7);
+  }
+
+  if (cs->extended)
+  {
+    if (!rtmp_read (conn, ext, 4))
+      return FALSE;
+    if (fmt <= 2)
+      timestamp = GST_READ_UINT32_BE (ext);
+  }
+
+  if (!cs->message)
+  {
+    if (fmt == 0)
+    {
+      cs->timestamp = timestamp;
+      cs->delta = 0;
+    }
+    else if (fmt <= 2)
+    {
+      cs->delta = timestamp;
+      cs->timestamp += cs->delta;
+    }
+    else
+    {
+      cs->timestamp += cs->delta;
+    }
+
+    if (cs->length > RTMP_MAX_MESSAGE_SIZE)
+      return FALSE;
+
+    cs->message = gst_buffer_new_allocate (NULL, cs->length, NULL);
+    gst_buffer_map (cs->message, &cs->map, GST_MAP_WRITE);
+    cs->received = 0;
+  }
+
+  if (cs->received > cs->length)
+    return FALSE;
+
+  chunk = MIN (conn->chunk_size, cs->length - cs->received);
+
+  if (!rtmp_read (conn, cs->map.data + cs->received, chunk))
+    return FALSE;
+
+  cs->received += chunk;
+
+  if (conn->window > 0 && conn->received - conn->acked >= conn->window)
+  {
+    conn->acked = conn->received;
+    if (!rtmp_send_control (conn, RTMP_MSG_ACK, conn->received & 0xffffffff, -1))
+      return FALSE;
+  }
+
+  if (cs->received < cs->length)
+    return TRUE;
+
+  gst_buffer_unmap (cs->message, &cs->map);
+
+  return rtmp_handle_message (conn, cs);
+}
+
+static gboolean
+rtmp_handshake (GstRTMPConnection *conn)
+{
+  guint8 *c0c1, *s0s1s2, *c2;
+  gboolean res = FALSE;
+  guint i;
+
+  c0c1 = g_malloc (1 + RTMP_HANDSHAKE_SIZE);
+  s0s1s2 = g_malloc0 (1 + 2 * RTMP_HANDSHAKE_SIZE);
+  c2 = g_malloc (RTMP_HANDSHAKE_SIZE);
+
+  if (!rtmp_read (conn, c0c1, 1 + RTMP_HANDSHAKE_SIZE))
+    goto done;
+
+  s0s1s2[0] = 3;
+  for (i = 9; i < 1 + RTMP_HANDSHAKE_SIZE; i++)
+    s0s1s2[i] = g_random_int () & 0xff;
+  memcpy (s0s1s2 + 1 + RTMP_HANDSHAKE_SIZE, c0c1 + 1, RTMP_HANDSHAKE_SIZE);
+
+  if (!rtmp_write (conn, s0s1s2, 1 + 2 * RTMP_HANDSHAKE_SIZE))
+    goto done;
+
+  if (!rtmp_read (conn, c2, RTMP_HANDSHAKE_SIZE))
+    goto done;
+
+  res = TRUE;
+
+done:
+  g_free (c0c1);
+  g_free (s0s1s2);
+  g_free (c2);
+
+  return res;
+}
+
+static gboolean
+rtmp_run (GThreadedSocketService *service, GSocketConnection *connection,
+    GObject *source_object, gpointer data)
+{
+  GstRTMPConnection conn;
+
+  memset (&conn, 0, sizeof (conn));
+  conn.input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  conn.output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  conn.chunk_size = RTMP_CHUNK_SIZE;
+  conn.chunk_streams = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) rtmp_chunk_stream_free);
+
+  /* one blocking thread per publisher, players are served over rtsp */
+  if (rtmp_handshake (&conn))
+  {
+    while (rtmp_read_chunk (&conn))
+      ;
+  }
+
+  rtmp_unpublish (&conn);
+
+  g_hash_table_destroy (conn.chunk_streams);
+  g_free (conn.app);
+
+  return TRUE;
+}
+
+gboolean
+rtmp_server_init (const gchar *host, const gchar *port)
+{
+  GSocketService *service;
+  GSocketAddress *address;
+  GError *error = NULL;
+
+  rtmp_streams = g_hash_table_new (g_str_hash, g_str_equal);
+
+  service = g_threaded_socket_service_new (-1);
+
+  address = g_inet_socket_address_new_from_string (host, atoi (port));
+  if (!address)
+  {
+    g_print ("rtmp2rtsp: failed to parse rtmp address %s:%s\n", host, port);
+    return FALSE;
+  }
+
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+          G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error))
+  {
+    g_print ("rtmp2rtsp: failed to listen rtmp at %s:%s: %s\n", host, port, error->message);
+    g_error_free (error);
+    g_object_unref (address);
+    return FALSE;
+  }
+
+  g_object_unref (address);
+
+  g_signal_connect (service, "run", (GCallback) rtmp_run, NULL);
+
+  g_socket_service_start (service);
+
+  g_print ("rtmp2rtsp: run rtmp at %s:%s\n", host, port);
+
+  return TRUE;
+}
@@ -0,0 +1,13 @@
+#ifndef __RTMP_H__
+#define __RTMP_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+gboolean rtmp_server_init (const gchar *host, const gchar *port);
+
+void rtmp_server_attach (const gchar *path, GstElement *appsrc);
+void rtmp_server_detach (const gchar *path, GstElement *appsrc);
+
+#endif
@@ -1,9 +1,54 @@
+#include <string.h>
+
 #include "rtsp.h"
+#include "taskpool.h"
+#include "gopcache.h"
+#include "stat.h"
+#include "metrics.h"
+#include "meta.h"
+#include "events.h"
+#include "rtmp.h"
+#include "batch.h"
+#include "resync.h"
+#include "backlog.h"
+#include "slab.h"
+#include "factory.h"
+#include "upstream.h"
+#include "shard.h"
+#include "edge.h"
+#include "timeshift.h"
+#include "hls.h"
+#include "whep.h"
+#include "rendition.h"
+#include "thumbnail.h"
+
+#define RTSP_LOW_LATENCY_QUEUE_MS 200
+#define RTSP_LOW_LATENCY_MS 0
+#define RTSP_PREPARE_THREADS 4
+
+struct _GstRTSPMediaTable
+{
+  GMutex lock;
+  GHashTable *table;
+  gint version;
+  GMutex snapshot_lock;
+  gint snapshot_version;
+  GPtrArray *snapshot;
+};
+
+typedef struct _GstRTSPSnapshotItem GstRTSPSnapshotItem;
+
+struct _GstRTSPSnapshotItem
+{
+  gchar *path;
+  gchar *body;
+};
 
 typedef struct _GstRTSPOpaque GstRTSPOpaque;
 
 struct _GstRTSPOpaque
 {
+  GMutex lock;
   GstRTSPMediaTable *media_table;
   gchar *rtmp_host;
   gchar *rtmp_port;
@@ -11,16 +56,70 @@ struct _GstRTSPOpaque
   gchar *rtsp_host;
   gchar *rtsp_port;
   guint rtsp_timeout;
+  guint workers;
+  gboolean gop_cache;
+  gboolean rtmp_listen;
+  GstRTSPAddressPool *address_pool;
+  guint multicast_ttl;
+  gboolean low_latency;
+  gchar *backup_host;
+  gchar *backup_port;
+  guint reconnect_timeout;
+  gboolean slate;
+  guint track_window;
+  gchar *upstream;
+  gboolean upstream_forward;
+  GThreadPool *prepares;
+};
+
+typedef void (*GstRTSPPrepareFunc) (gpointer data);
+
+typedef struct _GstRTSPPrepareJob GstRTSPPrepareJob;
+
+struct _GstRTSPPrepareJob
+{
+  GstRTSPPrepareFunc func;
+  gpointer data;
+};
+
+typedef struct _GstRTSPMulticast GstRTSPMulticast;
+
+struct _GstRTSPMulticast
+{
+  gchar *address;
+  guint port[MEDIA_META_TRACKS];
+  guint ttl;
 };
 
+static void
+rtsp_prepare_run (GstRTSPPrepareJob *job, gpointer user_data)
+{
+  job->func (job->data);
+  g_free (job);
+}
+
+static void
+rtsp_prepare_push (GstRTSPOpaque *opaque, GstRTSPPrepareFunc func, gpointer data)
+{
+  GstRTSPPrepareJob *job;
+
+  job = g_new0 (GstRTSPPrepareJob, 1);
+  job->func = func;
+  job->data = data;
+
+  g_thread_pool_push (opaque->prepares, job, NULL);
+}
+
 static GstRTSPOpaque *
 rtsp_opaque_new (GstRTSPMediaTable *media_table,
     const gchar *rtmp_host, const gchar *rtmp_port, guint rtmp_timeout,
-    const gchar *rtsp_host, const gchar *rtsp_port, guint rtsp_timeout)
+    const gchar *rtsp_host, const gchar *rtsp_port, guint rtsp_timeout,
+    guint workers, gboolean gop_cache, gboolean rtmp_listen)
 {
   GstRTSPOpaque *opaque;
 
   opaque = g_new0 (GstRTSPOpaque, 1);
+  g_mutex_init (&opaque->lock);
   opaque->media_table = media_table;
   opaque->rtmp_host = g_strdup (rtmp_host);
   opaque->rtmp_port = g_strdup (rtmp_port);
@@ -28,6 +127,15 @@ rtsp_opaque_new (GstRTSPMediaTable *media_table,
   opaque->rtsp_host = g_strdup (rtsp_host);
   opaque->rtsp_port = g_strdup (rtsp_port);
   opaque->rtsp_timeout = rtsp_timeout;
+  opaque->workers = workers;
+  opaque->gop_cache = gop_cache;
+  opaque->rtmp_listen = rtmp_listen;
+  opaque->track_window = RELAY_TRACK_WINDOW_MS;
+
+  /* prepares block until the upstream has caps, prepulls and rendition
+   * holds wait their turn on as many threads as serve clients */
+  opaque->prepares = g_thread_pool_new ((GFunc) rtsp_prepare_run, NULL,
+      workers > 0 ? workers : RTSP_PREPARE_THREADS, FALSE, NULL);
 
   return opaque;
 }
@@ -39,14 +147,27 @@ rtsp_opaque_free (GstRTSPOpaque *opaque)
   g_free (opaque->rtmp_port);
   g_free (opaque->rtsp_host);
   g_free (opaque->rtsp_port);
+  if (opaque->address_pool)
+    g_object_unref (opaque->address_pool);
+  g_free (opaque->backup_host);
+  g_free (opaque->backup_port);
+  g_free (opaque->upstream);
+  g_thread_pool_free (opaque->prepares, FALSE, TRUE);
+  g_mutex_clear (&opaque->lock);
   g_free (opaque);
 }
 
 GstRTSPMediaTable *
 rtsp_media_table_new ()
 {
-  GstRTSPMediaTable *media_table =
-      g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) g_free, NULL);
+  GstRTSPMediaTable *media_table;
+
+  media_table = g_new0 (GstRTSPMediaTable, 1);
+  g_mutex_init (&media_table->lock);
+  media_table->table =
+      g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) g_free, (GDestroyNotify) g_object_unref);
+  g_mutex_init (&media_table->snapshot_lock);
+  media_table->snapshot_version = -1;
 
   return media_table;
 }
@@ -54,33 +175,88 @@ rtsp_media_table_new ()
 void
 rtsp_media_table_free (GstRTSPMediaTable *media_table)
 {
-  g_hash_table_destroy (media_table);
+  g_hash_table_destroy (media_table->table);
+  g_mutex_clear (&media_table->lock);
+  if (media_table->snapshot)
+    g_ptr_array_unref (media_table->snapshot);
+  g_mutex_clear (&media_table->snapshot_lock);
+  g_free (media_table);
+}
+
+static void
+rtsp_media_table_touch (GstRTSPMediaTable *media_table)
+{
+  g_atomic_int_inc (&media_table->version);
+}
+
+static GList *
+rtsp_media_table_list (GstRTSPMediaTable *media_table)
+{
+  GList *list;
+
+  g_mutex_lock (&media_table->lock);
+  list = g_hash_table_get_values (media_table->table);
+  g_list_foreach (list, (GFunc) g_object_ref, NULL);
+  g_mutex_unlock (&media_table->lock);
+
+  return list;
+}
+
+static gint64 *
+rtsp_object_set_time (GObject *object, const gchar *key)
+{
+  gint64 *time;
+
+  time = g_new (gint64, 1);
+  *time = g_get_monotonic_time ();
+  g_object_set_data_full (object, key, time, g_free);
+
+  return time;
+}
+
+static gint64
+rtsp_object_get_time (GObject *object, const gchar *key)
+{
+  gint64 *time = g_object_get_data (object, key);
+
+  return time ? *time : 0;
 }
 
 static void rtsp_client_connected (GstRTSPServer *server, GstRTSPClient *client);
+static void rtsp_client_closed (GstRTSPClient *client, GstRTSPServer *server);
 
+static GstRTSPMediaFactory * rtsp_factory_new (GstRTSPOpaque *opaque, const gchar *path);
+static GstRTSPMediaFactory * rtsp_factory_mount (GstRTSPServer *server, const GstRTSPUrl *uri);
+
+static GstRTSPStatusCode rtsp_shard_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
+static void rtsp_shard_send_message (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPMessage *message, GstRTSPServer *server);
 static void rtsp_options_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
 static void rtsp_describe_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
 static void rtsp_setup_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
+static void rtsp_play_send_message (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPMessage *message, GstRTSPServer *server);
 static void rtsp_play_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
 static void rtsp_pause_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
 static void rtsp_teardown_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server);
 
 static void rtsp_media_configure (GstRTSPMediaFactory *factory, GstRTSPMedia *media, GstRTSPServer *server);
+static void rtsp_media_attach_metrics (GstRTSPMedia *media, GstElement *bin);
+static void rtsp_media_attach_source (GstRTSPMedia *media, GstElement *bin, gboolean attach);
+static void rtsp_media_attach_multicast (GstRTSPMedia *media);
 static void rtsp_media_prepared (GstRTSPMedia *media, GstRTSPServer *server);
 static void rtsp_media_unprepared (GstRTSPMedia *media, GstRTSPServer *server);
 static void rtsp_media_target_state (GstRTSPMedia *media, GstState state, GstRTSPServer *server);
 static void rtsp_media_new_state (GstRTSPMedia *media, GstState state, GstRTSPServer *server);
 
 static gboolean rtsp_session_pool_cleanup (GstRTSPServer *server);
+static gboolean rtsp_media_table_sample (GstRTSPMediaTable *media_table);
+static gboolean rtsp_media_table_backlog (GstRTSPMediaTable *media_table);
 
+static gboolean rtsp_media_table_is_prepared (GstRTSPMediaTable *media_table, const gchar *path);
 static void rtsp_media_insert (GstRTSPMediaTable *media_table, GstRTSPMedia *media);
 static void rtsp_media_remove (GstRTSPMediaTable *media_table, GstRTSPMedia *media);
 
 static gchar * rtsp_media_get_status (GstRTSPMedia *media);
 
-static GstStructure * rtsp_media_get_structure (GstRTSPMedia *media, const gchar *name);
-
 static gboolean
 rtsp_media_get_video_props (GstRTSPMedia *media,
     gchar **codec, gint *width, gint *height, gint *framerate_num, gint *framerate_den);
@@ -97,17 +273,19 @@ static void rtsp_media_table_stat (GstRTSPMediaTable *media_table,
     guint *streams_num, guint *streams_bps,
     guint *clients_num, guint *clients_bps);
 
-void
+GstRTSPServer *
 rtsp_init (GstRTSPMediaTable *media_table,
     const gchar *rtmp_host, const gchar *rtmp_port, guint rtmp_timeout,
-    const gchar *rtsp_host, const gchar *rtsp_port, guint rtsp_timeout)
+    const gchar *rtsp_host, const gchar *rtsp_port, guint rtsp_timeout,
+    guint workers, gboolean gop_cache, gboolean rtmp_listen)
 {
   GstRTSPOpaque *opaque;
   GstRTSPServer *server;
 
   opaque = rtsp_opaque_new (media_table,
       rtmp_host, rtmp_port, rtmp_timeout,
-      rtsp_host, rtsp_port, rtsp_timeout);
+      rtsp_host, rtsp_port, rtsp_timeout,
+      workers, gop_cache, rtmp_listen);
 
   server = gst_rtsp_server_new ();
 
@@ -116,323 +294,1581 @@ rtsp_init (GstRTSPMediaTable *media_table,
   gst_rtsp_server_set_address (server, rtsp_host);
   gst_rtsp_server_set_service (server, rtsp_port);
 
-  if (gst_rtsp_server_attach (server, NULL) == 0) {
-    g_print ("rtmp2rtsp: failed to attach\n");
-    return;
+  if (opaque->workers > 0)
+  {
+    GstRTSPThreadPool *thread_pool;
+
+    /* every client gets attached to the GMainContext of one of the pool
+     * threads, which are handed out round-robin once all are created */
+    thread_pool = gst_rtsp_server_get_thread_pool (server);
+    gst_rtsp_thread_pool_set_max_threads (thread_pool, opaque->workers);
+    g_object_unref (thread_pool);
   }
 
-  g_signal_connect (server, "client-connected", (GCallback) rtsp_client_connected, NULL);
+  return server;
+}
 
-  g_timeout_add_seconds (opaque->rtsp_timeout, (GSourceFunc) rtsp_session_pool_cleanup, server);
+typedef struct _GstRTSPClientContext GstRTSPClientContext;
+
+struct _GstRTSPClientContext
+{
+  GstRTSPServer *server;
+  GstRTSPClient *client;
+  GstRTSPThread *thread;
+};
+
+static gboolean
+rtsp_client_context_free (GstRTSPClientContext *cctx)
+{
+  if (cctx->thread)
+    gst_rtsp_thread_stop (cctx->thread);
 
-  g_print ("rtmp2rtsp: run rtsp at %s:%s from %s:%s\n", rtsp_host, rtsp_port, rtmp_host, rtmp_port);
+  g_object_unref (cctx->client);
+  g_object_unref (cctx->server);
+  g_free (cctx);
+
+  return G_SOURCE_REMOVE;
 }
 
 static void
-rtsp_client_connected (GstRTSPServer *server, GstRTSPClient *client)
+rtsp_client_unmanage (GstRTSPClient *client, GstRTSPClientContext *cctx)
 {
-  g_print ("rtmp2rtsp: client connected\n");
+  GSource *source;
 
-  g_signal_connect (client, "options-request", (GCallback) rtsp_options_request, server);
-  g_signal_connect (client, "describe-request", (GCallback) rtsp_describe_request, server);
-  g_signal_connect (client, "setup-request", (GCallback) rtsp_setup_request, server);
-  g_signal_connect (client, "play-request", (GCallback) rtsp_play_request, server);
-  g_signal_connect (client, "pause-request", (GCallback) rtsp_pause_request, server);
-  g_signal_connect (client, "teardown-request", (GCallback) rtsp_teardown_request, server);
+  /* closed is emitted from the client thread, which is only let go of
+   * once the emission is over */
+  if (!cctx->thread)
+  {
+    rtsp_client_context_free (cctx);
+    return;
+  }
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, (GSourceFunc) rtsp_client_context_free, cctx, NULL);
+  g_source_attach (source, cctx->thread->context);
+  g_source_unref (source);
 }
 
-static void
-rtsp_options_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+static gboolean
+rtsp_server_accept (GSocket *socket, GIOCondition condition, GstRTSPServer *server)
 {
-  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
-  GstRTSPUrl *uri = ctx->uri;
-  GstRTSPMountPoints *mp;
-  GstRTSPMediaFactory *factory;
+  GstRTSPConnection *connection = NULL;
+  GstRTSPThreadPool *thread_pool;
+  GstRTSPClientContext *cctx;
+  GstRTSPContext ctx = { NULL };
+  GMainContext *context = NULL;
+  GstRTSPClient *client;
+  GSource *watch;
+  guint id;
 
-  g_print ("rtmp2rtsp: %s: options request\n", uri->abspath);
+  if (!(condition & G_IO_IN))
+    return G_SOURCE_CONTINUE;
 
-  mp = gst_rtsp_server_get_mount_points (server);
+  if (gst_rtsp_connection_accept (socket, &connection, NULL) != GST_RTSP_OK)
+    return G_SOURCE_CONTINUE;
 
-  factory = gst_rtsp_mount_points_match (mp, uri->abspath, NULL);
+  /* what gst_rtsp_server_attach does, except that the id of the client
+   * watch is kept, the backlog of a tcp viewer is read from it */
+  client = GST_RTSP_SERVER_GET_CLASS (server)->create_client (server);
+  gst_rtsp_client_set_connection (client, connection);
 
-  if (!factory)
-  {
-    gchar *launch;
+  g_signal_emit_by_name (server, "client-connected", client);
 
-    factory = gst_rtsp_media_factory_new ();
+  cctx = g_new0 (GstRTSPClientContext, 1);
+  cctx->server = g_object_ref (server);
+  cctx->client = client;
 
-    g_object_set_data_full (G_OBJECT (factory), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+  g_signal_connect (client, "closed", (GCallback) rtsp_client_unmanage, cctx);
 
-    launch = g_strdup_printf (
-        "( "
-        "rtmpsrc location=rtmp://%s:%s%s timeout=%u "
-        "! flvdemux name=demux "
-        "demux.video "
-        "! queue "
-        "! h264parse name=parse0 "
-        "! rtph264pay name=pay0 pt=96 "
-        "demux.audio "
-        "! queue "
-        "! aacparse name=parse1 "
-        "! rtpmp4apay name=pay1 pt=97 "
-        ")",
-        opaque->rtmp_host, opaque->rtmp_port, uri->abspath, opaque->rtmp_timeout);
-
-    gst_rtsp_media_factory_set_launch (factory, launch);
-    gst_rtsp_media_factory_set_shared (factory, TRUE);
-    gst_rtsp_media_factory_set_eos_shutdown (factory, TRUE);
+  ctx.server = server;
+  ctx.client = client;
 
-    g_signal_connect (factory, "media-configure", (GCallback) rtsp_media_configure, server);
+  thread_pool = gst_rtsp_server_get_thread_pool (server);
+  cctx->thread = gst_rtsp_thread_pool_get_thread (thread_pool, GST_RTSP_THREAD_TYPE_CLIENT, &ctx);
+  g_object_unref (thread_pool);
 
-    gst_rtsp_mount_points_add_factory (mp, uri->abspath, factory);
+  if (cctx->thread)
+    context = cctx->thread->context;
 
-    g_free (launch);
-  }
-  else
-  {
-    g_object_unref (factory);
-  }
+  id = gst_rtsp_client_attach (client, context);
 
-  g_object_unref (mp);
+  /* the client keeps a reference on its watch for as long as it lives,
+   * so the source stays valid even if it is destroyed right away */
+  watch = id ? g_main_context_find_source_by_id (context, id) : NULL;
+  if (watch)
+    g_object_set_data_full (G_OBJECT (client), "watch", g_source_ref (watch), (GDestroyNotify) g_source_unref);
+
+  return G_SOURCE_CONTINUE;
 }
 
-static void
-rtsp_describe_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+gboolean
+rtsp_attach (GstRTSPServer *server)
 {
-  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GSource *source;
+  GError *error = NULL;
+
+  /* clients and publishers only come in once every setting is applied,
+   * the first factory is already built with them */
+  source = gst_rtsp_server_create_source (server, NULL, &error);
+  if (!source) {
+    g_print ("rtmp2rtsp: failed to attach: %s\n", error ? error->message : "");
+    g_clear_error (&error);
+    return FALSE;
+  }
 
-  g_print ("rtmp2rtsp: %s: describe request\n", uri->abspath);
+  g_source_set_callback (source, (GSourceFunc) rtsp_server_accept, g_object_ref (server), g_object_unref);
+  g_source_attach (source, NULL);
+  g_source_unref (source);
+
+  g_signal_connect (server, "client-connected", (GCallback) rtsp_client_connected, NULL);
+
+  g_timeout_add_seconds (opaque->rtsp_timeout, (GSourceFunc) rtsp_session_pool_cleanup, server);
+  g_timeout_add_seconds (1, (GSourceFunc) rtsp_media_table_sample, opaque->media_table);
+  g_timeout_add (200, (GSourceFunc) rtsp_media_table_backlog, opaque->media_table);
+
+  if (opaque->rtmp_listen && !rtmp_server_init (opaque->rtmp_host, opaque->rtmp_port))
+    return FALSE;
+
+  g_print ("rtmp2rtsp: run rtsp at %s:%s from %s:%s with %u workers\n",
+      opaque->rtsp_host, opaque->rtsp_port, opaque->rtmp_host, opaque->rtmp_port, opaque->workers);
+
+  return TRUE;
 }
 
-static void
-rtsp_setup_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+gboolean
+rtsp_set_profile (GstRTSPServer *server, const gchar *profile)
 {
-  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
 
-  g_print ("rtmp2rtsp: %s: setup request\n", uri->abspath);
+  if (g_strcmp0 (profile, "default") == 0)
+    opaque->low_latency = FALSE;
+  else if (g_strcmp0 (profile, "low-latency") == 0)
+    opaque->low_latency = TRUE;
+  else
+  {
+    g_print ("rtmp2rtsp: unknown profile %s\n", profile);
+    return FALSE;
+  }
+
+  g_print ("rtmp2rtsp: run %s profile\n", profile);
+
+  return TRUE;
 }
 
-static void
-rtsp_play_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+void
+rtsp_set_failover (GstRTSPServer *server, guint reconnect_timeout,
+    const gchar *backup_host, const gchar *backup_port, gboolean slate)
 {
-  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
 
-  g_print ("rtmp2rtsp: %s: play request\n", uri->abspath);
+  opaque->reconnect_timeout = reconnect_timeout;
+  opaque->backup_host = g_strdup (backup_host);
+  opaque->backup_port = g_strdup (backup_port);
+  opaque->slate = slate;
+
+  g_print ("rtmp2rtsp: reconnect upstream for %u seconds%s%s%s%s%s\n", reconnect_timeout,
+      backup_host ? " with backup " : "", backup_host ? backup_host : "",
+      backup_host ? ":" : "", backup_host ? backup_port : "",
+      slate ? " and slate" : "");
 }
 
-static void
-rtsp_pause_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+void
+rtsp_set_upstream (GstRTSPServer *server, const gchar *upstream, gboolean forward)
 {
-  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
 
-  g_print ("rtmp2rtsp: %s: pause request\n", uri->abspath);
+  /* the path of the request is appended, so no trailing slash */
+  opaque->upstream = g_strdup (upstream);
+  if (g_str_has_suffix (opaque->upstream, "/"))
+    opaque->upstream[strlen (opaque->upstream) - 1] = '\0';
+  opaque->upstream_forward = forward;
+
+  g_print ("rtmp2rtsp: run edge of %s%s\n", opaque->upstream, forward ? " forwarding rtp" : "");
 }
 
-static void
-rtsp_teardown_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+void
+rtsp_set_track_window (GstRTSPServer *server, guint track_window)
 {
-  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
 
-  g_print ("rtmp2rtsp: %s: teardown request\n", uri->abspath);
+  opaque->track_window = track_window;
 }
 
-static void
-rtsp_media_configure (GstRTSPMediaFactory *factory, GstRTSPMedia *media, GstRTSPServer *server)
+void
+rtsp_set_timeshift (GstRTSPServer *server, const gchar *dir, guint size_mb, const gchar *prefix)
 {
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (factory), "uri");
-
-  g_print ("rtmp2rtsp: %s: media configure\n", uri->abspath);
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
 
-  g_object_set_data_full (G_OBJECT (media), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+  timeshift_init (dir, size_mb, prefix, &opaque->media_table->version);
+}
 
-  gst_rtsp_media_set_reusable (media, TRUE);
+void
+rtsp_set_whep (GstRTSPServer *server)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
 
-  g_signal_connect (media, "prepared", (GCallback) rtsp_media_prepared, server);
-  g_signal_connect (media, "unprepared", (GCallback) rtsp_media_unprepared, server);
-  g_signal_connect (media, "target-state", (GCallback) rtsp_media_target_state, server);
-  g_signal_connect (media, "new-state", (GCallback) rtsp_media_new_state, server);
+  whep_init (&opaque->media_table->version);
 }
 
-static void
-rtsp_media_prepared (GstRTSPMedia *media, GstRTSPServer *server)
+void
+rtsp_set_renditions (GstRTSPServer *server)
 {
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
-
-  g_print ("rtmp2rtsp: %s: media prepared\n", uri->abspath);
+  rendition_init ();
 }
 
-static void
-rtsp_media_unprepared (GstRTSPMedia *media, GstRTSPServer *server)
+void
+rtsp_set_warm_pool (GstRTSPServer *server, guint size)
 {
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPMediaFactory *template;
 
-  g_print ("rtmp2rtsp: %s: media unprepared\n", uri->abspath);
+  template = rtsp_factory_new (opaque, "/");
+  relay_factory_pool_init (size, template);
+  g_object_unref (template);
 }
 
-static void
-rtsp_media_target_state (GstRTSPMedia *media, GstState state, GstRTSPServer *server)
+gboolean
+rtsp_set_multicast (GstRTSPServer *server, const gchar *range, guint ttl)
 {
   GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
-
-  g_print ("rtmp2rtsp: %s: media target state %d\n", uri->abspath, state);
+  GstRTSPAddressPool *pool;
+  gchar **addresses;
+  gboolean res;
 
-  if (state == GST_STATE_PLAYING)
+  if (ttl == 0 || ttl > 255)
   {
-    rtsp_media_insert (opaque->media_table, media);
+    g_print ("rtmp2rtsp: invalid multicast ttl %u\n", ttl);
+    return FALSE;
   }
 
-  if (state == GST_STATE_NULL)
+  addresses = g_strsplit (range, "-", 2);
+
+  if (!addresses[0] || !addresses[1])
   {
-    rtsp_media_remove (opaque->media_table, media);
-    gst_rtsp_mount_points_remove_factory (
-        gst_rtsp_server_get_mount_points (server), uri->abspath);
+    g_print ("rtmp2rtsp: failed to parse multicast range %s\n", range);
+    g_strfreev (addresses);
+    return FALSE;
   }
 
-  gst_rtsp_media_get_stream (media, 0);
-}
-
-static void
-rtsp_media_new_state (GstRTSPMedia *media, GstState state, GstRTSPServer *server)
-{
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  pool = gst_rtsp_address_pool_new ();
 
-  g_print ("rtmp2rtsp: %s: media new state %d\n", uri->abspath, state);
-}
+  res = gst_rtsp_address_pool_add_range (pool, addresses[0], addresses[1], 5000, 65534, ttl);
 
-static gboolean
-rtsp_session_pool_cleanup (GstRTSPServer *server)
-{
-  GstRTSPSessionPool *pool;
+  g_strfreev (addresses);
 
-  pool = gst_rtsp_server_get_session_pool (server);
-  gst_rtsp_session_pool_cleanup (pool);
-  g_object_unref (pool);
+  if (!res)
+  {
+    g_print ("rtmp2rtsp: failed to add multicast range %s\n", range);
+    g_object_unref (pool);
+    return FALSE;
+  }
 
-  return TRUE;
-}
+  opaque->address_pool = pool;
+  opaque->multicast_ttl = ttl;
 
-static void
-rtsp_media_insert (GstRTSPMediaTable *media_table, GstRTSPMedia *media)
-{
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  g_print ("rtmp2rtsp: run multicast in %s with ttl %u\n", range, ttl);
 
-  g_hash_table_insert (media_table, g_strdup (uri->abspath), media);
+  return TRUE;
 }
 
-static void
-rtsp_media_remove (GstRTSPMediaTable *media_table, GstRTSPMedia *media)
+static GstRTSPMedia *
+rtsp_prepull_media (GstRTSPServer *server, GstRTSPMediaFactory *factory, gboolean once)
 {
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
-
-  g_hash_table_remove (media_table, uri->abspath);
-}
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (factory), "uri");
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPThreadPool *thread_pool;
+  GstRTSPThread *thread;
+  GstRTSPMedia *media;
 
-static gchar *
-rtsp_media_get_status (GstRTSPMedia *media)
-{
-  switch (gst_rtsp_media_get_status (media))
+  media = gst_rtsp_media_factory_construct (factory, uri);
+  if (!media)
   {
-  case GST_RTSP_MEDIA_STATUS_UNPREPARED:
-    return "unprepared";
-  case GST_RTSP_MEDIA_STATUS_UNPREPARING:
-    return "unpreparing";
-  case GST_RTSP_MEDIA_STATUS_PREPARED:
-    return "prepared";
-  case GST_RTSP_MEDIA_STATUS_PREPARING:
-    return "preparing";
-  case GST_RTSP_MEDIA_STATUS_SUSPENDED:
-    return "suspended";
-  case GST_RTSP_MEDIA_STATUS_ERROR:
-    return "error";
-  default:
-    return "";
+    g_print ("rtmp2rtsp: %s: failed to construct media\n", uri->abspath);
+    return NULL;
   }
-}
-
-static GstStructure *
-rtsp_media_get_structure (GstRTSPMedia *media, const gchar *name)
-{
-  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
-  GstElement *bin, *element;
-  GstStructure *structure;
-  GList *item;
 
-  bin = gst_rtsp_media_get_element (media);
-  if (!bin)
+  /* a prepull holds at most one prepare of a media that nobody else
+   * prepared, however often it is asked for */
+  if (once && (gst_rtsp_media_get_status (media) == GST_RTSP_MEDIA_STATUS_PREPARED ||
+      g_object_get_data (G_OBJECT (media), "prepulled")))
   {
-    g_print ("rtmp2rtsp: %s: failed to get bin\n", uri->abspath);
+    g_object_unref (media);
     return NULL;
   }
 
-  element = gst_bin_get_by_name (GST_BIN (bin), name);
-  if (!element)
+  thread_pool = gst_rtsp_server_get_thread_pool (server);
+  thread = gst_rtsp_thread_pool_get_thread (thread_pool, GST_RTSP_THREAD_TYPE_MEDIA, NULL);
+  g_object_unref (thread_pool);
+
+  if (!gst_rtsp_media_prepare (media, thread))
   {
-    g_print ("rtmp2rtsp: %s: failed to get element %s\n", uri->abspath, name);
+    g_print ("rtmp2rtsp: %s: failed to prepare media\n", uri->abspath);
+    g_object_unref (media);
     return NULL;
   }
 
-  for (item = GST_ELEMENT_PADS (element); item; item = g_list_next (item))
-  {
-    if (GST_PAD_IS_SRC (GST_PAD (item->data)))
-    {
-      structure = gst_caps_get_structure (
-          gst_pad_get_current_caps (GST_PAD (item->data)), 0);
+  /* keep pulling without clients so the gop cache stays warm and the
+   * first client is not served from a stale preroll */
+  gst_rtsp_media_lock (media);
+  gst_rtsp_media_set_pipeline_state (media, GST_STATE_PLAYING);
+  gst_rtsp_media_unlock (media);
+  rtsp_media_insert (opaque->media_table, media);
 
-      return structure;
-    }
-  }
+  if (once)
+    g_object_set_data (G_OBJECT (media), "prepulled", GINT_TO_POINTER (TRUE));
 
-  return NULL;
+  return media;
 }
 
-static gboolean
-rtsp_media_get_video_props (GstRTSPMedia *media,
-    gchar **codec, gint *width, gint *height, gint *framerate_num, gint *framerate_den)
+static void
+rtsp_prepull_job (GstRTSPMediaFactory *factory)
 {
-  GstStructure *structure;
+  GstRTSPServer *server = g_object_get_data (G_OBJECT (factory), "server");
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPMedia *media;
 
-  structure = rtsp_media_get_structure (media, "parse0");
+  media = rtsp_prepull_media (server, factory, TRUE);
+  if (media)
+    g_object_unref (media);
 
-  if (structure)
-  {
-    if (gst_structure_get_int (structure, "width", width) &&
-        gst_structure_get_int (structure, "height", height) &&
+  g_mutex_lock (&opaque->lock);
+  g_object_set_data (G_OBJECT (factory), "prepulling", NULL);
+  g_mutex_unlock (&opaque->lock);
+
+  g_object_unref (factory);
+}
+
+static GstRTSPUrl *
+rtsp_prepull_url (GstRTSPServer *server, const gchar *path)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri;
+  gchar *location;
+
+  /* shared media are keyed on port and path, so use the ones clients use */
+  location = g_strdup_printf ("rtsp://%s:%s%s", opaque->rtsp_host, opaque->rtsp_port, path);
+
+  if (gst_rtsp_url_parse (location, &uri) != GST_RTSP_OK)
+    uri = NULL;
+
+  g_free (location);
+
+  return uri;
+}
+
+gboolean
+rtsp_prepull (GstRTSPServer *server, const gchar *path)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPMediaFactory *factory;
+  GstRTSPUrl *uri;
+  gboolean pulling;
+
+  if (!path || path[0] != '/')
+    return FALSE;
+
+  if (!shard_owns (path))
+    return FALSE;
+
+  /* a path that already plays needs no pull of its own */
+  if (rtsp_media_table_is_prepared (opaque->media_table, path))
+    return TRUE;
+
+  uri = rtsp_prepull_url (server, path);
+  if (!uri)
+    return FALSE;
+
+  g_print ("rtmp2rtsp: %s: prepull\n", uri->abspath);
+
+  factory = rtsp_factory_mount (server, uri);
+
+  gst_rtsp_url_free (uri);
+
+  g_mutex_lock (&opaque->lock);
+  pulling = g_object_get_data (G_OBJECT (factory), "prepulling") != NULL;
+  g_object_set_data (G_OBJECT (factory), "prepulling", GINT_TO_POINTER (TRUE));
+  g_mutex_unlock (&opaque->lock);
+
+  if (pulling)
+    g_object_unref (factory);
+  else
+    rtsp_prepare_push (opaque, (GstRTSPPrepareFunc) rtsp_prepull_job, factory);
+
+  return TRUE;
+}
+
+static void
+rtsp_rendition_unhold (GstRTSPMedia *source)
+{
+  gst_rtsp_media_unprepare (source);
+  g_object_unref (source);
+}
+
+static void
+rtsp_rendition_hold_job (GstRTSPMedia *media)
+{
+  GstRTSPServer *server = g_object_get_data (G_OBJECT (media), "server");
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  GstRTSPMediaFactory *factory;
+  GstRTSPMedia *source = NULL;
+  GstRTSPUrl *source_uri;
+  gchar *path;
+
+  path = rendition_get_source (uri->abspath);
+  source_uri = rtsp_prepull_url (server, path);
+  g_free (path);
+
+  if (source_uri)
+  {
+    factory = rtsp_factory_mount (server, source_uri);
+    source = rtsp_prepull_media (server, factory, FALSE);
+    g_object_unref (factory);
+    gst_rtsp_url_free (source_uri);
+  }
+
+  /* the rendition may have gone, or come back with a hold of its own,
+   * while the source prepared */
+  if (source)
+  {
+    g_mutex_lock (&opaque->lock);
+    if (g_object_get_data (G_OBJECT (media), "rendition-hold") &&
+        !g_object_get_data (G_OBJECT (media), "rendition-source-media"))
+    {
+      g_object_set_data (G_OBJECT (media), "rendition-source-media", source);
+      source = NULL;
+    }
+    g_mutex_unlock (&opaque->lock);
+  }
+
+  if (source)
+    rtsp_rendition_unhold (source);
+
+  g_object_unref (media);
+}
+
+static void
+rtsp_rendition_hold (GstRTSPServer *server, GstRTSPMedia *media)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  gboolean held;
+
+  /* the source media is prepared once more for as long as the rendition
+   * is, so it keeps pulling when its own viewers leave */
+  g_mutex_lock (&opaque->lock);
+  held = g_object_get_data (G_OBJECT (media), "rendition-hold") != NULL;
+  g_object_set_data (G_OBJECT (media), "rendition-hold", GINT_TO_POINTER (TRUE));
+  g_mutex_unlock (&opaque->lock);
+
+  if (held)
+    return;
+
+  g_object_set_data (G_OBJECT (media), "server", server);
+
+  rtsp_prepare_push (opaque, (GstRTSPPrepareFunc) rtsp_rendition_hold_job, g_object_ref (media));
+}
+
+static void
+rtsp_rendition_release (GstRTSPServer *server, GstRTSPMedia *media)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPMedia *source;
+
+  g_mutex_lock (&opaque->lock);
+  g_object_set_data (G_OBJECT (media), "rendition-hold", NULL);
+  source = g_object_steal_data (G_OBJECT (media), "rendition-source-media");
+  g_mutex_unlock (&opaque->lock);
+
+  if (source)
+    rtsp_rendition_unhold (source);
+}
+
+static void
+rtsp_client_connected (GstRTSPServer *server, GstRTSPClient *client)
+{
+  g_print ("rtmp2rtsp: client connected\n");
+
+  rtsp_object_set_time (G_OBJECT (client), "connected");
+
+  events_push ("client-connected", NULL);
+
+  if (rendition_enabled ())
+  {
+    g_signal_connect (client, "pre-options-request", (GCallback) rtsp_rendition_request, server);
+    g_signal_connect (client, "pre-describe-request", (GCallback) rtsp_rendition_request, server);
+    g_signal_connect (client, "pre-setup-request", (GCallback) rtsp_rendition_request, server);
+    g_signal_connect (client, "pre-play-request", (GCallback) rtsp_rendition_request, server);
+    g_signal_connect (client, "pre-pause-request", (GCallback) rtsp_rendition_request, server);
+    g_signal_connect (client, "pre-teardown-request", (GCallback) rtsp_rendition_request, server);
+  }
+
+  /* a worker only pulls the paths of its shard and sends clients of
+   * other paths to the owner before anything gets mounted */
+  if (shard_enabled ())
+  {
+    g_signal_connect (client, "pre-options-request", (GCallback) rtsp_shard_request, server);
+    g_signal_connect (client, "pre-describe-request", (GCallback) rtsp_shard_request, server);
+    g_signal_connect (client, "pre-setup-request", (GCallback) rtsp_shard_request, server);
+    g_signal_connect (client, "send-message", (GCallback) rtsp_shard_send_message, server);
+  }
+
+  g_signal_connect (client, "options-request", (GCallback) rtsp_options_request, server);
+  g_signal_connect (client, "describe-request", (GCallback) rtsp_describe_request, server);
+  g_signal_connect (client, "setup-request", (GCallback) rtsp_setup_request, server);
+  g_signal_connect (client, "send-message", (GCallback) rtsp_play_send_message, server);
+  g_signal_connect (client, "play-request", (GCallback) rtsp_play_request, server);
+  g_signal_connect (client, "pause-request", (GCallback) rtsp_pause_request, server);
+  g_signal_connect (client, "teardown-request", (GCallback) rtsp_teardown_request, server);
+  g_signal_connect (client, "closed", (GCallback) rtsp_client_closed, server);
+}
+
+static void
+rtsp_client_closed (GstRTSPClient *client, GstRTSPServer *server)
+{
+  const gchar *path = g_object_get_data (G_OBJECT (client), "playing");
+
+  g_print ("rtmp2rtsp: client closed\n");
+
+  /* a viewer that just drops the connection never sends a teardown, the
+   * path it was still playing goes with the event */
+  events_push ("client-disconnected", path);
+}
+
+static gchar *
+rtsp_shard_path (const gchar *abspath)
+{
+  gchar *path, *source, *control;
+
+  /* a setup names the stream control and a timeshift the ring, both
+   * live on the shard of the stream itself */
+  path = g_strdup (abspath);
+  control = g_strrstr (path, "/stream=");
+  if (control)
+    *control = '\0';
+
+  source = timeshift_get_source (path);
+  if (source)
+  {
+    g_free (path);
+    path = source;
+  }
+
+  source = rendition_get_source (path);
+  if (source)
+  {
+    g_free (path);
+    path = source;
+  }
+
+  return path;
+}
+
+static GstRTSPStatusCode
+rtsp_rendition_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+  gchar *path;
+
+  if (!uri || !uri->query)
+    return GST_RTSP_STS_OK;
+
+  /* the rest of the server only knows the path form, the content base
+   * handed out from here on has it too */
+  path = rendition_get_path (uri->abspath, uri->query);
+  if (path)
+  {
+    g_free (uri->abspath);
+    uri->abspath = path;
+    g_free (uri->query);
+    uri->query = NULL;
+  }
+
+  return GST_RTSP_STS_OK;
+}
+
+static GstRTSPStatusCode
+rtsp_shard_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPStatusCode code = GST_RTSP_STS_OK;
+  gchar *path;
+
+  if (!uri)
+    return GST_RTSP_STS_OK;
+
+  path = rtsp_shard_path (uri->abspath);
+
+  if (!shard_owns (path))
+  {
+    g_print ("rtmp2rtsp: %s: redirect to shard %u\n", uri->abspath, shard_lookup (path));
+    code = GST_RTSP_STS_MOVE_TEMPORARILY;
+  }
+
+  g_free (path);
+
+  return code;
+}
+
+static void
+rtsp_shard_send_message (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPMessage *message, GstRTSPServer *server)
+{
+  GstRTSPStatusCode code;
+  gchar *location, *path;
+
+  if (!ctx || !ctx->uri || gst_rtsp_message_get_type (message) != GST_RTSP_MESSAGE_RESPONSE)
+    return;
+
+  if (gst_rtsp_message_parse_response (message, &code, NULL, NULL) != GST_RTSP_OK ||
+      code != GST_RTSP_STS_MOVE_TEMPORARILY)
+    return;
+
+  path = rtsp_shard_path (ctx->uri->abspath);
+  location = shard_get_location (ctx->uri->host, path, ctx->uri->abspath);
+  gst_rtsp_message_add_header (message, GST_RTSP_HDR_LOCATION, location);
+  g_free (location);
+  g_free (path);
+}
+
+static void
+rtsp_options_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPMediaFactory *factory;
+
+  g_print ("rtmp2rtsp: %s: options request\n", uri->abspath);
+
+  factory = rtsp_factory_mount (server, uri);
+
+  g_object_unref (factory);
+}
+
+static GstRTSPMediaFactory *
+rtsp_factory_new (GstRTSPOpaque *opaque, const gchar *path)
+{
+  GstRTSPMediaFactory *factory;
+  gchar *location = NULL, *backup = NULL;
+
+  if (opaque->upstream)
+    location = g_strdup_printf ("%s%s", opaque->upstream, path);
+  else if (!opaque->rtmp_listen)
+    location = g_strdup_printf ("rtmp://%s:%s%s", opaque->rtmp_host, opaque->rtmp_port, path);
+
+  if (!opaque->rtmp_listen && opaque->backup_host)
+    backup = g_strdup_printf ("rtmp://%s:%s%s", opaque->backup_host, opaque->backup_port, path);
+
+  /* with the task pool the demuxer thread drives both branches, the rtsp
+   * stream sinks are decoupled by their own queues anyway, and the low
+   * latency queues drop the oldest data instead of holding a second */
+  factory = relay_factory_new (location, opaque->rtmp_timeout,
+      task_pool_get () == NULL, opaque->low_latency ? RTSP_LOW_LATENCY_QUEUE_MS : 0);
+
+  relay_factory_set_failover (factory, backup, opaque->reconnect_timeout, opaque->slate);
+  relay_factory_set_track_window (factory, opaque->track_window);
+
+  if (opaque->upstream)
+    relay_factory_set_edge (factory, opaque->upstream_forward);
+
+  g_free (location);
+  g_free (backup);
+
+  return factory;
+}
+
+static void
+rtsp_timeshift_configure (GstRTSPMediaFactory *factory, GstRTSPMedia *media, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (factory), "uri");
+
+  g_print ("rtmp2rtsp: %s: timeshift configure\n", uri->abspath);
+
+  events_push ("timeshift", uri->abspath);
+
+  g_object_set_data_full (G_OBJECT (media), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+}
+
+static GstRTSPMediaFactory *
+rtsp_timeshift_mount (GstRTSPServer *server, GstRTSPMountPoints *mp, const GstRTSPUrl *uri, const gchar *source)
+{
+  GstRTSPMediaFactory *factory;
+  gint matched;
+
+  /* the live path is a prefix of its timeshift path, only a mount of
+   * the whole path counts */
+  factory = gst_rtsp_mount_points_match (mp, uri->abspath, &matched);
+  if (factory && matched == (gint) strlen (uri->abspath))
+    return factory;
+
+  if (factory)
+    g_object_unref (factory);
+
+  /* every viewer gets a playback of its own that seeks in the ring */
+  factory = relay_factory_new (NULL, 0, FALSE, 0);
+  relay_factory_set_timeshift (factory, source);
+
+  g_object_set_data_full (G_OBJECT (factory), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+  g_object_set_data (G_OBJECT (factory), "server", server);
+
+  gst_rtsp_media_factory_set_shared (factory, FALSE);
+
+  g_signal_connect (factory, "media-configure", (GCallback) rtsp_timeshift_configure, server);
+
+  gst_rtsp_mount_points_add_factory (mp, uri->abspath, g_object_ref (factory));
+
+  return factory;
+}
+
+static GstRTSPMediaFactory *
+rtsp_rendition_mount (GstRTSPServer *server, GstRTSPMountPoints *mp, const GstRTSPUrl *uri)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPMediaFactory *factory;
+  gint matched;
+
+  /* the source path is a prefix of its rendition paths, only a mount of
+   * the whole path counts */
+  factory = gst_rtsp_mount_points_match (mp, uri->abspath, &matched);
+  if (factory && matched == (gint) strlen (uri->abspath))
+    return factory;
+
+  if (factory)
+    g_object_unref (factory);
+
+  /* all viewers of a rendition share one transcode, which goes away with
+   * the last of them like any shared media */
+  factory = relay_factory_new (NULL, 0, task_pool_get () == NULL, opaque->low_latency ? RTSP_LOW_LATENCY_QUEUE_MS : 0);
+  relay_factory_set_rendition (factory, uri->abspath);
+  relay_factory_set_track_window (factory, opaque->track_window);
+
+  g_object_set_data_full (G_OBJECT (factory), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+  g_object_set_data (G_OBJECT (factory), "server", server);
+  rtsp_object_set_time (G_OBJECT (factory), "created");
+
+  gst_rtsp_media_factory_set_shared (factory, TRUE);
+  gst_rtsp_media_factory_set_eos_shutdown (factory, TRUE);
+
+  if (opaque->low_latency)
+    gst_rtsp_media_factory_set_latency (factory, RTSP_LOW_LATENCY_MS);
+
+  g_signal_connect (factory, "media-configure", (GCallback) rtsp_media_configure, server);
+
+  gst_rtsp_mount_points_add_factory (mp, uri->abspath, g_object_ref (factory));
+
+  return factory;
+}
+
+static GstRTSPMediaFactory *
+rtsp_factory_mount (GstRTSPServer *server, const GstRTSPUrl *uri)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPMountPoints *mp;
+  GstRTSPMediaFactory *factory;
+  gchar *source;
+
+  mp = gst_rtsp_server_get_mount_points (server);
+
+  g_mutex_lock (&opaque->lock);
+
+  source = timeshift_get_source (uri->abspath);
+  if (source)
+  {
+    factory = rtsp_timeshift_mount (server, mp, uri, source);
+
+    g_mutex_unlock (&opaque->lock);
+
+    g_object_unref (mp);
+    g_free (source);
+
+    return factory;
+  }
+
+  source = rendition_get_source (uri->abspath);
+  if (source)
+  {
+    factory = rtsp_rendition_mount (server, mp, uri);
+
+    g_mutex_unlock (&opaque->lock);
+
+    g_object_unref (mp);
+    g_free (source);
+
+    return factory;
+  }
+
+  factory = gst_rtsp_mount_points_match (mp, uri->abspath, NULL);
+
+  /* a path that just went away comes back with its old factory */
+  if (!factory)
+  {
+    factory = relay_factory_acquire (uri->abspath);
+    if (factory)
+    {
+      rtsp_object_set_time (G_OBJECT (factory), "created");
+      gst_rtsp_mount_points_add_factory (mp, uri->abspath, g_object_ref (factory));
+    }
+  }
+
+  if (!factory)
+  {
+    factory = rtsp_factory_new (opaque, uri->abspath);
+
+    g_object_set_data_full (G_OBJECT (factory), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+    g_object_set_data (G_OBJECT (factory), "server", server);
+    rtsp_object_set_time (G_OBJECT (factory), "created");
+
+    gst_rtsp_media_factory_set_shared (factory, TRUE);
+    gst_rtsp_media_factory_set_eos_shutdown (factory, TRUE);
+
+    if (opaque->low_latency)
+      gst_rtsp_media_factory_set_latency (factory, RTSP_LOW_LATENCY_MS);
+
+    /* viewers asking for multicast share one send per packet, the others
+     * still get unicast */
+    if (opaque->address_pool)
+    {
+      gst_rtsp_media_factory_set_address_pool (factory, opaque->address_pool);
+      gst_rtsp_media_factory_set_max_mcast_ttl (factory, opaque->multicast_ttl);
+      gst_rtsp_media_factory_set_protocols (factory,
+          GST_RTSP_LOWER_TRANS_UDP_MCAST | GST_RTSP_LOWER_TRANS_UDP | GST_RTSP_LOWER_TRANS_TCP);
+    }
+
+    g_signal_connect (factory, "media-configure", (GCallback) rtsp_media_configure, server);
+
+    gst_rtsp_mount_points_add_factory (mp, uri->abspath, g_object_ref (factory));
+  }
+
+  g_mutex_unlock (&opaque->lock);
+
+  g_object_unref (mp);
+
+  return factory;
+}
+
+static void
+rtsp_describe_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+
+  g_print ("rtmp2rtsp: %s: describe request\n", uri->abspath);
+}
+
+static void
+rtsp_setup_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+
+  g_print ("rtmp2rtsp: %s: setup request\n", uri->abspath);
+}
+
+static void
+rtsp_play_send_message (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPMessage *message, GstRTSPServer *server)
+{
+  GstRTSPMethod method;
+  GstRTSPStatusCode code;
+  GstRTSPGopCache *cache;
+
+  if (!ctx || !ctx->request || !ctx->sessmedia || gst_rtsp_message_get_type (message) != GST_RTSP_MESSAGE_RESPONSE)
+    return;
+
+  if (gst_rtsp_message_parse_request (ctx->request, &method, NULL, NULL) != GST_RTSP_OK ||
+      method != GST_RTSP_PLAY)
+    return;
+
+  if (gst_rtsp_message_parse_response (message, &code, NULL, NULL) != GST_RTSP_OK ||
+      code != GST_RTSP_STS_OK)
+    return;
+
+  /* the burst sent after play has to match the rtp-info of its response */
+  cache = g_object_get_data (G_OBJECT (gst_rtsp_session_media_get_media (ctx->sessmedia)), "gop-cache");
+  if (cache)
+    gop_cache_rtpinfo (cache, ctx->sessmedia, message);
+}
+
+static void
+rtsp_play_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPMedia *media;
+  GstRTSPGopCache *cache;
+  GstRTSPMediaStat *stat;
+  GstRTSPBacklog *backlog;
+
+  g_print ("rtmp2rtsp: %s: play request\n", uri->abspath);
+
+  if (!ctx->sessmedia)
+    return;
+
+  g_object_set_data_full (G_OBJECT (client), "playing", g_strdup (uri->abspath), g_free);
+
+  media = gst_rtsp_session_media_get_media (ctx->sessmedia);
+
+  stat = g_object_get_data (G_OBJECT (media), "stat");
+  if (stat)
+  {
+    GstRTSPConnection *connection = gst_rtsp_client_get_connection (client);
+    guint i;
+
+    /* a client only counts what the payloaders produced while it was
+     * active, paused and skipped stretches are left out */
+    for (i = 0; i < MEDIA_STAT_TRACKS; i++)
+    {
+      GstRTSPStreamTransport *trans = relay_session_media_get_transport (ctx->sessmedia, i);
+      GstRTSPTransportStat *transport_stat;
+
+      if (!trans)
+        continue;
+
+      transport_stat = g_object_get_data (G_OBJECT (trans), "stat");
+      if (!transport_stat)
+      {
+        transport_stat = transport_stat_new (connection ? gst_rtsp_connection_get_ip (connection) : "", i);
+        g_object_set_data_full (G_OBJECT (trans), "stat", transport_stat, (GDestroyNotify) transport_stat_free);
+      }
+
+      transport_stat_start (transport_stat, stat);
+    }
+  }
+
+  cache = g_object_get_data (G_OBJECT (media), "gop-cache");
+  if (cache)
+    gop_cache_play (cache, client, ctx->sessmedia);
+
+  backlog = g_object_get_data (G_OBJECT (media), "backlog");
+  if (backlog)
+    backlog_play (backlog, client, ctx->sessmedia);
+}
+
+static void
+rtsp_pause_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+  GstRTSPMediaStat *stat;
+  guint i;
+
+  g_print ("rtmp2rtsp: %s: pause request\n", uri->abspath);
+
+  if (!ctx->sessmedia)
+    return;
+
+  stat = g_object_get_data (G_OBJECT (gst_rtsp_session_media_get_media (ctx->sessmedia)), "stat");
+  if (!stat)
+    return;
+
+  for (i = 0; i < MEDIA_STAT_TRACKS; i++)
+  {
+    GstRTSPStreamTransport *trans = relay_session_media_get_transport (ctx->sessmedia, i);
+    GstRTSPTransportStat *transport_stat = trans ? g_object_get_data (G_OBJECT (trans), "stat") : NULL;
+
+    if (transport_stat)
+      transport_stat_stop (transport_stat, stat);
+  }
+}
+
+static void
+rtsp_teardown_request (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPServer *server)
+{
+  GstRTSPUrl *uri = ctx->uri;
+
+  g_print ("rtmp2rtsp: %s: teardown request\n", uri->abspath);
+
+  events_push ("client-teardown", uri->abspath);
+
+  g_object_set_data (G_OBJECT (client), "playing", NULL);
+}
+
+static void
+rtsp_media_configure (GstRTSPMediaFactory *factory, GstRTSPMedia *media, GstRTSPServer *server)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (factory), "uri");
+  GstRTSPMediaMeta *meta;
+  GstRTSPMediaStat *stat;
+  GstRTSPGopCache *cache;
+  GstRTSPResync *resync;
+  GstRTSPBacklog *backlog;
+  GstRTSPEdge *edge;
+  GstRTSPTimeshift *timeshift;
+  GstRTSPHls *hls;
+  GstRTSPWhep *whep;
+  GstRTSPRendition *rendition;
+  GstRTSPRenditionSource *source;
+  GstRTSPThumbnail *thumbnail;
+  GstElement *element;
+  gchar *id;
+  gint64 *created;
+
+  g_print ("rtmp2rtsp: %s: media configure\n", uri->abspath);
+
+  events_push ("created", uri->abspath);
+
+  g_object_set_data_full (G_OBJECT (media), "uri", gst_rtsp_url_copy (uri), (GDestroyNotify) gst_rtsp_url_free);
+  created = rtsp_object_set_time (G_OBJECT (media), "created");
+  *created = rtsp_object_get_time (G_OBJECT (factory), "created");
+
+  element = gst_rtsp_media_get_element (media);
+  task_pool_install (element);
+
+  if (opaque->rtmp_listen)
+    rtsp_media_attach_source (media, element, TRUE);
+
+  meta = media_meta_new (&opaque->media_table->version);
+  media_meta_attach (meta, element);
+  g_object_set_data_full (G_OBJECT (media), "meta", meta, (GDestroyNotify) media_meta_free);
+
+  stat = media_stat_new ();
+  media_stat_attach (stat, element);
+  g_object_set_data_full (G_OBJECT (media), "stat", stat, (GDestroyNotify) media_stat_free);
+
+  /* without burst the cache only tracks keyframes for time-to-first-frame */
+  cache = gop_cache_new (opaque->gop_cache);
+  gop_cache_attach (cache, element);
+  g_object_set_data_full (G_OBJECT (media), "gop-cache", cache, (GDestroyNotify) gop_cache_free);
+
+  rtsp_media_attach_metrics (media, element);
+
+  batch_attach (element);
+
+  backlog = backlog_new (media);
+  backlog_attach (backlog, element);
+  g_object_set_data_full (G_OBJECT (media), "backlog", backlog, (GDestroyNotify) backlog_free);
+
+  if (opaque->upstream)
+  {
+    edge = edge_new (opaque->upstream, &opaque->media_table->version);
+    edge_attach (edge, element);
+    g_object_set_data_full (G_OBJECT (media), "edge", edge, (GDestroyNotify) edge_free);
+  }
+
+  /* a rendition is a live view of its source, not a second ring */
+  rendition = rendition_get (element);
+  if (rendition)
+    g_object_set_data (G_OBJECT (media), "rendition", rendition);
+  else if (rendition_enabled ())
+  {
+    source = rendition_source_acquire (uri->abspath);
+    rendition_source_attach (source, element);
+    g_object_set_data_full (G_OBJECT (media), "rendition-source", source, (GDestroyNotify) rendition_source_detach);
+  }
+
+  if (!rendition && timeshift_enabled (uri->abspath) && (timeshift = timeshift_acquire (uri->abspath)))
+  {
+    timeshift_attach (timeshift, element);
+    g_object_set_data_full (G_OBJECT (media), "timeshift", timeshift, (GDestroyNotify) timeshift_release);
+  }
+
+  if (hls_enabled () && (hls = hls_acquire (uri->abspath)))
+  {
+    hls_attach (hls, element);
+    g_object_set_data_full (G_OBJECT (media), "hls", hls, (GDestroyNotify) hls_release);
+  }
+
+  if (whep_enabled () && (whep = whep_acquire (uri->abspath)))
+  {
+    whep_attach (whep, element);
+    g_object_set_data_full (G_OBJECT (media), "whep", whep, (GDestroyNotify) whep_detach);
+  }
+
+  if (!rendition && thumbnail_enabled ())
+  {
+    id = rtsp_url_get_id (uri);
+    thumbnail = thumbnail_acquire (uri->abspath, id);
+    thumbnail_attach (thumbnail, element);
+    g_object_set_data_full (G_OBJECT (media), "thumbnail", thumbnail, (GDestroyNotify) thumbnail_release);
+    g_free (id);
+  }
+
+  if (opaque->low_latency)
+  {
+    resync = resync_new ();
+    resync_attach (resync, element);
+    g_object_set_data_full (G_OBJECT (media), "resync", resync, (GDestroyNotify) resync_free);
+  }
+
+  gst_object_unref (element);
+
+  gst_rtsp_media_set_reusable (media, TRUE);
+
+  g_signal_connect (media, "prepared", (GCallback) rtsp_media_prepared, server);
+  g_signal_connect (media, "unprepared", (GCallback) rtsp_media_unprepared, server);
+  g_signal_connect (media, "target-state", (GCallback) rtsp_media_target_state, server);
+  g_signal_connect (media, "new-state", (GCallback) rtsp_media_new_state, server);
+}
+
+static void
+rtsp_media_attach_source (GstRTSPMedia *media, GstElement *bin, gboolean attach)
+{
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  GstElement *src;
+
+  src = gst_bin_get_by_name (GST_BIN (bin), "src");
+  if (!src)
+    return;
+
+  if (attach)
+    rtmp_server_attach (uri->abspath, src);
+  else
+    rtmp_server_detach (uri->abspath, src);
+
+  gst_object_unref (src);
+}
+
+static void
+rtsp_multicast_free (GstRTSPMulticast *multicast)
+{
+  g_free (multicast->address);
+  g_free (multicast);
+}
+
+static void
+rtsp_media_attach_multicast (GstRTSPMedia *media)
+{
+  GstRTSPMulticast *multicast;
+  guint i;
+
+  multicast = g_new0 (GstRTSPMulticast, 1);
+
+  /* reserve the groups up front so they can be listed before the first
+   * multicast viewer shows up */
+  for (i = 0; i < MEDIA_META_TRACKS; i++)
+  {
+    GstRTSPStream *stream;
+    GstRTSPAddress *address;
+
+    stream = relay_media_get_stream (media, i);
+    if (!stream)
+      continue;
+
+    address = gst_rtsp_stream_get_multicast_address (stream, G_SOCKET_FAMILY_IPV4);
+    if (!address)
+      continue;
+
+    if (!multicast->address)
+    {
+      multicast->address = g_strdup (address->address);
+      multicast->ttl = address->ttl;
+    }
+    multicast->port[i] = address->port;
+
+    gst_rtsp_address_free (address);
+  }
+
+  g_object_set_data_full (G_OBJECT (media), "multicast", multicast, (GDestroyNotify) rtsp_multicast_free);
+}
+
+static GstPadProbeReturn
+rtsp_media_connected_probe (GstPad *pad, GstPadProbeInfo *info, gint64 *preparing)
+{
+  metrics_observe (METRICS_RTMP_CONNECT, g_get_monotonic_time () - *preparing);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+rtsp_media_attach_metrics (GstRTSPMedia *media, GstElement *bin)
+{
+  GstRTSPLatencyProbe *probe;
+  GstElement *src, *entry, *pay;
+  GstPad *src_pad, *entry_pad, *pay_pad;
+  gint64 *preparing;
+
+  preparing = rtsp_object_set_time (G_OBJECT (media), "preparing");
+
+  src = gst_bin_get_by_name (GST_BIN (bin), "src");
+  if (src)
+  {
+    /* an edge source has only dynamic pads */
+    src_pad = gst_element_get_static_pad (src, "src");
+    if (src_pad)
+    {
+      gst_pad_add_probe (src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+          (GstPadProbeCallback) rtsp_media_connected_probe, preparing, NULL);
+      gst_object_unref (src_pad);
+    }
+    gst_object_unref (src);
+  }
+
+  entry = gst_bin_get_by_name (GST_BIN (bin), "queue0");
+  if (!entry)
+    entry = gst_bin_get_by_name (GST_BIN (bin), "parse0");
+
+  pay = gst_bin_get_by_name (GST_BIN (bin), "rtppay0");
+
+  if (entry && pay)
+  {
+    probe = latency_probe_new ();
+    g_object_set_data_full (G_OBJECT (media), "latency-probe", probe, (GDestroyNotify) latency_probe_free);
+
+    entry_pad = gst_element_get_static_pad (entry, "sink");
+    pay_pad = gst_element_get_static_pad (pay, "sink");
+    latency_probe_attach (probe, entry_pad, pay_pad);
+    gst_object_unref (entry_pad);
+    gst_object_unref (pay_pad);
+  }
+
+  if (entry)
+    gst_object_unref (entry);
+  if (pay)
+    gst_object_unref (pay);
+}
+
+static void
+rtsp_media_prepared (GstRTSPMedia *media, GstRTSPServer *server)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  gint64 preparing;
+
+  g_print ("rtmp2rtsp: %s: media prepared\n", uri->abspath);
+
+  events_push ("prepared", uri->abspath);
+
+  if (opaque->address_pool)
+    rtsp_media_attach_multicast (media);
+
+  rtsp_media_table_touch (opaque->media_table);
+
+  /* a recycled factory or a warm pipeline is older than the prepare,
+   * only the time since the media started preparing counts */
+  preparing = rtsp_object_get_time (G_OBJECT (media), "preparing");
+  if (preparing)
+    metrics_observe (METRICS_MEDIA_PREPARE, g_get_monotonic_time () - preparing);
+}
+
+static void
+rtsp_media_unprepared (GstRTSPMedia *media, GstRTSPServer *server)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+
+  g_print ("rtmp2rtsp: %s: media unprepared\n", uri->abspath);
+
+  events_push ("unprepared", uri->abspath);
+
+  if (g_object_get_data (G_OBJECT (media), "rendition"))
+    rtsp_rendition_release (server, media);
+
+  rtsp_media_table_touch (opaque->media_table);
+}
+
+static void
+rtsp_media_target_state (GstRTSPMedia *media, GstState state, GstRTSPServer *server)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  GstRTSPMountPoints *mp;
+  GstRTSPMediaFactory *factory;
+  gint matched;
+
+  g_print ("rtmp2rtsp: %s: media target state %d\n", uri->abspath, state);
+
+  if (state == GST_STATE_PAUSED && gst_rtsp_media_get_status (media) == GST_RTSP_MEDIA_STATUS_PREPARING)
+  {
+    gint64 *preparing = g_object_get_data (G_OBJECT (media), "preparing");
+
+    *preparing = g_get_monotonic_time ();
+
+    /* nothing feeds the rendition until its source is pulled */
+    if (g_object_get_data (G_OBJECT (media), "rendition"))
+      rtsp_rendition_hold (server, media);
+  }
+
+  if (state == GST_STATE_PLAYING)
+  {
+    rtsp_media_insert (opaque->media_table, media);
+    events_push ("playing", uri->abspath);
+  }
+
+  if (state == GST_STATE_NULL)
+  {
+    rtsp_media_remove (opaque->media_table, media);
+    events_push ("removed", uri->abspath);
+
+    if (opaque->rtmp_listen)
+    {
+      GstElement *element = gst_rtsp_media_get_element (media);
+
+      rtsp_media_attach_source (media, element, FALSE);
+      gst_object_unref (element);
+    }
+
+    mp = gst_rtsp_server_get_mount_points (server);
+
+    factory = gst_rtsp_mount_points_match (mp, uri->abspath, &matched);
+    if (factory)
+    {
+      if (matched == strlen (uri->abspath))
+        relay_factory_release (factory, uri->abspath);
+      g_object_unref (factory);
+    }
+
+    gst_rtsp_mount_points_remove_factory (mp, uri->abspath);
+
+    g_object_unref (mp);
+  }
+
+  gst_rtsp_media_get_stream (media, 0);
+}
+
+static void
+rtsp_media_new_state (GstRTSPMedia *media, GstState state, GstRTSPServer *server)
+{
+  GstRTSPOpaque *opaque = g_object_get_data (G_OBJECT (server), "opaque");
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+
+  g_print ("rtmp2rtsp: %s: media new state %d\n", uri->abspath, state);
+
+  rtsp_media_table_touch (opaque->media_table);
+}
+
+static gboolean
+rtsp_session_pool_cleanup (GstRTSPServer *server)
+{
+  GstRTSPSessionPool *pool;
+
+  pool = gst_rtsp_server_get_session_pool (server);
+  gst_rtsp_session_pool_cleanup (pool);
+  g_object_unref (pool);
+
+  return TRUE;
+}
+
+static gboolean
+rtsp_media_table_sample (GstRTSPMediaTable *media_table)
+{
+  GList *list, *item;
+
+  list = rtsp_media_table_list (media_table);
+
+  for (item = list; item; item = g_list_next (item))
+  {
+    GstRTSPMediaStat *stat = g_object_get_data (G_OBJECT (item->data), "stat");
+
+    if (stat)
+      media_stat_sample (stat);
+  }
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+
+  slab_sample ();
+
+  return TRUE;
+}
+
+static gboolean
+rtsp_media_table_backlog (GstRTSPMediaTable *media_table)
+{
+  GList *list, *item;
+
+  list = rtsp_media_table_list (media_table);
+
+  for (item = list; item; item = g_list_next (item))
+  {
+    GstRTSPMediaStat *stat = g_object_get_data (G_OBJECT (item->data), "stat");
+    GstRTSPBacklog *backlog = g_object_get_data (G_OBJECT (item->data), "backlog");
+    guint track, bps = 0;
+
+    if (!stat || !backlog)
+      continue;
+
+    /* both tracks share the interleaved connection */
+    for (track = 0; track < MEDIA_STAT_TRACKS; track++)
+      bps += media_stat_get_bps (stat, track);
+
+    backlog_check (backlog, bps);
+  }
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+
+  return TRUE;
+}
+
+static gboolean
+rtsp_media_table_is_prepared (GstRTSPMediaTable *media_table, const gchar *path)
+{
+  GstRTSPMedia *media;
+  gboolean prepared;
+
+  g_mutex_lock (&media_table->lock);
+  media = g_hash_table_lookup (media_table->table, path);
+  prepared = media && gst_rtsp_media_get_status (media) == GST_RTSP_MEDIA_STATUS_PREPARED;
+  g_mutex_unlock (&media_table->lock);
+
+  return prepared;
+}
+
+static void
+rtsp_media_insert (GstRTSPMediaTable *media_table, GstRTSPMedia *media)
+{
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+
+  g_mutex_lock (&media_table->lock);
+  g_hash_table_insert (media_table->table, g_strdup (uri->abspath), g_object_ref (media));
+  g_mutex_unlock (&media_table->lock);
+
+  rtsp_media_table_touch (media_table);
+}
+
+static void
+rtsp_media_remove (GstRTSPMediaTable *media_table, GstRTSPMedia *media)
+{
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+
+  g_mutex_lock (&media_table->lock);
+  if (g_hash_table_lookup (media_table->table, uri->abspath) == media)
+    g_hash_table_remove (media_table->table, uri->abspath);
+  g_mutex_unlock (&media_table->lock);
+
+  rtsp_media_table_touch (media_table);
+}
+
+static gchar *
+rtsp_media_get_status (GstRTSPMedia *media)
+{
+  switch (gst_rtsp_media_get_status (media))
+  {
+  case GST_RTSP_MEDIA_STATUS_UNPREPARED:
+    return "unprepared";
+  case GST_RTSP_MEDIA_STATUS_UNPREPARING:
+    return "unpreparing";
+  case GST_RTSP_MEDIA_STATUS_PREPARED:
+    return "prepared";
+  case GST_RTSP_MEDIA_STATUS_PREPARING:
+    return "preparing";
+  case GST_RTSP_MEDIA_STATUS_SUSPENDED:
+    return "suspended";
+  case GST_RTSP_MEDIA_STATUS_ERROR:
+    return "error";
+  default:
+    return "";
+  }
+}
+
+static gboolean
+rtsp_media_get_video_props (GstRTSPMedia *media,
+    gchar **codec, gint *width, gint *height, gint *framerate_num, gint *framerate_den)
+{
+  GstRTSPMediaMeta *meta = g_object_get_data (G_OBJECT (media), "meta");
+  GstStructure *structure;
+  gboolean res = FALSE;
+
+  if (!meta)
+    return FALSE;
+
+  structure = media_meta_get_structure (meta, 0);
+
+  if (structure)
+  {
+    if (gst_structure_get_int (structure, "width", width) &&
+        gst_structure_get_int (structure, "height", height) &&
         gst_structure_get_fraction (structure, "framerate", framerate_num, framerate_den))
     {
-      if (g_str_equal (gst_structure_get_name (structure), "video/x-h264"))
-      {
-        *codec = "h264";
-        return TRUE;
-      }
+      *codec = (gchar *) relay_codec_get_name (0, structure);
+      res = *codec != NULL;
     }
+
+    gst_structure_free (structure);
   }
 
-  return FALSE;
+  return res;
 }
 
 static gboolean
 rtsp_media_get_audio_props (GstRTSPMedia *media,
     gchar **codec, gint *channels, gint *rate)
 {
+  GstRTSPMediaMeta *meta = g_object_get_data (G_OBJECT (media), "meta");
   GstStructure *structure;
+  gboolean res = FALSE;
 
-  structure = rtsp_media_get_structure (media, "parse1");
+  if (!meta)
+    return FALSE;
+
+  structure = media_meta_get_structure (meta, 1);
 
   if (structure)
   {
     if (gst_structure_get_int (structure, "channels", channels) &&
         gst_structure_get_int (structure, "rate", rate))
     {
-      if (g_str_equal (gst_structure_get_name (structure), "audio/mpeg"))
-      {
-        *codec = "aac";
-        return TRUE;
-      }
+      *codec = (gchar *) relay_codec_get_name (1, structure);
+      res = *codec != NULL;
     }
+
+    gst_structure_free (structure);
+  }
+
+  return res;
+}
+
+static GList *
+rtsp_media_get_transports (GstRTSPMedia *media, guint track)
+{
+  GstRTSPStream *stream;
+
+  stream = relay_media_get_stream (media, track);
+  if (!stream)
+    return NULL;
+
+  return gst_rtsp_stream_transport_filter (stream, NULL, NULL);
+}
+
+static void
+rtsp_media_stat (GstRTSPMedia *media,
+    guint *streams_num, guint *streams_bps,
+    guint *clients_num, guint *clients_bps)
+{
+  GstRTSPMediaStat *stat = g_object_get_data (G_OBJECT (media), "stat");
+  guint track, bps, transports, clients = 0;
+  GList *list;
+
+  *streams_num += 1;
+
+  if (!stat)
+    return;
+
+  for (track = 0; track < MEDIA_STAT_TRACKS; track++)
+  {
+    list = rtsp_media_get_transports (media, track);
+    transports = g_list_length (list);
+    g_list_free_full (list, (GDestroyNotify) g_object_unref);
+
+    bps = media_stat_get_bps (stat, track);
+
+    *streams_bps += bps;
+    *clients_bps += bps * transports;
+
+    clients = MAX (clients, transports);
   }
 
-  return FALSE;
+  *clients_num += clients;
+}
+
+static void
+rtsp_media_table_stat (GstRTSPMediaTable *media_table,
+    guint *streams_num, guint *streams_bps,
+    guint *clients_num, guint *clients_bps)
+{
+  GList *list, *item;
+
+  list = rtsp_media_table_list (media_table);
+
+  for (item = list; item; item = g_list_next (item))
+    rtsp_media_stat (item->data, streams_num, streams_bps, clients_num, clients_bps);
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+}
+
+void
+rtsp_stat (GstRTSPMediaTable *media_table,
+    guint *streams_num, guint *streams_bps,
+    guint *clients_num, guint *clients_bps)
+{
+  *streams_num = 0;
+  *streams_bps = 0;
+  *clients_num = 0;
+  *clients_bps = 0;
+
+  rtsp_media_table_stat (media_table, streams_num, streams_bps, clients_num, clients_bps);
 }
 
 static gchar *
@@ -469,6 +1905,11 @@ void
 json_builder_stream_value (JsonBuilder *builder, GstRTSPMedia *media)
 {
   GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  GstRTSPMulticast *multicast = g_object_get_data (G_OBJECT (media), "multicast");
+  GstRTSPEdge *edge = g_object_get_data (G_OBJECT (media), "edge");
+  GstRTSPTimeshift *timeshift = g_object_get_data (G_OBJECT (media), "timeshift");
+  GstRTSPHls *hls = g_object_get_data (G_OBJECT (media), "hls");
+  GstRTSPWhep *whep = g_object_get_data (G_OBJECT (media), "whep");
   gchar *id, *codec;
   gint width, height, framerate_num, framerate_den, channels, rate;
 
@@ -529,6 +1970,35 @@ json_builder_stream_value (JsonBuilder *builder, GstRTSPMedia *media)
     json_builder_end_object (builder);
   }
 
+  if (edge)
+    json_builder_edge_value (builder, edge);
+
+  if (timeshift)
+    json_builder_timeshift_value (builder, timeshift);
+
+  if (hls)
+    json_builder_hls_value (builder, hls);
+
+  if (whep)
+    json_builder_whep_value (builder, whep);
+
+  if (multicast && multicast->address)
+  {
+    json_builder_set_member_name (builder, "multicast");
+    json_builder_begin_object (builder);
+
+    json_builder_set_member_name (builder, "group");
+    json_builder_add_string_value (builder, multicast->address);
+    json_builder_set_member_name (builder, "video_port");
+    json_builder_add_int_value (builder, multicast->port[0]);
+    json_builder_set_member_name (builder, "audio_port");
+    json_builder_add_int_value (builder, multicast->port[1]);
+    json_builder_set_member_name (builder, "ttl");
+    json_builder_add_int_value (builder, multicast->ttl);
+
+    json_builder_end_object (builder);
+  }
+
   json_builder_end_object (builder);
 
   g_free (id);
@@ -548,17 +2018,446 @@ json_builder_stream_list (JsonBuilder *builder, GstRTSPMediaTable *media_table)
 void
 json_builder_stream_list_value (JsonBuilder *builder, GstRTSPMediaTable *media_table)
 {
-  GHashTableIter iter;
-  gpointer key, value;
+  GList *list, *item;
+
+  list = rtsp_media_table_list (media_table);
+
+  for (item = list; item; item = g_list_next (item))
+  {
+    json_builder_begin_object (builder);
+    json_builder_stream_value (builder, item->data);
+    json_builder_end_object (builder);
+  }
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+}
+
+static void
+rtsp_snapshot_item_free (GstRTSPSnapshotItem *item)
+{
+  g_free (item->path);
+  g_free (item->body);
+  g_free (item);
+}
+
+static gint
+rtsp_snapshot_item_compare (GstRTSPSnapshotItem **a, GstRTSPSnapshotItem **b)
+{
+  return g_strcmp0 ((*a)->path, (*b)->path);
+}
+
+static GPtrArray *
+rtsp_media_table_snapshot (GstRTSPMediaTable *media_table, gint *version)
+{
+  GPtrArray *snapshot;
+  GList *list, *item;
+
+  g_mutex_lock (&media_table->snapshot_lock);
+
+  *version = g_atomic_int_get (&media_table->version);
+
+  /* the table is only walked again when a stream, its status or its caps
+   * changed since the last snapshot */
+  if (media_table->snapshot_version != *version)
+  {
+    snapshot = g_ptr_array_new_with_free_func ((GDestroyNotify) rtsp_snapshot_item_free);
+
+    list = rtsp_media_table_list (media_table);
+
+    for (item = list; item; item = g_list_next (item))
+    {
+      GstRTSPUrl *uri = g_object_get_data (G_OBJECT (item->data), "uri");
+      GstRTSPSnapshotItem *snapshot_item;
+      JsonBuilder *builder;
+
+      builder = json_builder_new ();
+      json_builder_begin_object (builder);
+      json_builder_stream_value (builder, item->data);
+      json_builder_end_object (builder);
+
+      snapshot_item = g_new0 (GstRTSPSnapshotItem, 1);
+      snapshot_item->path = g_strdup (uri->abspath);
+      snapshot_item->body = json_builder_to_body (builder);
+      g_ptr_array_add (snapshot, snapshot_item);
+
+      g_object_unref (builder);
+    }
+
+    g_list_free_full (list, (GDestroyNotify) g_object_unref);
+
+    g_ptr_array_sort (snapshot, (GCompareFunc) rtsp_snapshot_item_compare);
+
+    if (media_table->snapshot)
+      g_ptr_array_unref (media_table->snapshot);
+
+    media_table->snapshot = snapshot;
+    media_table->snapshot_version = *version;
+  }
+
+  snapshot = g_ptr_array_ref (media_table->snapshot);
+
+  g_mutex_unlock (&media_table->snapshot_lock);
+
+  return snapshot;
+}
+
+gint
+rtsp_media_table_get_version (GstRTSPMediaTable *media_table)
+{
+  return g_atomic_int_get (&media_table->version);
+}
+
+gchar *
+rtsp_media_table_to_body (GstRTSPMediaTable *media_table,
+    const gchar *prefix, guint offset, guint limit, gint *version)
+{
+  GPtrArray *snapshot;
+  GString *body;
+  guint i, total = 0, count = 0;
+
+  snapshot = rtsp_media_table_snapshot (media_table, version);
+
+  body = g_string_new ("{\"data\":[");
+
+  for (i = 0; i < snapshot->len; i++)
+  {
+    GstRTSPSnapshotItem *item = g_ptr_array_index (snapshot, i);
+
+    if (prefix && !g_str_has_prefix (item->path, prefix))
+      continue;
+
+    if (total++ < offset)
+      continue;
+
+    if (limit > 0 && count >= limit)
+      continue;
+
+    if (count++ > 0)
+      g_string_append_c (body, ',');
+    g_string_append (body, item->body);
+  }
+
+  g_string_append_printf (body,
+      "],\"meta\":{\"total\":%u,\"offset\":%u,\"limit\":%u,\"version\":%d}}",
+      total, offset, limit, *version);
+
+  g_ptr_array_unref (snapshot);
+
+  return g_string_free (body, FALSE);
+}
+
+void
+json_builder_stats (JsonBuilder *builder, GstRTSPMediaTable *media_table)
+{
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "data");
+  json_builder_begin_object (builder);
+  json_builder_stats_value (builder, media_table);
+  json_builder_end_object (builder);
+  json_builder_end_object (builder);
+}
+
+static void
+rtsp_media_upstream_value (JsonBuilder *builder, GstRTSPMedia *media)
+{
+  GstElement *bin, *upstream;
+
+  bin = gst_rtsp_media_get_element (media);
+  upstream = gst_bin_get_by_name (GST_BIN (bin), "upstream");
+  gst_object_unref (bin);
+
+  if (!upstream)
+    return;
+
+  json_builder_upstream_value (builder, upstream);
+
+  gst_object_unref (upstream);
+}
+
+static gint
+rtsp_media_get_queue_ms (GstRTSPMedia *media, guint track)
+{
+  GstElement *bin, *queue;
+  gchar *name;
+  guint64 level_time;
+
+  bin = gst_rtsp_media_get_element (media);
+
+  name = g_strdup_printf ("queue%u", track);
+  queue = gst_bin_get_by_name (GST_BIN (bin), name);
+  g_free (name);
+
+  gst_object_unref (bin);
+
+  if (!queue)
+    return -1;
+
+  g_object_get (queue, "current-level-time", &level_time, NULL);
+
+  gst_object_unref (queue);
+
+  return level_time / GST_MSECOND;
+}
+
+static void
+json_builder_stats_media_value (JsonBuilder *builder, GstRTSPMedia *media)
+{
+  GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+  GstRTSPMediaStat *stat = g_object_get_data (G_OBJECT (media), "stat");
+  GstRTSPGopCache *cache = g_object_get_data (G_OBJECT (media), "gop-cache");
+  GstRTSPResync *resync = g_object_get_data (G_OBJECT (media), "resync");
+  GstRTSPBacklog *backlog = g_object_get_data (G_OBJECT (media), "backlog");
+  GstRTSPRendition *rendition = g_object_get_data (G_OBJECT (media), "rendition");
+  GstRTSPThumbnail *thumbnail = g_object_get_data (G_OBJECT (media), "thumbnail");
+  GstElement *element, *pipeline;
+  GList *list, *item;
+  guint track;
+  gint queue_ms;
+
+  json_builder_set_member_name (builder, "path");
+  json_builder_add_string_value (builder, uri->abspath);
+
+  if (cache)
+    json_builder_gop_cache_value (builder, cache);
+
+  if (resync)
+    json_builder_resync_value (builder, resync);
+
+  if (rendition)
+    json_builder_rendition_value (builder, rendition);
+
+  if (thumbnail)
+    json_builder_thumbnail_value (builder, thumbnail);
+
+  rtsp_media_upstream_value (builder, media);
+
+  if (!stat)
+    return;
+
+  /* the udp sinks of the streams live next to the media element */
+  element = gst_rtsp_media_get_element (media);
+  pipeline = element ? GST_ELEMENT (gst_object_get_parent (GST_OBJECT (element))) : NULL;
+
+  json_builder_set_member_name (builder, "tracks");
+  json_builder_begin_array (builder);
+
+  for (track = 0; track < MEDIA_STAT_TRACKS; track++)
+  {
+    json_builder_begin_object (builder);
+
+    json_builder_set_member_name (builder, "bytes");
+    json_builder_add_int_value (builder, media_stat_get_bytes (stat, track));
+    json_builder_set_member_name (builder, "packets");
+    json_builder_add_int_value (builder, media_stat_get_packets (stat, track));
+    json_builder_set_member_name (builder, "frames");
+    json_builder_add_int_value (builder, media_stat_get_frames (stat, track));
+    json_builder_set_member_name (builder, "bps");
+    json_builder_add_int_value (builder, media_stat_get_bps (stat, track));
+
+    queue_ms = rtsp_media_get_queue_ms (media, track);
+    if (queue_ms >= 0)
+    {
+      json_builder_set_member_name (builder, "queue_ms");
+      json_builder_add_int_value (builder, queue_ms);
+    }
+
+    json_builder_set_member_name (builder, "clients");
+    json_builder_begin_array (builder);
+
+    list = rtsp_media_get_transports (media, track);
+
+    for (item = list; item; item = g_list_next (item))
+    {
+      GstRTSPTransportStat *transport_stat = g_object_get_data (G_OBJECT (item->data), "stat");
+      const GstRTSPTransport *transport = gst_rtsp_stream_transport_get_transport (item->data);
+
+      json_builder_begin_object (builder);
+
+      json_builder_set_member_name (builder, "transport");
+      json_builder_add_string_value (builder,
+          transport->lower_transport == GST_RTSP_LOWER_TRANS_TCP ? "tcp" : "udp");
+
+      if (transport_stat)
+      {
+        guint64 bytes, packets;
+
+        transport_stat_get (transport_stat, item->data, stat, pipeline, &bytes, &packets);
+
+        json_builder_set_member_name (builder, "address");
+        json_builder_add_string_value (builder, transport_stat->address);
+        json_builder_set_member_name (builder, "bytes");
+        json_builder_add_int_value (builder, bytes);
+        json_builder_set_member_name (builder, "packets");
+        json_builder_add_int_value (builder, packets);
+      }
+
+      json_builder_set_member_name (builder, "bps");
+      json_builder_add_int_value (builder, media_stat_get_bps (stat, track));
+
+      if (backlog)
+        json_builder_backlog_value (builder, backlog, item->data);
+
+      json_builder_end_object (builder);
+    }
+
+    g_list_free_full (list, (GDestroyNotify) g_object_unref);
+
+    json_builder_end_array (builder);
+
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_array (builder);
+
+  if (pipeline)
+    gst_object_unref (pipeline);
+  if (element)
+    gst_object_unref (element);
+}
+
+void
+json_builder_stats_value (JsonBuilder *builder, GstRTSPMediaTable *media_table)
+{
+  guint streams_num, streams_bps, clients_num, clients_bps;
+  GList *list, *item;
+
+  list = rtsp_media_table_list (media_table);
+
+  streams_num = streams_bps = clients_num = clients_bps = 0;
 
-  g_hash_table_iter_init (&iter, media_table);
+  for (item = list; item; item = g_list_next (item))
+    rtsp_media_stat (item->data, &streams_num, &streams_bps, &clients_num, &clients_bps);
 
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  json_builder_set_member_name (builder, "type");
+  json_builder_add_string_value (builder, "stats");
+  json_builder_set_member_name (builder, "streams_num");
+  json_builder_add_int_value (builder, streams_num);
+  json_builder_set_member_name (builder, "streams_bps");
+  json_builder_add_int_value (builder, streams_bps);
+  json_builder_set_member_name (builder, "clients_num");
+  json_builder_add_int_value (builder, clients_num);
+  json_builder_set_member_name (builder, "clients_bps");
+  json_builder_add_int_value (builder, clients_bps);
+
+  json_builder_batch_value (builder);
+  json_builder_slab_value (builder);
+  json_builder_relay_pool_value (builder);
+
+  json_builder_set_member_name (builder, "streams");
+  json_builder_begin_array (builder);
+
+  for (item = list; item; item = g_list_next (item))
   {
     json_builder_begin_object (builder);
-    json_builder_stream_value (builder, value);
+    json_builder_stats_media_value (builder, item->data);
     json_builder_end_object (builder);
   }
+
+  json_builder_end_array (builder);
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
+}
+
+static void
+rtsp_metrics_append_queue (GString *body, GstElement *bin, const gchar *path, guint track)
+{
+  GstElement *queue;
+  gchar *name;
+  guint64 level_time;
+  guint level_buffers;
+
+  name = g_strdup_printf ("queue%u", track);
+  queue = gst_bin_get_by_name (GST_BIN (bin), name);
+  g_free (name);
+
+  if (!queue)
+    return;
+
+  g_object_get (queue,
+      "current-level-time", &level_time,
+      "current-level-buffers", &level_buffers,
+      NULL);
+
+  g_string_append_printf (body,
+      "rtmp2rtsp_queue_level_seconds{path=\"%s\",track=\"%u\"} %g\n",
+      path, track, (gdouble) level_time / GST_SECOND);
+  g_string_append_printf (body,
+      "rtmp2rtsp_queue_level_buffers{path=\"%s\",track=\"%u\"} %u\n",
+      path, track, level_buffers);
+
+  gst_object_unref (queue);
+}
+
+void
+rtsp_metrics_append (GString *body, GstRTSPMediaTable *media_table)
+{
+  GList *list, *item;
+  guint track;
+
+  list = rtsp_media_table_list (media_table);
+
+  g_string_append (body, "# TYPE rtmp2rtsp_streams gauge\n");
+  g_string_append_printf (body, "rtmp2rtsp_streams %u\n", g_list_length (list));
+  g_string_append (body, "# TYPE rtmp2rtsp_stream_bytes_total counter\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_stream_packets_total counter\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_stream_clients gauge\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_queue_level_seconds gauge\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_queue_level_buffers gauge\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_rendition_cpu_seconds_total counter\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_rendition_frames_total counter\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_rendition_dropped_total counter\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_rendition_encode_latency_seconds gauge\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_thumbnail_served_total counter\n");
+  g_string_append (body, "# TYPE rtmp2rtsp_thumbnail_decodes_total counter\n");
+
+  for (item = list; item; item = g_list_next (item))
+  {
+    GstRTSPMedia *media = item->data;
+    GstRTSPUrl *uri = g_object_get_data (G_OBJECT (media), "uri");
+    GstRTSPMediaStat *stat = g_object_get_data (G_OBJECT (media), "stat");
+    GstRTSPRendition *rendition = g_object_get_data (G_OBJECT (media), "rendition");
+    GstRTSPThumbnail *thumbnail = g_object_get_data (G_OBJECT (media), "thumbnail");
+    GstElement *bin;
+    GList *transports;
+    gchar *path;
+
+    bin = gst_rtsp_media_get_element (media);
+    path = metrics_escape_label (uri->abspath);
+
+    for (track = 0; track < MEDIA_STAT_TRACKS; track++)
+    {
+      if (stat)
+      {
+        g_string_append_printf (body,
+            "rtmp2rtsp_stream_bytes_total{path=\"%s\",track=\"%u\"} %" G_GUINT64_FORMAT "\n",
+            path, track, media_stat_get_bytes (stat, track));
+        g_string_append_printf (body,
+            "rtmp2rtsp_stream_packets_total{path=\"%s\",track=\"%u\"} %" G_GUINT64_FORMAT "\n",
+            path, track, media_stat_get_packets (stat, track));
+      }
+
+      transports = rtsp_media_get_transports (media, track);
+      g_string_append_printf (body,
+          "rtmp2rtsp_stream_clients{path=\"%s\",track=\"%u\"} %u\n",
+          path, track, g_list_length (transports));
+      g_list_free_full (transports, (GDestroyNotify) g_object_unref);
+
+      if (bin)
+        rtsp_metrics_append_queue (body, bin, path, track);
+    }
+
+    if (rendition)
+      rendition_metrics_append (body, rendition, path);
+
+    if (thumbnail)
+      thumbnail_metrics_append (body, thumbnail, path);
+
+    if (bin)
+      gst_object_unref (bin);
+    g_free (path);
+  }
+
+  g_list_free_full (list, (GDestroyNotify) g_object_unref);
 }
 
 gchar *
@@ -9,23 +9,53 @@
 
 #include <json-glib/json-glib.h>
 
-typedef GHashTable GstRTSPMediaTable;
+typedef struct _GstRTSPMediaTable GstRTSPMediaTable;
 
 GstRTSPMediaTable *rtsp_media_table_new ();
 void rtsp_media_table_free (GstRTSPMediaTable *media_table);
 
-void rtsp_init (GstRTSPMediaTable *media_table,
+GstRTSPServer *rtsp_init (GstRTSPMediaTable *media_table,
     const gchar *rtmp_host, const gchar *rtmp_port, guint rtmp_timeout,
-    const gchar *rtsp_host, const gchar *rtsp_port, guint rtsp_timeout);
+    const gchar *rtsp_host, const gchar *rtsp_port, guint rtsp_timeout,
+    guint workers, gboolean gop_cache, gboolean rtmp_listen);
+
+gboolean rtsp_attach (GstRTSPServer *server);
+
+gboolean rtsp_set_profile (GstRTSPServer *server, const gchar *profile);
+
+void rtsp_set_failover (GstRTSPServer *server, guint reconnect_timeout,
+    const gchar *backup_host, const gchar *backup_port, gboolean slate);
+
+void rtsp_set_upstream (GstRTSPServer *server, const gchar *upstream, gboolean forward);
+
+void rtsp_set_track_window (GstRTSPServer *server, guint track_window);
+
+void rtsp_set_timeshift (GstRTSPServer *server, const gchar *dir, guint size_mb, const gchar *prefix);
+void rtsp_set_whep (GstRTSPServer *server);
+void rtsp_set_renditions (GstRTSPServer *server);
+
+void rtsp_set_warm_pool (GstRTSPServer *server, guint size);
+
+gboolean rtsp_set_multicast (GstRTSPServer *server, const gchar *range, guint ttl);
+
+gboolean rtsp_prepull (GstRTSPServer *server, const gchar *path);
 
 void rtsp_stat (GstRTSPMediaTable *media_table,
     guint *streams_num, guint *streams_bps,
     guint *clients_num, guint *clients_bps);
 
+void rtsp_metrics_append (GString *body, GstRTSPMediaTable *media_table);
+
+gint rtsp_media_table_get_version (GstRTSPMediaTable *media_table);
+gchar * rtsp_media_table_to_body (GstRTSPMediaTable *media_table,
+    const gchar *prefix, guint offset, guint limit, gint *version);
+
 void json_builder_stream (JsonBuilder *builder, GstRTSPMedia *media);
 void json_builder_stream_value (JsonBuilder *builder, GstRTSPMedia *media);
 void json_builder_stream_list (JsonBuilder *builder, GstRTSPMediaTable *media_table);
 void json_builder_stream_list_value (JsonBuilder *builder, GstRTSPMediaTable *media_table);
+void json_builder_stats (JsonBuilder *builder, GstRTSPMediaTable *media_table);
+void json_builder_stats_value (JsonBuilder *builder, GstRTSPMediaTable *media_table);
 gchar * json_builder_to_body (JsonBuilder *builder);
 
 #endif
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "shard.h"
+
+#define SHARD_VNODES 64
+#define SHARD_RESPAWN_MS 1000
+
+typedef struct _GstRTSPShardPoint GstRTSPShardPoint;
+
+struct _GstRTSPShardPoint
+{
+  guint32 hash;
+  guint index;
+};
+
+typedef struct _GstRTSPShardWorker GstRTSPShardWorker;
+
+struct _GstRTSPShardWorker
+{
+  GPid pid;
+  guint restarts;
+  gint64 started;
+};
+
+typedef struct _GstRTSPShards GstRTSPShards;
+
+struct _GstRTSPShards
+{
+  GMutex lock;
+  guint count;
+  gint self;
+  gchar *host;
+  guint rtsp_port;
+  guint http_port;
+  GArray *ring;
+  gchar **argv;
+  GstRTSPShardWorker *workers;
+  gboolean stopping;
+};
+
+static GstRTSPShards shards;
+
+static void shard_respawn (guint index);
+
+static guint32
+shard_hash (const gchar *key)
+{
+  guint32 hash = 2166136261u;
+
+  /* fnv-1a, spreads short paths better than the glib string hash */
+  for (; *key; key++)
+  {
+    hash ^= (guchar) *key;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static gint
+shard_point_compare (const GstRTSPShardPoint *a, const GstRTSPShardPoint *b)
+{
+  return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+void
+shard_init (guint count, gint self, const gchar *host, const gchar *rtsp_port, const gchar *http_port)
+{
+  guint i, j;
+
+  g_mutex_init (&shards.lock);
+  shards.count = count;
+  shards.self = self;
+  shards.host = g_strdup (host);
+  shards.rtsp_port = atoi (rtsp_port);
+  shards.http_port = atoi (http_port);
+
+  /* virtual nodes keep the shards even and move only the paths of a
+   * shard when the count changes */
+  shards.ring = g_array_sized_new (FALSE, FALSE, sizeof (GstRTSPShardPoint), count * SHARD_VNODES);
+
+  for (i = 0; i < count; i++)
+  {
+    for (j = 0; j < SHARD_VNODES; j++)
+    {
+      GstRTSPShardPoint point;
+      gchar *key;
+
+      key = g_strdup_printf ("shard-%u-%u", i, j);
+      point.hash = shard_hash (key);
+      point.index = i;
+      g_free (key);
+
+      g_array_append_val (shards.ring, point);
+    }
+  }
+
+  g_array_sort (shards.ring, (GCompareFunc) shard_point_compare);
+}
+
+gboolean
+shard_enabled ()
+{
+  return shards.count > 0;
+}
+
+gboolean
+shard_is_supervisor ()
+{
+  return shards.count > 0 && shards.self < 0;
+}
+
+guint
+shard_count ()
+{
+  return shards.count;
+}
+
+guint
+shard_lookup (const gchar *path)
+{
+  GstRTSPShardPoint *points;
+  guint32 hash;
+  guint low = 0, high;
+
+  if (shards.count == 0)
+    return 0;
+
+  hash = shard_hash (path);
+  points = (GstRTSPShardPoint *) shards.ring->data;
+  high = shards.ring->len;
+
+  /* first point clockwise from the path */
+  while (low < high)
+  {
+    guint middle = (low + high) / 2;
+
+    if (points[middle].hash < hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return points[low == shards.ring->len ? 0 : low].index;
+}
+
+gboolean
+shard_owns (const gchar *path)
+{
+  return shards.count == 0 || shards.self < 0 || shard_lookup (path) == (guint) shards.self;
+}
+
+gchar *
+shard_get_rtsp_port (guint index)
+{
+  return g_strdup_printf ("%u", shards.rtsp_port + 1 + index);
+}
+
+gchar *
+shard_get_http_port (guint index)
+{
+  return g_strdup_printf ("%u", shards.http_port + 1 + index);
+}
+
+gchar *
+shard_get_location (const gchar *host, const gchar *key, const gchar *path)
+{
+  guint port = shards.rtsp_port + 1 + shard_lookup (key);
+
+  /* the bind address is no use to a remote client, it is sent back to
+   * the host it asked for */
+  if (!host || !host[0])
+    host = shards.host;
+
+  if (strchr (host, ':') && host[0] != '[')
+    return g_strdup_printf ("rtsp://[%s]:%u%s", host, port, path);
+
+  return g_strdup_printf ("rtsp://%s:%u%s", host, port, path);
+}
+
+static void
+shard_child_setup (gpointer user_data)
+{
+  /* a worker never outlives its supervisor */
+  prctl (PR_SET_PDEATHSIG, SIGTERM);
+}
+
+static gboolean
+shard_respawn_timeout (gpointer user_data)
+{
+  shard_respawn (GPOINTER_TO_UINT (user_data));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+shard_child_exited (GPid pid, gint status, gpointer user_data)
+{
+  guint index = GPOINTER_TO_UINT (user_data);
+
+  g_spawn_close_pid (pid);
+
+  g_mutex_lock (&shards.lock);
+  shards.workers[index].pid = 0;
+  g_mutex_unlock (&shards.lock);
+
+  if (shards.stopping)
+    return;
+
+  /* only the streams of this shard are gone, clients reconnect to the
+   * new worker once it is up */
+  g_print ("rtmp2rtsp: shard %u exited with status %d, respawn\n", index, status);
+
+  g_timeout_add (SHARD_RESPAWN_MS, shard_respawn_timeout, GUINT_TO_POINTER (index));
+}
+
+static void
+shard_respawn (guint index)
+{
+  GPtrArray *argv;
+  GError *error = NULL;
+  GPid pid;
+  guint i;
+
+  if (shards.stopping)
+    return;
+
+  /* exec instead of a bare fork, the supervisor already runs threads and
+   * the worker needs a fresh glib and gstreamer */
+  argv = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (argv, g_strdup ("/proc/self/exe"));
+  for (i = 0; shards.argv[i]; i++)
+    g_ptr_array_add (argv, g_strdup (shards.argv[i]));
+  g_ptr_array_add (argv, g_strdup_printf ("--shard-index=%u", index));
+  g_ptr_array_add (argv, NULL);
+
+  if (!g_spawn_async (NULL, (gchar **) argv->pdata, NULL,
+          G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_FILE_AND_ARGV_ZERO,
+          shard_child_setup, NULL, &pid, &error))
+  {
+    g_print ("rtmp2rtsp: failed to spawn shard %u: %s\n", index, error->message);
+    g_error_free (error);
+    g_ptr_array_unref (argv);
+    g_timeout_add (SHARD_RESPAWN_MS, shard_respawn_timeout, GUINT_TO_POINTER (index));
+    return;
+  }
+
+  g_ptr_array_unref (argv);
+
+  g_mutex_lock (&shards.lock);
+  if (shards.workers[index].started)
+    shards.workers[index].restarts++;
+  shards.workers[index].pid = pid;
+  shards.workers[index].started = g_get_real_time ();
+  g_mutex_unlock (&shards.lock);
+
+  g_child_watch_add (pid, shard_child_exited, GUINT_TO_POINTER (index));
+
+  g_print ("rtmp2rtsp: run shard %u as pid %d\n", index, pid);
+}
+
+void
+shard_spawn (gchar **argv)
+{
+  guint i;
+
+  shards.argv = g_strdupv (argv);
+  shards.workers = g_new0 (GstRTSPShardWorker, shards.count);
+
+  for (i = 0; i < shards.count; i++)
+    shard_respawn (i);
+}
+
+void
+shard_stop ()
+{
+  guint i;
+
+  shards.stopping = TRUE;
+
+  g_mutex_lock (&shards.lock);
+  for (i = 0; i < shards.count; i++)
+  {
+    if (shards.workers[i].pid > 0)
+      kill (shards.workers[i].pid, SIGTERM);
+  }
+  g_mutex_unlock (&shards.lock);
+}
+
+static gboolean
+shard_accept (GSocket *socket, GIOCondition condition, GstRTSPServer *server)
+{
+  GSocket *client;
+
+  /* every worker waits on the public port, the kernel hands each
+   * connection to one of them and foreign paths are redirected */
+  while ((client = g_socket_accept (socket, NULL, NULL)))
+  {
+    GSocketAddress *address;
+    gchar *ip = NULL;
+    guint port = 0;
+
+    address = g_socket_get_remote_address (client, NULL);
+    if (address)
+    {
+      ip = g_inet_address_to_string (g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (address)));
+      port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+      g_object_unref (address);
+    }
+
+    gst_rtsp_server_transfer_connection (server, client, ip ? ip : "", port, NULL);
+
+    g_free (ip);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+gboolean
+shard_listen (GstRTSPServer *server, const gchar *host, const gchar *port)
+{
+  GSocketAddress *address;
+  GSocket *socket = NULL;
+  GSource *source;
+  GError *error = NULL;
+
+  address = g_inet_socket_address_new_from_string (host, atoi (port));
+  if (!address)
+  {
+    g_print ("rtmp2rtsp: shards need a numeric rtsp host, got %s\n", host);
+    return FALSE;
+  }
+
+  socket = g_socket_new (g_socket_address_get_family (address), G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &error);
+
+  if (!socket ||
+      !g_socket_set_option (socket, SOL_SOCKET, SO_REUSEPORT, 1, &error) ||
+      !g_socket_bind (socket, address, TRUE, &error) ||
+      !g_socket_listen (socket, &error))
+  {
+    g_print ("rtmp2rtsp: failed to listen at %s:%s: %s\n", host, port, error->message);
+    g_error_free (error);
+    if (socket)
+      g_object_unref (socket);
+    g_object_unref (address);
+    return FALSE;
+  }
+
+  g_object_unref (address);
+
+  g_socket_set_blocking (socket, FALSE);
+
+  source = g_socket_create_source (socket, G_IO_IN, NULL);
+  g_source_set_callback (source, (GSourceFunc) shard_accept, g_object_ref (server), g_object_unref);
+  g_source_attach (source, NULL);
+  g_source_unref (source);
+
+  g_object_unref (socket);
+
+  g_print ("rtmp2rtsp: run shard %d of %u at %s:%s\n", shards.self, shards.count, host, port);
+
+  return TRUE;
+}
+
+void
+json_builder_shards (JsonBuilder *builder)
+{
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "data");
+  json_builder_begin_object (builder);
+  json_builder_shards_value (builder);
+  json_builder_end_object (builder);
+  json_builder_end_object (builder);
+}
+
+void
+json_builder_shards_value (JsonBuilder *builder)
+{
+  guint i;
+
+  json_builder_set_member_name (builder, "type");
+  json_builder_add_string_value (builder, "shards");
+
+  json_builder_set_member_name (builder, "enabled");
+  json_builder_add_boolean_value (builder, shard_is_supervisor ());
+
+  if (!shard_is_supervisor ())
+    return;
+
+  g_mutex_lock (&shards.lock);
+
+  json_builder_set_member_name (builder, "shards");
+  json_builder_begin_array (builder);
+
+  for (i = 0; i < shards.count; i++)
+  {
+    json_builder_begin_object (builder);
+
+    json_builder_set_member_name (builder, "index");
+    json_builder_add_int_value (builder, i);
+    json_builder_set_member_name (builder, "pid");
+    json_builder_add_int_value (builder, shards.workers[i].pid);
+    json_builder_set_member_name (builder, "rtsp_port");
+    json_builder_add_int_value (builder, shards.rtsp_port + 1 + i);
+    json_builder_set_member_name (builder, "http_port");
+    json_builder_add_int_value (builder, shards.http_port + 1 + i);
+    json_builder_set_member_name (builder, "restarts");
+    json_builder_add_int_value (builder, shards.workers[i].restarts);
+    json_builder_set_member_name (builder, "started");
+    json_builder_add_int_value (builder, shards.workers[i].started / G_USEC_PER_SEC);
+
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_array (builder);
+
+  g_mutex_unlock (&shards.lock);
+}
@@ -0,0 +1,32 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <json-glib/json-glib.h>
+
+void shard_init (guint count, gint self, const gchar *host, const gchar *rtsp_port, const gchar *http_port);
+
+gboolean shard_enabled ();
+gboolean shard_is_supervisor ();
+
+guint shard_count ();
+guint shard_lookup (const gchar *path);
+gboolean shard_owns (const gchar *path);
+
+gchar *shard_get_rtsp_port (guint index);
+gchar *shard_get_http_port (guint index);
+gchar *shard_get_location (const gchar *host, const gchar *key, const gchar *path);
+
+void shard_spawn (gchar **argv);
+void shard_stop ();
+
+gboolean shard_listen (GstRTSPServer *server, const gchar *host, const gchar *port);
+
+void json_builder_shards (JsonBuilder *builder);
+void json_builder_shards_value (JsonBuilder *builder);
+
+#endif
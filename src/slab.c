@@ -0,0 +1,345 @@
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_SIZE 2048
+#define SLAB_ALIGN 63
+#define SLAB_THREAD_CACHE 256
+#define SLAB_BATCH 64
+
+typedef struct _GstRTSPSlabMemory GstRTSPSlabMemory;
+
+struct _GstRTSPSlabMemory
+{
+  GstMemory mem;
+  guint8 *data;
+  GstRTSPSlabMemory *next;
+};
+
+typedef struct _GstRTSPSlabCache GstRTSPSlabCache;
+
+struct _GstRTSPSlabCache
+{
+  GstRTSPSlabMemory *head;
+  guint length;
+};
+
+typedef struct _GstRTSPSlabStat GstRTSPSlabStat;
+
+struct _GstRTSPSlabStat
+{
+  guint64 allocs;
+  guint64 thread_hits;
+  guint64 shared_hits;
+  guint64 slabs;
+  guint64 oversize;
+  guint64 sample_allocs;
+  gint64 sample_time;
+  guint rate;
+};
+
+typedef struct
+{
+  GstAllocator parent;
+} GstRTSPSlabAllocator;
+
+typedef struct
+{
+  GstAllocatorClass parent_class;
+} GstRTSPSlabAllocatorClass;
+
+GType gst_rtsp_slab_allocator_get_type (void);
+
+G_DEFINE_TYPE (GstRTSPSlabAllocator, gst_rtsp_slab_allocator, GST_TYPE_ALLOCATOR);
+
+static GMutex slab_lock;
+static GstRTSPSlabMemory *slab_free_list = NULL;
+static GstAllocator *slab_sysmem = NULL;
+static GstRTSPSlabStat slab_stat;
+
+static void slab_cache_release (GstRTSPSlabCache *cache);
+
+static GPrivate slab_cache = G_PRIVATE_INIT ((GDestroyNotify) slab_cache_release);
+
+static void
+slab_cache_release (GstRTSPSlabCache *cache)
+{
+  GstRTSPSlabMemory *last;
+
+  /* a thread going away hands its cached slabs to the others */
+  if (cache->head)
+  {
+    for (last = cache->head; last->next; last = last->next);
+
+    g_mutex_lock (&slab_lock);
+    last->next = slab_free_list;
+    slab_free_list = cache->head;
+    g_mutex_unlock (&slab_lock);
+  }
+
+  g_free (cache);
+}
+
+static GstRTSPSlabCache *
+slab_cache_get ()
+{
+  GstRTSPSlabCache *cache = g_private_get (&slab_cache);
+
+  if (!cache)
+  {
+    cache = g_new0 (GstRTSPSlabCache, 1);
+    g_private_set (&slab_cache, cache);
+  }
+
+  return cache;
+}
+
+static GstRTSPSlabMemory *
+slab_take ()
+{
+  GstRTSPSlabCache *cache = slab_cache_get ();
+  GstRTSPSlabMemory *slab;
+
+  if (cache->head)
+  {
+    slab = cache->head;
+    cache->head = slab->next;
+    cache->length--;
+    __atomic_add_fetch (&slab_stat.thread_hits, 1, __ATOMIC_RELAXED);
+    return slab;
+  }
+
+  /* slabs are usually freed by the sink threads, refill in batches so the
+   * shared list is locked once per batch and not per packet */
+  g_mutex_lock (&slab_lock);
+  while (slab_free_list && cache->length < SLAB_BATCH)
+  {
+    slab = slab_free_list;
+    slab_free_list = slab->next;
+    slab->next = cache->head;
+    cache->head = slab;
+    cache->length++;
+  }
+  g_mutex_unlock (&slab_lock);
+
+  if (cache->head)
+  {
+    slab = cache->head;
+    cache->head = slab->next;
+    cache->length--;
+    __atomic_add_fetch (&slab_stat.shared_hits, 1, __ATOMIC_RELAXED);
+    return slab;
+  }
+
+  /* header and data in one block, kept for the lifetime of the process */
+  slab = g_malloc (sizeof (GstRTSPSlabMemory) + SLAB_SIZE + SLAB_ALIGN);
+  slab->data = (guint8 *) (((guintptr) (slab + 1) + SLAB_ALIGN) & ~(guintptr) SLAB_ALIGN);
+  __atomic_add_fetch (&slab_stat.slabs, 1, __ATOMIC_RELAXED);
+
+  return slab;
+}
+
+static void
+slab_give (GstRTSPSlabMemory *slab)
+{
+  GstRTSPSlabCache *cache = slab_cache_get ();
+  GstRTSPSlabMemory *first, *last;
+  guint i;
+
+  slab->next = cache->head;
+  cache->head = slab;
+  cache->length++;
+
+  if (cache->length < SLAB_THREAD_CACHE)
+    return;
+
+  first = last = cache->head;
+  for (i = 1; i < SLAB_BATCH; i++)
+    last = last->next;
+
+  cache->head = last->next;
+  cache->length -= SLAB_BATCH;
+
+  g_mutex_lock (&slab_lock);
+  last->next = slab_free_list;
+  slab_free_list = first;
+  g_mutex_unlock (&slab_lock);
+}
+
+static GstMemory *
+gst_rtsp_slab_allocator_alloc (GstAllocator *allocator, gsize size, GstAllocationParams *params)
+{
+  GstRTSPSlabMemory *slab;
+  gsize maxsize;
+
+  __atomic_add_fetch (&slab_stat.allocs, 1, __ATOMIC_RELAXED);
+
+  maxsize = size + params->prefix + params->padding;
+
+  if (maxsize > SLAB_SIZE || params->align > SLAB_ALIGN)
+  {
+    __atomic_add_fetch (&slab_stat.oversize, 1, __ATOMIC_RELAXED);
+    return gst_allocator_alloc (slab_sysmem, size, params);
+  }
+
+  slab = slab_take ();
+  slab->next = NULL;
+
+  gst_memory_init (GST_MEMORY_CAST (slab), params->flags, allocator, NULL,
+      maxsize, params->align, params->prefix, size);
+
+  if (params->prefix && (params->flags & GST_MEMORY_FLAG_ZERO_PREFIXED))
+    memset (slab->data, 0, params->prefix);
+  if (params->padding && (params->flags & GST_MEMORY_FLAG_ZERO_PADDED))
+    memset (slab->data + params->prefix + size, 0, params->padding);
+
+  return GST_MEMORY_CAST (slab);
+}
+
+static void
+gst_rtsp_slab_allocator_free (GstAllocator *allocator, GstMemory *mem)
+{
+  GstRTSPSlabMemory *slab = (GstRTSPSlabMemory *) mem;
+
+  /* shares only own their header, the parent is released by the core */
+  if (mem->parent)
+    g_slice_free (GstRTSPSlabMemory, slab);
+  else
+    slab_give (slab);
+}
+
+static gpointer
+gst_rtsp_slab_memory_map (GstMemory *mem, gsize maxsize, GstMapFlags flags)
+{
+  return ((GstRTSPSlabMemory *) mem)->data;
+}
+
+static void
+gst_rtsp_slab_memory_unmap (GstMemory *mem)
+{
+}
+
+static GstMemory *
+gst_rtsp_slab_memory_share (GstMemory *mem, gssize offset, gssize size)
+{
+  GstRTSPSlabMemory *slab = (GstRTSPSlabMemory *) mem;
+  GstRTSPSlabMemory *sub;
+  GstMemory *parent;
+
+  if ((parent = mem->parent) == NULL)
+    parent = mem;
+
+  if (size == -1)
+    size = mem->size - offset;
+
+  sub = g_slice_new (GstRTSPSlabMemory);
+  sub->data = slab->data;
+  sub->next = NULL;
+
+  gst_memory_init (GST_MEMORY_CAST (sub),
+      GST_MINI_OBJECT_FLAGS (parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+      mem->allocator, parent, mem->maxsize, mem->align, mem->offset + offset, size);
+
+  return GST_MEMORY_CAST (sub);
+}
+
+static void
+gst_rtsp_slab_allocator_class_init (GstRTSPSlabAllocatorClass *klass)
+{
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  allocator_class->alloc = gst_rtsp_slab_allocator_alloc;
+  allocator_class->free = gst_rtsp_slab_allocator_free;
+}
+
+static void
+gst_rtsp_slab_allocator_init (GstRTSPSlabAllocator *allocator)
+{
+  GstAllocator *alloc = GST_ALLOCATOR_CAST (allocator);
+
+  alloc->mem_type = "rtmp2rtsp-slab";
+  alloc->mem_map = gst_rtsp_slab_memory_map;
+  alloc->mem_unmap = gst_rtsp_slab_memory_unmap;
+  alloc->mem_share = gst_rtsp_slab_memory_share;
+}
+
+void
+slab_init ()
+{
+  GstAllocator *allocator;
+
+  slab_sysmem = gst_allocator_find (GST_ALLOCATOR_SYSMEM);
+
+  /* the rtp payloaders allocate their headers from the default allocator
+   * without asking downstream, so the pool has to become the default */
+  allocator = g_object_new (gst_rtsp_slab_allocator_get_type (), NULL);
+  gst_object_ref_sink (allocator);
+
+  gst_allocator_register ("rtmp2rtsp-slab", gst_object_ref (allocator));
+  gst_allocator_set_default (allocator);
+
+  g_print ("rtmp2rtsp: run slab allocator with %u byte slabs\n", SLAB_SIZE);
+}
+
+void
+slab_sample ()
+{
+  guint64 allocs;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  allocs = __atomic_load_n (&slab_stat.allocs, __ATOMIC_RELAXED);
+
+  if (slab_stat.sample_time > 0 && now > slab_stat.sample_time)
+    g_atomic_int_set (&slab_stat.rate,
+        (allocs - slab_stat.sample_allocs) * G_USEC_PER_SEC / (now - slab_stat.sample_time));
+
+  slab_stat.sample_allocs = allocs;
+  slab_stat.sample_time = now;
+}
+
+void
+slab_metrics_append (GString *body)
+{
+  if (!slab_sysmem)
+    return;
+
+  g_string_append (body, "# TYPE rtmp2rtsp_slab_allocs_total counter\n");
+  g_string_append_printf (body,
+      "rtmp2rtsp_slab_allocs_total{source=\"thread\"} %" G_GUINT64_FORMAT "\n",
+      __atomic_load_n (&slab_stat.thread_hits, __ATOMIC_RELAXED));
+  g_string_append_printf (body,
+      "rtmp2rtsp_slab_allocs_total{source=\"shared\"} %" G_GUINT64_FORMAT "\n",
+      __atomic_load_n (&slab_stat.shared_hits, __ATOMIC_RELAXED));
+  g_string_append_printf (body,
+      "rtmp2rtsp_slab_allocs_total{source=\"heap\"} %" G_GUINT64_FORMAT "\n",
+      __atomic_load_n (&slab_stat.slabs, __ATOMIC_RELAXED));
+  g_string_append_printf (body,
+      "rtmp2rtsp_slab_allocs_total{source=\"sysmem\"} %" G_GUINT64_FORMAT "\n",
+      __atomic_load_n (&slab_stat.oversize, __ATOMIC_RELAXED));
+}
+
+void
+json_builder_slab_value (JsonBuilder *builder)
+{
+  if (!slab_sysmem)
+    return;
+
+  json_builder_set_member_name (builder, "slab");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "allocs");
+  json_builder_add_int_value (builder, __atomic_load_n (&slab_stat.allocs, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "allocs_per_sec");
+  json_builder_add_int_value (builder, g_atomic_int_get (&slab_stat.rate));
+  json_builder_set_member_name (builder, "thread_hits");
+  json_builder_add_int_value (builder, __atomic_load_n (&slab_stat.thread_hits, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "shared_hits");
+  json_builder_add_int_value (builder, __atomic_load_n (&slab_stat.shared_hits, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "slabs");
+  json_builder_add_int_value (builder, __atomic_load_n (&slab_stat.slabs, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "oversize");
+  json_builder_add_int_value (builder, __atomic_load_n (&slab_stat.oversize, __ATOMIC_RELAXED));
+
+  json_builder_end_object (builder);
+}
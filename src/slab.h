@@ -0,0 +1,18 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+void slab_init ();
+
+void slab_sample ();
+
+void slab_metrics_append (GString *body);
+
+void json_builder_slab_value (JsonBuilder *builder);
+
+#endif
@@ -0,0 +1,278 @@
+#include "stat.h"
+
+GstRTSPMediaStat *
+media_stat_new ()
+{
+  GstRTSPMediaStat *stat;
+
+  stat = g_new0 (GstRTSPMediaStat, 1);
+
+  return stat;
+}
+
+void
+media_stat_free (GstRTSPMediaStat *stat)
+{
+  g_free (stat);
+}
+
+static GstPadProbeReturn
+media_stat_frame_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPStat *stat)
+{
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+  {
+    GstCaps *caps;
+
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) != GST_EVENT_CAPS)
+      return GST_PAD_PROBE_OK;
+
+    gst_event_parse_caps (GST_PAD_PROBE_INFO_EVENT (info), &caps);
+    stat->rtp = gst_structure_has_name (gst_caps_get_structure (caps, 0), "application/x-rtp");
+
+    return GST_PAD_PROBE_OK;
+  }
+
+  /* forwarded packets reach the payloader as they are, a frame ends on
+   * the marker */
+  if (stat->rtp && !GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info), GST_BUFFER_FLAG_MARKER))
+    return GST_PAD_PROBE_OK;
+
+  __atomic_add_fetch (&stat->frames, 1, __ATOMIC_RELAXED);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+media_stat_packet_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPStat *stat)
+{
+  guint64 bytes, packets;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+
+    bytes = gst_buffer_list_calculate_size (list);
+    packets = gst_buffer_list_length (list);
+  }
+  else
+  {
+    bytes = gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+    packets = 1;
+  }
+
+  __atomic_add_fetch (&stat->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&stat->packets, packets, __ATOMIC_RELAXED);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+media_stat_probe (GstElement *bin, const gchar *name, const gchar *pad_name,
+    GstPadProbeType type, GstPadProbeCallback callback, GstRTSPStat *stat)
+{
+  GstElement *element;
+  GstPad *pad;
+
+  element = gst_bin_get_by_name (GST_BIN (bin), name);
+  if (!element)
+    return;
+
+  pad = gst_element_get_static_pad (element, pad_name);
+  if (pad)
+  {
+    gst_pad_add_probe (pad, type, callback, stat, NULL);
+    gst_object_unref (pad);
+  }
+
+  gst_object_unref (element);
+}
+
+void
+media_stat_attach (GstRTSPMediaStat *stat, GstElement *bin)
+{
+  guint i;
+
+  for (i = 0; i < MEDIA_STAT_TRACKS; i++)
+  {
+    gchar *name;
+
+    name = g_strdup_printf ("rtppay%u", i);
+
+    media_stat_probe (bin, name, "sink",
+        GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+        (GstPadProbeCallback) media_stat_frame_probe, &stat->tracks[i]);
+    media_stat_probe (bin, name, "src",
+        GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+        (GstPadProbeCallback) media_stat_packet_probe, &stat->tracks[i]);
+
+    g_free (name);
+  }
+}
+
+void
+media_stat_sample (GstRTSPMediaStat *stat)
+{
+  gint64 now;
+  guint i;
+
+  now = g_get_monotonic_time ();
+
+  for (i = 0; i < MEDIA_STAT_TRACKS; i++)
+  {
+    GstRTSPStat *track = &stat->tracks[i];
+    guint64 bytes;
+
+    bytes = __atomic_load_n (&track->bytes, __ATOMIC_RELAXED);
+
+    if (track->sample_time > 0 && now > track->sample_time)
+      g_atomic_int_set (&track->bps,
+          (bytes - track->sample_bytes) * 8 * G_USEC_PER_SEC / (now - track->sample_time));
+
+    track->sample_bytes = bytes;
+    track->sample_time = now;
+  }
+}
+
+guint64
+media_stat_get_bytes (GstRTSPMediaStat *stat, guint track)
+{
+  return __atomic_load_n (&stat->tracks[track].bytes, __ATOMIC_RELAXED);
+}
+
+guint64
+media_stat_get_packets (GstRTSPMediaStat *stat, guint track)
+{
+  return __atomic_load_n (&stat->tracks[track].packets, __ATOMIC_RELAXED);
+}
+
+guint64
+media_stat_get_frames (GstRTSPMediaStat *stat, guint track)
+{
+  return __atomic_load_n (&stat->tracks[track].frames, __ATOMIC_RELAXED);
+}
+
+guint
+media_stat_get_bps (GstRTSPMediaStat *stat, guint track)
+{
+  return g_atomic_int_get (&stat->tracks[track].bps);
+}
+
+GstRTSPTransportStat *
+transport_stat_new (const gchar *address, guint track)
+{
+  GstRTSPTransportStat *transport_stat;
+
+  transport_stat = g_new0 (GstRTSPTransportStat, 1);
+  g_mutex_init (&transport_stat->lock);
+  transport_stat->address = g_strdup (address);
+  transport_stat->track = track;
+
+  return transport_stat;
+}
+
+void
+transport_stat_free (GstRTSPTransportStat *stat)
+{
+  g_mutex_clear (&stat->lock);
+  g_free (stat->address);
+  g_free (stat);
+}
+
+void
+transport_stat_start (GstRTSPTransportStat *stat, GstRTSPMediaStat *media_stat)
+{
+  g_mutex_lock (&stat->lock);
+
+  /* an active transport is sent every packet the payloader produces,
+   * so it only has to remember where the media counters were */
+  if (!stat->active)
+  {
+    stat->active = TRUE;
+    stat->base_bytes = media_stat_get_bytes (media_stat, stat->track);
+    stat->base_packets = media_stat_get_packets (media_stat, stat->track);
+  }
+
+  g_mutex_unlock (&stat->lock);
+}
+
+void
+transport_stat_stop (GstRTSPTransportStat *stat, GstRTSPMediaStat *media_stat)
+{
+  g_mutex_lock (&stat->lock);
+
+  if (stat->active)
+  {
+    stat->active = FALSE;
+    stat->bytes += media_stat_get_bytes (media_stat, stat->track) - stat->base_bytes;
+    stat->packets += media_stat_get_packets (media_stat, stat->track) - stat->base_packets;
+  }
+
+  g_mutex_unlock (&stat->lock);
+}
+
+static void
+transport_stat_get_sink (const GValue *value, const GstRTSPTransport *transport, guint64 *bytes, guint64 *packets)
+{
+  GstElement *sink = g_value_get_object (value);
+  GstStructure *structure = NULL;
+  const gchar *host;
+  guint64 value64;
+  gint port;
+
+  if (g_strcmp0 (G_OBJECT_TYPE_NAME (sink), "GstMultiUDPSink") != 0)
+    return;
+
+  host = transport->destination;
+  port = transport->lower_transport == GST_RTSP_LOWER_TRANS_UDP_MCAST ?
+      transport->port.min : transport->client_port.min;
+
+  g_signal_emit_by_name (sink, "get-stats", host, port, &structure);
+  if (!structure)
+    return;
+
+  if (gst_structure_get_uint64 (structure, "bytes-sent", &value64))
+    *bytes += value64;
+  if (gst_structure_get_uint64 (structure, "packets-sent", &value64))
+    *packets += value64;
+
+  gst_structure_free (structure);
+}
+
+void
+transport_stat_get (GstRTSPTransportStat *stat, GstRTSPStreamTransport *trans, GstRTSPMediaStat *media_stat,
+    GstElement *pipeline, guint64 *bytes, guint64 *packets)
+{
+  const GstRTSPTransport *transport = gst_rtsp_stream_transport_get_transport (trans);
+  GstIterator *iter;
+  GValue value = G_VALUE_INIT;
+
+  *bytes = *packets = 0;
+
+  if (transport->lower_transport == GST_RTSP_LOWER_TRANS_TCP)
+  {
+    g_mutex_lock (&stat->lock);
+    *bytes = stat->bytes;
+    *packets = stat->packets;
+    if (stat->active)
+    {
+      *bytes += media_stat_get_bytes (media_stat, stat->track) - stat->base_bytes;
+      *packets += media_stat_get_packets (media_stat, stat->track) - stat->base_packets;
+    }
+    g_mutex_unlock (&stat->lock);
+    return;
+  }
+
+  /* udp clients are sent to by the sinks of the stream, which keep
+   * their own count per destination */
+  if (!pipeline || !transport->destination)
+    return;
+
+  iter = gst_bin_iterate_sinks (GST_BIN (pipeline));
+  while (gst_iterator_next (iter, &value) == GST_ITERATOR_OK)
+  {
+    transport_stat_get_sink (&value, transport, bytes, packets);
+    g_value_reset (&value);
+  }
+  g_value_unset (&value);
+  gst_iterator_free (iter);
+}
@@ -0,0 +1,66 @@
+#ifndef __STAT_H__
+#define __STAT_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#define MEDIA_STAT_TRACKS 2
+
+typedef struct _GstRTSPStat GstRTSPStat;
+
+struct _GstRTSPStat
+{
+  guint64 bytes;
+  guint64 packets;
+  guint64 frames;
+  gboolean rtp;
+  guint64 sample_bytes;
+  gint64 sample_time;
+  guint bps;
+};
+
+typedef struct _GstRTSPMediaStat GstRTSPMediaStat;
+
+struct _GstRTSPMediaStat
+{
+  GstRTSPStat tracks[MEDIA_STAT_TRACKS];
+};
+
+typedef struct _GstRTSPTransportStat GstRTSPTransportStat;
+
+struct _GstRTSPTransportStat
+{
+  GMutex lock;
+  gchar *address;
+  guint track;
+  gboolean active;
+  guint64 bytes;
+  guint64 packets;
+  guint64 base_bytes;
+  guint64 base_packets;
+};
+
+GstRTSPMediaStat *media_stat_new ();
+void media_stat_free (GstRTSPMediaStat *stat);
+
+void media_stat_attach (GstRTSPMediaStat *stat, GstElement *bin);
+
+void media_stat_sample (GstRTSPMediaStat *stat);
+
+guint64 media_stat_get_bytes (GstRTSPMediaStat *stat, guint track);
+guint64 media_stat_get_packets (GstRTSPMediaStat *stat, guint track);
+guint64 media_stat_get_frames (GstRTSPMediaStat *stat, guint track);
+guint media_stat_get_bps (GstRTSPMediaStat *stat, guint track);
+
+GstRTSPTransportStat *transport_stat_new (const gchar *address, guint track);
+void transport_stat_free (GstRTSPTransportStat *stat);
+
+void transport_stat_start (GstRTSPTransportStat *stat, GstRTSPMediaStat *media_stat);
+void transport_stat_stop (GstRTSPTransportStat *stat, GstRTSPMediaStat *media_stat);
+
+void transport_stat_get (GstRTSPTransportStat *stat, GstRTSPStreamTransport *trans, GstRTSPMediaStat *media_stat,
+    GstElement *pipeline, guint64 *bytes, guint64 *packets);
+
+#endif
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "taskpool.h"
+
+typedef struct _GstRTSPTaskWorker GstRTSPTaskWorker;
+
+struct _GstRTSPTaskWorker
+{
+  guint cpu;
+  gint tasks;
+  guint64 pushed;
+};
+
+typedef struct _GstRTSPTaskJob GstRTSPTaskJob;
+
+struct _GstRTSPTaskJob
+{
+  GstTaskPoolFunction func;
+  gpointer user_data;
+};
+
+typedef struct _GstRTSPTaskPool GstRTSPTaskPool;
+typedef struct _GstRTSPTaskPoolClass GstRTSPTaskPoolClass;
+
+struct _GstRTSPTaskPool
+{
+  GstTaskPool parent;
+  GThreadPool *threads;
+  GstRTSPTaskWorker *workers;
+  guint workers_num;
+  guint threads_max;
+  gint running;
+  guint64 refused;
+};
+
+struct _GstRTSPTaskPoolClass
+{
+  GstTaskPoolClass parent_class;
+};
+
+#define GST_TYPE_RTSP_TASK_POOL (gst_rtsp_task_pool_get_type ())
+#define GST_RTSP_TASK_POOL(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_RTSP_TASK_POOL, GstRTSPTaskPool))
+
+GType gst_rtsp_task_pool_get_type (void);
+
+G_DEFINE_TYPE (GstRTSPTaskPool, gst_rtsp_task_pool, GST_TYPE_TASK_POOL);
+
+static GstTaskPool *task_pool = NULL;
+
+static GstRTSPTaskWorker *
+task_pool_pick (GstRTSPTaskPool *pool)
+{
+  GstRTSPTaskWorker *worker;
+  guint i;
+
+  worker = &pool->workers[0];
+
+  for (i = 1; i < pool->workers_num; i++)
+  {
+    if (g_atomic_int_get (&pool->workers[i].tasks) < g_atomic_int_get (&worker->tasks))
+      worker = &pool->workers[i];
+  }
+
+  return worker;
+}
+
+static void
+task_pool_run (GstRTSPTaskJob *job, GstRTSPTaskPool *pool)
+{
+  GstRTSPTaskWorker *worker;
+  cpu_set_t cpuset;
+
+  worker = task_pool_pick (pool);
+
+  g_atomic_int_inc (&worker->tasks);
+  __atomic_add_fetch (&worker->pushed, 1, __ATOMIC_RELAXED);
+
+  CPU_ZERO (&cpuset);
+  CPU_SET (worker->cpu, &cpuset);
+  pthread_setaffinity_np (pthread_self (), sizeof (cpuset), &cpuset);
+
+  job->func (job->user_data);
+
+  g_atomic_int_add (&worker->tasks, -1);
+  g_atomic_int_add (&pool->running, -1);
+
+  g_free (job);
+}
+
+static void
+gst_rtsp_task_pool_prepare (GstTaskPool *task_pool, GError **error)
+{
+  GstRTSPTaskPool *pool = GST_RTSP_TASK_POOL (task_pool);
+
+  /* streaming tasks loop until they are stopped, a queued task would stall
+   * its pipeline, so push refuses tasks above the cap instead of queueing */
+  pool->threads = g_thread_pool_new ((GFunc) task_pool_run, pool, pool->threads_max, FALSE, error);
+}
+
+static void
+gst_rtsp_task_pool_cleanup (GstTaskPool *task_pool)
+{
+  GstRTSPTaskPool *pool = GST_RTSP_TASK_POOL (task_pool);
+
+  if (pool->threads)
+  {
+    g_thread_pool_free (pool->threads, FALSE, TRUE);
+    pool->threads = NULL;
+  }
+}
+
+static gpointer
+gst_rtsp_task_pool_push (GstTaskPool *task_pool,
+    GstTaskPoolFunction func, gpointer user_data, GError **error)
+{
+  GstRTSPTaskPool *pool = GST_RTSP_TASK_POOL (task_pool);
+  GstRTSPTaskJob *job;
+
+  if (g_atomic_int_add (&pool->running, 1) >= (gint) pool->threads_max)
+  {
+    g_atomic_int_add (&pool->running, -1);
+    __atomic_add_fetch (&pool->refused, 1, __ATOMIC_RELAXED);
+    g_set_error (error, GST_CORE_ERROR, GST_CORE_ERROR_FAILED,
+        "task pool is full, %u threads running", pool->threads_max);
+    return NULL;
+  }
+
+  job = g_new0 (GstRTSPTaskJob, 1);
+  job->func = func;
+  job->user_data = user_data;
+
+  if (!g_thread_pool_push (pool->threads, job, error))
+  {
+    g_atomic_int_add (&pool->running, -1);
+    g_free (job);
+  }
+
+  return NULL;
+}
+
+static void
+gst_rtsp_task_pool_join (GstTaskPool *task_pool, gpointer id)
+{
+}
+
+static void
+gst_rtsp_task_pool_finalize (GObject *object)
+{
+  GstRTSPTaskPool *pool = GST_RTSP_TASK_POOL (object);
+
+  g_free (pool->workers);
+
+  G_OBJECT_CLASS (gst_rtsp_task_pool_parent_class)->finalize (object);
+}
+
+static void
+gst_rtsp_task_pool_class_init (GstRTSPTaskPoolClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstTaskPoolClass *task_pool_class = GST_TASK_POOL_CLASS (klass);
+
+  gobject_class->finalize = gst_rtsp_task_pool_finalize;
+
+  task_pool_class->prepare = gst_rtsp_task_pool_prepare;
+  task_pool_class->cleanup = gst_rtsp_task_pool_cleanup;
+  task_pool_class->push = gst_rtsp_task_pool_push;
+  task_pool_class->join = gst_rtsp_task_pool_join;
+}
+
+static void
+gst_rtsp_task_pool_init (GstRTSPTaskPool *pool)
+{
+}
+
+void
+task_pool_init (guint workers, guint threads)
+{
+  GstRTSPTaskPool *pool;
+  GError *error = NULL;
+  guint i;
+
+  pool = g_object_new (GST_TYPE_RTSP_TASK_POOL, NULL);
+  pool->workers_num = MIN (workers, g_get_num_processors ());
+  pool->workers = g_new0 (GstRTSPTaskWorker, pool->workers_num);
+  pool->threads_max = threads > 0 ? threads : pool->workers_num * TASK_POOL_THREADS_PER_CORE;
+
+  for (i = 0; i < pool->workers_num; i++)
+    pool->workers[i].cpu = i;
+
+  gst_task_pool_prepare (GST_TASK_POOL (pool), &error);
+
+  if (error)
+  {
+    g_print ("rtmp2rtsp: failed to prepare task pool: %s\n", error->message);
+    g_error_free (error);
+    gst_object_unref (pool);
+    return;
+  }
+
+  task_pool = GST_TASK_POOL (pool);
+
+  g_print ("rtmp2rtsp: run task pool on %u cores, up to %u threads\n", pool->workers_num, pool->threads_max);
+}
+
+GstTaskPool *
+task_pool_get ()
+{
+  return task_pool;
+}
+
+static void
+task_pool_sync_message (GstBus *bus, GstMessage *message, GstTaskPool *pool)
+{
+  GstStreamStatusType type;
+  GstElement *owner;
+  const GValue *value;
+  GObject *object;
+
+  gst_message_parse_stream_status (message, &type, &owner);
+
+  if (type != GST_STREAM_STATUS_TYPE_CREATE)
+    return;
+
+  value = gst_message_get_stream_status_object (message);
+
+  if (value && G_VALUE_HOLDS_OBJECT (value))
+  {
+    object = g_value_get_object (value);
+
+    if (GST_IS_TASK (object))
+      gst_task_set_pool (GST_TASK (object), pool);
+  }
+}
+
+void
+task_pool_install (GstElement *element)
+{
+  GstObject *pipeline, *parent;
+  GstBus *bus;
+
+  if (!task_pool)
+    return;
+
+  /* the media bin posts on its parent's child bus, which keeps the bin's
+   * own sync handler; stream-status is forwarded up to the pipeline bus */
+  pipeline = gst_object_ref (element);
+  while ((parent = gst_object_get_parent (pipeline)))
+  {
+    gst_object_unref (pipeline);
+    pipeline = parent;
+  }
+
+  if (!GST_IS_PIPELINE (pipeline))
+  {
+    g_print ("rtmp2rtsp: %s: no pipeline, skip task pool\n", GST_OBJECT_NAME (element));
+    gst_object_unref (pipeline);
+    return;
+  }
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+
+  /* the media watches the bus from its own source, sync-message emission
+   * leaves the bus handlers untouched */
+  gst_bus_enable_sync_message_emission (bus);
+  g_signal_connect (bus, "sync-message::stream-status", G_CALLBACK (task_pool_sync_message), task_pool);
+
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+}
+
+void
+json_builder_task_pool (JsonBuilder *builder)
+{
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "data");
+  json_builder_begin_object (builder);
+  json_builder_task_pool_value (builder);
+  json_builder_end_object (builder);
+  json_builder_end_object (builder);
+}
+
+void
+json_builder_task_pool_value (JsonBuilder *builder)
+{
+  GstRTSPTaskPool *pool = (GstRTSPTaskPool *) task_pool;
+  guint i;
+
+  json_builder_set_member_name (builder, "type");
+  json_builder_add_string_value (builder, "workers");
+
+  json_builder_set_member_name (builder, "enabled");
+  json_builder_add_boolean_value (builder, pool != NULL);
+
+  if (!pool)
+    return;
+
+  json_builder_set_member_name (builder, "threads");
+  json_builder_add_int_value (builder, g_thread_pool_get_num_threads (pool->threads));
+  json_builder_set_member_name (builder, "max_threads");
+  json_builder_add_int_value (builder, pool->threads_max);
+  json_builder_set_member_name (builder, "refused");
+  json_builder_add_int_value (builder, __atomic_load_n (&pool->refused, __ATOMIC_RELAXED));
+  json_builder_set_member_name (builder, "idle_threads");
+  json_builder_add_int_value (builder, g_thread_pool_get_num_unused_threads ());
+
+  json_builder_set_member_name (builder, "workers");
+  json_builder_begin_array (builder);
+
+  for (i = 0; i < pool->workers_num; i++)
+  {
+    json_builder_begin_object (builder);
+    json_builder_set_member_name (builder, "cpu");
+    json_builder_add_int_value (builder, pool->workers[i].cpu);
+    json_builder_set_member_name (builder, "tasks");
+    json_builder_add_int_value (builder, g_atomic_int_get (&pool->workers[i].tasks));
+    json_builder_set_member_name (builder, "pushed");
+    json_builder_add_int_value (builder, __atomic_load_n (&pool->workers[i].pushed, __ATOMIC_RELAXED));
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_array (builder);
+}
@@ -0,0 +1,21 @@
+#ifndef __TASKPOOL_H__
+#define __TASKPOOL_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+#define TASK_POOL_THREADS_PER_CORE 16
+
+void task_pool_init (guint workers, guint threads);
+
+GstTaskPool *task_pool_get ();
+
+void task_pool_install (GstElement *element);
+
+void json_builder_task_pool (JsonBuilder *builder);
+void json_builder_task_pool_value (JsonBuilder *builder);
+
+#endif
@@ -0,0 +1,489 @@
+#include <string.h>
+
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+#include "thumbnail.h"
+
+/* decodes are short and rare, a couple of threads keep a wall of
+ * thumbnails from ever running one decoder per viewer */
+#define THUMBNAIL_DECODERS 2
+#define THUMBNAIL_DECODE_TIMEOUT (2 * GST_SECOND)
+
+struct _GstRTSPThumbnail
+{
+  gint ref_count;
+  GMutex lock;
+  gchar *path;
+  gchar *id;
+
+  GstCaps *caps;
+  GstCaps *keyframe_caps;
+  GstBuffer *keyframe;
+  guint64 sequence;
+
+  GBytes *jpeg;
+  guint64 jpeg_sequence;
+  gint64 jpeg_time;
+  guint64 failed_sequence;
+  gboolean decoding;
+
+  guint64 served;
+  guint64 decodes;
+  guint64 failed;
+  gint64 decode_us;
+};
+
+typedef struct _GstRTSPThumbnailJob GstRTSPThumbnailJob;
+
+struct _GstRTSPThumbnailJob
+{
+  GstRTSPThumbnail *thumbnail;
+  GstCaps *caps;
+  GstBuffer *keyframe;
+  guint64 sequence;
+};
+
+typedef struct _GstRTSPThumbnailRegistry GstRTSPThumbnailRegistry;
+
+struct _GstRTSPThumbnailRegistry
+{
+  GMutex lock;
+  gboolean enabled;
+  gint64 ttl;
+  GHashTable *streams;
+  GThreadPool *decoders;
+  ThumbnailNotify notify;
+  gpointer notify_data;
+};
+
+static GstRTSPThumbnailRegistry thumbnail_registry;
+
+static void thumbnail_run (GstRTSPThumbnailJob *job, gpointer data);
+
+void
+thumbnail_init (guint ttl_ms)
+{
+  g_mutex_init (&thumbnail_registry.lock);
+  thumbnail_registry.enabled = TRUE;
+  thumbnail_registry.ttl = (gint64) ttl_ms * 1000;
+  thumbnail_registry.streams = g_hash_table_new (g_str_hash, g_str_equal);
+  thumbnail_registry.decoders = g_thread_pool_new ((GFunc) thumbnail_run, NULL, THUMBNAIL_DECODERS, FALSE, NULL);
+}
+
+gboolean
+thumbnail_enabled ()
+{
+  return thumbnail_registry.enabled;
+}
+
+guint
+thumbnail_get_ttl ()
+{
+  return thumbnail_registry.ttl / 1000;
+}
+
+void
+thumbnail_set_notify (ThumbnailNotify notify, gpointer data)
+{
+  g_mutex_lock (&thumbnail_registry.lock);
+  thumbnail_registry.notify = notify;
+  thumbnail_registry.notify_data = data;
+  g_mutex_unlock (&thumbnail_registry.lock);
+}
+
+static void
+thumbnail_notify (GstRTSPThumbnail *thumbnail)
+{
+  ThumbnailNotify notify;
+  gpointer notify_data;
+
+  g_mutex_lock (&thumbnail_registry.lock);
+  notify = thumbnail_registry.notify;
+  notify_data = thumbnail_registry.notify_data;
+  g_mutex_unlock (&thumbnail_registry.lock);
+
+  if (notify)
+    notify (thumbnail->path, notify_data);
+}
+
+static GstRTSPThumbnail *
+thumbnail_new (const gchar *path, const gchar *id)
+{
+  GstRTSPThumbnail *thumbnail;
+
+  thumbnail = g_new0 (GstRTSPThumbnail, 1);
+  thumbnail->ref_count = 1;
+  g_mutex_init (&thumbnail->lock);
+  thumbnail->path = g_strdup (path);
+  thumbnail->id = g_strdup (id);
+
+  /* a restarted stream must not match etags browsers still hold */
+  thumbnail->sequence = g_get_real_time ();
+
+  return thumbnail;
+}
+
+static void
+thumbnail_free (GstRTSPThumbnail *thumbnail)
+{
+  gst_caps_replace (&thumbnail->caps, NULL);
+  gst_caps_replace (&thumbnail->keyframe_caps, NULL);
+  gst_buffer_replace (&thumbnail->keyframe, NULL);
+  if (thumbnail->jpeg)
+    g_bytes_unref (thumbnail->jpeg);
+  g_mutex_clear (&thumbnail->lock);
+  g_free (thumbnail->path);
+  g_free (thumbnail->id);
+  g_free (thumbnail);
+}
+
+GstRTSPThumbnail *
+thumbnail_acquire (const gchar *path, const gchar *id)
+{
+  GstRTSPThumbnail *thumbnail;
+
+  g_mutex_lock (&thumbnail_registry.lock);
+
+  thumbnail = g_hash_table_lookup (thumbnail_registry.streams, path);
+  if (thumbnail)
+  {
+    thumbnail->ref_count++;
+  }
+  else
+  {
+    thumbnail = thumbnail_new (path, id);
+    g_hash_table_insert (thumbnail_registry.streams, thumbnail->path, thumbnail);
+  }
+
+  g_mutex_unlock (&thumbnail_registry.lock);
+
+  return thumbnail;
+}
+
+GstRTSPThumbnail *
+thumbnail_lookup (const gchar *id)
+{
+  GstRTSPThumbnail *thumbnail = NULL;
+  GHashTableIter iter;
+  gpointer value;
+
+  if (!thumbnail_registry.enabled)
+    return NULL;
+
+  g_mutex_lock (&thumbnail_registry.lock);
+
+  /* ids are what /api/v1/streams lists, views of a stream such as its
+   * timeshift share the id, so the stream itself has the shortest path */
+  g_hash_table_iter_init (&iter, thumbnail_registry.streams);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+  {
+    GstRTSPThumbnail *item = value;
+
+    if (g_strcmp0 (item->id, id) != 0)
+      continue;
+
+    if (!thumbnail || strlen (item->path) < strlen (thumbnail->path))
+      thumbnail = item;
+  }
+
+  if (thumbnail)
+    thumbnail->ref_count++;
+
+  g_mutex_unlock (&thumbnail_registry.lock);
+
+  return thumbnail;
+}
+
+void
+thumbnail_release (GstRTSPThumbnail *thumbnail)
+{
+  gboolean last;
+
+  g_mutex_lock (&thumbnail_registry.lock);
+  last = --thumbnail->ref_count == 0;
+  if (last)
+    g_hash_table_remove (thumbnail_registry.streams, thumbnail->path);
+  g_mutex_unlock (&thumbnail_registry.lock);
+
+  if (last)
+    thumbnail_free (thumbnail);
+}
+
+static GstPadProbeReturn
+thumbnail_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPThumbnail *thumbnail)
+{
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+  {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+      return GST_PAD_PROBE_OK;
+
+    /* only a reference to the newest idr is kept, nothing is decoded
+     * until someone asks for it */
+    g_mutex_lock (&thumbnail->lock);
+    if (thumbnail->caps)
+    {
+      gst_buffer_replace (&thumbnail->keyframe, buffer);
+      gst_caps_replace (&thumbnail->keyframe_caps, thumbnail->caps);
+      thumbnail->sequence++;
+    }
+    g_mutex_unlock (&thumbnail->lock);
+  }
+  else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+  {
+    GstCaps *caps;
+
+    gst_event_parse_caps (GST_PAD_PROBE_INFO_EVENT (info), &caps);
+
+    /* a forwarded packet is a slice of a frame, there is nothing to decode */
+    if (gst_structure_has_name (gst_caps_get_structure (caps, 0), "application/x-rtp"))
+      caps = NULL;
+
+    g_mutex_lock (&thumbnail->lock);
+    gst_caps_replace (&thumbnail->caps, caps);
+    g_mutex_unlock (&thumbnail->lock);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+thumbnail_attach (GstRTSPThumbnail *thumbnail, GstElement *bin)
+{
+  GstElement *element;
+  GstPad *pad;
+
+  /* the last keyframe of a previous pipeline stays until the new one
+   * has its own, its caps went with it */
+  g_mutex_lock (&thumbnail->lock);
+  gst_caps_replace (&thumbnail->caps, NULL);
+  g_mutex_unlock (&thumbnail->lock);
+
+  element = gst_bin_get_by_name (GST_BIN (bin), "parse0");
+  if (!element)
+    return;
+
+  pad = gst_element_get_static_pad (element, "src");
+  if (pad)
+  {
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+        (GstPadProbeCallback) thumbnail_probe, thumbnail, NULL);
+    gst_object_unref (pad);
+  }
+
+  gst_object_unref (element);
+}
+
+const gchar *
+thumbnail_get_path (GstRTSPThumbnail *thumbnail)
+{
+  return thumbnail->path;
+}
+
+static GBytes *
+thumbnail_decode (GstCaps *caps, GstBuffer *keyframe)
+{
+  GstElement *pipeline, *appsrc, *appsink;
+  GstMessage *message;
+  GstSample *sample;
+  GstBuffer *buffer;
+  GstMapInfo map;
+  GBytes *jpeg = NULL;
+  GError *error = NULL;
+
+  pipeline = gst_parse_launch (
+      "appsrc name=src format=time "
+      "! decodebin "
+      "! videoconvert "
+      "! jpegenc "
+      "! appsink name=sink sync=false max-buffers=1",
+      &error);
+
+  if (error)
+  {
+    g_print ("rtmp2rtsp: thumbnail: %s\n", error->message);
+    g_error_free (error);
+    if (pipeline)
+      gst_object_unref (pipeline);
+    return NULL;
+  }
+
+  appsrc = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  appsink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+
+  gst_app_src_set_caps (GST_APP_SRC (appsrc), caps);
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  /* the idr alone, then eos drains the decoder, p-frames never get here */
+  buffer = gst_buffer_copy (keyframe);
+  GST_BUFFER_PTS (buffer) = 0;
+  GST_BUFFER_DTS (buffer) = 0;
+  GST_BUFFER_DURATION (buffer) = GST_CLOCK_TIME_NONE;
+  gst_app_src_push_buffer (GST_APP_SRC (appsrc), buffer);
+  gst_app_src_end_of_stream (GST_APP_SRC (appsrc));
+
+  message = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline), THUMBNAIL_DECODE_TIMEOUT,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+
+  if (message && GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS)
+  {
+    sample = gst_app_sink_try_pull_sample (GST_APP_SINK (appsink), 0);
+    if (sample)
+    {
+      buffer = gst_sample_get_buffer (sample);
+      if (buffer && gst_buffer_map (buffer, &map, GST_MAP_READ))
+      {
+        jpeg = g_bytes_new (map.data, map.size);
+        gst_buffer_unmap (buffer, &map);
+      }
+      gst_sample_unref (sample);
+    }
+  }
+
+  if (message)
+    gst_message_unref (message);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  gst_object_unref (appsrc);
+  gst_object_unref (appsink);
+  gst_object_unref (pipeline);
+
+  return jpeg;
+}
+
+static void
+thumbnail_run (GstRTSPThumbnailJob *job, gpointer data)
+{
+  GstRTSPThumbnail *thumbnail = job->thumbnail;
+  gint64 start;
+  GBytes *jpeg;
+
+  start = g_get_monotonic_time ();
+  jpeg = thumbnail_decode (job->caps, job->keyframe);
+
+  g_mutex_lock (&thumbnail->lock);
+
+  if (jpeg)
+  {
+    if (thumbnail->jpeg)
+      g_bytes_unref (thumbnail->jpeg);
+    thumbnail->jpeg = jpeg;
+    thumbnail->jpeg_sequence = job->sequence;
+    thumbnail->jpeg_time = g_get_monotonic_time ();
+    thumbnail->decodes++;
+    thumbnail->decode_us = thumbnail->jpeg_time - start;
+  }
+  else
+  {
+    /* the same keyframe is not tried again, the next one may decode */
+    thumbnail->failed_sequence = job->sequence;
+    thumbnail->failed++;
+    g_print ("rtmp2rtsp: %s: thumbnail decode failed\n", thumbnail->path);
+  }
+
+  thumbnail->decoding = FALSE;
+
+  g_mutex_unlock (&thumbnail->lock);
+
+  thumbnail_notify (thumbnail);
+
+  gst_caps_unref (job->caps);
+  gst_buffer_unref (job->keyframe);
+  thumbnail_release (thumbnail);
+  g_free (job);
+}
+
+GBytes *
+thumbnail_get_jpeg (GstRTSPThumbnail *thumbnail, guint64 *sequence, gboolean *pending)
+{
+  GstRTSPThumbnailJob *job = NULL;
+  GBytes *jpeg = NULL;
+  gint64 now = g_get_monotonic_time ();
+
+  *pending = FALSE;
+
+  g_mutex_lock (&thumbnail->lock);
+
+  /* the jpeg of the newest keyframe never goes stale, an older one is
+   * good enough for the ttl so a busy wall costs one decode per ttl */
+  if (thumbnail->jpeg &&
+      (thumbnail->jpeg_sequence == thumbnail->sequence || now - thumbnail->jpeg_time < thumbnail_registry.ttl))
+  {
+    jpeg = g_bytes_ref (thumbnail->jpeg);
+    *sequence = thumbnail->jpeg_sequence;
+    thumbnail->served++;
+  }
+  else if (thumbnail->decoding)
+  {
+    *pending = TRUE;
+  }
+  else if (thumbnail->keyframe && thumbnail->failed_sequence != thumbnail->sequence)
+  {
+    job = g_new0 (GstRTSPThumbnailJob, 1);
+    job->thumbnail = thumbnail;
+    job->caps = gst_caps_ref (thumbnail->keyframe_caps);
+    job->keyframe = gst_buffer_ref (thumbnail->keyframe);
+    job->sequence = thumbnail->sequence;
+    thumbnail->decoding = TRUE;
+    *pending = TRUE;
+  }
+
+  g_mutex_unlock (&thumbnail->lock);
+
+  if (job)
+  {
+    g_mutex_lock (&thumbnail_registry.lock);
+    thumbnail->ref_count++;
+    g_mutex_unlock (&thumbnail_registry.lock);
+
+    g_thread_pool_push (thumbnail_registry.decoders, job, NULL);
+  }
+
+  return jpeg;
+}
+
+void
+json_builder_thumbnail_value (JsonBuilder *builder, GstRTSPThumbnail *thumbnail)
+{
+  g_mutex_lock (&thumbnail->lock);
+
+  json_builder_set_member_name (builder, "thumbnail");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "served");
+  json_builder_add_int_value (builder, thumbnail->served);
+  json_builder_set_member_name (builder, "decodes");
+  json_builder_add_int_value (builder, thumbnail->decodes);
+  json_builder_set_member_name (builder, "failed");
+  json_builder_add_int_value (builder, thumbnail->failed);
+  json_builder_set_member_name (builder, "decode_ms");
+  json_builder_add_int_value (builder, thumbnail->decode_us / 1000);
+  json_builder_set_member_name (builder, "size");
+  json_builder_add_int_value (builder, thumbnail->jpeg ? g_bytes_get_size (thumbnail->jpeg) : 0);
+  json_builder_set_member_name (builder, "age_ms");
+  json_builder_add_int_value (builder,
+      thumbnail->jpeg ? (g_get_monotonic_time () - thumbnail->jpeg_time) / 1000 : -1);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&thumbnail->lock);
+}
+
+void
+thumbnail_metrics_append (GString *body, GstRTSPThumbnail *thumbnail, const gchar *path)
+{
+  g_mutex_lock (&thumbnail->lock);
+
+  g_string_append_printf (body,
+      "rtmp2rtsp_thumbnail_served_total{path=\"%s\"} %" G_GUINT64_FORMAT "\n",
+      path, thumbnail->served);
+  g_string_append_printf (body,
+      "rtmp2rtsp_thumbnail_decodes_total{path=\"%s\"} %" G_GUINT64_FORMAT "\n",
+      path, thumbnail->decodes);
+
+  g_mutex_unlock (&thumbnail->lock);
+}
@@ -0,0 +1,34 @@
+#ifndef __THUMBNAIL_H__
+#define __THUMBNAIL_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+#define THUMBNAIL_TIMEOUT_S 5
+
+typedef struct _GstRTSPThumbnail GstRTSPThumbnail;
+
+typedef void (*ThumbnailNotify) (const gchar *path, gpointer data);
+
+void thumbnail_init (guint ttl_ms);
+gboolean thumbnail_enabled ();
+guint thumbnail_get_ttl ();
+
+void thumbnail_set_notify (ThumbnailNotify notify, gpointer data);
+
+GstRTSPThumbnail *thumbnail_acquire (const gchar *path, const gchar *id);
+GstRTSPThumbnail *thumbnail_lookup (const gchar *id);
+void thumbnail_release (GstRTSPThumbnail *thumbnail);
+
+void thumbnail_attach (GstRTSPThumbnail *thumbnail, GstElement *bin);
+
+const gchar *thumbnail_get_path (GstRTSPThumbnail *thumbnail);
+GBytes *thumbnail_get_jpeg (GstRTSPThumbnail *thumbnail, guint64 *sequence, gboolean *pending);
+
+void json_builder_thumbnail_value (JsonBuilder *builder, GstRTSPThumbnail *thumbnail);
+void thumbnail_metrics_append (GString *body, GstRTSPThumbnail *thumbnail, const gchar *path);
+
+#endif
@@ -0,0 +1,881 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <glib/gstdio.h>
+#include <gst/app/gstappsrc.h>
+
+#include "timeshift.h"
+
+#define TIMESHIFT_ALIGN(size) (((size) + 7) & ~((guint64) 7))
+#define TIMESHIFT_FLUSH_MS 1000
+#define TIMESHIFT_WAIT_MS 100
+#define TIMESHIFT_QUEUE_BYTES (512 * 1024)
+#define TIMESHIFT_PREFAULT_BYTES (4 * 1024 * 1024)
+
+/* the published window and occupancy only move in steps so the stream
+ * list is not rebuilt for every frame */
+#define TIMESHIFT_REPORT_S 10
+#define TIMESHIFT_REPORT_STEPS 10
+
+/* audio-only streams index a frame every second instead of every frame */
+#define TIMESHIFT_AUDIO_INDEX GST_SECOND
+
+#define TIMESHIFT_RECORD_DELTA (1 << 0)
+#define TIMESHIFT_RECORD_CAPS (1 << 1)
+
+typedef struct _GstRTSPTimeshiftRecord GstRTSPTimeshiftRecord;
+
+struct _GstRTSPTimeshiftRecord
+{
+  guint32 size;
+  guint32 length;
+  guint32 track;
+  guint32 flags;
+  guint64 pts;
+  guint64 dts;
+  guint64 duration;
+};
+
+typedef struct _GstRTSPTimeshiftKeyframe GstRTSPTimeshiftKeyframe;
+
+struct _GstRTSPTimeshiftKeyframe
+{
+  guint64 position;
+  GstClockTime pts;
+  GstCaps *caps[TIMESHIFT_TRACKS];
+};
+
+struct _GstRTSPTimeshift
+{
+  gint ref_count;
+  GMutex lock;
+  GCond cond;
+  gchar *path;
+  gchar *filename;
+  gint fd;
+  guint8 *data;
+  guint64 size;
+  guint64 head;
+  guint64 tail;
+  guint64 flushed;
+  guint64 prefaulted;
+  GArray *keyframes;
+  GstCaps *caps[TIMESHIFT_TRACKS];
+  GstClockTime last_pts;
+  guint playbacks;
+  guint64 reported_window;
+  guint64 reported_used;
+};
+
+struct _GstRTSPTimeshiftPlayback
+{
+  GMutex lock;
+  GstRTSPTimeshift *store;
+  GstClockTime base;
+  GstClockTime duration;
+  GstClockTime target;
+  guint64 start;
+  GstClockTimeDiff offset;
+  GstCaps *caps[TIMESHIFT_TRACKS];
+};
+
+typedef struct _GstRTSPTimeshiftReader GstRTSPTimeshiftReader;
+
+struct _GstRTSPTimeshiftReader
+{
+  GstRTSPTimeshiftPlayback *playback;
+  guint track;
+  guint64 position;
+  GstCaps *caps;
+};
+
+typedef struct _GstRTSPTimeshifts GstRTSPTimeshifts;
+
+struct _GstRTSPTimeshifts
+{
+  GMutex lock;
+  gchar *dir;
+  gchar *prefix;
+  guint64 size;
+  gint *version;
+  GHashTable *stores;
+};
+
+static GstRTSPTimeshifts timeshifts;
+
+static void
+timeshift_keyframe_clear (GstRTSPTimeshiftKeyframe *keyframe)
+{
+  guint i;
+
+  for (i = 0; i < TIMESHIFT_TRACKS; i++)
+    gst_caps_replace (&keyframe->caps[i], NULL);
+}
+
+static void
+timeshift_sync (GstRTSPTimeshift *store, guint64 start, guint64 end)
+{
+  guint64 offset;
+
+  if (end - start >= store->size)
+  {
+    sync_file_range (store->fd, 0, store->size, SYNC_FILE_RANGE_WRITE);
+    return;
+  }
+
+  offset = start % store->size;
+
+  if (offset + (end - start) <= store->size)
+  {
+    sync_file_range (store->fd, offset, end - start, SYNC_FILE_RANGE_WRITE);
+  }
+  else
+  {
+    sync_file_range (store->fd, offset, store->size - offset, SYNC_FILE_RANGE_WRITE);
+    sync_file_range (store->fd, 0, offset + (end - start) - store->size, SYNC_FILE_RANGE_WRITE);
+  }
+}
+
+static void
+timeshift_prefault_range (GstRTSPTimeshift *store, guint64 offset, guint64 length)
+{
+  guint64 page = sysconf (_SC_PAGESIZE);
+  guint64 start = offset & ~(page - 1);
+
+#ifdef MADV_POPULATE_WRITE
+  if (madvise (store->data + start, offset + length - start, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  madvise (store->data + start, offset + length - start, MADV_WILLNEED);
+}
+
+static void
+timeshift_prefault (GstRTSPTimeshift *store, guint64 start, guint64 end)
+{
+  guint64 offset;
+
+  offset = start % store->size;
+
+  if (offset + (end - start) <= store->size)
+  {
+    timeshift_prefault_range (store, offset, end - start);
+  }
+  else
+  {
+    timeshift_prefault_range (store, offset, store->size - offset);
+    timeshift_prefault_range (store, 0, offset + (end - start) - store->size);
+  }
+}
+
+static gpointer
+timeshift_flush_thread (gpointer user_data)
+{
+  while (TRUE)
+  {
+    GHashTableIter iter;
+    GstRTSPTimeshift *store;
+    GPtrArray *stores;
+    guint i;
+
+    g_usleep (TIMESHIFT_FLUSH_MS * 1000);
+
+    stores = g_ptr_array_new_with_free_func ((GDestroyNotify) timeshift_release);
+
+    g_mutex_lock (&timeshifts.lock);
+    g_hash_table_iter_init (&iter, timeshifts.stores);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &store))
+    {
+      store->ref_count++;
+      g_ptr_array_add (stores, store);
+    }
+    g_mutex_unlock (&timeshifts.lock);
+
+    /* the streaming threads only copy into the page cache, the disk sees
+     * one sequential range per stream and second, stream after stream */
+    for (i = 0; i < stores->len; i++)
+    {
+      guint64 start, end, ahead;
+
+      store = g_ptr_array_index (stores, i);
+
+      g_mutex_lock (&store->lock);
+      start = store->flushed;
+      end = store->head;
+      store->flushed = end;
+      g_mutex_unlock (&store->lock);
+
+      if (end > start)
+        timeshift_sync (store, start, end);
+
+      /* the pages the next second lands on are faulted in here, so the
+       * copy on the streaming thread never waits for the filesystem */
+      ahead = MIN (MAX (TIMESHIFT_PREFAULT_BYTES, 2 * (end - start)), store->size / 4);
+      start = MAX (store->prefaulted, end);
+      if (end + ahead > start)
+      {
+        timeshift_prefault (store, start, end + ahead);
+        store->prefaulted = end + ahead;
+      }
+    }
+
+    g_ptr_array_unref (stores);
+  }
+
+  return NULL;
+}
+
+void
+timeshift_init (const gchar *dir, guint size_mb, const gchar *prefix, gint *version)
+{
+  g_mutex_init (&timeshifts.lock);
+  timeshifts.dir = g_strdup (dir);
+  timeshifts.prefix = g_strdup (prefix ? prefix : "/");
+  timeshifts.size = (guint64) size_mb * 1024 * 1024;
+  timeshifts.version = version;
+  timeshifts.stores = g_hash_table_new (g_str_hash, g_str_equal);
+
+  if (g_mkdir_with_parents (dir, 0755) < 0)
+    g_print ("rtmp2rtsp: failed to create timeshift directory %s\n", dir);
+
+  g_thread_unref (g_thread_new ("timeshift", timeshift_flush_thread, NULL));
+}
+
+gboolean
+timeshift_enabled (const gchar *path)
+{
+  return timeshifts.dir && g_str_has_prefix (path, timeshifts.prefix) && !g_str_has_suffix (path, TIMESHIFT_SUFFIX);
+}
+
+gchar *
+timeshift_get_source (const gchar *path)
+{
+  gsize length;
+
+  if (!timeshifts.dir || !g_str_has_suffix (path, TIMESHIFT_SUFFIX))
+    return NULL;
+
+  length = strlen (path) - strlen (TIMESHIFT_SUFFIX);
+  if (length == 0)
+    return NULL;
+
+  return g_strndup (path, length);
+}
+
+static GstRTSPTimeshift *
+timeshift_new (const gchar *path)
+{
+  GstRTSPTimeshift *store;
+  gchar *name;
+  gint fd, res;
+  guint8 *data;
+
+  name = g_uri_escape_string (path, NULL, FALSE);
+  store = g_new0 (GstRTSPTimeshift, 1);
+  store->filename = g_strdup_printf ("%s/%s.ring", timeshifts.dir, name);
+  g_free (name);
+
+  /* the ring is allocated in one go so it stays contiguous on disk and
+   * is never grown while frames come in */
+  fd = g_open (store->filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  res = fd < 0 ? -1 : posix_fallocate (fd, 0, timeshifts.size);
+  data = res != 0 ? MAP_FAILED : mmap (NULL, timeshifts.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+  {
+    g_print ("rtmp2rtsp: %s: failed to map timeshift ring %s\n", path, store->filename);
+    if (fd >= 0)
+    {
+      close (fd);
+      g_unlink (store->filename);
+    }
+    g_free (store->filename);
+    g_free (store);
+    return NULL;
+  }
+
+  madvise (data, timeshifts.size, MADV_SEQUENTIAL);
+
+  store->ref_count = 1;
+  g_mutex_init (&store->lock);
+  g_cond_init (&store->cond);
+  store->path = g_strdup (path);
+  store->fd = fd;
+  store->data = data;
+  store->size = timeshifts.size;
+  store->last_pts = GST_CLOCK_TIME_NONE;
+  store->keyframes = g_array_new (FALSE, FALSE, sizeof (GstRTSPTimeshiftKeyframe));
+  g_array_set_clear_func (store->keyframes, (GDestroyNotify) timeshift_keyframe_clear);
+
+  g_print ("rtmp2rtsp: %s: timeshift ring of %" G_GUINT64_FORMAT " bytes at %s\n",
+      path, store->size, store->filename);
+
+  return store;
+}
+
+static void
+timeshift_free (GstRTSPTimeshift *store)
+{
+  guint i;
+
+  munmap (store->data, store->size);
+  close (store->fd);
+  g_unlink (store->filename);
+
+  for (i = 0; i < TIMESHIFT_TRACKS; i++)
+    gst_caps_replace (&store->caps[i], NULL);
+
+  g_array_unref (store->keyframes);
+  g_cond_clear (&store->cond);
+  g_mutex_clear (&store->lock);
+  g_free (store->filename);
+  g_free (store->path);
+  g_free (store);
+}
+
+GstRTSPTimeshift *
+timeshift_acquire (const gchar *path)
+{
+  GstRTSPTimeshift *store;
+
+  g_mutex_lock (&timeshifts.lock);
+
+  store = g_hash_table_lookup (timeshifts.stores, path);
+  if (store)
+  {
+    store->ref_count++;
+  }
+  else
+  {
+    store = timeshift_new (path);
+    if (store)
+      g_hash_table_insert (timeshifts.stores, store->path, store);
+  }
+
+  g_mutex_unlock (&timeshifts.lock);
+
+  return store;
+}
+
+GstRTSPTimeshift *
+timeshift_lookup (const gchar *path)
+{
+  GstRTSPTimeshift *store;
+
+  g_mutex_lock (&timeshifts.lock);
+  store = g_hash_table_lookup (timeshifts.stores, path);
+  if (store)
+    store->ref_count++;
+  g_mutex_unlock (&timeshifts.lock);
+
+  return store;
+}
+
+void
+timeshift_release (GstRTSPTimeshift *store)
+{
+  gboolean last;
+
+  /* the ring lives as long as the stream writes it or someone watches
+   * what is in it */
+  g_mutex_lock (&timeshifts.lock);
+  last = --store->ref_count == 0;
+  if (last)
+    g_hash_table_remove (timeshifts.stores, store->path);
+  g_mutex_unlock (&timeshifts.lock);
+
+  if (last)
+    timeshift_free (store);
+}
+
+static void
+timeshift_evict (GstRTSPTimeshift *store, guint64 end)
+{
+  guint i;
+
+  while (end - store->tail > store->size)
+  {
+    guint64 offset = store->tail % store->size;
+    GstRTSPTimeshiftRecord *record = (GstRTSPTimeshiftRecord *) (store->data + offset);
+
+    if (store->size - offset < sizeof (GstRTSPTimeshiftRecord) || record->size == 0)
+      store->tail += store->size - offset;
+    else
+      store->tail += record->size;
+  }
+
+  for (i = 0; i < store->keyframes->len; i++)
+  {
+    if (g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, i).position >= store->tail)
+      break;
+  }
+
+  if (i > 0)
+    g_array_remove_range (store->keyframes, 0, i);
+}
+
+static void
+timeshift_report (GstRTSPTimeshift *store)
+{
+  GstClockTime window = 0;
+  guint64 used;
+
+  if (store->keyframes->len > 0 && GST_CLOCK_TIME_IS_VALID (store->last_pts))
+    window = store->last_pts - MIN (store->last_pts, g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, 0).pts);
+
+  window /= TIMESHIFT_REPORT_S * GST_SECOND;
+  used = (store->head - store->tail) * TIMESHIFT_REPORT_STEPS / store->size;
+
+  if (window != store->reported_window || used != store->reported_used)
+  {
+    store->reported_window = window;
+    store->reported_used = used;
+    g_atomic_int_inc (timeshifts.version);
+  }
+}
+
+static void
+timeshift_write (GstRTSPTimeshift *store, guint track, guint32 flags, GstBuffer *buffer,
+    const guint8 *data, gsize length)
+{
+  GstRTSPTimeshiftRecord *record;
+  GstClockTime pts;
+  guint64 size, offset, pad;
+  gboolean keyframe;
+
+  size = TIMESHIFT_ALIGN (sizeof (GstRTSPTimeshiftRecord) + length);
+  if (size > store->size / 4)
+    return;
+
+  pts = buffer ? GST_BUFFER_PTS (buffer) : GST_CLOCK_TIME_NONE;
+
+  g_mutex_lock (&store->lock);
+
+  /* a frame never wraps, the rest of the lap is skipped instead */
+  offset = store->head % store->size;
+  pad = offset + size > store->size ? store->size - offset : 0;
+
+  timeshift_evict (store, store->head + pad + size);
+
+  if (pad)
+  {
+    *(guint32 *) (store->data + offset) = 0;
+    store->head += pad;
+    offset = 0;
+  }
+
+  record = (GstRTSPTimeshiftRecord *) (store->data + offset);
+  record->size = size;
+  record->length = length;
+  record->track = track;
+  record->flags = flags;
+  record->pts = pts;
+  record->dts = buffer ? GST_BUFFER_DTS (buffer) : GST_CLOCK_TIME_NONE;
+  record->duration = buffer ? GST_BUFFER_DURATION (buffer) : GST_CLOCK_TIME_NONE;
+  memcpy (record + 1, data, length);
+
+  keyframe = !(flags & (TIMESHIFT_RECORD_DELTA | TIMESHIFT_RECORD_CAPS)) && GST_CLOCK_TIME_IS_VALID (pts);
+
+  if (keyframe && track != 0)
+  {
+    GstRTSPTimeshiftKeyframe *last = store->keyframes->len > 0 ?
+        &g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, store->keyframes->len - 1) : NULL;
+
+    keyframe = !store->caps[0] && (!last || pts >= last->pts + TIMESHIFT_AUDIO_INDEX);
+  }
+
+  if (keyframe)
+  {
+    GstRTSPTimeshiftKeyframe entry = { store->head, pts, { NULL } };
+    guint i;
+
+    /* a playback starting here needs the caps that were valid then */
+    for (i = 0; i < TIMESHIFT_TRACKS; i++)
+      entry.caps[i] = store->caps[i] ? gst_caps_ref (store->caps[i]) : NULL;
+
+    g_array_append_val (store->keyframes, entry);
+  }
+
+  if (GST_CLOCK_TIME_IS_VALID (pts) && (!GST_CLOCK_TIME_IS_VALID (store->last_pts) || pts > store->last_pts))
+    store->last_pts = pts;
+
+  store->head += size;
+
+  timeshift_report (store);
+
+  g_cond_broadcast (&store->cond);
+  g_mutex_unlock (&store->lock);
+}
+
+static GstPadProbeReturn
+timeshift_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPTimeshift *store)
+{
+  guint track = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "timeshift-track"));
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+  {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstMapInfo map;
+
+    if (gst_buffer_map (buffer, &map, GST_MAP_READ))
+    {
+      timeshift_write (store, track,
+          GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) ? TIMESHIFT_RECORD_DELTA : 0,
+          buffer, map.data, map.size);
+      gst_buffer_unmap (buffer, &map);
+    }
+  }
+  else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+  {
+    GstCaps *caps;
+    gchar *string;
+
+    gst_event_parse_caps (GST_PAD_PROBE_INFO_EVENT (info), &caps);
+
+    g_mutex_lock (&store->lock);
+    gst_caps_replace (&store->caps[track], caps);
+    g_mutex_unlock (&store->lock);
+
+    /* a format change mid-stream is replayed where it happened */
+    string = gst_caps_to_string (caps);
+    timeshift_write (store, track, TIMESHIFT_RECORD_CAPS, NULL, (const guint8 *) string, strlen (string) + 1);
+    g_free (string);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+timeshift_attach (GstRTSPTimeshift *store, GstElement *bin)
+{
+  guint i;
+
+  /* after the parser every frame is whole and flagged, which is what a
+   * playback has to start from */
+  for (i = 0; i < TIMESHIFT_TRACKS; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "src");
+    if (pad)
+    {
+      g_object_set_data (G_OBJECT (pad), "timeshift-track", GUINT_TO_POINTER (i));
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+          (GstPadProbeCallback) timeshift_probe, store, NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+}
+
+static void
+timeshift_playback_start (GstRTSPTimeshiftPlayback *playback, const GstRTSPTimeshiftKeyframe *keyframe,
+    GstClockTime target)
+{
+  guint i;
+
+  /* the keyframe is played at the position asked for, so nothing before
+   * the segment start gets clipped downstream */
+  playback->target = target;
+  playback->start = keyframe->position;
+  playback->offset = (GstClockTimeDiff) target - (GstClockTimeDiff) keyframe->pts;
+
+  for (i = 0; i < TIMESHIFT_TRACKS; i++)
+    gst_caps_replace (&playback->caps[i], keyframe->caps[i]);
+}
+
+GstRTSPTimeshiftPlayback *
+timeshift_playback_new (GstRTSPTimeshift *store)
+{
+  GstRTSPTimeshiftPlayback *playback;
+  GstRTSPTimeshiftKeyframe *keyframe;
+
+  g_mutex_lock (&store->lock);
+
+  if (store->keyframes->len == 0)
+  {
+    g_mutex_unlock (&store->lock);
+    return NULL;
+  }
+
+  playback = g_new0 (GstRTSPTimeshiftPlayback, 1);
+  g_mutex_init (&playback->lock);
+  playback->store = store;
+
+  /* npt 0 is the oldest keyframe still in the ring */
+  keyframe = &g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, 0);
+  playback->base = keyframe->pts;
+  playback->duration = store->last_pts - MIN (store->last_pts, keyframe->pts);
+  timeshift_playback_start (playback, keyframe, 0);
+
+  store->playbacks++;
+  g_mutex_unlock (&store->lock);
+
+  g_mutex_lock (&timeshifts.lock);
+  store->ref_count++;
+  g_mutex_unlock (&timeshifts.lock);
+
+  return playback;
+}
+
+void
+timeshift_playback_free (GstRTSPTimeshiftPlayback *playback)
+{
+  GstRTSPTimeshift *store = playback->store;
+  guint i;
+
+  g_mutex_lock (&store->lock);
+  store->playbacks--;
+  g_mutex_unlock (&store->lock);
+
+  timeshift_release (store);
+
+  for (i = 0; i < TIMESHIFT_TRACKS; i++)
+    gst_caps_replace (&playback->caps[i], NULL);
+
+  g_mutex_clear (&playback->lock);
+  g_free (playback);
+}
+
+gboolean
+timeshift_playback_has_track (GstRTSPTimeshiftPlayback *playback, guint track)
+{
+  return playback->caps[track] != NULL;
+}
+
+static void
+timeshift_playback_seek (GstRTSPTimeshiftPlayback *playback, GstClockTime target)
+{
+  GstRTSPTimeshift *store = playback->store;
+  GstRTSPTimeshiftKeyframe *keyframe = NULL;
+  guint i;
+
+  g_mutex_lock (&store->lock);
+
+  /* the last keyframe at or before the position, or the oldest one when
+   * the position already left the ring */
+  for (i = store->keyframes->len; i > 0; i--)
+  {
+    keyframe = &g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, i - 1);
+    if (keyframe->pts <= playback->base + target)
+      break;
+  }
+
+  if (keyframe)
+  {
+    timeshift_playback_start (playback, keyframe, target);
+    g_print ("rtmp2rtsp: %s: timeshift to npt %" GST_TIME_FORMAT " from keyframe at %" GST_TIME_FORMAT "\n",
+        store->path, GST_TIME_ARGS (target), GST_TIME_ARGS (keyframe->pts - MIN (keyframe->pts, playback->base)));
+  }
+
+  g_mutex_unlock (&store->lock);
+}
+
+static GstRTSPTimeshiftRecord *
+timeshift_record_at (GstRTSPTimeshift *store, guint64 *position)
+{
+  while (*position < store->head)
+  {
+    guint64 offset = *position % store->size;
+    GstRTSPTimeshiftRecord *record = (GstRTSPTimeshiftRecord *) (store->data + offset);
+
+    if (store->size - offset >= sizeof (GstRTSPTimeshiftRecord) && record->size != 0)
+      return record;
+
+    *position += store->size - offset;
+  }
+
+  return NULL;
+}
+
+static GstClockTime
+timeshift_shift (guint64 time, GstClockTimeDiff offset)
+{
+  if (!GST_CLOCK_TIME_IS_VALID (time))
+    return GST_CLOCK_TIME_NONE;
+
+  return (GstClockTimeDiff) time + offset > 0 ? (GstClockTime) ((GstClockTimeDiff) time + offset) : 0;
+}
+
+static GstBuffer *
+timeshift_read (GstRTSPTimeshift *store, GstRTSPTimeshiftReader *reader, GstClockTimeDiff offset, GstCaps **caps)
+{
+  GstRTSPTimeshiftRecord *record;
+  GstBuffer *buffer;
+
+  while (TRUE)
+  {
+    /* a reader left behind by the writer picks up at the oldest keyframe */
+    if (reader->position < store->tail)
+    {
+      reader->position = store->keyframes->len > 0 ?
+          g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, 0).position : store->tail;
+      g_print ("rtmp2rtsp: %s: timeshift reader overrun, skip to the oldest keyframe\n", store->path);
+    }
+
+    record = timeshift_record_at (store, &reader->position);
+    if (!record)
+      return NULL;
+
+    reader->position += record->size;
+
+    if (record->track != reader->track)
+      continue;
+
+    if (record->flags & TIMESHIFT_RECORD_CAPS)
+    {
+      *caps = gst_caps_from_string ((const gchar *) (record + 1));
+      return NULL;
+    }
+
+    buffer = gst_buffer_new_allocate (NULL, record->length, NULL);
+    gst_buffer_fill (buffer, 0, record + 1, record->length);
+
+    GST_BUFFER_PTS (buffer) = timeshift_shift (record->pts, offset);
+    GST_BUFFER_DTS (buffer) = timeshift_shift (record->dts, offset);
+    GST_BUFFER_DURATION (buffer) = record->duration;
+    if (record->flags & TIMESHIFT_RECORD_DELTA)
+      GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    return buffer;
+  }
+}
+
+static void
+timeshift_need_data (GstAppSrc *appsrc, guint length, GstRTSPTimeshiftReader *reader)
+{
+  GstRTSPTimeshiftPlayback *playback = reader->playback;
+  GstRTSPTimeshift *store = playback->store;
+  GstBuffer *buffer = NULL;
+  GstClockTimeDiff offset;
+  GstCaps *caps;
+  GstPad *pad;
+
+  g_mutex_lock (&playback->lock);
+  offset = playback->offset;
+  caps = reader->caps;
+  reader->caps = NULL;
+  g_mutex_unlock (&playback->lock);
+
+  pad = gst_element_get_static_pad (GST_ELEMENT (appsrc), "src");
+
+  /* at the live edge the reader waits for the writer, a seek or a stop
+   * flushes the pad and lets it go */
+  while (!buffer && !GST_PAD_IS_FLUSHING (pad))
+  {
+    if (caps)
+    {
+      gst_app_src_set_caps (appsrc, caps);
+      gst_caps_unref (caps);
+      caps = NULL;
+    }
+
+    g_mutex_lock (&store->lock);
+    buffer = timeshift_read (store, reader, offset, &caps);
+    if (!buffer && !caps)
+      g_cond_wait_until (&store->cond, &store->lock,
+          g_get_monotonic_time () + TIMESHIFT_WAIT_MS * G_TIME_SPAN_MILLISECOND);
+    g_mutex_unlock (&store->lock);
+  }
+
+  gst_object_unref (pad);
+
+  if (caps)
+    gst_caps_unref (caps);
+
+  if (buffer)
+    gst_app_src_push_buffer (appsrc, buffer);
+}
+
+static gboolean
+timeshift_seek_data (GstAppSrc *appsrc, guint64 target, GstRTSPTimeshiftReader *reader)
+{
+  GstRTSPTimeshiftPlayback *playback = reader->playback;
+
+  /* both tracks seek to the same position, the first one picks the
+   * keyframe for both */
+  g_mutex_lock (&playback->lock);
+  if (target != playback->target)
+    timeshift_playback_seek (playback, target);
+  reader->position = playback->start;
+  gst_caps_replace (&reader->caps, playback->caps[reader->track]);
+  g_mutex_unlock (&playback->lock);
+
+  return TRUE;
+}
+
+static void
+timeshift_reader_free (GstRTSPTimeshiftReader *reader)
+{
+  gst_caps_replace (&reader->caps, NULL);
+  g_free (reader);
+}
+
+void
+timeshift_source_attach (GstRTSPTimeshiftPlayback *playback, GstElement *appsrc, guint track)
+{
+  GstAppSrcCallbacks callbacks = { NULL };
+  GstRTSPTimeshiftReader *reader;
+
+  reader = g_new0 (GstRTSPTimeshiftReader, 1);
+  reader->playback = playback;
+  reader->track = track;
+  reader->position = playback->start;
+
+  /* not live, the sinks pace the playback and the media can seek */
+  gst_util_set_object_arg (G_OBJECT (appsrc), "format", "time");
+  gst_util_set_object_arg (G_OBJECT (appsrc), "stream-type", "seekable");
+  g_object_set (appsrc,
+      "is-live", FALSE,
+      "block", FALSE,
+      "max-bytes", (guint64) TIMESHIFT_QUEUE_BYTES,
+      "caps", playback->caps[track],
+      "duration", playback->duration,
+      NULL);
+
+  callbacks.need_data = (gpointer) timeshift_need_data;
+  callbacks.seek_data = (gpointer) timeshift_seek_data;
+  gst_app_src_set_callbacks (GST_APP_SRC (appsrc), &callbacks, reader, (GDestroyNotify) timeshift_reader_free);
+}
+
+void
+json_builder_timeshift_value (JsonBuilder *builder, GstRTSPTimeshift *store)
+{
+  GstClockTime window = 0;
+
+  g_mutex_lock (&store->lock);
+
+  if (store->keyframes->len > 0 && GST_CLOCK_TIME_IS_VALID (store->last_pts))
+    window = store->last_pts - MIN (store->last_pts, g_array_index (store->keyframes, GstRTSPTimeshiftKeyframe, 0).pts);
+
+  json_builder_set_member_name (builder, "timeshift");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "window_ms");
+  json_builder_add_int_value (builder, window / GST_MSECOND);
+  json_builder_set_member_name (builder, "size_bytes");
+  json_builder_add_int_value (builder, store->size);
+  json_builder_set_member_name (builder, "used_bytes");
+  json_builder_add_int_value (builder, store->head - store->tail);
+  json_builder_set_member_name (builder, "keyframes");
+  json_builder_add_int_value (builder, store->keyframes->len);
+  json_builder_set_member_name (builder, "playbacks");
+  json_builder_add_int_value (builder, store->playbacks);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&store->lock);
+}
@@ -0,0 +1,36 @@
+#ifndef __TIMESHIFT_H__
+#define __TIMESHIFT_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <json-glib/json-glib.h>
+
+#define TIMESHIFT_TRACKS 2
+#define TIMESHIFT_SUFFIX "/timeshift"
+#define TIMESHIFT_SIZE_MB 256
+
+typedef struct _GstRTSPTimeshift GstRTSPTimeshift;
+typedef struct _GstRTSPTimeshiftPlayback GstRTSPTimeshiftPlayback;
+
+void timeshift_init (const gchar *dir, guint size_mb, const gchar *prefix, gint *version);
+
+gboolean timeshift_enabled (const gchar *path);
+gchar *timeshift_get_source (const gchar *path);
+
+GstRTSPTimeshift *timeshift_acquire (const gchar *path);
+GstRTSPTimeshift *timeshift_lookup (const gchar *path);
+void timeshift_release (GstRTSPTimeshift *store);
+
+void timeshift_attach (GstRTSPTimeshift *store, GstElement *bin);
+
+GstRTSPTimeshiftPlayback *timeshift_playback_new (GstRTSPTimeshift *store);
+void timeshift_playback_free (GstRTSPTimeshiftPlayback *playback);
+gboolean timeshift_playback_has_track (GstRTSPTimeshiftPlayback *playback, guint track);
+void timeshift_source_attach (GstRTSPTimeshiftPlayback *playback, GstElement *appsrc, guint track);
+
+void json_builder_timeshift_value (JsonBuilder *builder, GstRTSPTimeshift *store);
+
+#endif
@@ -0,0 +1,646 @@
+#include "upstream.h"
+
+#define UPSTREAM_TRACKS 2
+#define UPSTREAM_BACKOFF_MIN 500
+#define UPSTREAM_BACKOFF_MAX 8000
+#define UPSTREAM_FAILOVER 2
+#define UPSTREAM_GAP (40 * GST_MSECOND)
+#define UPSTREAM_SLATE 3
+
+typedef enum
+{
+  UPSTREAM_PRIMARY,
+  UPSTREAM_BACKUP,
+  UPSTREAM_SLATE_SOURCE
+} GstRTSPUpstreamSource;
+
+static const gchar *upstream_source_names[] =
+{
+  "primary",
+  "backup",
+  "slate"
+};
+
+typedef struct _GstRTSPUpstream GstRTSPUpstream;
+typedef struct _GstRTSPUpstreamClass GstRTSPUpstreamClass;
+
+struct _GstRTSPUpstream
+{
+  GstBin parent;
+  GMutex lock;
+  gchar *location;
+  gchar *backup;
+  guint timeout;
+  guint reconnect_timeout;
+  gboolean slate;
+  GstPad *pads[UPSTREAM_TRACKS];
+  GstElement *src;
+  GstElement *demux;
+  GstElement *slate_elements[UPSTREAM_SLATE];
+  GstRTSPUpstreamSource source;
+  GstRTSPUpstreamSource pending;
+  guint attempts;
+  gboolean reconnecting;
+  gboolean given_up;
+  guint reconnects;
+  guint outages;
+  gint64 outage_start;
+  gint64 outage_last;
+  gint64 outage_total;
+  GstSegment segments[UPSTREAM_TRACKS];
+  GstClockTime last[UPSTREAM_TRACKS];
+  GstClockTimeDiff shift;
+  gboolean resync;
+  gboolean switched;
+};
+
+struct _GstRTSPUpstreamClass
+{
+  GstBinClass parent_class;
+};
+
+#define GST_TYPE_RTSP_UPSTREAM (gst_rtsp_upstream_get_type ())
+#define GST_RTSP_UPSTREAM(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_RTSP_UPSTREAM, GstRTSPUpstream))
+
+GType gst_rtsp_upstream_get_type (void);
+
+G_DEFINE_TYPE (GstRTSPUpstream, gst_rtsp_upstream, GST_TYPE_BIN);
+
+static void upstream_fail (GstRTSPUpstream *upstream);
+
+static void
+upstream_pad_added (GstElement *demux, GstPad *pad, GstRTSPUpstream *upstream)
+{
+  gchar *name;
+  guint track;
+  gint64 now;
+
+  name = gst_pad_get_name (pad);
+  if (g_strcmp0 (name, "video") == 0)
+    track = 0;
+  else if (g_strcmp0 (name, "audio") == 0)
+    track = 1;
+  else
+  {
+    g_free (name);
+    return;
+  }
+  g_free (name);
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&upstream->lock);
+
+  if (demux != upstream->demux)
+  {
+    g_mutex_unlock (&upstream->lock);
+    return;
+  }
+
+  if (upstream->outage_start)
+  {
+    upstream->outage_last = now - upstream->outage_start;
+    upstream->outage_total += upstream->outage_last;
+    upstream->outage_start = 0;
+    upstream->reconnects++;
+    upstream->attempts = 0;
+
+    g_print ("rtmp2rtsp: %s: upstream back after %" G_GINT64_FORMAT " ms\n",
+        upstream->location, upstream->outage_last / 1000);
+  }
+
+  /* the first pad of a new chain starts its timeline, the second one
+   * shares the shift the first buffer picked */
+  if (upstream->switched)
+    upstream->resync = TRUE;
+  upstream->switched = FALSE;
+  upstream->source = upstream->pending;
+
+  g_mutex_unlock (&upstream->lock);
+
+  /* the slate goes away before its pad is replaced, so it never pushes
+   * into an unlinked pad and fails */
+  if (track == 0 && upstream->slate_elements[0])
+  {
+    guint i;
+
+    for (i = 0; i < UPSTREAM_SLATE; i++)
+    {
+      gst_element_set_state (upstream->slate_elements[i], GST_STATE_NULL);
+      gst_bin_remove (GST_BIN (upstream), upstream->slate_elements[i]);
+      upstream->slate_elements[i] = NULL;
+    }
+  }
+
+  gst_ghost_pad_set_target (GST_GHOST_PAD (upstream->pads[track]), pad);
+}
+
+static void
+upstream_no_more_pads (GstElement *demux, GstRTSPUpstream *upstream)
+{
+  gboolean current;
+
+  g_mutex_lock (&upstream->lock);
+  current = demux == upstream->demux;
+  g_mutex_unlock (&upstream->lock);
+
+  /* the media waits for the header to tell which tracks there are */
+  if (current)
+    gst_element_no_more_pads (GST_ELEMENT (upstream));
+}
+
+static gboolean
+upstream_chain_new (GstRTSPUpstream *upstream, const gchar *location)
+{
+  GstElement *src, *demux;
+
+  src = gst_element_factory_make ("rtmpsrc", "src");
+  demux = gst_element_factory_make ("flvdemux", "demux");
+
+  if (!src || !demux)
+  {
+    if (src)
+      gst_object_unref (src);
+    if (demux)
+      gst_object_unref (demux);
+    return FALSE;
+  }
+
+  g_object_set (src, "location", location, "timeout", upstream->timeout, NULL);
+  g_signal_connect (demux, "pad-added", (GCallback) upstream_pad_added, upstream);
+  g_signal_connect (demux, "no-more-pads", (GCallback) upstream_no_more_pads, upstream);
+
+  gst_bin_add_many (GST_BIN (upstream), src, demux, NULL);
+  gst_element_link (src, demux);
+
+  g_mutex_lock (&upstream->lock);
+  upstream->src = src;
+  upstream->demux = demux;
+  g_mutex_unlock (&upstream->lock);
+
+  return TRUE;
+}
+
+static void
+upstream_chain_remove (GstRTSPUpstream *upstream, GstElement *src, GstElement *demux)
+{
+  guint i;
+
+  for (i = 0; i < UPSTREAM_TRACKS; i++)
+  {
+    GstPad *target = gst_ghost_pad_get_target (GST_GHOST_PAD (upstream->pads[i]));
+
+    if (target)
+    {
+      if (GST_PAD_PARENT (target) == demux)
+        gst_ghost_pad_set_target (GST_GHOST_PAD (upstream->pads[i]), NULL);
+      gst_object_unref (target);
+    }
+  }
+
+  gst_element_set_state (src, GST_STATE_NULL);
+  gst_element_set_state (demux, GST_STATE_NULL);
+  gst_bin_remove_many (GST_BIN (upstream), src, demux, NULL);
+}
+
+static void
+upstream_slate_start (GstRTSPUpstream *upstream)
+{
+  GstElement **elements = upstream->slate_elements;
+  GstCaps *caps;
+  GstPad *pad;
+  guint i;
+
+  if (elements[0])
+    return;
+
+  elements[0] = gst_element_factory_make ("videotestsrc", "slate-src");
+  elements[1] = gst_element_factory_make ("capsfilter", "slate-caps");
+  elements[2] = gst_element_factory_make ("x264enc", "slate-enc");
+
+  if (!elements[0] || !elements[1] || !elements[2])
+  {
+    g_print ("rtmp2rtsp: slate needs videotestsrc and x264enc\n");
+    for (i = 0; i < UPSTREAM_SLATE; i++)
+    {
+      if (elements[i])
+        gst_object_unref (elements[i]);
+      elements[i] = NULL;
+    }
+    upstream->slate = FALSE;
+    return;
+  }
+
+  gst_util_set_object_arg (G_OBJECT (elements[0]), "pattern", "black");
+  g_object_set (elements[0], "is-live", TRUE, NULL);
+
+  caps = gst_caps_new_simple ("video/x-raw",
+      "width", G_TYPE_INT, 640,
+      "height", G_TYPE_INT, 360,
+      "framerate", GST_TYPE_FRACTION, 25, 1,
+      NULL);
+  g_object_set (elements[1], "caps", caps, NULL);
+  gst_caps_unref (caps);
+
+  gst_util_set_object_arg (G_OBJECT (elements[2]), "tune", "zerolatency");
+  gst_util_set_object_arg (G_OBJECT (elements[2]), "speed-preset", "ultrafast");
+  g_object_set (elements[2], "key-int-max", 25, NULL);
+
+  gst_bin_add_many (GST_BIN (upstream), elements[0], elements[1], elements[2], NULL);
+  gst_element_link_many (elements[0], elements[1], elements[2], NULL);
+
+  pad = gst_element_get_static_pad (elements[2], "src");
+  gst_ghost_pad_set_target (GST_GHOST_PAD (upstream->pads[0]), pad);
+  gst_object_unref (pad);
+
+  g_mutex_lock (&upstream->lock);
+  upstream->resync = TRUE;
+  upstream->source = UPSTREAM_SLATE_SOURCE;
+  g_mutex_unlock (&upstream->lock);
+
+  for (i = 0; i < UPSTREAM_SLATE; i++)
+    gst_element_sync_state_with_parent (elements[i]);
+}
+
+static gboolean
+upstream_reconnect (GstRTSPUpstream *upstream)
+{
+  GstElement *src, *demux;
+  GstRTSPUpstreamSource source;
+  gboolean give_up;
+  guint attempt, i;
+
+  if (GST_STATE_TARGET (upstream) < GST_STATE_PAUSED)
+    return G_SOURCE_REMOVE;
+
+  g_mutex_lock (&upstream->lock);
+
+  give_up = g_get_monotonic_time () - upstream->outage_start
+      > (gint64) upstream->reconnect_timeout * G_USEC_PER_SEC;
+
+  attempt = upstream->attempts++;
+  upstream->reconnecting = FALSE;
+  upstream->given_up = give_up;
+
+  src = upstream->src;
+  demux = upstream->demux;
+  upstream->src = upstream->demux = NULL;
+
+  /* two tries on the primary, then alternate with the backup */
+  source = UPSTREAM_PRIMARY;
+  if (upstream->backup && attempt >= UPSTREAM_FAILOVER && attempt % 2 == 0)
+    source = UPSTREAM_BACKUP;
+  upstream->pending = source;
+  upstream->switched = TRUE;
+
+  g_mutex_unlock (&upstream->lock);
+
+  if (src)
+    upstream_chain_remove (upstream, src, demux);
+
+  if (give_up)
+  {
+    g_print ("rtmp2rtsp: %s: upstream gone for %u seconds\n", upstream->location, upstream->reconnect_timeout);
+
+    for (i = 0; i < UPSTREAM_SLATE && upstream->slate_elements[i]; i++)
+    {
+      gst_element_set_state (upstream->slate_elements[i], GST_STATE_NULL);
+      gst_bin_remove (GST_BIN (upstream), upstream->slate_elements[i]);
+      upstream->slate_elements[i] = NULL;
+    }
+
+    /* let the media shut down like it did without reconnects */
+    for (i = 0; i < UPSTREAM_TRACKS; i++)
+      gst_pad_push_event (upstream->pads[i], gst_event_new_eos ());
+
+    return G_SOURCE_REMOVE;
+  }
+
+  if (upstream->slate)
+    upstream_slate_start (upstream);
+
+  g_print ("rtmp2rtsp: %s: reconnect to %s upstream, attempt %u\n",
+      upstream->location, upstream_source_names[source], attempt + 1);
+
+  if (!upstream_chain_new (upstream, source == UPSTREAM_BACKUP ? upstream->backup : upstream->location))
+    return G_SOURCE_REMOVE;
+
+  g_mutex_lock (&upstream->lock);
+  src = upstream->src;
+  demux = upstream->demux;
+  g_mutex_unlock (&upstream->lock);
+
+  if (!gst_element_sync_state_with_parent (demux) || !gst_element_sync_state_with_parent (src))
+    upstream_fail (upstream);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+upstream_fail (GstRTSPUpstream *upstream)
+{
+  guint delay;
+
+  g_mutex_lock (&upstream->lock);
+
+  if (upstream->reconnecting || upstream->given_up)
+  {
+    g_mutex_unlock (&upstream->lock);
+    return;
+  }
+
+  upstream->reconnecting = TRUE;
+
+  if (!upstream->outage_start)
+  {
+    upstream->outage_start = g_get_monotonic_time ();
+    upstream->outages++;
+  }
+
+  delay = upstream->attempts == 0 ? 0 :
+      MIN (UPSTREAM_BACKOFF_MIN << MIN (upstream->attempts - 1, 8), UPSTREAM_BACKOFF_MAX);
+
+  g_mutex_unlock (&upstream->lock);
+
+  /* the chain is torn down from the main loop, never from its own thread */
+  g_timeout_add_full (G_PRIORITY_DEFAULT, delay,
+      (GSourceFunc) upstream_reconnect, gst_object_ref (upstream), gst_object_unref);
+}
+
+static GstPadProbeReturn
+upstream_event_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPUpstream *upstream)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstSegment segment;
+  GstEvent *replace;
+  gboolean given_up;
+  guint track;
+
+  track = pad == upstream->pads[0] ? 0 : 1;
+
+  switch (GST_EVENT_TYPE (event))
+  {
+    case GST_EVENT_EOS:
+      g_mutex_lock (&upstream->lock);
+      given_up = upstream->given_up;
+      g_mutex_unlock (&upstream->lock);
+
+      if (given_up)
+        return GST_PAD_PROBE_OK;
+
+      upstream_fail (upstream);
+      return GST_PAD_PROBE_DROP;
+
+    case GST_EVENT_SEGMENT:
+      /* every source starts its own timeline, downstream only ever sees
+       * one that the buffers are mapped onto */
+      g_mutex_lock (&upstream->lock);
+      gst_event_copy_segment (event, &upstream->segments[track]);
+      g_mutex_unlock (&upstream->lock);
+
+      gst_segment_init (&segment, GST_FORMAT_TIME);
+      replace = gst_event_new_segment (&segment);
+      gst_event_set_seqnum (replace, gst_event_get_seqnum (event));
+
+      gst_event_unref (event);
+      GST_PAD_PROBE_INFO_DATA (info) = replace;
+      return GST_PAD_PROBE_OK;
+
+    default:
+      return GST_PAD_PROBE_OK;
+  }
+}
+
+static GstClockTime
+upstream_map (GstRTSPUpstream *upstream, guint track, GstClockTime time)
+{
+  GstClockTime running_time;
+  GstClockTimeDiff mapped;
+
+  if (!GST_CLOCK_TIME_IS_VALID (time))
+    return time;
+
+  running_time = gst_segment_to_running_time (&upstream->segments[track], GST_FORMAT_TIME, time);
+  if (!GST_CLOCK_TIME_IS_VALID (running_time))
+    return GST_CLOCK_TIME_NONE;
+
+  mapped = (GstClockTimeDiff) running_time + upstream->shift;
+
+  return mapped > 0 ? (GstClockTime) mapped : 0;
+}
+
+static GstPadProbeReturn
+upstream_buffer_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPUpstream *upstream)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts, dts, running_time;
+  guint track;
+
+  track = pad == upstream->pads[0] ? 0 : 1;
+
+  g_mutex_lock (&upstream->lock);
+
+  /* the first buffer of a new source continues right after the last one
+   * sent, so payloader timestamps and sequence numbers never jump back */
+  if (upstream->resync && GST_BUFFER_PTS_IS_VALID (buffer))
+  {
+    GstClockTime last = GST_CLOCK_TIME_NONE;
+    guint i;
+
+    for (i = 0; i < UPSTREAM_TRACKS; i++)
+      if (GST_CLOCK_TIME_IS_VALID (upstream->last[i]))
+        last = GST_CLOCK_TIME_IS_VALID (last) ? MAX (last, upstream->last[i]) : upstream->last[i];
+
+    running_time = gst_segment_to_running_time (&upstream->segments[track], GST_FORMAT_TIME,
+        GST_BUFFER_PTS (buffer));
+
+    if (GST_CLOCK_TIME_IS_VALID (last) && GST_CLOCK_TIME_IS_VALID (running_time))
+      upstream->shift = (GstClockTimeDiff) (last + UPSTREAM_GAP) - (GstClockTimeDiff) running_time;
+
+    upstream->resync = FALSE;
+  }
+
+  pts = upstream_map (upstream, track, GST_BUFFER_PTS (buffer));
+  dts = upstream_map (upstream, track, GST_BUFFER_DTS (buffer));
+
+  if (GST_CLOCK_TIME_IS_VALID (pts))
+    upstream->last[track] = GST_CLOCK_TIME_IS_VALID (upstream->last[track]) ?
+        MAX (upstream->last[track], pts) : pts;
+
+  g_mutex_unlock (&upstream->lock);
+
+  buffer = gst_buffer_make_writable (buffer);
+  GST_BUFFER_PTS (buffer) = pts;
+  GST_BUFFER_DTS (buffer) = dts;
+  GST_PAD_PROBE_INFO_DATA (info) = buffer;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+upstream_is_current (GstRTSPUpstream *upstream, GstObject *object)
+{
+  gboolean current = FALSE;
+
+  g_mutex_lock (&upstream->lock);
+  if (upstream->src && (object == GST_OBJECT (upstream->src)
+      || gst_object_has_as_ancestor (object, GST_OBJECT (upstream->src))))
+    current = TRUE;
+  if (upstream->demux && (object == GST_OBJECT (upstream->demux)
+      || gst_object_has_as_ancestor (object, GST_OBJECT (upstream->demux))))
+    current = TRUE;
+  g_mutex_unlock (&upstream->lock);
+
+  return current;
+}
+
+static void
+gst_rtsp_upstream_handle_message (GstBin *bin, GstMessage *message)
+{
+  GstRTSPUpstream *upstream = GST_RTSP_UPSTREAM (bin);
+  gboolean given_up;
+
+  g_mutex_lock (&upstream->lock);
+  given_up = upstream->given_up;
+  g_mutex_unlock (&upstream->lock);
+
+  /* upstream errors end in a reconnect and never reach the media */
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR && !given_up)
+  {
+    if (upstream_is_current (upstream, GST_MESSAGE_SRC (message)))
+    {
+      GError *error = NULL;
+
+      gst_message_parse_error (message, &error, NULL);
+      g_print ("rtmp2rtsp: %s: upstream failed: %s\n", upstream->location, error ? error->message : "");
+      g_clear_error (&error);
+
+      upstream_fail (upstream);
+    }
+
+    gst_message_unref (message);
+    return;
+  }
+
+  GST_BIN_CLASS (gst_rtsp_upstream_parent_class)->handle_message (bin, message);
+}
+
+static void
+gst_rtsp_upstream_finalize (GObject *object)
+{
+  GstRTSPUpstream *upstream = GST_RTSP_UPSTREAM (object);
+
+  g_free (upstream->location);
+  g_free (upstream->backup);
+  g_mutex_clear (&upstream->lock);
+
+  G_OBJECT_CLASS (gst_rtsp_upstream_parent_class)->finalize (object);
+}
+
+static void
+gst_rtsp_upstream_class_init (GstRTSPUpstreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GstBinClass *bin_class = GST_BIN_CLASS (klass);
+
+  object_class->finalize = gst_rtsp_upstream_finalize;
+  bin_class->handle_message = gst_rtsp_upstream_handle_message;
+}
+
+static void
+gst_rtsp_upstream_init (GstRTSPUpstream *upstream)
+{
+  guint i;
+
+  g_mutex_init (&upstream->lock);
+
+  for (i = 0; i < UPSTREAM_TRACKS; i++)
+  {
+    gst_segment_init (&upstream->segments[i], GST_FORMAT_TIME);
+    upstream->last[i] = GST_CLOCK_TIME_NONE;
+  }
+}
+
+GstElement *
+upstream_new (const gchar *location, const gchar *backup,
+    guint timeout, guint reconnect_timeout, gboolean slate)
+{
+  GstRTSPUpstream *upstream;
+  guint i;
+
+  upstream = g_object_new (GST_TYPE_RTSP_UPSTREAM, "name", "upstream", NULL);
+  upstream->location = g_strdup (location);
+  upstream->backup = g_strdup (backup);
+  upstream->timeout = timeout;
+  upstream->reconnect_timeout = reconnect_timeout;
+  upstream->slate = slate;
+
+  /* the pads outlive every source behind them */
+  for (i = 0; i < UPSTREAM_TRACKS; i++)
+  {
+    upstream->pads[i] = gst_ghost_pad_new_no_target (i ? "audio" : "video", GST_PAD_SRC);
+    gst_pad_add_probe (upstream->pads[i], GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+        (GstPadProbeCallback) upstream_event_probe, upstream, NULL);
+    gst_pad_add_probe (upstream->pads[i], GST_PAD_PROBE_TYPE_BUFFER,
+        (GstPadProbeCallback) upstream_buffer_probe, upstream, NULL);
+    gst_element_add_pad (GST_ELEMENT (upstream), upstream->pads[i]);
+  }
+
+  if (!upstream_chain_new (upstream, location))
+  {
+    gst_object_unref (upstream);
+    return NULL;
+  }
+
+  return GST_ELEMENT (upstream);
+}
+
+void
+upstream_set_location (GstElement *element, const gchar *location, const gchar *backup)
+{
+  GstRTSPUpstream *upstream = GST_RTSP_UPSTREAM (element);
+
+  g_mutex_lock (&upstream->lock);
+  g_free (upstream->location);
+  upstream->location = g_strdup (location);
+  g_free (upstream->backup);
+  upstream->backup = g_strdup (backup);
+  if (upstream->src)
+    g_object_set (upstream->src, "location", location, NULL);
+  g_mutex_unlock (&upstream->lock);
+}
+
+void
+json_builder_upstream_value (JsonBuilder *builder, GstElement *element)
+{
+  GstRTSPUpstream *upstream = GST_RTSP_UPSTREAM (element);
+  gint64 outage = 0;
+
+  g_mutex_lock (&upstream->lock);
+
+  if (upstream->outage_start)
+    outage = g_get_monotonic_time () - upstream->outage_start;
+
+  json_builder_set_member_name (builder, "upstream");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "source");
+  json_builder_add_string_value (builder, upstream_source_names[upstream->source]);
+  json_builder_set_member_name (builder, "connected");
+  json_builder_add_boolean_value (builder, upstream->outage_start == 0);
+  json_builder_set_member_name (builder, "reconnects");
+  json_builder_add_int_value (builder, upstream->reconnects);
+  json_builder_set_member_name (builder, "outages");
+  json_builder_add_int_value (builder, upstream->outages);
+  json_builder_set_member_name (builder, "outage_ms");
+  json_builder_add_int_value (builder, outage / 1000);
+  json_builder_set_member_name (builder, "last_outage_ms");
+  json_builder_add_int_value (builder, upstream->outage_last / 1000);
+  json_builder_set_member_name (builder, "total_outage_ms");
+  json_builder_add_int_value (builder, (upstream->outage_total + outage) / 1000);
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&upstream->lock);
+}
@@ -0,0 +1,17 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+
+#include <json-glib/json-glib.h>
+
+GstElement *upstream_new (const gchar *location, const gchar *backup,
+    guint timeout, guint reconnect_timeout, gboolean slate);
+
+void upstream_set_location (GstElement *element, const gchar *location, const gchar *backup);
+
+void json_builder_upstream_value (JsonBuilder *builder, GstElement *element);
+
+#endif
@@ -0,0 +1,1447 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <gst/webrtc/webrtc.h>
+
+#include "whep.h"
+
+/* a peer that falls this far behind skips to the next keyframe instead
+ * of catching up on stale frames */
+#define WHEP_QUEUE_BYTES (512 * 1024)
+
+typedef struct _GstRTSPWhepRewrite GstRTSPWhepRewrite;
+
+struct _GstRTSPWhepRewrite
+{
+  guint pt;
+  guint32 ssrc;
+};
+
+typedef struct _GstRTSPWhepSession GstRTSPWhepSession;
+
+struct _GstRTSPWhepSession
+{
+  gchar *id;
+  GstRTSPWhep *whep;
+  GstSDPMessage *offer;
+  gint mline[WHEP_TRACKS];
+  GList *formats[WHEP_TRACKS];
+  GstCaps *codec[WHEP_TRACKS];
+
+  GstElement *peer;
+  GstElement *webrtc;
+  GstPad *teepad[WHEP_TRACKS];
+  GstRTSPWhepRewrite rewrite[WHEP_TRACKS];
+  gboolean linked;
+  gboolean started;
+  gboolean building;
+  gboolean removed;
+  gint keyframe;
+
+  gboolean done;
+  gchar *answer;
+};
+
+struct _GstRTSPWhep
+{
+  gint ref_count;
+  GMutex lock;
+  gchar *path;
+  gint attached;
+
+  gboolean announced;
+  gboolean present[WHEP_TRACKS];
+  GstCaps *caps[WHEP_TRACKS];
+
+  GstElement *pipeline;
+  GstElement *appsrc[WHEP_TRACKS];
+  GstElement *tee[WHEP_TRACKS];
+  guint peers;
+  gboolean keyframe;
+  gboolean synced;
+  gint64 offset;
+
+  GList *sessions;
+};
+
+typedef struct _GstRTSPWhepRegistry GstRTSPWhepRegistry;
+
+struct _GstRTSPWhepRegistry
+{
+  GMutex lock;
+  gboolean enabled;
+  gint *version;
+  GHashTable *streams;
+  GHashTable *sessions;
+  WhepNotify notify;
+  gpointer notify_data;
+};
+
+static GstRTSPWhepRegistry whep_registry;
+
+static void whep_session_free (GstRTSPWhepSession *session);
+static void whep_stream_teardown (GstRTSPWhep *whep);
+
+void
+whep_init (gint *version)
+{
+  g_mutex_init (&whep_registry.lock);
+  whep_registry.enabled = TRUE;
+  whep_registry.version = version;
+  whep_registry.streams = g_hash_table_new (g_str_hash, g_str_equal);
+  whep_registry.sessions = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+gboolean
+whep_enabled ()
+{
+  return whep_registry.enabled;
+}
+
+void
+whep_set_notify (WhepNotify notify, gpointer data)
+{
+  g_mutex_lock (&whep_registry.lock);
+  whep_registry.notify = notify;
+  whep_registry.notify_data = data;
+  g_mutex_unlock (&whep_registry.lock);
+}
+
+static void
+whep_notify (const gchar *id)
+{
+  WhepNotify notify;
+  gpointer notify_data;
+
+  g_mutex_lock (&whep_registry.lock);
+  notify = whep_registry.notify;
+  notify_data = whep_registry.notify_data;
+  g_mutex_unlock (&whep_registry.lock);
+
+  if (notify)
+    notify (id, notify_data);
+}
+
+static GstRTSPWhep *
+whep_new (const gchar *path)
+{
+  GstRTSPWhep *whep;
+
+  whep = g_new0 (GstRTSPWhep, 1);
+  whep->ref_count = 1;
+  g_mutex_init (&whep->lock);
+  whep->path = g_strdup (path);
+
+  return whep;
+}
+
+static void
+whep_free (GstRTSPWhep *whep)
+{
+  guint i;
+
+  whep_stream_teardown (whep);
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+    gst_caps_replace (&whep->caps[i], NULL);
+  g_mutex_clear (&whep->lock);
+  g_free (whep->path);
+  g_free (whep);
+}
+
+GstRTSPWhep *
+whep_acquire (const gchar *path)
+{
+  GstRTSPWhep *whep;
+
+  g_mutex_lock (&whep_registry.lock);
+
+  whep = g_hash_table_lookup (whep_registry.streams, path);
+  if (whep)
+  {
+    whep->ref_count++;
+  }
+  else
+  {
+    whep = whep_new (path);
+    g_hash_table_insert (whep_registry.streams, whep->path, whep);
+  }
+
+  g_mutex_unlock (&whep_registry.lock);
+
+  return whep;
+}
+
+GstRTSPWhep *
+whep_lookup (const gchar *path)
+{
+  GstRTSPWhep *whep;
+
+  if (!whep_registry.enabled)
+    return NULL;
+
+  g_mutex_lock (&whep_registry.lock);
+  whep = g_hash_table_lookup (whep_registry.streams, path);
+  if (whep)
+    whep->ref_count++;
+  g_mutex_unlock (&whep_registry.lock);
+
+  return whep;
+}
+
+void
+whep_release (GstRTSPWhep *whep)
+{
+  gboolean last;
+
+  g_mutex_lock (&whep_registry.lock);
+  last = --whep->ref_count == 0;
+  if (last)
+    g_hash_table_remove (whep_registry.streams, whep->path);
+  g_mutex_unlock (&whep_registry.lock);
+
+  if (last)
+    whep_free (whep);
+}
+
+static void
+whep_session_finish (const gchar *id, const gchar *answer)
+{
+  GstRTSPWhepSession *session;
+
+  g_mutex_lock (&whep_registry.lock);
+  session = g_hash_table_lookup (whep_registry.sessions, id);
+  if (session && !session->done)
+  {
+    session->done = TRUE;
+    session->answer = g_strdup (answer);
+  }
+  g_mutex_unlock (&whep_registry.lock);
+
+  if (!answer)
+    g_print ("rtmp2rtsp: whep %s: negotiation failed\n", id);
+
+  whep_notify (id);
+}
+
+static GstElement *
+whep_session_get_webrtc (const gchar *id)
+{
+  GstRTSPWhepSession *session;
+  GstElement *webrtc = NULL;
+
+  g_mutex_lock (&whep_registry.lock);
+  session = g_hash_table_lookup (whep_registry.sessions, id);
+  if (session && session->webrtc)
+    webrtc = gst_object_ref (session->webrtc);
+  g_mutex_unlock (&whep_registry.lock);
+
+  return webrtc;
+}
+
+static gboolean
+whep_promise_ok (GstPromise *promise)
+{
+  const GstStructure *reply;
+
+  if (gst_promise_wait (promise) != GST_PROMISE_RESULT_REPLIED)
+    return FALSE;
+
+  reply = gst_promise_get_reply (promise);
+
+  return !reply || !gst_structure_has_field (reply, "error");
+}
+
+static void
+whep_on_answer_created (GstPromise *promise, gchar *id)
+{
+  GstWebRTCSessionDescription *answer = NULL;
+  GstElement *webrtc;
+
+  if (whep_promise_ok (promise) && gst_promise_get_reply (promise))
+    gst_structure_get (gst_promise_get_reply (promise), "answer",
+        GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
+  gst_promise_unref (promise);
+
+  webrtc = whep_session_get_webrtc (id);
+
+  if (!answer || !webrtc)
+    whep_session_finish (id, NULL);
+  else
+    g_signal_emit_by_name (webrtc, "set-local-description", answer, NULL);
+
+  /* the answer goes out once gathering is complete, there is no trickle */
+  if (answer)
+    gst_webrtc_session_description_free (answer);
+  if (webrtc)
+    gst_object_unref (webrtc);
+}
+
+static void
+whep_on_remote_set (GstPromise *promise, gchar *id)
+{
+  gboolean ok;
+  GstElement *webrtc;
+
+  ok = whep_promise_ok (promise);
+  gst_promise_unref (promise);
+
+  webrtc = whep_session_get_webrtc (id);
+
+  if (!ok || !webrtc)
+  {
+    whep_session_finish (id, NULL);
+  }
+  else
+  {
+    promise = gst_promise_new_with_change_func ((GstPromiseChangeFunc) whep_on_answer_created,
+        g_strdup (id), g_free);
+    g_signal_emit_by_name (webrtc, "create-answer", NULL, promise);
+  }
+
+  if (webrtc)
+    gst_object_unref (webrtc);
+}
+
+static void
+whep_on_gathering_state (GstElement *webrtc, GParamSpec *pspec, const gchar *id)
+{
+  GstWebRTCICEGatheringState state;
+  GstWebRTCSessionDescription *local = NULL;
+  gchar *answer = NULL;
+
+  g_object_get (webrtc, "ice-gathering-state", &state, NULL);
+  if (state != GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE)
+    return;
+
+  g_object_get (webrtc, "local-description", &local, NULL);
+  if (local)
+  {
+    answer = gst_sdp_message_as_text (local->sdp);
+    gst_webrtc_session_description_free (local);
+  }
+
+  whep_session_finish (id, answer);
+
+  g_free (answer);
+}
+
+static gboolean
+whep_session_expire (gchar *id)
+{
+  whep_session_remove (id);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+whep_on_connection_state (GstElement *webrtc, GParamSpec *pspec, const gchar *id)
+{
+  GstWebRTCPeerConnectionState state;
+
+  g_object_get (webrtc, "connection-state", &state, NULL);
+
+  /* a closed tab only shows up as failed consent, tear down outside the
+   * webrtcbin thread */
+  if (state == GST_WEBRTC_PEER_CONNECTION_STATE_FAILED || state == GST_WEBRTC_PEER_CONNECTION_STATE_CLOSED)
+  {
+    g_print ("rtmp2rtsp: whep %s: connection gone\n", id);
+    g_idle_add_full (G_PRIORITY_DEFAULT, (GSourceFunc) whep_session_expire, g_strdup (id), g_free);
+  }
+}
+
+static GstElement *
+whep_element_new (GstElement *bin, const gchar *name)
+{
+  GstElement *element;
+
+  element = gst_element_factory_make (name, NULL);
+  if (!element)
+  {
+    g_print ("rtmp2rtsp: missing element %s\n", name);
+    return NULL;
+  }
+
+  gst_bin_add (GST_BIN (bin), element);
+
+  return element;
+}
+
+static void
+whep_decodebin_pad_added (GstElement *decodebin, GstPad *pad, GstElement *convert)
+{
+  GstPad *sinkpad;
+
+  sinkpad = gst_element_get_static_pad (convert, "sink");
+  if (!gst_pad_is_linked (sinkpad))
+    gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+static GstElement *
+whep_stream_add_audio (GstElement *pipeline, GstElement *appsrc, GstCaps *caps)
+{
+  GstElement *decodebin, *convert, *resample, *encode, *pay;
+
+  /* opus goes out as it came in, anything else is decoded once for all
+   * peers since browsers only take opus and g.711 at 8 khz */
+  if (gst_structure_has_name (gst_caps_get_structure (caps, 0), "audio/x-opus"))
+  {
+    pay = whep_element_new (pipeline, "rtpopuspay");
+    if (!pay || !gst_element_link (appsrc, pay))
+      return NULL;
+
+    return pay;
+  }
+
+  decodebin = whep_element_new (pipeline, "decodebin");
+  convert = whep_element_new (pipeline, "audioconvert");
+  resample = whep_element_new (pipeline, "audioresample");
+  encode = whep_element_new (pipeline, "opusenc");
+  pay = whep_element_new (pipeline, "rtpopuspay");
+
+  if (!decodebin || !convert || !resample || !encode || !pay)
+    return NULL;
+
+  gst_util_set_object_arg (G_OBJECT (encode), "frame-size", "10");
+
+  if (!gst_element_link (appsrc, decodebin) || !gst_element_link_many (convert, resample, encode, pay, NULL))
+    return NULL;
+
+  g_signal_connect (decodebin, "pad-added", (GCallback) whep_decodebin_pad_added, convert);
+
+  return pay;
+}
+
+static GstElement *
+whep_stream_add_video (GstElement *pipeline, GstElement *appsrc, GstCaps *caps)
+{
+  GstElement *pay;
+
+  pay = whep_element_new (pipeline, "rtph264pay");
+  if (!pay || !gst_element_link (appsrc, pay))
+    return NULL;
+
+  /* parameter sets with every keyframe so a peer that skipped ahead can
+   * decode, one frame per packet group without waiting for the next */
+  g_object_set (pay, "config-interval", -1, NULL);
+  gst_util_set_object_arg (G_OBJECT (pay), "aggregate-mode", "zero-latency");
+
+  return pay;
+}
+
+static GstElement *
+whep_stream_add_track (GstElement *pipeline, guint track, GstCaps *caps, GstElement **tee)
+{
+  GstElement *appsrc, *pay;
+
+  appsrc = whep_element_new (pipeline, "appsrc");
+  *tee = whep_element_new (pipeline, "tee");
+  if (!appsrc || !*tee)
+    return NULL;
+
+  gst_util_set_object_arg (G_OBJECT (appsrc), "format", "time");
+  g_object_set (appsrc, "is-live", TRUE, "caps", caps, NULL);
+
+  /* peers come and go, the stream keeps flowing without any */
+  g_object_set (*tee, "allow-not-linked", TRUE, NULL);
+
+  if (track)
+    pay = whep_stream_add_audio (pipeline, appsrc, caps);
+  else
+    pay = whep_stream_add_video (pipeline, appsrc, caps);
+
+  if (!pay || !gst_element_link (pay, *tee))
+    return NULL;
+
+  return appsrc;
+}
+
+static gboolean
+whep_stream_build (GstRTSPWhep *whep)
+{
+  GstElement *pipeline, *appsrc[WHEP_TRACKS] = { NULL, }, *tee[WHEP_TRACKS] = { NULL, };
+  GstCaps *caps[WHEP_TRACKS] = { NULL, };
+  gboolean linked = FALSE;
+  guint i;
+
+  if (whep->pipeline)
+    return TRUE;
+
+  g_mutex_lock (&whep->lock);
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (whep->caps[i])
+      caps[i] = gst_caps_ref (whep->caps[i]);
+  }
+  g_mutex_unlock (&whep->lock);
+
+  /* the stream is transcoded and payloaded once, every peer hangs off
+   * the tee of a track and only gets its own payload type and ssrc */
+  pipeline = gst_pipeline_new (NULL);
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (!caps[i])
+      continue;
+
+    if (i == 0 && !gst_structure_has_name (gst_caps_get_structure (caps[i], 0), "video/x-h264"))
+    {
+      g_print ("rtmp2rtsp: whep %s: video is not h264, sending audio only\n", whep->path);
+      continue;
+    }
+
+    appsrc[i] = whep_stream_add_track (pipeline, i, caps[i], &tee[i]);
+    if (!appsrc[i])
+    {
+      linked = FALSE;
+      break;
+    }
+
+    linked = TRUE;
+  }
+
+  if (linked && gst_element_set_state (pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+    linked = FALSE;
+
+  if (!linked)
+  {
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (pipeline);
+  }
+  else
+  {
+    /* the stream only pushes once the pipeline is up, with the caps it
+     * has by now */
+    g_mutex_lock (&whep->lock);
+    whep->pipeline = pipeline;
+    for (i = 0; i < WHEP_TRACKS; i++)
+    {
+      whep->appsrc[i] = appsrc[i];
+      whep->tee[i] = tee[i];
+      if (appsrc[i] && whep->caps[i] && whep->caps[i] != caps[i])
+        gst_app_src_set_caps (GST_APP_SRC (appsrc[i]), whep->caps[i]);
+    }
+    whep->keyframe = whep->appsrc[0] != NULL;
+    whep->synced = FALSE;
+    g_mutex_unlock (&whep->lock);
+  }
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (caps[i])
+      gst_caps_unref (caps[i]);
+  }
+
+  return linked;
+}
+
+static void
+whep_stream_teardown (GstRTSPWhep *whep)
+{
+  GstElement *pipeline;
+  guint i;
+
+  g_mutex_lock (&whep->lock);
+  pipeline = whep->pipeline;
+  whep->pipeline = NULL;
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    whep->appsrc[i] = NULL;
+    whep->tee[i] = NULL;
+  }
+  g_mutex_unlock (&whep->lock);
+
+  if (pipeline)
+  {
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (pipeline);
+  }
+}
+
+static gboolean
+whep_stream_profile (GstCaps *caps, guint8 profile[3])
+{
+  const GValue *value;
+  GstMapInfo map;
+  gboolean res;
+
+  /* profile, constraint flags and level follow the version byte of the
+   * avcC record */
+  value = gst_structure_get_value (gst_caps_get_structure (caps, 0), "codec_data");
+  if (!value || !GST_VALUE_HOLDS_BUFFER (value) ||
+      !gst_buffer_map (gst_value_get_buffer (value), &map, GST_MAP_READ))
+    return FALSE;
+
+  res = map.size >= 4;
+  if (res)
+    memcpy (profile, map.data + 1, 3);
+
+  gst_buffer_unmap (gst_value_get_buffer (value), &map);
+
+  return res;
+}
+
+static gboolean
+whep_offer_profile (const GstStructure *structure, guint8 profile[3])
+{
+  const gchar *id = gst_structure_get_string (structure, "profile-level-id");
+  guint64 value;
+  gchar *end;
+
+  if (!id || strlen (id) != 6)
+    return FALSE;
+
+  value = g_ascii_strtoull (id, &end, 16);
+  if (*end != '\0')
+    return FALSE;
+
+  profile[0] = value >> 16;
+  profile[1] = value >> 8;
+  profile[2] = value;
+
+  return TRUE;
+}
+
+static GstCaps *
+whep_offer_pick (GList *formats, GstCaps *caps)
+{
+  guint8 stream[3], offered[3];
+  GstCaps *picked = formats->data;
+  gboolean known;
+  guint score = 0;
+  GList *item;
+
+  if (!gst_structure_has_name (gst_caps_get_structure (caps, 0), "video/x-h264"))
+    return picked;
+
+  known = whep_stream_profile (caps, stream);
+
+  /* the profile of the stream at a level the peer takes, or may differ
+   * from, beats the same profile at a lower level, which beats
+   * constrained baseline since every browser decoder has it */
+  for (item = formats; item; item = g_list_next (item))
+  {
+    const GstStructure *structure = gst_caps_get_structure (item->data, 0);
+    guint rank = 0;
+
+    if (!whep_offer_profile (structure, offered))
+      continue;
+
+    if (known && offered[0] == stream[0] && (!(offered[1] & 0x40) || (stream[1] & 0x40)))
+      rank = (offered[2] >= stream[2] ||
+          g_strcmp0 (gst_structure_get_string (structure, "level-asymmetry-allowed"), "1") == 0) ? 3 : 2;
+    else if (offered[0] == 0x42 && (offered[1] & 0x40))
+      rank = 1;
+
+    if (rank > score)
+    {
+      picked = item->data;
+      score = rank;
+    }
+  }
+
+  return picked;
+}
+
+static GstBuffer *
+whep_peer_rewrite (GstRTSPWhepRewrite *rewrite, GstBuffer *buffer)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+  /* only the header is written, the payload stays shared between peers */
+  buffer = gst_buffer_make_writable (buffer);
+  if (gst_rtp_buffer_map (buffer, GST_MAP_WRITE, &rtp))
+  {
+    gst_rtp_buffer_set_payload_type (&rtp, rewrite->pt);
+    gst_rtp_buffer_set_ssrc (&rtp, rewrite->ssrc);
+    gst_rtp_buffer_unmap (&rtp);
+  }
+
+  return buffer;
+}
+
+static gboolean
+whep_peer_rewrite_item (GstBuffer **buffer, guint idx, GstRTSPWhepRewrite *rewrite)
+{
+  *buffer = whep_peer_rewrite (rewrite, *buffer);
+
+  return TRUE;
+}
+
+static GstPadProbeReturn
+whep_peer_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPWhepSession *session)
+{
+  guint track = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "whep-track"));
+  GstRTSPWhepRewrite *rewrite = &session->rewrite[track];
+  GstBuffer *first;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+  {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstCaps *caps;
+
+    if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+      return GST_PAD_PROBE_OK;
+
+    gst_event_parse_caps (event, &caps);
+    caps = gst_caps_copy (caps);
+    gst_caps_set_simple (caps, "payload", G_TYPE_INT, rewrite->pt, "ssrc", G_TYPE_UINT, rewrite->ssrc, NULL);
+
+    GST_PAD_PROBE_INFO_DATA (info) = gst_event_new_caps (caps);
+    gst_caps_unref (caps);
+    gst_event_unref (event);
+
+    return GST_PAD_PROBE_OK;
+  }
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    first = gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info)) ?
+        gst_buffer_list_get (GST_PAD_PROBE_INFO_BUFFER_LIST (info), 0) : NULL;
+  else
+    first = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  if (!first)
+    return GST_PAD_PROBE_OK;
+
+  /* a peer starts, and restarts after falling behind, on a keyframe with
+   * the audio that goes with it, the payloader keeps the delta flag of
+   * the frame on its packets */
+  if (g_atomic_int_get (&session->keyframe))
+  {
+    if (track != 0 || GST_BUFFER_FLAG_IS_SET (first, GST_BUFFER_FLAG_DELTA_UNIT))
+      return GST_PAD_PROBE_DROP;
+
+    g_atomic_int_set (&session->keyframe, FALSE);
+  }
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+
+    gst_buffer_list_foreach (list, (GstBufferListFunc) whep_peer_rewrite_item, rewrite);
+    GST_PAD_PROBE_INFO_DATA (info) = list;
+  }
+  else
+  {
+    GST_PAD_PROBE_INFO_DATA (info) = whep_peer_rewrite (rewrite, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+whep_peer_overrun (GstElement *queue, GstRTSPWhepSession *session)
+{
+  /* what the leaky queue dropped leaves the peer without references, it
+   * skips ahead to the next keyframe while the stream and other peers
+   * go on */
+  if (session->teepad[0])
+    g_atomic_int_set (&session->keyframe, TRUE);
+}
+
+static gboolean
+whep_session_add_track (GstRTSPWhepSession *session, guint track, GstCaps *caps)
+{
+  GstWebRTCRTPTransceiver *transceiver;
+  GstElement *queue;
+  GstPad *pad;
+  gchar *name;
+  gint pt;
+
+  /* with the stream caps known the payload type can follow its profile */
+  gst_caps_replace (&session->codec[track], whep_offer_pick (session->formats[track], caps));
+  gst_structure_get_int (gst_caps_get_structure (session->codec[track], 0), "payload", &pt);
+
+  session->rewrite[track].pt = pt;
+  session->rewrite[track].ssrc = g_random_int ();
+
+  queue = whep_element_new (session->peer, "queue");
+  if (!queue)
+    return FALSE;
+
+  gst_util_set_object_arg (G_OBJECT (queue), "leaky", "downstream");
+  g_object_set (queue,
+      "max-size-buffers", 0,
+      "max-size-time", (guint64) 0,
+      "max-size-bytes", WHEP_QUEUE_BYTES,
+      NULL);
+  g_signal_connect (queue, "overrun", (GCallback) whep_peer_overrun, session);
+
+  /* the sink pad for the offered mline takes that transceiver, what we
+   * send is limited to the one payload type picked from the offer */
+  name = g_strdup_printf ("sink_%d", session->mline[track]);
+  if (!gst_element_link_pads (queue, "src", session->webrtc, name))
+  {
+    g_free (name);
+    return FALSE;
+  }
+
+  pad = gst_element_get_static_pad (session->webrtc, name);
+  g_free (name);
+
+  g_object_get (pad, "transceiver", &transceiver, NULL);
+  g_object_set (transceiver,
+      "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY,
+      "codec-preferences", session->codec[track],
+      NULL);
+  gst_object_unref (transceiver);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (queue, "src");
+  g_object_set_data (G_OBJECT (pad), "whep-track", GUINT_TO_POINTER (track));
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      (GstPadProbeCallback) whep_peer_probe, session, NULL);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (queue, "sink");
+  name = g_strdup_printf ("sink%u", track);
+  gst_element_add_pad (session->peer, gst_ghost_pad_new (name, pad));
+  g_free (name);
+  gst_object_unref (pad);
+
+  return TRUE;
+}
+
+static gboolean
+whep_session_link (GstRTSPWhepSession *session, GstCaps *caps[WHEP_TRACKS])
+{
+  GstRTSPWhep *whep = session->whep;
+  GstPad *ghost;
+  gchar *name;
+  guint i;
+
+  gst_bin_add (GST_BIN (whep->pipeline), session->peer);
+  session->linked = TRUE;
+  whep->peers++;
+
+  /* the video of a new peer waits for the next keyframe, the peer is up
+   * before the tee pushes to it so it never answers flushing */
+  g_atomic_int_set (&session->keyframe, caps[0] != NULL);
+
+  if (!gst_element_sync_state_with_parent (session->peer))
+    return FALSE;
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (!caps[i])
+      continue;
+
+    session->teepad[i] = gst_element_request_pad_simple (whep->tee[i], "src_%u");
+
+    name = g_strdup_printf ("sink%u", i);
+    ghost = gst_element_get_static_pad (session->peer, name);
+    g_free (name);
+
+    if (gst_pad_link (session->teepad[i], ghost) != GST_PAD_LINK_OK)
+    {
+      gst_object_unref (ghost);
+      return FALSE;
+    }
+
+    gst_object_unref (ghost);
+  }
+
+  return TRUE;
+}
+
+static void
+whep_session_unlink (GstRTSPWhepSession *session)
+{
+  GstRTSPWhep *whep = session->whep;
+  guint i;
+
+  /* a tee drops a released pad between pushes, the queue of the peer is
+   * the only thread the peer blocks */
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    GstPad *ghost;
+
+    if (!session->teepad[i])
+      continue;
+
+    ghost = gst_pad_get_peer (session->teepad[i]);
+    if (ghost)
+    {
+      gst_pad_unlink (session->teepad[i], ghost);
+      gst_object_unref (ghost);
+    }
+
+    gst_element_release_request_pad (whep->tee[i], session->teepad[i]);
+    gst_object_unref (session->teepad[i]);
+    session->teepad[i] = NULL;
+  }
+
+  gst_element_set_state (session->peer, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (whep->pipeline), session->peer);
+
+  session->linked = FALSE;
+  if (--whep->peers == 0)
+    whep_stream_teardown (whep);
+}
+
+static gboolean
+whep_session_build (GstRTSPWhepSession *session)
+{
+  GstRTSPWhep *whep = session->whep;
+  GstWebRTCSessionDescription *offer;
+  GstCaps *caps[WHEP_TRACKS] = { NULL, };
+  GstPromise *promise;
+  gboolean linked = FALSE;
+  guint i;
+
+  if (!whep_stream_build (whep))
+    return FALSE;
+
+  g_mutex_lock (&whep->lock);
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (session->mline[i] >= 0 && whep->tee[i] && whep->caps[i])
+      caps[i] = gst_caps_ref (whep->caps[i]);
+  }
+  g_mutex_unlock (&whep->lock);
+
+  session->peer = gst_object_ref_sink (gst_bin_new (NULL));
+  session->webrtc = whep_element_new (session->peer, "webrtcbin");
+  if (!session->webrtc)
+    goto done;
+
+  /* no stun or turn, host candidates are all a local peer needs */
+  gst_util_set_object_arg (G_OBJECT (session->webrtc), "bundle-policy", "max-bundle");
+
+  g_signal_connect_data (session->webrtc, "notify::ice-gathering-state",
+      (GCallback) whep_on_gathering_state, g_strdup (session->id), (GClosureNotify) g_free, 0);
+  g_signal_connect_data (session->webrtc, "notify::connection-state",
+      (GCallback) whep_on_connection_state, g_strdup (session->id), (GClosureNotify) g_free, 0);
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (caps[i] && !whep_session_add_track (session, i, caps[i]))
+      gst_caps_replace (&caps[i], NULL);
+    else if (caps[i])
+      linked = TRUE;
+  }
+
+  if (!linked || !whep_session_link (session, caps))
+  {
+    linked = FALSE;
+    goto done;
+  }
+
+  offer = gst_webrtc_session_description_new (GST_WEBRTC_SDP_TYPE_OFFER, session->offer);
+  session->offer = NULL;
+
+  promise = gst_promise_new_with_change_func ((GstPromiseChangeFunc) whep_on_remote_set,
+      g_strdup (session->id), g_free);
+  g_signal_emit_by_name (session->webrtc, "set-remote-description", offer, promise);
+  gst_webrtc_session_description_free (offer);
+
+done:
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (caps[i])
+      gst_caps_unref (caps[i]);
+  }
+
+  return linked;
+}
+
+static gboolean
+whep_session_start (gchar *id)
+{
+  GstRTSPWhepSession *session;
+  GstRTSPWhep *whep;
+  gboolean built, removed;
+
+  /* peers are built in the main context, away from the streaming thread
+   * and without the stream lock, a removal meanwhile leaves the free to
+   * whoever is building */
+  g_mutex_lock (&whep_registry.lock);
+  session = g_hash_table_lookup (whep_registry.sessions, id);
+  if (session)
+    session->building = TRUE;
+  g_mutex_unlock (&whep_registry.lock);
+
+  if (!session)
+    return G_SOURCE_REMOVE;
+
+  whep = session->whep;
+
+  g_print ("rtmp2rtsp: whep %s: start %s\n", id, whep->path);
+
+  built = whep_session_build (session);
+
+  g_mutex_lock (&whep_registry.lock);
+  session->building = FALSE;
+  removed = session->removed;
+  g_mutex_unlock (&whep_registry.lock);
+
+  if (removed)
+  {
+    whep_session_free (session);
+    whep_release (whep);
+  }
+  else if (!built)
+  {
+    whep_session_finish (id, NULL);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+whep_is_ready (GstRTSPWhep *whep)
+{
+  guint i;
+
+  if (!whep->announced)
+    return FALSE;
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    if (whep->present[i] && !whep->caps[i])
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+whep_start_sessions (GstRTSPWhep *whep)
+{
+  GList *item;
+
+  /* called with the lock, sessions wait until every track has caps so
+   * the answer covers what the stream really has */
+  if (!whep_is_ready (whep))
+    return;
+
+  for (item = whep->sessions; item; item = g_list_next (item))
+  {
+    GstRTSPWhepSession *session = item->data;
+
+    if (session->started)
+      continue;
+
+    session->started = TRUE;
+
+    g_idle_add_full (G_PRIORITY_DEFAULT, (GSourceFunc) whep_session_start, g_strdup (session->id), g_free);
+  }
+}
+
+static void
+whep_push (GstRTSPWhep *whep, guint track, GstBuffer *buffer)
+{
+  gboolean delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  GstAppSrc *appsrc;
+  GstClockTime time;
+  GstClock *clock;
+  GstBuffer *copy;
+
+  time = GST_BUFFER_DTS_IS_VALID (buffer) ? GST_BUFFER_DTS (buffer) : GST_BUFFER_PTS (buffer);
+  if (!GST_CLOCK_TIME_IS_VALID (time))
+    return;
+
+  g_mutex_lock (&whep->lock);
+
+  appsrc = whep->appsrc[track] ? GST_APP_SRC (whep->appsrc[track]) : NULL;
+  if (!appsrc)
+    goto done;
+
+  /* peers fall behind in their own queues, the shared pipeline only
+   * backs up when the transcode does and then restarts on a keyframe */
+  if (gst_app_src_get_current_level_bytes (appsrc) > WHEP_QUEUE_BYTES)
+  {
+    gst_element_send_event (GST_ELEMENT (appsrc), gst_event_new_flush_start ());
+    gst_element_send_event (GST_ELEMENT (appsrc), gst_event_new_flush_stop (FALSE));
+    whep->keyframe = whep->appsrc[0] != NULL;
+  }
+
+  /* the stream starts, and restarts on a new pipeline, on a keyframe
+   * with the audio that goes with it */
+  if (whep->keyframe && (track != 0 || delta))
+    goto done;
+
+  /* stream time is moved onto the running time of the shared pipeline
+   * so frames go out as they arrive */
+  if (!whep->synced)
+  {
+    clock = gst_element_get_clock (whep->pipeline);
+    if (!clock)
+      goto done;
+
+    whep->offset = (gint64) (gst_clock_get_time (clock) - gst_element_get_base_time (whep->pipeline)) - (gint64) time;
+    whep->synced = TRUE;
+    gst_object_unref (clock);
+  }
+
+  whep->keyframe = FALSE;
+
+  copy = gst_buffer_copy (buffer);
+  if (GST_BUFFER_PTS_IS_VALID (copy))
+    GST_BUFFER_PTS (copy) = MAX ((gint64) GST_BUFFER_PTS (copy) + whep->offset, 0);
+  if (GST_BUFFER_DTS_IS_VALID (copy))
+    GST_BUFFER_DTS (copy) = MAX ((gint64) GST_BUFFER_DTS (copy) + whep->offset, 0);
+
+  gst_app_src_push_buffer (appsrc, copy);
+
+done:
+  g_mutex_unlock (&whep->lock);
+}
+
+static void
+whep_set_caps (GstRTSPWhep *whep, guint track, GstCaps *caps)
+{
+  g_mutex_lock (&whep->lock);
+
+  gst_caps_replace (&whep->caps[track], caps);
+
+  if (whep->appsrc[track])
+    gst_app_src_set_caps (GST_APP_SRC (whep->appsrc[track]), caps);
+
+  whep_start_sessions (whep);
+
+  g_mutex_unlock (&whep->lock);
+}
+
+static GstPadProbeReturn
+whep_probe (GstPad *pad, GstPadProbeInfo *info, GstRTSPWhep *whep)
+{
+  guint track = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "whep-track"));
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+  {
+    whep_push (whep, track, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+  else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+  {
+    GstCaps *caps;
+
+    gst_event_parse_caps (GST_PAD_PROBE_INFO_EVENT (info), &caps);
+    whep_set_caps (whep, track, caps);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+whep_no_more_pads (GstElement *dynpay, GstRTSPWhep *whep)
+{
+  guint i;
+
+  /* the tracks the relay settled on are the ones whose stages are left */
+  g_mutex_lock (&whep->lock);
+
+  whep->announced = TRUE;
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    GstElement *element;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (dynpay), name);
+    g_free (name);
+
+    whep->present[i] = element != NULL;
+    if (element)
+      gst_object_unref (element);
+  }
+
+  whep_start_sessions (whep);
+
+  g_mutex_unlock (&whep->lock);
+}
+
+void
+whep_attach (GstRTSPWhep *whep, GstElement *bin)
+{
+  GstElement *dynpay;
+  guint i;
+
+  /* a new pipeline for the path restarts the timestamps, running peers
+   * resync on its first keyframe */
+  g_mutex_lock (&whep->lock);
+  whep->announced = FALSE;
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    whep->present[i] = FALSE;
+    gst_caps_replace (&whep->caps[i], NULL);
+  }
+  whep->keyframe = whep->appsrc[0] != NULL;
+  whep->synced = FALSE;
+  g_mutex_unlock (&whep->lock);
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    GstElement *element;
+    GstPad *pad;
+    gchar *name;
+
+    name = g_strdup_printf ("parse%u", i);
+    element = gst_bin_get_by_name (GST_BIN (bin), name);
+    g_free (name);
+
+    if (!element)
+      continue;
+
+    pad = gst_element_get_static_pad (element, "src");
+    if (pad)
+    {
+      g_object_set_data (G_OBJECT (pad), "whep-track", GUINT_TO_POINTER (i));
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+          (GstPadProbeCallback) whep_probe, whep, NULL);
+      gst_object_unref (pad);
+    }
+
+    gst_object_unref (element);
+  }
+
+  dynpay = gst_bin_get_by_name (GST_BIN (bin), "dynpay0");
+  if (dynpay)
+  {
+    g_signal_connect (dynpay, "no-more-pads", (GCallback) whep_no_more_pads, whep);
+    gst_object_unref (dynpay);
+  }
+
+  g_atomic_int_inc (&whep->attached);
+}
+
+void
+whep_detach (GstRTSPWhep *whep)
+{
+  guint i;
+
+  /* peers that stay wait for the tracks of the next pipeline, not the
+   * caps of the one that went away */
+  if (g_atomic_int_dec_and_test (&whep->attached))
+  {
+    g_mutex_lock (&whep->lock);
+    whep->announced = FALSE;
+    for (i = 0; i < WHEP_TRACKS; i++)
+    {
+      whep->present[i] = FALSE;
+      gst_caps_replace (&whep->caps[i], NULL);
+    }
+    g_mutex_unlock (&whep->lock);
+  }
+
+  whep_release (whep);
+}
+
+gboolean
+whep_is_live (GstRTSPWhep *whep)
+{
+  return g_atomic_int_get (&whep->attached) > 0;
+}
+
+static gboolean
+whep_offer_find (GstRTSPWhepSession *session, const GstSDPMedia *media, guint track)
+{
+  guint i;
+
+  for (i = 0; i < gst_sdp_media_formats_len (media); i++)
+  {
+    const GstStructure *structure;
+    const gchar *encoding;
+    GstCaps *caps;
+
+    caps = gst_sdp_media_get_caps_from_media (media, atoi (gst_sdp_media_get_format (media, i)));
+    if (!caps)
+      continue;
+
+    structure = gst_caps_get_structure (caps, 0);
+    encoding = gst_structure_get_string (structure, "encoding-name");
+
+    /* h264 has to be non-interleaved, which of them is sent is only
+     * known once the stream has caps */
+    if ((track == 1 && g_strcmp0 (encoding, "OPUS") == 0) ||
+        (track == 0 && g_strcmp0 (encoding, "H264") == 0 &&
+         g_strcmp0 (gst_structure_get_string (structure, "packetization-mode"), "1") == 0))
+      session->formats[track] = g_list_append (session->formats[track], caps);
+    else
+      gst_caps_unref (caps);
+  }
+
+  return session->formats[track] != NULL;
+}
+
+static gboolean
+whep_offer_parse (GstRTSPWhepSession *session)
+{
+  guint i;
+
+  session->mline[0] = session->mline[1] = -1;
+
+  for (i = 0; i < gst_sdp_message_medias_len (session->offer); i++)
+  {
+    const GstSDPMedia *media = gst_sdp_message_get_media (session->offer, i);
+    guint track;
+
+    if (gst_sdp_media_get_port (media) == 0)
+      continue;
+
+    if (g_strcmp0 (gst_sdp_media_get_media (media), "video") == 0)
+      track = 0;
+    else if (g_strcmp0 (gst_sdp_media_get_media (media), "audio") == 0)
+      track = 1;
+    else
+      continue;
+
+    if (session->mline[track] >= 0)
+      continue;
+
+    if (whep_offer_find (session, media, track))
+      session->mline[track] = i;
+  }
+
+  return session->mline[0] >= 0 || session->mline[1] >= 0;
+}
+
+static void
+whep_session_free (GstRTSPWhepSession *session)
+{
+  guint i;
+
+  if (session->linked)
+    whep_session_unlink (session);
+  else if (session->whep && session->whep->peers == 0)
+    whep_stream_teardown (session->whep);
+
+  if (session->peer)
+  {
+    gst_element_set_state (session->peer, GST_STATE_NULL);
+    gst_object_unref (session->peer);
+  }
+
+  for (i = 0; i < WHEP_TRACKS; i++)
+  {
+    g_list_free_full (session->formats[i], (GDestroyNotify) gst_caps_unref);
+    gst_caps_replace (&session->codec[i], NULL);
+  }
+
+  if (session->offer)
+    gst_sdp_message_free (session->offer);
+
+  g_free (session->answer);
+  g_free (session->id);
+  g_free (session);
+}
+
+gchar *
+whep_session_new (GstRTSPWhep *whep, GstSDPMessage *offer)
+{
+  GstRTSPWhepSession *session;
+  gchar *id;
+
+  session = g_new0 (GstRTSPWhepSession, 1);
+  session->offer = offer;
+
+  if (!whep_offer_parse (session))
+  {
+    g_print ("rtmp2rtsp: whep %s: offer has no h264 or opus\n", whep->path);
+    whep_session_free (session);
+    return NULL;
+  }
+
+  session->id = g_uuid_string_random ();
+  session->whep = whep;
+  id = g_strdup (session->id);
+
+  g_mutex_lock (&whep_registry.lock);
+  whep->ref_count++;
+  g_hash_table_insert (whep_registry.sessions, session->id, session);
+  g_mutex_unlock (&whep_registry.lock);
+
+  g_mutex_lock (&whep->lock);
+  whep->sessions = g_list_prepend (whep->sessions, session);
+  whep_start_sessions (whep);
+  g_mutex_unlock (&whep->lock);
+
+  g_atomic_int_inc (whep_registry.version);
+
+  return id;
+}
+
+gboolean
+whep_session_get_answer (const gchar *id, gchar **answer)
+{
+  GstRTSPWhepSession *session;
+  gboolean done = FALSE;
+
+  g_mutex_lock (&whep_registry.lock);
+  session = g_hash_table_lookup (whep_registry.sessions, id);
+  if (session && session->done)
+  {
+    done = TRUE;
+    *answer = g_strdup (session->answer);
+  }
+  g_mutex_unlock (&whep_registry.lock);
+
+  return done;
+}
+
+gboolean
+whep_session_remove (const gchar *id)
+{
+  GstRTSPWhepSession *session;
+  GstRTSPWhep *whep;
+  gboolean building = FALSE;
+
+  g_mutex_lock (&whep_registry.lock);
+  session = g_hash_table_lookup (whep_registry.sessions, id);
+  if (session)
+  {
+    g_hash_table_remove (whep_registry.sessions, id);
+    session->removed = TRUE;
+    building = session->building;
+  }
+  g_mutex_unlock (&whep_registry.lock);
+
+  if (!session)
+    return FALSE;
+
+  whep = session->whep;
+
+  g_mutex_lock (&whep->lock);
+  whep->sessions = g_list_remove (whep->sessions, session);
+  g_mutex_unlock (&whep->lock);
+
+  g_print ("rtmp2rtsp: whep %s: stop %s\n", session->id, whep->path);
+
+  if (!building)
+  {
+    whep_session_free (session);
+    whep_release (whep);
+  }
+
+  g_atomic_int_inc (whep_registry.version);
+
+  return TRUE;
+}
+
+void
+json_builder_whep_value (JsonBuilder *builder, GstRTSPWhep *whep)
+{
+  gchar *endpoint;
+  guint sessions;
+
+  endpoint = g_strdup_printf ("/whep%s", whep->path);
+
+  g_mutex_lock (&whep->lock);
+  sessions = g_list_length (whep->sessions);
+  g_mutex_unlock (&whep->lock);
+
+  json_builder_set_member_name (builder, "whep");
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "endpoint");
+  json_builder_add_string_value (builder, endpoint);
+  json_builder_set_member_name (builder, "sessions");
+  json_builder_add_int_value (builder, sessions);
+
+  json_builder_end_object (builder);
+
+  g_free (endpoint);
+}
@@ -0,0 +1,37 @@
+#ifndef __WHEP_H__
+#define __WHEP_H__
+
+#include <glib.h>
+
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+
+#include <json-glib/json-glib.h>
+
+#define WHEP_TRACKS 2
+#define WHEP_START_TIMEOUT_S 10
+
+typedef struct _GstRTSPWhep GstRTSPWhep;
+
+typedef void (*WhepNotify) (const gchar *id, gpointer data);
+
+void whep_init (gint *version);
+gboolean whep_enabled ();
+
+void whep_set_notify (WhepNotify notify, gpointer data);
+
+GstRTSPWhep *whep_acquire (const gchar *path);
+GstRTSPWhep *whep_lookup (const gchar *path);
+void whep_release (GstRTSPWhep *whep);
+
+void whep_attach (GstRTSPWhep *whep, GstElement *bin);
+void whep_detach (GstRTSPWhep *whep);
+gboolean whep_is_live (GstRTSPWhep *whep);
+
+gchar *whep_session_new (GstRTSPWhep *whep, GstSDPMessage *offer);
+gboolean whep_session_get_answer (const gchar *id, gchar **answer);
+gboolean whep_session_remove (const gchar *id);
+
+void json_builder_whep_value (JsonBuilder *builder, GstRTSPWhep *whep);
+
+#endif